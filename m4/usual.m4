@@ -11,6 +11,7 @@ dnl  AC_USUAL_DEBUG
 dnl Optional features:
 dnl  AC_USUAL_UREGEX
 dnl  AC_USUAL_GETADDRINFO_A
+dnl  AC_USUAL_PTHREAD
 dnl  AC_USUAL_TLS
 
 dnl Catching missing pkg-config
@@ -193,7 +194,7 @@ AC_CHECK_HEADERS([sys/param.h sys/uio.h pwd.h grp.h])
 AC_CHECK_HEADERS([sys/wait.h sys/mman.h syslog.h netdb.h dlfcn.h])
 AC_CHECK_HEADERS([err.h pthread.h endian.h sys/endian.h byteswap.h])
 AC_CHECK_HEADERS([malloc.h regex.h getopt.h fnmatch.h])
-AC_CHECK_HEADERS([langinfo.h xlocale.h linux/random.h])
+AC_CHECK_HEADERS([langinfo.h xlocale.h linux/random.h execinfo.h])
 dnl ucred.h may have prereqs
 AC_CHECK_HEADERS([ucred.h sys/ucred.h], [], [], [
 #ifdef HAVE_SYS_TYPES_H
@@ -224,7 +225,7 @@ AC_CHECK_FUNCS(asprintf vasprintf timegm)
 ### Functions provided only on win32
 AC_CHECK_FUNCS(localtime_r gettimeofday recvmsg sendmsg usleep getrusage)
 ### Functions used by libusual itself
-AC_CHECK_FUNCS(syslog mmap getpeerucred arc4random_buf getentropy getrandom)
+AC_CHECK_FUNCS(syslog mmap getpeerucred arc4random_buf getentropy getrandom backtrace memfd_create)
 ### win32: link with ws2_32
 AC_SEARCH_LIBS(WSAGetLastError, ws2_32)
 AC_FUNC_STRERROR_R
@@ -266,6 +267,21 @@ fi
 ])
 
 
+dnl
+dnl  AC_USUAL_TALLOC_COMPACT:  --enable-talloc-compact switch to set macro TALLOC_COMPACT
+dnl
+AC_DEFUN([AC_USUAL_TALLOC_COMPACT], [
+AC_ARG_ENABLE(talloc-compact, AS_HELP_STRING([--enable-talloc-compact],[use smaller talloc headers]))
+AC_MSG_CHECKING([whether to use compact talloc headers])
+if test "$enable_talloc_compact" = "yes"; then
+  AC_DEFINE(TALLOC_COMPACT, 1, [Define to use compact talloc headers])
+  AC_MSG_RESULT([yes])
+else
+  AC_MSG_RESULT([no])
+fi
+])
+
+
 dnl
 dnl  AC_USUAL_WERROR:  --enable-werror switch to turn warnings into errors
 dnl
@@ -353,6 +369,18 @@ else
 fi
 ])
 
+dnl
+dnl  AC_USUAL_PTHREAD - use threads where available, for parallel NDJSON parsing
+dnl
+AC_DEFUN([AC_USUAL_PTHREAD], [
+AX_PTHREAD([
+  AC_DEFINE(HAVE_PTHREAD, 1, [Define if you have POSIX threads libraries and header files.])
+  CC="$PTHREAD_CC"
+  CFLAGS="$CFLAGS $PTHREAD_CFLAGS"
+  LIBS="$LIBS $PTHREAD_LIBS"
+], [AC_MSG_RESULT([Threads not available, NDJSON is parsed in single thread.])])
+])
+
 
 dnl
 dnl  AC_USUAL_TLS:  --with-openssl [ / --with-gnutls ? ]
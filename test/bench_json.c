@@ -0,0 +1,609 @@
+/*
+ * JSON throughput benchmark.
+ *
+ * Runs each mode over generated corpora that mimic the usual
+ * twitter.json, canada.json and citm_catalog.json test files,
+ * or over files given as arguments.  Reports MB/s of source
+ * JSON, allocations per document and peak memory.
+ *
+ * Memory goes through cx profiler, which adds small constant
+ * cost per allocation.
+ */
+
+#include <usual/json.h>
+#include <usual/cxprof.h>
+#include <usual/err.h>
+#include <usual/fileutil.h>
+#include <usual/getopt.h>
+#include <usual/psrandom.h>
+#include <usual/string.h>
+#include <usual/time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define DEFAULT_LOOPS	20
+
+struct Corpus {
+	const char *name;
+	char *data;
+	size_t len;
+	struct MBuf cbor;
+};
+
+struct Mode {
+	const char *name;
+	/* one document, false on failure */
+	bool (*run)(struct Corpus *c, CxMem *cx, void **state_p);
+	void (*cleanup)(void *state);
+};
+
+static int loops = DEFAULT_LOOPS;
+
+/*
+ * Corpus generation.
+ */
+
+static const char *words[] = {
+	"the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog",
+	"caf\xc3\xa9", "na\xc3\xafve", "\xe6\x97\xa5\xe6\x9c\xac", "\xf0\x9f\x98\x80",
+	"\"quoted\"", "back\\slash", "tab\there", "line\nbreak",
+};
+
+static uint32_t rnd(uint32_t n)
+{
+	return pseudo_random_range(n);
+}
+
+static void put_text(struct JsonWriter *jw, int nwords)
+{
+	char buf[512];
+	int i;
+
+	buf[0] = 0;
+	for (i = 0; i < nwords; i++) {
+		if (i > 0)
+			strlcat(buf, " ", sizeof(buf));
+		strlcat(buf, words[rnd(ARRAY_NELEM(words))], sizeof(buf));
+	}
+	jw_string(jw, buf);
+}
+
+/* status updates with nested user and entities, mostly strings */
+static void gen_twitter(struct JsonWriter *jw)
+{
+	char buf[32];
+	int i, j, n;
+	int64_t id;
+
+	jw_begin_dict(jw);
+	jw_key(jw, "statuses");
+	jw_begin_list(jw);
+	for (i = 0; i < 1000; i++) {
+		id = INT64_C(505874924095815681) / 1000 + i;
+		jw_begin_dict(jw);
+		jw_key(jw, "created_at");
+		jw_string(jw, "Sun Aug 31 00:29:15 +0000 2014");
+		jw_key(jw, "id");
+		jw_int(jw, id);
+		jw_key(jw, "id_str");
+		snprintf(buf, sizeof(buf), "%lld", (long long)id);
+		jw_string(jw, buf);
+		jw_key(jw, "text");
+		put_text(jw, 5 + rnd(20));
+		jw_key(jw, "truncated");
+		jw_bool(jw, false);
+		jw_key(jw, "in_reply_to_status_id");
+		jw_null(jw);
+		jw_key(jw, "user");
+		jw_begin_dict(jw);
+		jw_key(jw, "id");
+		jw_int(jw, rnd(1000000000));
+		jw_key(jw, "name");
+		put_text(jw, 2);
+		jw_key(jw, "screen_name");
+		snprintf(buf, sizeof(buf), "user_%u", rnd(100000));
+		jw_string(jw, buf);
+		jw_key(jw, "description");
+		put_text(jw, rnd(30));
+		jw_key(jw, "followers_count");
+		jw_int(jw, rnd(100000));
+		jw_key(jw, "verified");
+		jw_bool(jw, rnd(10) == 0);
+		jw_key(jw, "lang");
+		jw_string(jw, "ja");
+		jw_end_dict(jw);
+		jw_key(jw, "entities");
+		jw_begin_dict(jw);
+		jw_key(jw, "hashtags");
+		jw_begin_list(jw);
+		n = rnd(4);
+		for (j = 0; j < n; j++) {
+			jw_begin_dict(jw);
+			jw_key(jw, "text");
+			put_text(jw, 1);
+			jw_key(jw, "indices");
+			jw_begin_list(jw);
+			jw_int(jw, j * 10);
+			jw_int(jw, j * 10 + 8);
+			jw_end_list(jw);
+			jw_end_dict(jw);
+		}
+		jw_end_list(jw);
+		jw_key(jw, "urls");
+		jw_begin_list(jw);
+		jw_end_list(jw);
+		jw_end_dict(jw);
+		jw_key(jw, "retweet_count");
+		jw_int(jw, rnd(1000));
+		jw_key(jw, "favorited");
+		jw_bool(jw, false);
+		jw_key(jw, "coordinates");
+		jw_null(jw);
+		jw_end_dict(jw);
+	}
+	jw_end_list(jw);
+	jw_key(jw, "search_metadata");
+	jw_begin_dict(jw);
+	jw_key(jw, "count");
+	jw_int(jw, 1000);
+	jw_key(jw, "query");
+	jw_string(jw, "%E4%B8%80");
+	jw_end_dict(jw);
+	jw_end_dict(jw);
+}
+
+/* polygon coordinates, almost all floats in small lists */
+static void gen_canada(struct JsonWriter *jw)
+{
+	double lon, lat;
+	int i, j;
+
+	jw_begin_dict(jw);
+	jw_key(jw, "type");
+	jw_string(jw, "FeatureCollection");
+	jw_key(jw, "features");
+	jw_begin_list(jw);
+	jw_begin_dict(jw);
+	jw_key(jw, "type");
+	jw_string(jw, "Feature");
+	jw_key(jw, "properties");
+	jw_begin_dict(jw);
+	jw_key(jw, "name");
+	jw_string(jw, "Canada");
+	jw_end_dict(jw);
+	jw_key(jw, "geometry");
+	jw_begin_dict(jw);
+	jw_key(jw, "type");
+	jw_string(jw, "Polygon");
+	jw_key(jw, "coordinates");
+	jw_begin_list(jw);
+	for (i = 0; i < 480; i++) {
+		lon = -65.613616999999977;
+		lat = 43.420273000000009;
+		jw_begin_list(jw);
+		for (j = 0; j < 233; j++) {
+			lon += ((int)rnd(2000000) - 1000000) / 1e7;
+			lat += ((int)rnd(2000000) - 1000000) / 1e7;
+			jw_begin_list(jw);
+			jw_float(jw, lon);
+			jw_float(jw, lat);
+			jw_end_list(jw);
+		}
+		jw_end_list(jw);
+	}
+	jw_end_list(jw);
+	jw_end_dict(jw);
+	jw_end_dict(jw);
+	jw_end_list(jw);
+	jw_end_dict(jw);
+}
+
+static void put_id_list(struct JsonWriter *jw, int n)
+{
+	int i;
+
+	jw_begin_list(jw);
+	for (i = 0; i < n; i++)
+		jw_int(jw, 337184262 + rnd(100000));
+	jw_end_list(jw);
+}
+
+/* dicts keyed by numeric ids, mostly ints */
+static void gen_citm(struct JsonWriter *jw)
+{
+	char buf[32];
+	int i, j, n;
+
+	jw_begin_dict(jw);
+	jw_key(jw, "areaNames");
+	jw_begin_dict(jw);
+	for (i = 0; i < 17; i++) {
+		snprintf(buf, sizeof(buf), "%d", 205705993 + i);
+		jw_key(jw, buf);
+		put_text(jw, 3);
+	}
+	jw_end_dict(jw);
+	jw_key(jw, "events");
+	jw_begin_dict(jw);
+	for (i = 0; i < 184; i++) {
+		snprintf(buf, sizeof(buf), "%d", 138586341 + i * 3);
+		jw_key(jw, buf);
+		jw_begin_dict(jw);
+		jw_key(jw, "description");
+		jw_null(jw);
+		jw_key(jw, "id");
+		jw_int(jw, 138586341 + i * 3);
+		jw_key(jw, "logo");
+		jw_null(jw);
+		jw_key(jw, "name");
+		put_text(jw, 4);
+		jw_key(jw, "subTopicIds");
+		put_id_list(jw, 2 + rnd(4));
+		jw_key(jw, "subjectCode");
+		jw_null(jw);
+		jw_key(jw, "topicIds");
+		put_id_list(jw, 1 + rnd(3));
+		jw_end_dict(jw);
+	}
+	jw_end_dict(jw);
+	jw_key(jw, "performances");
+	jw_begin_list(jw);
+	for (i = 0; i < 243; i++) {
+		jw_begin_dict(jw);
+		jw_key(jw, "eventId");
+		jw_int(jw, 138586341 + rnd(184) * 3);
+		jw_key(jw, "id");
+		jw_int(jw, 339887544 + i);
+		jw_key(jw, "logo");
+		jw_null(jw);
+		jw_key(jw, "name");
+		jw_null(jw);
+		jw_key(jw, "prices");
+		jw_begin_list(jw);
+		n = 1 + rnd(6);
+		for (j = 0; j < n; j++) {
+			jw_begin_dict(jw);
+			jw_key(jw, "amount");
+			jw_int(jw, 10000 + rnd(100000));
+			jw_key(jw, "audienceSubCategoryId");
+			jw_int(jw, 337100890);
+			jw_key(jw, "seatCategoryId");
+			jw_int(jw, 338937295 + j);
+			jw_end_dict(jw);
+		}
+		jw_end_list(jw);
+		jw_key(jw, "seatCategories");
+		jw_begin_list(jw);
+		for (j = 0; j < n; j++) {
+			jw_begin_dict(jw);
+			jw_key(jw, "areas");
+			jw_begin_list(jw);
+			jw_begin_dict(jw);
+			jw_key(jw, "areaId");
+			jw_int(jw, 205705999 + rnd(17));
+			jw_key(jw, "blockIds");
+			jw_begin_list(jw);
+			jw_end_list(jw);
+			jw_end_dict(jw);
+			jw_end_list(jw);
+			jw_key(jw, "seatCategoryId");
+			jw_int(jw, 338937295 + j);
+			jw_end_dict(jw);
+		}
+		jw_end_list(jw);
+		jw_key(jw, "start");
+		jw_int(jw, INT64_C(1372701600000) + i * INT64_C(86400000));
+		jw_key(jw, "venueCode");
+		jw_string(jw, "PLEYEL_PLEYEL");
+		jw_end_dict(jw);
+	}
+	jw_end_list(jw);
+	jw_end_dict(jw);
+}
+
+static void generate(struct Corpus *c, const char *name, void (*gen)(struct JsonWriter *jw))
+{
+	struct JsonWriter jw;
+	struct MBuf buf;
+
+	mbuf_init_dynamic(&buf);
+	jw_init(&jw, &buf);
+	gen(&jw);
+	if (!jw_finish(&jw))
+		errx(1, "%s: generator failed", name);
+	c->name = name;
+	c->len = mbuf_written(&buf);
+	c->data = (char *)mbuf_data(&buf);
+}
+
+static void load(struct Corpus *c, const char *fname)
+{
+	const char *p;
+
+	c->data = load_file(fname, &c->len);
+	if (!c->data)
+		err(1, "%s", fname);
+	p = strrchr(fname, '/');
+	c->name = p ? p + 1 : fname;
+}
+
+/*
+ * Modes.
+ */
+
+/* fresh context for each document */
+static bool run_parse(struct Corpus *c, CxMem *cx, void **state_p)
+{
+	struct JsonContext *ctx;
+	bool ok;
+
+	ctx = json_new_context(cx, c->len);
+	if (!ctx)
+		return false;
+	ok = json_parse(ctx, c->data, c->len) != NULL;
+	json_free_context(ctx);
+	return ok;
+}
+
+/* one context, reset between documents */
+static bool run_parse_reuse(struct Corpus *c, CxMem *cx, void **state_p)
+{
+	struct JsonContext *ctx = *state_p;
+
+	if (!ctx) {
+		ctx = *state_p = json_new_context(cx, c->len);
+		if (!ctx)
+			return false;
+	}
+	json_reset_context(ctx);
+	return json_parse(ctx, c->data, c->len) != NULL;
+}
+
+static void free_context(void *state)
+{
+	json_free_context(state);
+}
+
+static bool run_lazy(struct Corpus *c, CxMem *cx, void **state_p)
+{
+	struct JsonContext *ctx;
+	bool ok;
+
+	ctx = json_new_context(cx, c->len);
+	if (!ctx)
+		return false;
+	ok = json_parse_lazy(ctx, c->data, c->len) != NULL;
+	json_free_context(ctx);
+	return ok;
+}
+
+/* tree is parsed once, its memory is included */
+struct TreeState {
+	struct JsonContext *ctx;
+	struct JsonValue *top;
+	struct MBuf out;
+};
+
+static struct TreeState *get_tree(struct Corpus *c, CxMem *cx, void **state_p)
+{
+	struct TreeState *st = *state_p;
+
+	if (st)
+		return st;
+	st = cx_alloc0(cx, sizeof(*st));
+	if (!st)
+		return NULL;
+	st->ctx = json_new_context(cx, c->len);
+	if (st->ctx)
+		st->top = json_parse(st->ctx, c->data, c->len);
+	mbuf_init_dynamic_cx(&st->out, cx);
+	*state_p = st;
+	return st->top ? st : NULL;
+}
+
+static void free_tree(void *state)
+{
+	struct TreeState *st = state;
+	CxMem *cx;
+
+	if (!st)
+		return;
+	cx = st->out.cx;
+	mbuf_free(&st->out);
+	json_free_context(st->ctx);
+	cx_free(cx, st);
+}
+
+static bool run_render(struct Corpus *c, CxMem *cx, void **state_p)
+{
+	struct TreeState *st = get_tree(c, cx, state_p);
+
+	if (!st)
+		return false;
+	mbuf_rewind_writer(&st->out);
+	return json_render(&st->out, st->top);
+}
+
+static bool access_value(struct JsonValue *jv);
+
+static bool access_key(void *arg, struct JsonValue *key, struct JsonValue *val)
+{
+	struct JsonValue *dict = arg, *found;
+	const char *str;
+
+	if (!json_value_as_string(key, &str, NULL))
+		return false;
+	if (!json_dict_get_value(dict, str, &found) || found != val)
+		return false;
+	return access_value(val);
+}
+
+/* look up every dict key and list index */
+static bool access_value(struct JsonValue *jv)
+{
+	struct JsonValue *elem;
+	size_t i, n;
+
+	switch (json_value_type(jv)) {
+	case JSON_DICT:
+		return json_dict_iter(jv, access_key, jv);
+	case JSON_LIST:
+		n = json_value_size(jv);
+		for (i = 0; i < n; i++) {
+			if (!json_list_get_value(jv, i, &elem) || !access_value(elem))
+				return false;
+		}
+		return true;
+	default:
+		return true;
+	}
+}
+
+static bool run_access(struct Corpus *c, CxMem *cx, void **state_p)
+{
+	struct TreeState *st = get_tree(c, cx, state_p);
+
+	return st && access_value(st->top);
+}
+
+static bool run_cbor_render(struct Corpus *c, CxMem *cx, void **state_p)
+{
+	struct TreeState *st = get_tree(c, cx, state_p);
+
+	if (!st)
+		return false;
+	mbuf_rewind_writer(&st->out);
+	return json_render_cbor(&st->out, st->top);
+}
+
+static bool run_cbor_parse(struct Corpus *c, CxMem *cx, void **state_p)
+{
+	struct JsonContext *ctx;
+	bool ok;
+
+	ctx = json_new_context(cx, c->len);
+	if (!ctx)
+		return false;
+	ok = json_parse_cbor(ctx, mbuf_data(&c->cbor), mbuf_written(&c->cbor)) != NULL;
+	json_free_context(ctx);
+	return ok;
+}
+
+static const struct Mode modes[] = {
+	{ "parse", run_parse, NULL },
+	{ "parse_reuse", run_parse_reuse, free_context },
+	{ "parse_lazy", run_lazy, NULL },
+	{ "access", run_access, free_tree },
+	{ "render", run_render, free_tree },
+	{ "cbor_render", run_cbor_render, free_tree },
+	{ "cbor_parse", run_cbor_parse, NULL },
+};
+
+/*
+ * Main.
+ */
+
+static void prepare_cbor(struct Corpus *c)
+{
+	struct JsonContext *ctx;
+	struct JsonValue *top;
+
+	mbuf_init_dynamic(&c->cbor);
+	ctx = json_new_context(NULL, c->len);
+	if (!ctx)
+		errx(1, "no memory");
+	top = json_parse(ctx, c->data, c->len);
+	if (!top)
+		errx(1, "%s: %s", c->name, json_strerror(ctx));
+	if (!json_render_cbor(&c->cbor, top))
+		errx(1, "%s: cannot encode CBOR", c->name);
+	json_free_context(ctx);
+}
+
+static void run_mode(struct Corpus *c, const struct Mode *m)
+{
+	const struct CxProfStats *st;
+	CxMem *prof;
+	void *state = NULL;
+	usec_t start, total;
+	double mbps;
+	int i;
+
+	prof = cx_new_profiler(NULL);
+	if (!prof)
+		errx(1, "no memory");
+
+	/* first round fills caches and lazy state */
+	if (!m->run(c, prof, &state))
+		errx(1, "%s/%s: failed", c->name, m->name);
+
+	start = get_time_usec();
+	for (i = 0; i < loops; i++) {
+		if (!m->run(c, prof, &state))
+			errx(1, "%s/%s: failed", c->name, m->name);
+	}
+	total = get_time_usec() - start;
+
+	st = cx_profiler_stats(prof);
+	mbps = (double)c->len * loops / (total ? total : 1);
+	printf("%-18s %8zu %-12s %10.1f %12.1f %10zu\n", c->name, c->len / 1024, m->name, mbps,
+	       (double)(st->allocs + st->reallocs) / (loops + 1),
+	       st->peak_bytes / 1024);
+
+	if (m->cleanup)
+		m->cleanup(state);
+	cx_destroy(prof);
+}
+
+static void usage(void)
+{
+	printf("usage: bench_json [-n loops] [-m mode] [file.json ...]\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct Corpus corpora[16];
+	const char *only = NULL;
+	int ncorpora = 0;
+	unsigned int i, j;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:m:h")) != -1) {
+		switch (c) {
+		case 'n':
+			loops = atoi(optarg);
+			if (loops < 1)
+				usage();
+			break;
+		case 'm':
+			only = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind < argc) {
+		for (; optind < argc && ncorpora < (int)ARRAY_NELEM(corpora); optind++)
+			load(&corpora[ncorpora++], argv[optind]);
+	} else {
+		pseudo_random_seed(1, 2);
+		generate(&corpora[ncorpora++], "twitter-like", gen_twitter);
+		generate(&corpora[ncorpora++], "canada-like", gen_canada);
+		generate(&corpora[ncorpora++], "citm-like", gen_citm);
+	}
+
+	printf("%-18s %8s %-12s %10s %12s %10s\n", "corpus", "KB", "mode", "MB/s", "allocs/doc", "peak KB");
+	for (i = 0; i < (unsigned)ncorpora; i++) {
+		prepare_cbor(&corpora[i]);
+		for (j = 0; j < ARRAY_NELEM(modes); j++) {
+			if (!only || strcmp(only, modes[j].name) == 0)
+				run_mode(&corpora[i], &modes[j]);
+		}
+		mbuf_free(&corpora[i].cbor);
+		free(corpora[i].data);
+	}
+	return 0;
+}
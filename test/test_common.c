@@ -25,7 +25,9 @@ struct testgroup_t groups[] = {
 	{ "heap/", heap_tests },
 	{ "json/", json_tests },
 	{ "list/", list_tests },
+	{ "mbuf/", mbuf_tests },
 	{ "mdict/", mdict_tests },
+	{ "mempool/", mempool_tests },
 	{ "netdb/", netdb_tests },
 	{ "pgutil/", pgutil_tests },
 	{ "psrandom/", psrandom_tests },
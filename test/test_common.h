@@ -41,7 +41,9 @@ extern struct testcase_t hashtab_tests[];
 extern struct testcase_t heap_tests[];
 extern struct testcase_t json_tests[];
 extern struct testcase_t list_tests[];
+extern struct testcase_t mbuf_tests[];
 extern struct testcase_t mdict_tests[];
+extern struct testcase_t mempool_tests[];
 extern struct testcase_t netdb_tests[];
 extern struct testcase_t pgutil_tests[];
 extern struct testcase_t psrandom_tests[];
@@ -2,6 +2,8 @@
 
 #include <usual/string.h>
 #include <usual/cxextra.h>
+#include <usual/cxprof.h>
+#include <usual/json.h>
 
 static int delta = 0;
 
@@ -135,9 +137,197 @@ static void test_cxalloc_util(void *zzz)
 end:;
 }
 
+static void test_cxalloc_pool_reset(void *zzz)
+{
+	CxMem *pool;
+	struct CxPoolMark mark;
+	char *p1, *p2, *p3;
+	int i;
+
+	delta = 0;
+	pool = cx_new_pool(&log_libc, 1024, 8);
+	tt_assert(pool);
+	reset();
+
+	/* warm up: initial area + two segments */
+	p1 = cx_alloc(pool, 1000);
+	p2 = cx_alloc(pool, 2000);
+	cx_alloc(pool, 4000);
+	log_check("A(2080) A(4128)");
+
+	/* reset keeps largest segment as spare */
+	cx_pool_reset(pool);
+	log_check("F(2080)");
+	tt_assert(cx_alloc(pool, 1000) == p1);
+	tt_assert(cx_alloc(pool, 2000) != NULL);
+	cx_alloc(pool, 4000);
+	cx_pool_reset(pool);
+	log_check("A(8224) F(4128)");
+
+	/* steady state, no calls to parent */
+	for (i = 0; i < 3; i++) {
+		tt_assert(cx_alloc(pool, 1000) == p1);
+		p3 = cx_alloc(pool, 2000);
+		tt_assert(i == 0 || p2 == p3);
+		p2 = p3;
+		cx_alloc(pool, 4000);
+		cx_pool_reset(pool);
+	}
+	log_check("");
+
+	/* savepoints */
+	p1 = cx_alloc(pool, 100);
+	cx_pool_mark(pool, &mark);
+	p2 = cx_alloc(pool, 100);
+	cx_alloc(pool, 3000);
+	cx_pool_rewind(pool, &mark);
+	tt_assert(cx_alloc(pool, 100) == p2);
+	cx_pool_rewind(pool, &mark);
+	cx_pool_rewind(pool, &mark);
+	tt_assert(cx_alloc(pool, 50) == p2);
+	log_check("");
+
+	cx_destroy(pool);
+	int_check(delta, 0);
+end:
+	reset();
+}
+
+static void test_cxalloc_pool_sized(void *zzz)
+{
+	CxMem *pool;
+	char *a, *b, *a2;
+	size_t alen = 0, i;
+
+	pool = cx_new_pool_sized(NULL, 1024, 8);
+	tt_assert(pool);
+
+	/* grow two objects in turns */
+	a = cx_alloc(pool, 16);
+	b = cx_alloc(pool, 16);
+	for (i = 0; i < 1000; i++) {
+		if (i % 16 == 0) {
+			a = cx_realloc(pool, a, i + 16);
+			b = cx_realloc(pool, b, i + 16);
+		}
+		a[i] = 'a';
+		b[i] = 'b';
+	}
+	for (i = 0; i < 1000; i++) {
+		if (a[i] != 'a' || b[i] != 'b')
+			tt_fail_msg("bad data");
+	}
+
+	/* shrink of non-last object stays in place */
+	a2 = cx_realloc(pool, a, 10);
+	tt_assert(a2 == a);
+
+	/* build object in tail */
+	for (i = 0; i < 5000; i++) {
+		a = cx_pool_reserve(pool, alen + 1);
+		tt_assert(a);
+		a[alen++] = '0' + i % 10;
+	}
+	a = cx_pool_commit(pool, alen);
+	for (i = 0; i < alen; i++) {
+		if (a[i] != (char)('0' + i % 10))
+			tt_fail_msg("bad tail data");
+	}
+	b = cx_alloc(pool, 8);
+	tt_assert(b >= a + alen || b < a);
+end:
+	cx_destroy(pool);
+}
+
+static void test_cxalloc_profiler(void *zzz)
+{
+	CxMem *prof, *ta, *tb;
+	const struct CxProfStats *st;
+	struct JsonContext *ctx = NULL;
+	struct JsonValue *res, *val;
+	struct MBuf buf;
+	void *p1, *p2, *p3;
+	int64_t n;
+	int i;
+
+	delta = 0;
+	mbuf_init_dynamic(&buf);
+	prof = cx_new_profiler(&log_libc);
+	tt_assert(prof);
+	ta = cx_profiler_tag(prof, "aaa");
+	tb = cx_profiler_tag(ta, "bbb");
+	tt_assert(ta && tb && ta != tb);
+	tt_assert(cx_profiler_tag(tb, "aaa") == ta);
+	tt_assert(cx_profiler_tag(ta, "default") == prof);
+
+	p1 = cx_alloc(ta, 10);
+	p2 = cx_alloc(ta, 100);
+	p3 = cx_alloc(tb, 1000);
+	st = cx_profiler_stats(ta);
+	int_check(st->allocs, 2);
+	int_check(st->live_bytes, 110);
+	int_check(st->hist[0], 1);
+	int_check(st->hist[3], 1);
+
+	/* credited to owner, not to view */
+	p2 = cx_realloc(tb, p2, 300);
+	cx_free(prof, p1);
+	int_check(st->reallocs, 1);
+	int_check(st->frees, 1);
+	int_check(st->live_count, 1);
+	int_check(st->live_bytes, 300);
+	int_check(st->peak_bytes, 310);
+	st = cx_profiler_stats(tb);
+	int_check(st->allocs, 1);
+	int_check(st->live_bytes, 1000);
+	st = cx_profiler_stats(prof);
+	int_check(st->allocs, 0);
+
+	/* every 3rd allocation is sampled */
+	cx_profiler_set_sampling(prof, 3);
+	for (i = 0; i < 200; i++)
+		cx_free(tb, cx_alloc(tb, i + 1));
+	cx_free(ta, p2);
+	cx_free(tb, p3);
+
+	ctx = json_new_context(NULL, 128);
+	res = cx_profiler_dump(prof, ctx);
+	tt_assert(res);
+	tt_assert(json_render(&buf, res));
+	tt_assert(json_dict_get_int(res, "live_bytes", &n));
+	int_check(n, 0);
+	tt_assert(json_dict_get_int(res, "peak_bytes", &n));
+	int_check(n, 1500);
+	tt_assert(json_dict_get_dict(res, "tags", &val));
+	int_check(json_value_size(val), 3);
+	tt_assert(json_dict_get_dict(val, "bbb", &val));
+	tt_assert(json_dict_get_int(val, "allocs", &n));
+	int_check(n, 201);
+	tt_assert(json_dict_get_dict(val, "hist", &val));
+	tt_assert(json_dict_get_int(val, "16", &n));
+	int_check(n, 16);
+	tt_assert(json_dict_get_int(val, "1024", &n));
+	int_check(n, 1);
+	tt_assert(json_dict_get_list(res, "samples", &val));
+	int_check(json_value_size(val), CX_PROF_SAMPLES);
+	tt_assert(json_list_get_dict(val, CX_PROF_SAMPLES - 1, &val));
+	tt_assert(json_dict_get_int(val, "size", &n));
+	int_check(n, 198);
+
+	cx_destroy(prof);
+	int_check(delta, 0);
+end:
+	json_free_context(ctx);
+	mbuf_free(&buf);
+	reset();
+}
+
 struct testcase_t cxalloc_tests[] = {
 	{ "basic", test_cxalloc_basic },
 	{ "tree", test_cxalloc_tree },
 	{ "util", test_cxalloc_util },
+	{ "pool_reset", test_cxalloc_pool_reset },
+	{ "pool_sized", test_cxalloc_pool_sized },
+	{ "profiler", test_cxalloc_profiler },
 	END_OF_TESTCASES
 };
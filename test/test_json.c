@@ -1,6 +1,10 @@
 #include <usual/json.h>
+#include <usual/ndjson.h>
+#include <usual/cxprof.h>
 
 #include <usual/string.h>
+#include <math.h>
+#include <float.h>
 #include "test_common.h"
 
 static const char *simple_value(const char *json)
@@ -251,7 +255,7 @@ static void test_json_render(void *p)
 	tt_assert(json_dict_put_int(dict, "i", 22));
 	tt_assert(json_dict_put_float(dict, "f", 1));
 	tt_assert(json_dict_put_string(dict, "s", "qwe"));
-	str_check(render(dict), "{\"b\":true,\"f\":1.0,\"i\":22,\"k\":[],\"n\":null,\"s\":\"qwe\"}");
+	str_check(render(dict), "{\"k\":[],\"n\":null,\"b\":true,\"i\":22,\"f\":1.0,\"s\":\"qwe\"}");
 
 	str_check(render(json_new_string(ctx, "\"\\ low:\a\b\f\n\r\t")), "\"\\\"\\\\ low:\\u0007\\b\\f\\n\\r\\t\"");
 
@@ -380,13 +384,32 @@ static bool list_walker(void *arg, struct JsonValue *elem)
 	return true;
 }
 
+/* checks order like list_walker, appends next value up to 100 */
+struct GrowState {
+	struct JsonValue *list;
+	int counter;
+};
+
+static bool list_grower(void *arg, struct JsonValue *elem)
+{
+	struct GrowState *st = arg;
+
+	if (!list_walker(&st->counter, elem))
+		return false;
+	if (st->counter > 100)
+		return true;
+	return json_list_append_int(st->list, st->counter);
+}
+
 static void test_json_iter(void *p)
 {
 	struct JsonContext *ctx;
 	struct JsonValue *list, *dict;
-	const char *json = "{\"3\": 3, \"1\": 1, \"2\": 2}";
+	const char *json = "{\"1\": 1, \"2\": 2, \"3\": 3}";
 	const char *json2 = "[1,2,3]";
-	int counter;
+	struct GrowState grow;
+	int counter, i;
+	int64_t v;
 
 	ctx = json_new_context(NULL, 128); tt_assert(ctx);
 	dict = json_parse(ctx, json, strlen(json)); tt_assert(dict);
@@ -398,6 +421,27 @@ static void test_json_iter(void *p)
 	int_check(json_value_size(list), 3);
 	counter = 1;
 	tt_assert(json_list_iter(list, list_walker, &counter));
+
+	/* appends mixed with indexed access */
+	for (i = 4; i <= 1000; i++) {
+		tt_assert(json_list_append_int(list, i));
+		tt_assert(json_list_get_int(list, i - 1, &v));
+		int_check(v, i);
+		tt_assert(json_list_get_int(list, i / 2, &v));
+		int_check(v, i / 2 + 1);
+	}
+	tt_assert(!json_list_get_int(list, 1000, &v));
+	counter = 1;
+	tt_assert(json_list_iter(list, list_walker, &counter));
+	int_check(counter, 1001);
+
+	/* elements appended during iteration are seen */
+	grow.list = list = json_new_list(ctx);
+	tt_assert(json_list_append_int(list, 1));
+	grow.counter = 1;
+	tt_assert(json_list_iter(list, list_grower, &grow));
+	int_check(json_value_size(list), 100);
+	int_check(grow.counter, 101);
 end:
 	json_free_context(ctx);
 }
@@ -423,11 +467,1389 @@ static void test_json_relax(void *p)
 end:;
 }
 
+/* parse string with special sequence at every offset of vector block */
+static const char *long_string(int pos, const char *special, bool junk)
+{
+	struct JsonContext *ctx;
+	struct JsonValue *obj;
+	static char buf[256];
+	char src[256];
+	const char *val;
+	size_t len;
+	int i;
+
+	src[0] = '"';
+	for (i = 0; i < pos; i++)
+		src[i + 1] = 'a' + i % 26;
+	snprintf(src + pos + 1, sizeof(src) - pos - 1, "%s%s\"%s", special,
+		 "0123456789abcdefghijklmnopqrstuvwxyz", junk ? " x" : "");
+
+	ctx = json_new_context(NULL, 128);
+	obj = json_parse(ctx, src, strlen(src));
+	if (!obj) {
+		snprintf(buf, sizeof(buf), "EPARSE: %s", json_strerror(ctx));
+	} else if (!json_value_as_string(obj, &val, &len)) {
+		strlcpy(buf, "ESTR", sizeof(buf));
+	} else {
+		/* return only part after prefix */
+		strlcpy(buf, val + pos, sizeof(buf));
+	}
+	json_free_context(ctx);
+	return buf;
+}
+
+static void test_json_longstr(void *p)
+{
+	const char *tail = "0123456789abcdefghijklmnopqrstuvwxyz";
+	char exp[128];
+	int pos;
+
+	for (pos = 0; pos < 70; pos++) {
+		str_check(long_string(pos, "", false), tail);
+
+		snprintf(exp, sizeof(exp), "\"\\%s", tail);
+		str_check(long_string(pos, "\\\"\\\\", false), exp);
+
+		snprintf(exp, sizeof(exp), "\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80%s", tail);
+		str_check(long_string(pos, "\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80", false), exp);
+
+		snprintf(exp, sizeof(exp), "\t\n%s", tail);
+		str_check(long_string(pos, "\t\n", false), exp);
+		str_check(long_string(pos, "\n\n", true), "EPARSE: Line #3: Invalid symbol: 'x'");
+
+		str_check(long_string(pos, "\xc3", false), "EPARSE: Line #1: Invalid UTF8 sequence");
+		str_check(long_string(pos, "\xff", false), "EPARSE: Line #1: Invalid UTF8 sequence");
+	}
+end:;
+}
+
+/* simple per-byte escaper to compare against */
+static void ref_escape(struct MBuf *dst, const char *str, size_t len)
+{
+	const unsigned char *s = (const unsigned char *)str;
+	char tmp[8];
+	size_t i;
+
+	tt_assert(mbuf_write_byte(dst, '"'));
+	for (i = 0; i < len; i++) {
+		if (s[i] == '"' || s[i] == '\\') {
+			snprintf(tmp, sizeof(tmp), "\\%c", s[i]);
+		} else if (s[i] == '\n') {
+			strlcpy(tmp, "\\n", sizeof(tmp));
+		} else if (s[i] < 0x20) {
+			snprintf(tmp, sizeof(tmp), "\\u%04x", s[i]);
+		} else if (s[i] == 0xE2 && i + 2 < len && s[i + 1] == 0x80 && (s[i + 2] == 0xA8 || s[i + 2] == 0xA9)) {
+			snprintf(tmp, sizeof(tmp), "\\u%04x", 0x2028 + s[i + 2] - 0xA8);
+			i += 2;
+		} else {
+			tmp[0] = s[i];
+			tmp[1] = 0;
+		}
+		tt_assert(mbuf_write(dst, tmp, strlen(tmp)));
+	}
+	tt_assert(mbuf_write_byte(dst, '"'));
+end:;
+}
+
+static void test_json_render_escape(void *p)
+{
+	static const char *pieces[] = {
+		"\"", "\\", "\n", "\x01", "\x1f", " ", "\x7f", "\xc3\xa9",
+		"\xe2\x80\xa8", "\xe2\x80\xa9", "\xe2\x82\xac", "\xe2\x80\x99",
+	};
+	const char *fill = "abcdefghijklmnopqrstuvwxyz0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ0123";
+	struct JsonWriter jw;
+	struct MBuf got, exp;
+	char str[128];
+	size_t len, k;
+	int pos;
+
+	mbuf_init_dynamic(&got);
+	mbuf_init_dynamic(&exp);
+
+	/* each special piece at every offset, with and without clean tail */
+	for (k = 0; k < ARRAY_NELEM(pieces); k++) {
+		for (pos = 0; pos < 66; pos++) {
+			memcpy(str, fill, pos);
+			len = pos;
+			memcpy(str + len, pieces[k], strlen(pieces[k]));
+			len += strlen(pieces[k]);
+			if (pos & 1) {
+				memcpy(str + len, fill, 40);
+				len += 40;
+			}
+
+			mbuf_rewind_writer(&got);
+			mbuf_rewind_writer(&exp);
+			jw_init(&jw, &got);
+			tt_assert(jw_string_len(&jw, str, len));
+			ref_escape(&exp, str, len);
+			tt_assert(mbuf_eq(&got, &exp));
+		}
+	}
+end:
+	mbuf_free(&got);
+	mbuf_free(&exp);
+}
+
+static const char *render_opts(const char *json, unsigned int opts, size_t max_bytes)
+{
+	struct JsonContext *ctx;
+	struct JsonValue *obj;
+	static char buf[1024];
+	struct MBuf dst;
+	bool ok;
+
+	mbuf_init_fixed_writer(&dst, buf, sizeof(buf));
+	ctx = json_new_context(NULL, 128);
+	obj = json_parse(ctx, json, strlen(json));
+	if (!obj) {
+		json_free_context(ctx);
+		return "EPARSE";
+	}
+	if (!mbuf_write(&dst, "ERENDER:", 8))
+		return "EBUF";
+	ok = json_render_opts(&dst, obj, opts, max_bytes);
+	json_free_context(ctx);
+	if (!mbuf_write_byte(&dst, 0))
+		return "EBUF";
+	return ok ? buf + 8 : buf;
+}
+
+static void test_json_render_opts(void *p)
+{
+	/* pretty */
+	str_check(render_opts("{\"b\": [1, {}, []], \"a\": {\"x\": null}}", JSON_RENDER_PRETTY, 0),
+		  "{\n  \"b\": [\n    1,\n    {},\n    []\n  ],\n  \"a\": {\n    \"x\": null\n  }\n}");
+	str_check(render_opts("[]", JSON_RENDER_PRETTY, 0), "[]");
+	str_check(render_opts("\"s\"", JSON_RENDER_PRETTY, 0), "\"s\"");
+
+	/* sorted keys */
+	str_check(render_opts("{\"b\": 1, \"a\": {\"d\": 2, \"c\": 3}, \"ab\": 0}", JSON_RENDER_SORT_KEYS, 0),
+		  "{\"a\":{\"c\":3,\"d\":2},\"ab\":0,\"b\":1}");
+	str_check(render_opts("{\"b\": 1, \"a\": 2}", JSON_RENDER_SORT_KEYS | JSON_RENDER_PRETTY, 0),
+		  "{\n  \"a\": 2,\n  \"b\": 1\n}");
+
+	/* RFC 8785 examples: UTF-16 key order */
+	str_check(render_opts("{\"\\u20ac\": 1, \"\\r\": 2, \"\\ufb33\": 3, \"1\": 4, \"\\ud83d\\ude00\": 5, \"\\u0080\": 6, \"\\u00f6\": 7}",
+			      JSON_RENDER_CANONICAL | JSON_RENDER_PRETTY, 0),
+		  "{\"\\r\":2,\"1\":4,\"\xc2\x80\":6,\"\xc3\xb6\":7,\"\xe2\x82\xac\":1,\"\xf0\x9f\x98\x80\":5,\"\xef\xac\xb3\":3}");
+
+	/* RFC 8785 examples: numbers */
+	str_check(render_opts("[1e30, 4.50, 2e-3, 0.000000000000000000000000001, -0.0, 1.0, 1e21, 1e20, 1e-6, 1e-7]",
+			      JSON_RENDER_CANONICAL, 0),
+		  "[1e+30,4.5,0.002,1e-27,0,1,1e+21,100000000000000000000,0.000001,1e-7]");
+	str_check(render_opts("[333333333.33333329, 9007199254740991, -1.5e-300, 1.7976931348623157e308, 1.2345678901234568e20]",
+			      JSON_RENDER_CANONICAL, 0),
+		  "[333333333.3333333,9007199254740991,-1.5e-300,1.7976931348623157e+308,123456789012345680000]");
+
+	/* canonical keeps U+2028 as-is */
+	str_check(render_opts("[\"\\u2028\\n\"]", JSON_RENDER_CANONICAL, 0), "[\"\xe2\x80\xa8\\n\"]");
+	str_check(render_opts("[\"\\u2028\\n\"]", 0, 0), "[\"\\u2028\\n\"]");
+
+	/* byte budget */
+	str_check(render_opts("[1, 2, 3]", 0, 7), "[1,2,3]");
+	str_check(render_opts("[1, 2, 3]", 0, 6), "ERENDER:[1,2,3");
+	str_check(render_opts("[1, \"long string\"]", 0, 8), "ERENDER:[1,");
+	str_check(render_opts("{\"a\": [1, 2, 3]}", JSON_RENDER_PRETTY, 10), "ERENDER:{\n  \"a\": [");
+end:;
+}
+
+static bool path_collect(void *arg, struct JsonValue *val)
+{
+	struct MBuf *dst = arg;
+
+	if (mbuf_written(dst) > 0 && !mbuf_write_byte(dst, '|'))
+		return false;
+	return json_render(dst, val);
+}
+
+/* all matches separated with '|' */
+static const char *path_query(const char *json, const char *expr, bool lazy)
+{
+	static const char doc[] =
+		"{\"a\": {\"b\": [10, 20, 30, 40]}, \"c/d\": 1, \"e~f\": 2, \"\": 3, \"x y\": {\"a\": 5},"
+		" \"list\": [{\"id\": 1, \"n\": \"p\"}, {\"id\": 2}, {\"n\": \"q\"}], \"01\": 4}";
+	static char buf[512];
+	struct JsonContext *ctx;
+	struct JsonValue *obj;
+	struct JsonPath *path;
+	struct MBuf dst;
+	const char *res = buf;
+
+	if (!json)
+		json = doc;
+	memset(buf, 0, sizeof(buf));
+	mbuf_init_fixed_writer(&dst, buf, sizeof(buf) - 1);
+
+	path = json_path_compile(NULL, expr);
+	if (!path)
+		return "ECOMPILE";
+	ctx = json_new_context(NULL, 128);
+	if (lazy)
+		obj = json_parse_lazy(ctx, json, strlen(json));
+	else
+		obj = json_parse(ctx, json, strlen(json));
+	if (!obj)
+		res = "EPARSE";
+	else if (!json_path_iter(path, obj, path_collect, &dst))
+		res = "EITER";
+	else if (!mbuf_written(&dst))
+		res = "NONE";
+	json_free_context(ctx);
+	json_path_free(path);
+	return res;
+}
+
+static void test_json_path(void *p)
+{
+	struct JsonContext *ctx = NULL;
+	struct JsonValue *obj, *val;
+	struct JsonPath *path = NULL;
+	int64_t ival;
+	int lazy;
+
+	for (lazy = 0; lazy < 2; lazy++) {
+		/* RFC 6901 */
+		str_check(path_query(NULL, "/a/b/1", lazy), "20");
+		str_check(path_query(NULL, "/a/b/4", lazy), "NONE");
+		str_check(path_query(NULL, "/a/b/-", lazy), "NONE");
+		str_check(path_query(NULL, "/a/b/01", lazy), "NONE");
+		str_check(path_query(NULL, "/c~1d", lazy), "1");
+		str_check(path_query(NULL, "/e~0f", lazy), "2");
+		str_check(path_query(NULL, "/", lazy), "3");
+		str_check(path_query(NULL, "/01", lazy), "4");
+		str_check(path_query(NULL, "/x y/a", lazy), "5");
+		str_check(path_query(NULL, "/list/0/n", lazy), "\"p\"");
+		str_check(path_query("[1, [2]]", "", lazy), "[1,[2]]");
+		str_check(path_query(NULL, "/a/b/1/x", lazy), "NONE");
+
+		/* expressions */
+		str_check(path_query("[1, [2]]", "$", lazy), "[1,[2]]");
+		str_check(path_query(NULL, "$.a.b[0]", lazy), "10");
+		str_check(path_query(NULL, "$.a.b[-1]", lazy), "40");
+		str_check(path_query(NULL, "$.a.b[-5]", lazy), "NONE");
+		str_check(path_query(NULL, "$.a.b[1:3]", lazy), "20|30");
+		str_check(path_query(NULL, "$.a.b[:-2]", lazy), "10|20");
+		str_check(path_query(NULL, "$.a.b[-2:]", lazy), "30|40");
+		str_check(path_query(NULL, "$.a.b[:]", lazy), "10|20|30|40");
+		str_check(path_query(NULL, "$.a.b[3:1]", lazy), "NONE");
+		str_check(path_query(NULL, "$.a.b[-10:10]", lazy), "10|20|30|40");
+		str_check(path_query(NULL, "$.list[*].id", lazy), "1|2");
+		str_check(path_query(NULL, "$.list.*.n", lazy), "\"p\"|\"q\"");
+		str_check(path_query(NULL, "$['x y'].a", lazy), "5");
+		str_check(path_query(NULL, "$[\"c/d\"]", lazy), "1");
+		str_check(path_query("{\"it's\": 1}", "$['it\\'s']", lazy), "1");
+		str_check(path_query("{\"a\": 1, \"b\": [2], \"c\": {\"d\": 3}}", "$.*", lazy), "1|[2]|{\"d\":3}");
+		str_check(path_query("{\"a\": {\"x\": 1}, \"b\": {\"x\": 2}}", "$[*].x", lazy), "1|2");
+		str_check(path_query(NULL, "$.a[0]", lazy), "NONE");
+		str_check(path_query(NULL, "$.a.b.c", lazy), "NONE");
+	}
+
+	/* syntax errors */
+	str_check(path_query(NULL, "a/b", false), "ECOMPILE");
+	str_check(path_query(NULL, "/a~2", false), "ECOMPILE");
+	str_check(path_query(NULL, "/a~", false), "ECOMPILE");
+	str_check(path_query(NULL, "$a", false), "ECOMPILE");
+	str_check(path_query(NULL, "$.", false), "ECOMPILE");
+	str_check(path_query(NULL, "$[", false), "ECOMPILE");
+	str_check(path_query(NULL, "$[1", false), "ECOMPILE");
+	str_check(path_query(NULL, "$[x]", false), "ECOMPILE");
+	str_check(path_query(NULL, "$['a]", false), "ECOMPILE");
+	str_check(path_query(NULL, "$[1:2:3]", false), "ECOMPILE");
+	str_check(path_query(NULL, "$[12345678901234567890]", false), "ECOMPILE");
+
+	/* compiled path is reused, first match */
+	path = json_path_compile(NULL, "$.list[*].id");
+	tt_assert(path);
+	ctx = json_new_context(NULL, 128);
+	obj = json_parse(ctx, "{\"list\": [{\"x\": 1}, {\"id\": 7}, {\"id\": 8}]}", 42);
+	tt_assert(obj);
+	tt_assert(json_path_get(path, obj, &val));
+	tt_assert(json_value_as_int(val, &ival));
+	tt_assert(ival == 7);
+	obj = json_parse(ctx, "{\"list\": []}", 12);
+	tt_assert(obj);
+	tt_assert(!json_path_get(path, obj, &val));
+
+	tt_assert(json_pointer_get(obj, "/list", &val));
+	tt_assert(json_value_is_list(val));
+	tt_assert(!json_pointer_get(obj, "$.list", &val));
+end:
+	json_path_free(path);
+	json_free_context(ctx);
+}
+
+#define ND_RECORDS	3000
+#define ND_BAD		1234
+
+struct NdResult {
+	int seen[ND_RECORDS];
+	int bad;
+	int last;
+	int stop_at;
+	bool in_order;
+	bool track;		/* last/in_order, only when single caller */
+	char err[128];
+};
+
+static bool nd_record(void *arg, size_t ofs, struct JsonValue *val, const char *err)
+{
+	struct NdResult *res = arg;
+	int64_t id;
+
+	if (!val) {
+		res->bad++;
+		strlcpy(res->err, err, sizeof(res->err));
+		return true;
+	}
+	if (!json_dict_get_int(val, "id", &id) || id < 0 || id >= ND_RECORDS)
+		return false;
+	res->seen[id]++;
+	if (res->track) {
+		if (id <= res->last)
+			res->in_order = false;
+		res->last = id;
+	}
+	return id != res->stop_at;
+}
+
+static void test_json_ndjson(void *p)
+{
+	static const char fname[] = "test_ndjson.tmp";
+	const struct CxProfStats *stats;
+	struct NdjsonConfig cf;
+	struct NdResult res;
+	CxMem *prof = NULL;
+	struct MBuf buf;
+	char line[128];
+	FILE *f;
+	int i, mode, n;
+
+	/* records with blank lines between, one broken */
+	mbuf_init_dynamic(&buf);
+	for (i = 0; i < ND_RECORDS; i++) {
+		if (i == ND_BAD)
+			n = snprintf(line, sizeof(line), "{\"id\": %d, }\n", i);
+		else if (i % 7 == 0)
+			n = snprintf(line, sizeof(line), "\n  {\"id\": %d, \"s\": \"a\\nb\"}\r\n\t\n", i);
+		else
+			n = snprintf(line, sizeof(line), "{\"id\": %d, \"list\": [1, 2, {\"x\": null}]}\n", i);
+		tt_assert(mbuf_write(&buf, line, n));
+	}
+
+	/* single thread, ordered, unordered; default and small batches */
+	for (mode = 0; mode < 6; mode++) {
+		memset(&cf, 0, sizeof(cf));
+		cf.cb_func = nd_record;
+		cf.cb_arg = &res;
+		cf.threads = (mode % 3 == 0) ? 0 : 4;
+		cf.ordered = (mode % 3 == 1);
+		cf.batch_size = (mode < 3) ? 0 : 100;
+
+		memset(&res, 0, sizeof(res));
+		res.last = -1;
+		res.stop_at = -1;
+		res.in_order = true;
+		res.track = cf.threads == 0 || cf.ordered;
+		tt_assert(ndjson_parse(&cf, mbuf_data(&buf), mbuf_written(&buf)));
+		for (i = 0; i < ND_RECORDS; i++)
+			tt_int_op(res.seen[i], ==, (i == ND_BAD) ? 0 : 1);
+		tt_int_op(res.bad, ==, 1);
+		if (res.track) {
+			tt_assert(res.in_order);
+			str_check(res.err, "Line #1: Unexpected symbol: '}'");
+		}
+
+		/* stop in the middle */
+		memset(&res, 0, sizeof(res));
+		res.last = -1;
+		res.stop_at = 100;
+		res.in_order = true;
+		res.track = cf.threads == 0 || cf.ordered;
+		tt_assert(!ndjson_parse(&cf, mbuf_data(&buf), mbuf_written(&buf)));
+		tt_int_op(res.seen[100], ==, 1);
+		if (res.track)
+			tt_int_op(res.last, ==, 100);
+	}
+
+	/* threads share allocator */
+	for (mode = 0; mode < 2; mode++) {
+		prof = cx_new_profiler(NULL);
+		tt_assert(prof);
+		memset(&cf, 0, sizeof(cf));
+		cf.cb_func = nd_record;
+		cf.cb_arg = &res;
+		cf.cx_mem = prof;
+		cf.threads = 8;
+		cf.ordered = mode == 1;
+		cf.batch_size = 100;
+
+		memset(&res, 0, sizeof(res));
+		res.stop_at = -1;
+		res.track = cf.ordered;
+		res.last = -1;
+		res.in_order = true;
+		tt_assert(ndjson_parse(&cf, mbuf_data(&buf), mbuf_written(&buf)));
+		for (i = 0; i < ND_RECORDS; i++)
+			tt_int_op(res.seen[i], ==, (i == ND_BAD) ? 0 : 1);
+		tt_assert(res.in_order);
+		stats = cx_profiler_stats(prof);
+		tt_assert(stats->allocs > 0);
+		tt_int_op(stats->live_count, ==, 0);
+		tt_assert(stats->frees == stats->allocs);
+		cx_destroy(prof);
+		prof = NULL;
+	}
+
+	/* from file */
+	f = fopen(fname, "wb");
+	tt_assert(f);
+	tt_assert(fwrite(mbuf_data(&buf), 1, mbuf_written(&buf), f) == mbuf_written(&buf));
+	fclose(f);
+	memset(&cf, 0, sizeof(cf));
+	cf.cb_func = nd_record;
+	cf.cb_arg = &res;
+	cf.threads = 3;
+	cf.ordered = true;
+	memset(&res, 0, sizeof(res));
+	res.last = -1;
+	res.stop_at = -1;
+	res.in_order = true;
+	res.track = true;
+	tt_assert(ndjson_parse_file(&cf, fname));
+	tt_assert(res.in_order);
+	tt_int_op(res.last, ==, ND_RECORDS - 1);
+	tt_assert(!ndjson_parse_file(&cf, "nonexist"));
+
+	/* empty input */
+	tt_assert(ndjson_parse(&cf, "", 0));
+	tt_assert(ndjson_parse(&cf, "\n \n", 3));
+end:
+	cx_destroy(prof);
+	unlink(fname);
+	mbuf_free(&buf);
+}
+
+/*
+ * Binding to struct.
+ */
+
+struct BindAddr {
+	char host[8];
+	int port;
+};
+
+struct BindConf {
+	bool debug;
+	int level;
+	unsigned int workers;
+	int64_t maxmem;
+	double ratio;
+	char *name;
+	struct BindAddr addr;
+};
+
+#define JSON_BIND_BASE struct BindAddr
+static const struct JsonBind addr_binds[] = {
+	JSON_BIND("host", JSON_BIND_STRBUF, host, JSON_BIND_REQUIRED),
+	JSON_BIND_RANGE("port", JSON_BIND_INT, port, 0, 1, 65535),
+	{ NULL }
+};
+#undef JSON_BIND_BASE
+
+#define JSON_BIND_BASE struct BindConf
+static const struct JsonBind conf_binds[] = {
+	JSON_BIND("debug", JSON_BIND_BOOL, debug, 0),
+	JSON_BIND("level", JSON_BIND_INT, level, JSON_BIND_REQUIRED),
+	JSON_BIND("workers", JSON_BIND_UINT, workers, 0),
+	JSON_BIND("maxmem", JSON_BIND_INT64, maxmem, 0),
+	JSON_BIND("ratio", JSON_BIND_DOUBLE, ratio, 0),
+	JSON_BIND("name", JSON_BIND_STRING, name, 0),
+	JSON_BIND_SUB("addr", addr, 0, addr_binds),
+	{ NULL }
+};
+#undef JSON_BIND_BASE
+
+static struct BindConf bconf;
+
+static const char *bind_check(const char *json, unsigned int options)
+{
+	struct JsonContext *ctx;
+	static char buf[128];
+
+	memset(&bconf, 0, sizeof(bconf));
+	bconf.addr.port = 5432;
+	ctx = json_new_context(NULL, 128);
+	if (json_bind_parse(ctx, conf_binds, &bconf, options, json, strlen(json)))
+		strlcpy(buf, "OK", sizeof(buf));
+	else
+		snprintf(buf, sizeof(buf), "EBIND: %s", json_strerror(ctx));
+	json_free_context(ctx);
+	return buf;
+}
+
+static void test_json_bind(void *p)
+{
+	struct JsonContext *ctx;
+	const char *json;
+
+	str_check(bind_check("{\"level\": 3, \"debug\": true, \"workers\": 4, \"maxmem\": 10000000000,"
+			     " \"ratio\": 2, \"addr\": {\"host\": \"db\", \"port\": 6432}}", 0), "OK");
+	tt_assert(bconf.debug);
+	int_check(bconf.level, 3);
+	int_check(bconf.workers, 4);
+	tt_assert(bconf.maxmem == INT64_C(10000000000));
+	tt_assert(bconf.ratio == 2.0);
+	tt_assert(bconf.name == NULL);
+	str_check(bconf.addr.host, "db");
+	int_check(bconf.addr.port, 6432);
+
+	/* defaults stay, unknown keys are skipped */
+	str_check(bind_check("{\"x\": {\"level\": 1, \"y\": [1, {}]}, \"level\": -2, \"ratio\": 0.5,"
+			     " \"addr\": {\"host\": \"h\", \"z\": null}}", 0), "OK");
+	int_check(bconf.level, -2);
+	tt_assert(bconf.ratio == 0.5);
+	int_check(bconf.addr.port, 5432);
+	str_check(bind_check("{\"level\": 1, \"x\": 1}", JSON_BIND_STRICT), "EBIND: Line #1: Unknown key: x");
+	str_check(bind_check("{\"level\": 1, \"addr\": {\"host\": \"\", \"p\": 1}}", JSON_BIND_STRICT),
+		  "EBIND: Line #1: Unknown key: p");
+
+	/* required */
+	str_check(bind_check("{}", 0), "EBIND: Line #1: Missing key: level");
+	str_check(bind_check("{\"level\": 1, \"addr\": {}}", 0), "EBIND: Line #1: Missing key: host");
+	str_check(bind_check("{\"level\": 1, \"level\": 2}", 0), "EBIND: Line #1: Duplicate key: level");
+
+	/* types and ranges */
+	str_check(bind_check("{\"level\": 1.5}", 0), "EBIND: Line #1: Wrong type for key: level");
+	str_check(bind_check("{\"level\": \"1\"}", 0), "EBIND: Line #1: Wrong type for key: level");
+	str_check(bind_check("{\"level\": 3000000000}", 0), "EBIND: Line #1: Wrong type for key: level");
+	str_check(bind_check("{\"level\": 1, \"workers\": -1}", 0), "EBIND: Line #1: Wrong type for key: workers");
+	str_check(bind_check("{\"level\": 1, \"debug\": 1}", 0), "EBIND: Line #1: Wrong type for key: debug");
+	str_check(bind_check("{\"level\": 1, \"addr\": 1}", 0), "EBIND: Line #1: Wrong type for key: addr");
+	str_check(bind_check("{\"level\": 1, \"name\": []}", 0), "EBIND: Line #1: Wrong type for key: name");
+	str_check(bind_check("{\"level\": 1, \"name\": {}}", 0), "EBIND: Line #1: Wrong type for key: name");
+	str_check(bind_check("{\"level\": 1, \"addr\": {\"host\": \"a\", \"port\": 0}}", 0),
+		  "EBIND: Line #1: Value out of range for key: port");
+	str_check(bind_check("{\"level\": 1, \"addr\": {\"host\": \"a\", \"port\": 65536}}", 0),
+		  "EBIND: Line #1: Value out of range for key: port");
+	str_check(bind_check("{\"level\": 1, \"addr\": {\"host\": \"1234567\"}}", 0), "OK");
+	str_check(bconf.addr.host, "1234567");
+	str_check(bind_check("{\"level\": 1, \"addr\": {\"host\": \"12345678\"}}", 0),
+		  "EBIND: Line #1: Too long value for key: host");
+
+	/* top must be dict */
+	str_check(bind_check("[]", 0), "EBIND: Line #1: Expected dict");
+	str_check(bind_check("1", 0), "EBIND: Line #1: Expected dict");
+	str_check(bind_check("{\"level\": 1", 0), "EBIND: Line #1: Container still open");
+	str_check(bind_check("{\"level\": 1}}", 0), "EBIND: Line #1: Unexpected symbol: '}'");
+
+	/* strings live in context */
+	ctx = json_new_context(NULL, 128);
+	json = "{\"level\": 1, \"name\": \"foo\\nbar\"}";
+	memset(&bconf, 0, sizeof(bconf));
+	tt_assert(json_bind_parse(ctx, conf_binds, &bconf, 0, json, strlen(json)));
+	str_check(bconf.name, "foo\nbar");
+	json = "{\"level\": 1, \"name\": null}";
+	tt_assert(json_bind_parse(ctx, conf_binds, &bconf, 0, json, strlen(json)));
+	tt_assert(bconf.name == NULL);
+	json_free_context(ctx);
+end:;
+}
+
+/*
+ * CBOR.
+ */
+
+/* parse JSON text, encode as CBOR, return hex */
+static const char *cbor_encode(const char *json)
+{
+	struct JsonContext *ctx;
+	struct JsonValue *obj;
+	static char buf[256];
+	struct MBuf dst;
+	unsigned int i;
+
+	ctx = json_new_context(NULL, 128);
+	mbuf_init_dynamic(&dst);
+	obj = json_parse(ctx, json, strlen(json));
+	if (!obj) {
+		snprintf(buf, sizeof(buf), "EPARSE: %s", json_strerror(ctx));
+	} else if (!json_render_cbor(&dst, obj)) {
+		strlcpy(buf, "ERENDER", sizeof(buf));
+	} else {
+		buf[0] = 0;
+		for (i = 0; i < dst.write_pos && i * 2 + 2 < sizeof(buf); i++)
+			snprintf(buf + i * 2, 3, "%02x", dst.data[i]);
+	}
+	mbuf_free(&dst);
+	json_free_context(ctx);
+	return buf;
+}
+
+/* decode hex CBOR, render as JSON text */
+static const char *cbor_decode(const char *hex)
+{
+	struct JsonContext *ctx;
+	struct JsonValue *obj;
+	static char buf[256];
+	uint8_t bin[128];
+	struct MBuf dst;
+	unsigned int i, c;
+
+	for (i = 0; hex[i * 2] && i < sizeof(bin); i++) {
+		sscanf(hex + i * 2, "%2x", &c);
+		bin[i] = c;
+	}
+
+	ctx = json_new_context(NULL, 128);
+	mbuf_init_fixed_writer(&dst, buf, sizeof(buf));
+	obj = json_parse_cbor(ctx, bin, i);
+	if (!obj)
+		snprintf(buf, sizeof(buf), "EPARSE: %s", json_strerror(ctx));
+	else if (!json_render(&dst, obj) || !mbuf_write_byte(&dst, 0))
+		strlcpy(buf, "ERENDER", sizeof(buf));
+	json_free_context(ctx);
+	return buf;
+}
+
+static bool cbor_count_key(void *arg, const char *key, size_t len)
+{
+	(*(int *)arg)++;
+	return true;
+}
+
+static void test_json_cbor(void *p)
+{
+	static const struct JsonEvents count_events = { .key = cbor_count_key };
+	static const uint8_t nested[] = { 0xa2, 0x61, 'a', 0xa1, 0x61, 'b', 0x01, 0x61, 'c', 0x80 };
+	struct JsonContext *ctx;
+	struct JsonValue *obj;
+	struct MBuf buf;
+	int nkeys = 0;
+
+	/* RFC 8949 Appendix A */
+	str_check(cbor_encode("0"), "00");
+	str_check(cbor_encode("23"), "17");
+	str_check(cbor_encode("24"), "1818");
+	str_check(cbor_encode("100"), "1864");
+	str_check(cbor_encode("1000"), "1903e8");
+	str_check(cbor_encode("1000000"), "1a000f4240");
+	str_check(cbor_encode("1000000000000"), "1b000000e8d4a51000");
+	str_check(cbor_encode("-1"), "20");
+	str_check(cbor_encode("-100"), "3863");
+	str_check(cbor_encode("-1000"), "3903e7");
+	str_check(cbor_encode("0.0"), "f90000");
+	str_check(cbor_encode("-0.0"), "f98000");
+	str_check(cbor_encode("1.0"), "f93c00");
+	str_check(cbor_encode("1.1"), "fb3ff199999999999a");
+	str_check(cbor_encode("1.5"), "f93e00");
+	str_check(cbor_encode("65504.0"), "f97bff");
+	str_check(cbor_encode("100000.0"), "fa47c35000");
+	str_check(cbor_encode("3.4028234663852886e+38"), "fa7f7fffff");
+	str_check(cbor_encode("1.0e+300"), "fb7e37e43c8800759c");
+	str_check(cbor_encode("5.960464477539063e-8"), "f90001");
+	str_check(cbor_encode("0.00006103515625"), "f90400");
+	str_check(cbor_encode("-4.0"), "f9c400");
+	str_check(cbor_encode("-4.1"), "fbc010666666666666");
+	str_check(cbor_encode("false"), "f4");
+	str_check(cbor_encode("true"), "f5");
+	str_check(cbor_encode("null"), "f6");
+	str_check(cbor_encode("\"\""), "60");
+	str_check(cbor_encode("\"a\""), "6161");
+	str_check(cbor_encode("\"IETF\""), "6449455446");
+	str_check(cbor_encode("\"\\u00fc\""), "62c3bc");
+	str_check(cbor_encode("[]"), "80");
+	str_check(cbor_encode("[1, 2, 3]"), "83010203");
+	str_check(cbor_encode("[1, [2, 3], [4, 5]]"), "8301820203820405");
+	str_check(cbor_encode("{}"), "a0");
+	str_check(cbor_encode("{\"a\": 1, \"b\": [2, 3]}"), "a26161016162820203");
+	str_check(cbor_encode("[\"a\", {\"b\": \"c\"}]"), "826161a161626163");
+
+	/* decode */
+	str_check(cbor_decode("1b000000e8d4a51000"), "1000000000000");
+	str_check(cbor_decode("3903e7"), "-1000");
+	str_check(cbor_decode("f93e00"), "1.5");
+	str_check(cbor_decode("f90001"), "5.960464477539063e-08");
+	str_check(cbor_decode("fa47c35000"), "100000.0");
+	str_check(cbor_decode("fb3ff199999999999a"), "1.1");
+	str_check(cbor_decode("a26161016162820203"), "{\"a\":1,\"b\":[2,3]}");
+	str_check(cbor_decode("826161a161626163"), "[\"a\",{\"b\":\"c\"}]");
+	str_check(cbor_decode("62c3bc"), "\"\xc3\xbc\"");
+	str_check(cbor_decode("c11a514b67b0"), "1363896240");
+
+	/* indefinite length */
+	str_check(cbor_decode("7f657374726561646d696e67ff"), "\"streaming\"");
+	str_check(cbor_decode("7fff"), "\"\"");
+	str_check(cbor_decode("9fff"), "[]");
+	str_check(cbor_decode("9f018202039f0405ffff"), "[1,[2,3],[4,5]]");
+	str_check(cbor_decode("bf61610161629f0203ffff"), "{\"a\":1,\"b\":[2,3]}");
+	str_check(cbor_decode("826161bf61626163ff"), "[\"a\",{\"b\":\"c\"}]");
+
+	/* errors */
+	str_check(cbor_decode(""), "EPARSE: Line #1: Unexpected end of data");
+	str_check(cbor_decode("830102"), "EPARSE: Line #1: Unexpected end of data");
+	str_check(cbor_decode("6461"), "EPARSE: Line #1: Unexpected end of data");
+	str_check(cbor_decode("0000"), "EPARSE: Line #1: Extra data after value");
+	str_check(cbor_decode("4161"), "EPARSE: Line #1: Byte strings not supported");
+	str_check(cbor_decode("a10102"), "EPARSE: Line #1: Dict key must be string");
+	str_check(cbor_decode("1b0020000000000000"), "EPARSE: Line #1: Number out of range");
+	str_check(cbor_decode("1b001fffffffffffff"), "9007199254740991");
+	str_check(cbor_decode("3b001ffffffffffffe"), "-9007199254740991");
+	str_check(cbor_decode("3b001fffffffffffff"), "EPARSE: Line #1: Number out of range");
+	str_check(cbor_decode("ff"), "EPARSE: Line #1: Unexpected break");
+	str_check(cbor_decode("f7"), "EPARSE: Line #1: Unsupported simple value");
+	str_check(cbor_decode("f97c00"), "EPARSE: Line #1: Invalid float");
+	str_check(cbor_decode("1c"), "EPARSE: Line #1: Invalid CBOR header");
+	str_check(cbor_decode("1f"), "EPARSE: Line #1: Invalid CBOR header");
+	str_check(cbor_decode("bf6161ff"), "EPARSE: Line #1: Missing value for key");
+	str_check(cbor_decode("7f01ff"), "EPARSE: Line #1: Invalid string chunk");
+	str_check(cbor_decode("62c328"), "EPARSE: Line #1: Invalid UTF8 sequence");
+	str_check(cbor_decode("6100"), "EPARSE: Line #1: Invalid UTF8 sequence");
+
+	/* lazy tree */
+	ctx = json_new_context(NULL, 128);
+	mbuf_init_dynamic(&buf);
+	obj = json_parse_lazy(ctx, "[{\"a\": 1, \"b\": [2, 3]}]", 23);
+	tt_assert(obj && json_render_cbor(&buf, obj));
+	int_check(buf.write_pos, 10);
+	tt_assert(memcmp(buf.data, "\x81\xa2\x61\x61\x01\x61\x62\x82\x02\x03", 10) == 0);
+	mbuf_free(&buf);
+	json_free_context(ctx);
+
+	/* events */
+	ctx = json_new_context(NULL, 128);
+	tt_assert(json_parse_cbor_events(ctx, &count_events, &nkeys, nested, sizeof(nested)));
+	int_check(nkeys, 3);
+	tt_assert(!json_parse_cbor_events(ctx, &count_events, &nkeys, nested, sizeof(nested) - 1));
+	str_check(json_strerror(ctx), "Line #1: Unexpected end of data");
+	json_free_context(ctx);
+end:;
+}
+
+static void test_json_reset(void *p)
+{
+	struct JsonContext *ctx = NULL;
+	struct JsonValue *obj;
+	struct MBuf doc;
+	CxMem *prof;
+	uint64_t allocs = 0;
+	int64_t v;
+	int i;
+
+	prof = cx_new_profiler(NULL);
+	tt_assert(prof);
+	mbuf_init_dynamic(&doc);
+	tt_assert(mbuf_write_byte(&doc, '['));
+	for (i = 0; i < 300; i++)
+		tt_assert(mbuf_write(&doc, "{\"key\": \"value\", \"n\": 1},", 25));
+	tt_assert(mbuf_write(&doc, "null]", 5));
+
+	ctx = json_new_context(prof, 256);
+	tt_assert(ctx);
+	json_set_options(ctx, JSON_PARSE_RELAXED);
+	for (i = 0; i < 10; i++) {
+		json_reset_context(ctx);
+		obj = json_parse(ctx, (char *)doc.data, doc.write_pos);
+		tt_assert(obj);
+		int_check(json_value_size(obj), 301);
+		tt_assert(json_list_get_dict(obj, 299, &obj));
+		tt_assert(json_dict_get_int(obj, "n", &v));
+		int_check(v, 1);
+
+		/* no new memory once pool has grown */
+		if (i == 3)
+			allocs = cx_profiler_stats(prof)->allocs + cx_profiler_stats(prof)->reallocs;
+	}
+	tt_assert(cx_profiler_stats(prof)->allocs + cx_profiler_stats(prof)->reallocs == allocs);
+
+	/* error is cleared, options stay */
+	tt_assert(!json_parse(ctx, "[1,]x", 5));
+	str_check(json_strerror(ctx), "Line #1: Invalid symbol: 'x'");
+	json_reset_context(ctx);
+	tt_assert(json_strerror(ctx) == NULL);
+	obj = json_parse(ctx, "[1,]", 4);
+	tt_assert(obj);
+	int_check(json_value_size(obj), 1);
+end:
+	json_free_context(ctx);
+	mbuf_free(&doc);
+	cx_destroy(prof);
+}
+
+/* parse in chunks of given size, render result */
+static const char *chunked(const char *json, size_t step, int opts)
+{
+	struct JsonContext *ctx;
+	struct JsonValue *obj;
+	static char buf[1024];
+	struct MBuf dst;
+	size_t pos, len = strlen(json);
+
+	memset(buf, 0, sizeof buf);
+	mbuf_init_fixed_writer(&dst, buf, sizeof(buf));
+
+	ctx = json_new_context(NULL, 128);
+	json_set_options(ctx, opts);
+	json_parse_start(ctx, NULL, NULL);
+	for (pos = 0; pos < len; pos += step) {
+		if (!json_parse_feed(ctx, json + pos, (len - pos < step) ? len - pos : step))
+			goto failed;
+	}
+	if (!json_parse_finish(ctx, &obj))
+		goto failed;
+	if (!json_render(&dst, obj) || !mbuf_write_byte(&dst, 0))
+		strlcpy(buf, "ERENDER", sizeof(buf));
+	json_free_context(ctx);
+	return buf;
+failed:
+	snprintf(buf, sizeof(buf), "EPARSE: %s", json_strerror(ctx));
+	json_free_context(ctx);
+	return buf;
+}
+
+static void test_json_chunks(void *p)
+{
+	static const char *docs[] = {
+		"{\"a\": [1, -23, 4.5e10, true, false, null], \"bb\": {\"c\": \"d\\\"e\\u00e9\\ud83d\\ude00\"}}",
+		"  [ \"\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80\", 12345678901, 0.25, [], {} ]  ",
+		"\"top\\\\string\"",
+		"1234",
+		NULL
+	};
+	const char *relaxed = "/* x */ {\"a\": [1, 2,], // y\n \"b\": {\"c\": 3,},}";
+	const char **doc;
+	char exp[1024];
+	size_t step;
+	struct JsonContext *ctx = NULL;
+	struct JsonValue *obj;
+	const char *str;
+	char *big = NULL;
+	size_t i, len, biglen = 1024*1024;
+	int64_t num;
+
+	for (doc = docs; *doc; doc++) {
+		strlcpy(exp, rerender(*doc), sizeof(exp));
+		for (step = 1; step <= strlen(*doc); step++)
+			str_check(chunked(*doc, step, 0), exp);
+	}
+	for (step = 1; step <= strlen(relaxed); step++)
+		str_check(chunked(relaxed, step, JSON_PARSE_RELAXED), "{\"a\":[1,2],\"b\":{\"c\":3}}");
+
+	/* errors */
+	str_check(chunked("[1, 2", 1, 0), "EPARSE: Line #1: Container still open");
+	str_check(chunked("[\"ab", 1, 0), "EPARSE: Line #1: Unexpected end of string");
+	str_check(chunked("[\"a\xc3", 1, 0), "EPARSE: Line #1: Invalid UTF8 sequence");
+	str_check(chunked("[\"a\xc3x\"]", 1, 0), "EPARSE: Line #1: Invalid UTF8 sequence");
+	str_check(chunked("[tru", 2, 0), "EPARSE: Line #1: Unexpected end of token");
+	str_check(chunked("[1,\n\n2 x]", 3, 0), "EPARSE: Line #3: Invalid symbol: 'x'");
+	str_check(chunked("[1] 2", 1, 0), "EPARSE: Line #1: Unexpected symbol: '2'");
+
+	/* long string and number fed byte by byte, carry is not rescanned */
+	big = malloc(biglen + 32);
+	tt_assert(big);
+	big[0] = '[';
+	big[1] = '"';
+	for (i = 2; i < biglen; i += 2)
+		memcpy(big + i, (i % 1000) ? "ab" : "\\\"", 2);
+	len = biglen + snprintf(big + biglen, 32, "\", 12345678]");
+	ctx = json_new_context(NULL, 128);
+	tt_assert(ctx);
+	json_parse_start(ctx, NULL, NULL);
+	for (i = 0; i < len; i++)
+		tt_assert(json_parse_feed(ctx, big + i, 1));
+	tt_assert(json_parse_finish(ctx, &obj));
+	tt_assert(json_list_get_string(obj, 0, &str, &len));
+	int_check(len, biglen - 2 - (biglen - 2) / 1000);
+	tt_assert(memcmp(str, "abab", 4) == 0);
+	tt_assert(json_list_get_int(obj, 1, &num));
+	int_check(num, 12345678);
+end:
+	json_free_context(ctx);
+	free(big);
+}
+
+/* log events as text */
+static bool ev_log(void *arg, const char *s)
+{
+	return mbuf_write(arg, s, strlen(s));
+}
+static bool ev_start_dict(void *arg) { return ev_log(arg, "{"); }
+static bool ev_end_dict(void *arg) { return ev_log(arg, "}"); }
+static bool ev_start_list(void *arg) { return ev_log(arg, "["); }
+static bool ev_end_list(void *arg) { return ev_log(arg, "]"); }
+static bool ev_null(void *arg) { return ev_log(arg, "N "); }
+static bool ev_bool(void *arg, bool val) { return ev_log(arg, val ? "T " : "F "); }
+static bool ev_key(void *arg, const char *str, size_t len)
+{
+	return ev_log(arg, "K:") && mbuf_write(arg, str, len) && ev_log(arg, " ");
+}
+static bool ev_string(void *arg, const char *str, size_t len)
+{
+	return ev_log(arg, "S:") && mbuf_write(arg, str, len) && ev_log(arg, " ");
+}
+static bool ev_int(void *arg, int64_t val)
+{
+	char buf[32];
+	snprintf(buf, sizeof(buf), "I:%d ", (int)val);
+	return ev_log(arg, buf);
+}
+static bool ev_stop(void *arg, double val)
+{
+	return false;
+}
+
+static void test_json_events(void *p)
+{
+	struct JsonEvents ev;
+	struct JsonContext *ctx;
+	struct JsonValue *top = NULL;
+	struct MBuf log;
+	const char *json = "{\"k\": [1, \"x\\ny\", null, true], \"z\": {}}";
+	size_t i;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.start_dict = ev_start_dict;
+	ev.end_dict = ev_end_dict;
+	ev.start_list = ev_start_list;
+	ev.end_list = ev_end_list;
+	ev.key = ev_key;
+	ev.null_value = ev_null;
+	ev.bool_value = ev_bool;
+	ev.int_value = ev_int;
+	ev.string_value = ev_string;
+
+	ctx = json_new_context(NULL, 128);
+	mbuf_init_dynamic(&log);
+
+	/* byte at a time */
+	json_parse_start(ctx, &ev, &log);
+	for (i = 0; json[i]; i++)
+		tt_assert(json_parse_feed(ctx, json + i, 1));
+	tt_assert(json_parse_finish(ctx, &top));
+	tt_assert(top == NULL);
+	tt_assert(mbuf_write_byte(&log, 0));
+	str_check((char *)log.data, "{K:k [I:1 S:x\ny N T ]K:z {}}");
+
+	/* callback stops parsing */
+	ev.float_value = ev_stop;
+	json_parse_start(ctx, &ev, &log);
+	tt_assert(!json_parse_feed(ctx, "[1, 2.5]", 8));
+	str_check(json_strerror(ctx), "Line #1: Stopped by callback");
+	tt_assert(!json_parse_finish(ctx, NULL));
+
+	/* context can be reused for tree */
+	json_parse_start(ctx, NULL, NULL);
+	tt_assert(json_parse_feed(ctx, "[\"a", 3));
+	tt_assert(json_parse_feed(ctx, "b\"]", 3));
+	tt_assert(json_parse_finish(ctx, &top));
+	tt_assert(json_list_get_string(top, 0, &json, NULL));
+	str_check(json, "ab");
+end:
+	mbuf_free(&log);
+	json_free_context(ctx);
+}
+
+static void test_json_dict_order(void *p)
+{
+	struct JsonContext *ctx;
+	struct JsonValue *dict, *val;
+	char key[32], json[1024];
+	struct MBuf buf;
+	int64_t v;
+	int i, n;
+
+	ctx = json_new_context(NULL, 128); tt_assert(ctx);
+
+	/* small and indexed dicts, keys in reverse order */
+	for (n = 1; n < 40; n += 6) {
+		mbuf_init_fixed_writer(&buf, json, sizeof(json));
+		tt_assert(mbuf_write_byte(&buf, '{'));
+		for (i = n; i > 0; i--) {
+			snprintf(key, sizeof(key), "%s\"k%d\":%d", (i < n) ? "," : "", i, i);
+			tt_assert(mbuf_write(&buf, key, strlen(key)));
+		}
+		tt_assert(mbuf_write(&buf, "}", 2));
+
+		dict = json_parse(ctx, json, strlen(json));
+		tt_assert(dict);
+		int_check(json_value_size(dict), n);
+		str_check(rerender(json), json);
+		for (i = 1; i <= n; i++) {
+			snprintf(key, sizeof(key), "k%d", i);
+			tt_assert(json_dict_get_int(dict, key, &v));
+			int_check(v, i);
+		}
+		tt_assert(!json_dict_get_value(dict, "k0", &val));
+		tt_assert(!json_dict_get_value(dict, "k", &val));
+	}
+
+	/* built dict */
+	dict = json_new_dict(ctx);
+	for (i = 0; i < 100; i++) {
+		snprintf(key, sizeof(key), "%d", i * 7 % 100);
+		tt_assert(json_dict_put_int(dict, key, i));
+	}
+	tt_assert(!json_dict_put_int(dict, "7", 0));
+	for (i = 0; i < 100; i++) {
+		snprintf(key, sizeof(key), "%d", i * 7 % 100);
+		tt_assert(json_dict_get_int(dict, key, &v));
+		int_check(v, i);
+	}
+
+	str_check(rerender("{\"a\":1,\"b\":2,\"a\":3}"), "EPARSE: Line #1: Duplicate key");
+	str_check(rerender("{\"a\":1,\"\":2,\"\":3}"), "EPARSE: Line #1: Duplicate key");
+end:
+	json_free_context(ctx);
+}
+
+static const char *lazy_rerender(const char *json)
+{
+	struct JsonContext *ctx;
+	struct JsonValue *obj;
+	static char buf[1024];
+	struct MBuf dst;
+
+	memset(buf, 0, sizeof buf);
+	mbuf_init_fixed_writer(&dst, buf, sizeof(buf));
+
+	ctx = json_new_context(NULL, 128);
+	obj = json_parse_lazy(ctx, json, strlen(json));
+	if (!obj)
+		snprintf(buf, sizeof(buf), "EPARSE: %s", json_strerror(ctx));
+	else if (!json_render(&dst, obj) || !mbuf_write_byte(&dst, 0))
+		strlcpy(buf, "ERENDER", sizeof(buf));
+	json_free_context(ctx);
+	return buf;
+}
+
+static void test_json_lazy(void *p)
+{
+	static const char *docs[] = {
+		"{\"a\": [1, -23, 4.5e10, true, false, null], \"bb\": {\"c\": \"d\\\"e\\u00e9\"}}",
+		"[[], {}, [[1]], \"x\", {\"a\": {\"b\": []}}]",
+		"\"top\\\\string\"",
+		"1234",
+		"[1,",
+		"{\"a\" 1}",
+		"[\"\\x\"]",
+		"[\"\xff\"]",
+		"[1] 2",
+		"{\"a\":1,\"a\":2}",
+		NULL
+	};
+	const char *json = "{\"id\": 7, \"name\": \"a\\\"b\", \"tags\": [\"x\", \"y\", \"z\"],"
+			   " \"nested\": {\"k\\u0065y\": {\"v\": 2.5}}, \"n\": null, \"t\": true}";
+	struct JsonContext *ctx = NULL;
+	struct JsonValue *top, *val, *val2, *list, *dict;
+	const char **doc, *str;
+	char exp[1024];
+	int64_t v_int;
+	double v_float;
+	bool v_bool;
+	size_t len;
+
+	for (doc = docs; *doc; doc++) {
+		strlcpy(exp, rerender(*doc), sizeof(exp));
+		if (strcmp(*doc, "{\"a\":1,\"a\":2}") == 0)
+			str_check(lazy_rerender(*doc), "ERENDER");
+		else
+			str_check(lazy_rerender(*doc), exp);
+	}
+
+	ctx = json_new_context(NULL, 128);
+	top = json_parse_lazy(ctx, json, strlen(json));
+	tt_assert(top);
+	tt_assert(json_value_is_dict(top));
+	int_check(json_value_size(top), 6);
+
+	tt_assert(json_dict_get_int(top, "id", &v_int));
+	int_check(v_int, 7);
+	tt_assert(json_dict_get_string(top, "name", &str, &len));
+	str_check(str, "a\"b");
+	int_check(len, 3);
+	tt_assert(json_dict_get_list(top, "tags", &list));
+	int_check(json_value_size(list), 3);
+	tt_assert(json_list_get_string(list, 2, &str, NULL));
+	str_check(str, "z");
+	tt_assert(!json_list_get_string(list, 3, &str, NULL));
+	tt_assert(json_dict_get_dict(top, "nested", &dict));
+	tt_assert(json_dict_get_dict(dict, "key", &dict));
+	tt_assert(json_dict_get_float(dict, "v", &v_float));
+	tt_assert(v_float == 2.5);
+	tt_assert(json_dict_is_null(top, "n"));
+	tt_assert(json_dict_get_bool(top, "t", &v_bool));
+	tt_assert(v_bool);
+	tt_assert(!json_dict_get_int(top, "missing", &v_int));
+	v_int = 5;
+	tt_assert(json_dict_get_opt_int(top, "missing", &v_int));
+	int_check(v_int, 5);
+
+	/* values are created once */
+	tt_assert(json_dict_get_value(top, "tags", &val));
+	tt_assert(json_dict_get_value(top, "tags", &val2));
+	tt_assert(val == val2);
+
+	/* indexed access in any order, past nested containers */
+	str = "[[1, [2]], {\"a\": [3]}, \"s\", 4, 5]";
+	val = json_parse_lazy(ctx, str, strlen(str));
+	tt_assert(val);
+	tt_assert(json_list_get_int(val, 4, &v_int));
+	int_check(v_int, 5);
+	tt_assert(json_list_get_int(val, 3, &v_int));
+	int_check(v_int, 4);
+	tt_assert(json_list_get_string(val, 2, &str, NULL));
+	str_check(str, "s");
+	tt_assert(json_list_get_dict(val, 1, &dict));
+	tt_assert(json_dict_get_list(dict, "a", &val2));
+	tt_assert(json_list_get_list(val, 0, &val2));
+	tt_assert(json_list_get_list(val2, 1, &val2));
+	tt_assert(json_list_get_int(val2, 0, &v_int));
+	int_check(v_int, 2);
+	tt_assert(!json_list_get_int(val, 5, &v_int));
+	str_check(render(val), "[[1,[2]],{\"a\":[3]},\"s\",4,5]");
+
+	/* modification expands container */
+	tt_assert(json_list_append_int(list, 4));
+	tt_assert(json_dict_put_null(top, "last"));
+	tt_assert(json_dict_get_int(top, "id", &v_int));
+	int_check(v_int, 7);
+	str_check(render(top), "{\"id\":7,\"name\":\"a\\\"b\",\"tags\":[\"x\",\"y\",\"z\",4],"
+		  "\"nested\":{\"key\":{\"v\":2.5}},\"n\":null,\"t\":true,\"last\":null}");
+end:
+	json_free_context(ctx);
+}
+
+/* parse number, render it back */
+static double num_roundtrip(double val, char *buf, size_t buflen)
+{
+	struct JsonContext *ctx;
+	struct JsonValue *jv;
+	struct MBuf dst;
+	double res = -1;
+
+	ctx = json_new_context(NULL, 128);
+	mbuf_init_fixed_writer(&dst, buf, buflen);
+	if (json_render(&dst, json_new_float(ctx, val)) && mbuf_write_byte(&dst, 0)) {
+		jv = json_parse(ctx, buf, strlen(buf));
+		if (!json_value_as_float(jv, &res))
+			res = -1;
+	}
+	json_free_context(ctx);
+	return res;
+}
+
+/* significant digits in number string */
+static int sig_digits(const char *s)
+{
+	int n = 0, zeros = 0;
+
+	for (; *s && *s != 'e'; s++) {
+		if (*s == '0') {
+			if (n)
+				zeros++;
+		} else if (*s >= '1' && *s <= '9') {
+			n += zeros + 1;
+			zeros = 0;
+		}
+	}
+	return n;
+}
+
+/* fewest digits that survive strtod */
+static int min_digits(double val)
+{
+	char tmp[32];
+	int prec;
+
+	for (prec = 0; prec < 16; prec++) {
+		snprintf(tmp, sizeof(tmp), "%.*e", prec, val);
+		if (strtod(tmp, NULL) == val)
+			break;
+	}
+	return prec + 1;
+}
+
+static void test_json_numbers(void *p)
+{
+	char buf[128], json[64];
+	uint64_t bits, rnd = 1;
+	double val, exp;
+	int i;
+
+	/* shortest output */
+	str_check(rerender("[0.1, 0.2, 12.345678, -0.5, 0.0001, 100, 1.5e3]"), "[0.1,0.2,12.345678,-0.5,0.0001,100,1500.0]");
+	str_check(rerender("[0.0, -0.0, 1e15, 1e-5, 123456789012345.6]"), "[0.0,-0.0,1000000000000000.0,1e-05,123456789012345.6]");
+	str_check(rerender("[1e16, 1e17, 5e-5, 1.7976931348623157e308, 2.2250738585072014e-308, 1e23]"),
+		  "[10000000000000000.0,1e+17,5e-05,1.7976931348623157e+308,2.2250738585072014e-308,1e+23]");
+	str_check(rerender("[9007199254740991, -9007199254740991, 0, -0, 1234567890]"), "[9007199254740991,-9007199254740991,0,0,1234567890]");
+	str_check(rerender("9007199254740992"), "EPARSE: Line #1: Number parse failed");
+	str_check(rerender("[-]"), "EPARSE: Line #1: Number parse failed");
+	str_check(rerender("[1-2]"), "EPARSE: Line #1: Number parse failed");
+	str_check(simple_value("1e400"), "EPARSE: Line #1: Number parse failed");
+	str_check(simple_value("007"), "INT:7");
+	str_check(simple_value("1E+2"), "FLOAT:100");
+	str_check(simple_value("25e-23"), "FLOAT:2.4999999999999998e-22");
+	str_check(simple_value("0.30000000000000004"), "FLOAT:0.30000000000000004");
+
+	/* same value as strtod, in fast and slow paths */
+	for (i = 0; i < 2000; i++) {
+		rnd = rnd * 6364136223846793005ULL + 1442695040888963407ULL;
+		snprintf(json, sizeof(json), "%s%d.%de%d", (rnd & 1) ? "-" : "",
+			 (int)((rnd >> 40) % 100000), (int)((rnd >> 16) % 100000), (int)((rnd >> 8) % 50) - 25);
+		exp = strtod(json, NULL);
+		str_check(simple_value(json), (snprintf(buf, sizeof(buf), "FLOAT:%.17g", exp), buf));
+	}
+
+	/* random bit patterns survive render + parse */
+	for (i = 0; i < 2000; i++) {
+		rnd = rnd * 6364136223846793005ULL + 1442695040888963407ULL;
+		bits = rnd;
+		memcpy(&val, &bits, sizeof(val));
+		/* subnormals are rejected by parser (ERANGE) */
+		if (!isfinite(val) || (val != 0 && fabs(val) < DBL_MIN))
+			continue;
+		tt_assert(num_roundtrip(val, buf, sizeof(buf)) == val);
+		if (val != 0)
+			int_check(sig_digits(buf), min_digits(val));
+	}
+	for (i = 1; i < 2000; i++) {
+		val = i / 1000.0;
+		tt_assert(num_roundtrip(val, buf, sizeof(buf)) == val);
+		tt_assert(strlen(buf) <= 5);
+	}
+end:;
+}
+
+static const char *jw_output(struct MBuf *dst)
+{
+	if (!mbuf_write_byte(dst, 0))
+		return "EBUF";
+	return (const char *)mbuf_data(dst);
+}
+
+static void test_json_writer(void *p)
+{
+	struct JsonWriter jw;
+	struct JsonContext *ctx = NULL;
+	struct JsonValue *jv;
+	struct MBuf dst;
+	char buf[512];
+	int i;
+
+	mbuf_init_fixed_writer(&dst, buf, sizeof(buf));
+	jw_init(&jw, &dst);
+	tt_assert(jw_begin_dict(&jw));
+	tt_assert(jw_key(&jw, "a"));
+	tt_assert(jw_begin_list(&jw));
+	tt_assert(jw_int(&jw, 1));
+	tt_assert(jw_int(&jw, -23));
+	tt_assert(jw_float(&jw, 4.5e10));
+	tt_assert(jw_bool(&jw, true));
+	tt_assert(jw_bool(&jw, false));
+	tt_assert(jw_null(&jw));
+	tt_assert(jw_begin_dict(&jw));
+	tt_assert(jw_end_dict(&jw));
+	tt_assert(jw_end_list(&jw));
+	tt_assert(jw_key(&jw, "b\"\n"));
+	tt_assert(jw_string(&jw, "x\x01\xe2\x80\xa8y"));
+	tt_assert(jw_key_len(&jw, "cd", 1));
+	tt_assert(jw_string_len(&jw, "\xc3\xa9x", 2));
+	tt_assert(!jw_finish(&jw));
+	tt_assert(jw_end_dict(&jw));
+	tt_assert(jw_finish(&jw));
+	str_check(jw_output(&dst), "{\"a\":[1,-23,45000000000.0,true,false,null,{}],\"b\\\"\\n\":\"x\\u0001\\u2028y\",\"c\":\"\xc3\xa9\"}");
+
+	/* same output as json_render() */
+	ctx = json_new_context(NULL, 128);
+	tt_assert(ctx);
+	jv = json_parse(ctx, "{\"k\": [0.1, \"\\u00e9\"]}", 22);
+	tt_assert(jv);
+	mbuf_init_fixed_writer(&dst, buf, sizeof(buf));
+	jw_init(&jw, &dst);
+	tt_assert(jw_begin_list(&jw));
+	tt_assert(jw_value(&jw, jv));
+	tt_assert(jw_string(&jw, "\xc3\xa9"));
+	tt_assert(jw_end_list(&jw));
+	str_check(jw_output(&dst), "[{\"k\":[0.1,\"\xc3\xa9\"]},\"\xc3\xa9\"]");
+
+	/* nesting errors */
+	mbuf_init_fixed_writer(&dst, buf, sizeof(buf));
+	jw_init(&jw, &dst);
+	tt_assert(!jw_key(&jw, "a"));
+	tt_assert(!jw_end_list(&jw));
+	tt_assert(jw_begin_dict(&jw));
+	tt_assert(!jw_int(&jw, 1));
+	tt_assert(!jw_end_list(&jw));
+	tt_assert(jw_key(&jw, "a"));
+	tt_assert(!jw_key(&jw, "b"));
+	tt_assert(!jw_end_dict(&jw));
+	tt_assert(!jw_float(&jw, NAN));
+	tt_assert(jw_begin_list(&jw));
+	tt_assert(!jw_key(&jw, "b"));
+	tt_assert(!jw_end_dict(&jw));
+	tt_assert(jw_end_list(&jw));
+	tt_assert(jw_end_dict(&jw));
+	tt_assert(!jw_int(&jw, 2));
+	tt_assert(!jw_begin_list(&jw));
+	str_check(jw_output(&dst), "{\"a\":[]}");
+
+	/* depth limit */
+	mbuf_init_fixed_writer(&dst, buf, sizeof(buf));
+	jw_init(&jw, &dst);
+	for (i = 0; i < JSON_WRITER_DEPTH; i++)
+		tt_assert(jw_begin_list(&jw));
+	tt_assert(!jw_begin_list(&jw));
+	for (i = 0; i < JSON_WRITER_DEPTH; i++)
+		tt_assert(jw_end_list(&jw));
+	tt_assert(!jw_finish(&jw));
+
+	/* invalid UTF-8 is refused, separator is not left behind */
+	mbuf_init_fixed_writer(&dst, buf, sizeof(buf));
+	jw_init(&jw, &dst);
+	tt_assert(jw_begin_list(&jw));
+	tt_assert(jw_int(&jw, 1));
+	tt_assert(!jw_string(&jw, "ab\xff" "cd"));
+	tt_assert(jw_int(&jw, 2));
+	tt_assert(jw_begin_dict(&jw));
+	tt_assert(!jw_key(&jw, "\xc3"));
+	tt_assert(jw_end_dict(&jw));
+	tt_assert(jw_end_list(&jw));
+	tt_assert(!jw_finish(&jw));
+	str_check(jw_output(&dst), "[1,2,{}]");
+
+	/* full buffer, partial write is dropped */
+	mbuf_init_fixed_writer(&dst, buf, 4);
+	jw_init(&jw, &dst);
+	tt_assert(jw_begin_list(&jw));
+	tt_assert(!jw_string(&jw, "long"));
+	tt_assert(jw_int(&jw, 1));
+	tt_assert(jw_end_list(&jw));
+	tt_assert(!jw_finish(&jw));
+	str_check(jw_output(&dst), "[1]");
+end:
+	json_free_context(ctx);
+}
+
 struct testcase_t json_tests[] = {
 	{ "basic", test_json_basic },
 	{ "render", test_json_render },
 	{ "fetch", test_json_fetch },
 	{ "iter", test_json_iter },
 	{ "relax", test_json_relax },
+	{ "longstr", test_json_longstr },
+	{ "render_escape", test_json_render_escape },
+	{ "render_opts", test_json_render_opts },
+	{ "chunks", test_json_chunks },
+	{ "events", test_json_events },
+	{ "dict_order", test_json_dict_order },
+	{ "lazy", test_json_lazy },
+	{ "numbers", test_json_numbers },
+	{ "writer", test_json_writer },
+	{ "path", test_json_path },
+	{ "ndjson", test_json_ndjson },
+	{ "bind", test_json_bind },
+	{ "cbor", test_json_cbor },
+	{ "reset", test_json_reset },
 	END_OF_TESTCASES
 };
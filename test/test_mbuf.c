@@ -0,0 +1,486 @@
+#include "test_common.h"
+
+#include <usual/mbufchain.h>
+#include <usual/cxprof.h>
+#include <usual/safeio.h>
+#include <usual/string.h>
+
+/*
+ * MBuf
+ */
+
+static void test_mbuf_cx(void *p)
+{
+	CxMem *prof;
+	const struct CxProfStats *st;
+	struct MBuf buf;
+	int i;
+
+	prof = cx_new_profiler(NULL);
+	tt_assert(prof);
+	st = cx_profiler_stats(prof);
+
+	mbuf_init_dynamic_cx(&buf, prof);
+	for (i = 0; i < 100; i++)
+		tt_assert(mbuf_write(&buf, "0123456789", 10));
+	int_check(mbuf_written(&buf), 1000);
+	int_check(buf.alloc_len, 1024);
+	int_check(st->live_bytes, 1024);
+
+	tt_assert(mbuf_shrink_to_fit(&buf));
+	int_check(buf.alloc_len, 1000);
+	int_check(st->live_bytes, 1000);
+	tt_assert(memcmp((char *)mbuf_data(&buf) + 990, "0123456789", 10) == 0);
+
+	mbuf_rewind_writer(&buf);
+	tt_assert(mbuf_shrink_to_fit(&buf));
+	tt_assert(mbuf_data(&buf) == NULL);
+	int_check(st->live_count, 0);
+
+	tt_assert(mbuf_write_byte(&buf, 'x'));
+	int_check(st->live_bytes, 128);
+	mbuf_free(&buf);
+	int_check(st->live_bytes, 0);
+	int_check(st->frees, st->allocs);
+end:
+	cx_destroy(prof);
+}
+
+static void test_mbuf_growth(void *p)
+{
+	struct MBuf buf;
+	char tmp[16];
+	volatile size_t huge = SIZE_MAX;
+
+	mbuf_init_dynamic(&buf);
+	mbuf_set_growth(&buf, mbuf_grow_half, 100);
+	tt_assert(mbuf_fill(&buf, 'a', 10));
+	int_check(buf.alloc_len, 100);
+	tt_assert(mbuf_fill(&buf, 'a', 100));
+	int_check(buf.alloc_len, 150);
+	tt_assert(mbuf_fill(&buf, 'a', 100));
+	int_check(buf.alloc_len, 225);
+
+	mbuf_set_growth(&buf, mbuf_grow_fixed, 64);
+	tt_assert(mbuf_fill(&buf, 'a', 100));
+	int_check(buf.alloc_len, 320);
+	mbuf_free(&buf);
+
+	mbuf_init_dynamic(&buf);
+	tt_assert(mbuf_fill(&buf, 'a', 129));
+	int_check(buf.alloc_len, 256);
+	mbuf_free(&buf);
+
+	/* no overflow */
+	tt_assert(mbuf_grow_double(SIZE_MAX / 2 + 2, SIZE_MAX - 1, 128) == SIZE_MAX - 1);
+	tt_assert(mbuf_grow_half(SIZE_MAX / 2, SIZE_MAX, 128) == SIZE_MAX);
+	tt_assert(mbuf_grow_fixed(0, SIZE_MAX - 2, 64) == SIZE_MAX - 2);
+	if (sizeof(size_t) > 4) {
+		uint64_t big = (uint64_t)5 << 30;
+		tt_assert(mbuf_grow_double(0, big, 128) == (uint64_t)8 << 30);
+	}
+
+	mbuf_init_fixed_writer(&buf, tmp, sizeof(tmp));
+	tt_assert(!mbuf_write(&buf, tmp, huge));
+	tt_assert(mbuf_write(&buf, "abc", 3));
+	tt_assert(!mbuf_fill(&buf, 0, huge - 1));
+	tt_assert(!mbuf_shrink_to_fit(&buf));
+	tt_assert(mbuf_cut(&buf, 1, huge));
+	int_check(mbuf_written(&buf), 1);
+end:;
+}
+
+static void test_mbuf_ring(void *p)
+{
+	struct MBuf buf;
+	const uint8_t *data;
+	char tmp[3000];
+	size_t size, i;
+	uint32_t val;
+
+	tt_assert(mbuf_init_ring(&buf, 100));
+	size = buf.ring_size;
+	tt_assert(size >= 4096);
+	int_check(mbuf_avail_for_write(&buf), size);
+
+	/* fill, consume part, then write over end of ring */
+	memset(tmp, 'a', sizeof(tmp));
+	tt_assert(mbuf_fill(&buf, 'x', size - 1000));
+	tt_assert(mbuf_get_bytes(&buf, size - 2000, &data));
+	int_check(mbuf_avail_for_write(&buf), size - 1000);
+	for (i = 0; i < sizeof(tmp); i++)
+		tmp[i] = i % 100;
+	tt_assert(mbuf_write(&buf, tmp, sizeof(tmp)));
+	tt_assert(mbuf_get_bytes(&buf, 1000, &data));
+	tt_assert(mbuf_get_bytes(&buf, sizeof(tmp), &data));
+	tt_assert(memcmp(data, tmp, sizeof(tmp)) == 0);
+	int_check(mbuf_avail_for_read(&buf), 0);
+
+	/* no growth */
+	tt_assert(mbuf_fill(&buf, 'y', size));
+	tt_assert(!mbuf_write_byte(&buf, 'z'));
+	tt_assert(mbuf_get_bytes(&buf, 5, &data));
+	tt_assert(!mbuf_fill(&buf, 'z', 6));
+	tt_assert(mbuf_fill(&buf, 'z', 5));
+
+	/* ring memory is not from cx */
+	tt_assert(!mbuf_shrink_to_fit(&buf));
+	int_check(buf.ring_size, size);
+	int_check(mbuf_avail_for_write(&buf), 0);
+
+	/* long run keeps positions bounded */
+	mbuf_rewind_writer(&buf);
+	for (i = 0; i < 100000; i++) {
+		tt_assert(mbuf_write(&buf, "\0\0\0\0\0\0\0\0\0\0\0", 7));
+		tt_assert(mbuf_get_uint32be(&buf, &val));
+		tt_assert(mbuf_get_bytes(&buf, 3, &data));
+	}
+	tt_assert(buf.write_pos <= 2 * size);
+	int_check(mbuf_avail_for_read(&buf), 0);
+end:
+	mbuf_free(&buf);
+}
+
+static void test_mbuf_sockio(void *p)
+{
+	struct MBuf src, dst, ring;
+	int spair[2] = { -1, -1 }, i;
+	char msg[64];
+	ssize_t res;
+
+	mbuf_init_dynamic(&src);
+	mbuf_init_dynamic(&dst);
+	tt_assert(mbuf_init_ring(&ring, 4096));
+	tt_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, spair) == 0);
+
+	/* relay small packets through ring */
+	for (i = 0; i < 2000; i++) {
+		snprintf(msg, sizeof(msg), "packet %d;", i);
+		tt_assert(mbuf_write(&src, msg, strlen(msg)));
+		tt_assert(mbuf_write(&ring, msg, strlen(msg)));
+		while (mbuf_avail_for_read(&ring) > 0) {
+			res = mbuf_send(&ring, spair[0], 0);
+			tt_assert(res > 0);
+			res = mbuf_recv(&dst, spair[1], 0);
+			tt_assert(res > 0);
+		}
+	}
+	tt_assert(mbuf_eq(&src, &dst));
+
+	/* full ring */
+	tt_assert(mbuf_fill(&ring, 0, ring.ring_size));
+	res = mbuf_recv(&ring, spair[1], 0);
+	int_check(res, -1);
+	int_check(errno, ENOBUFS);
+	int_check(mbuf_send(&src, spair[0], 0), mbuf_written(&src));
+	int_check(mbuf_send(&src, spair[0], 0), 0);
+end:
+	if (spair[0] >= 0)
+		close(spair[0]);
+	if (spair[1] >= 0)
+		close(spair[1]);
+	mbuf_free(&src);
+	mbuf_free(&dst);
+	mbuf_free(&ring);
+}
+
+static void test_mbuf_bulk(void *p)
+{
+	struct MBuf buf;
+	uint16_t a16[40], b16[40];
+	uint32_t a32[40], b32[40];
+	uint64_t a64[40], b64[40];
+	static const size_t counts[] = { 0, 1, 3, 7, 8, 9, 33 };
+	const uint8_t *data;
+	size_t i, j, n;
+
+	for (i = 0; i < 40; i++) {
+		a16[i] = 0x0102 + i * 0x1111;
+		a32[i] = 0x01020304 + i * 0x11111111;
+		a64[i] = 0x0102030405060708ULL + i * 0x1111111111111111ULL;
+	}
+
+	mbuf_init_dynamic(&buf);
+	for (j = 0; j < ARRAY_NELEM(counts); j++) {
+		n = counts[j];
+		mbuf_rewind_writer(&buf);
+		tt_assert(mbuf_write_uint16be_array(&buf, a16, n));
+		tt_assert(mbuf_write_uint32be_array(&buf, a32, n));
+		tt_assert(mbuf_write_uint64be_array(&buf, a64, n));
+		int_check(mbuf_written(&buf), n * 14);
+
+		/* same bytes as single-value encoding */
+		for (i = 0; i < n; i++) {
+			tt_assert(be16dec(buf.data + i * 2) == a16[i]);
+			tt_assert(be32dec(buf.data + n * 2 + i * 4) == a32[i]);
+			tt_assert(be64dec(buf.data + n * 6 + i * 8) == a64[i]);
+		}
+
+		memset(b16, 0, sizeof(b16));
+		memset(b32, 0, sizeof(b32));
+		memset(b64, 0, sizeof(b64));
+		tt_assert(mbuf_get_uint16be_array(&buf, b16, n));
+		tt_assert(mbuf_get_uint32be_array(&buf, b32, n));
+		tt_assert(!mbuf_get_uint64be_array(&buf, b64, n + 1));
+		tt_assert(mbuf_get_uint64be_array(&buf, b64, n));
+		tt_assert(memcmp(a16, b16, n * 2) == 0);
+		tt_assert(memcmp(a32, b32, n * 4) == 0);
+		tt_assert(memcmp(a64, b64, n * 8) == 0);
+		int_check(mbuf_avail_for_read(&buf), 0);
+	}
+
+	/* single values and unchecked reads */
+	mbuf_rewind_writer(&buf);
+	tt_assert(mbuf_write_byte(&buf, 0xFE));
+	tt_assert(mbuf_write_uint16be(&buf, 0x0102));
+	tt_assert(mbuf_write_uint32be(&buf, 0x03040506));
+	tt_assert(mbuf_write_uint64be(&buf, 0x0708090A0B0C0D0EULL));
+	tt_assert(mbuf_write(&buf, "xyz", 3));
+	tt_assert(mbuf_avail_for_read(&buf) >= 18);
+	int_check(mbuf_get_byte_unchecked(&buf), 0xFE);
+	int_check(mbuf_get_uint16be_unchecked(&buf), 0x0102);
+	ull_check(mbuf_get_uint32be_unchecked(&buf), 0x03040506);
+	ull_check(mbuf_get_uint64be_unchecked(&buf), 0x0708090A0B0C0D0EULL);
+	data = mbuf_get_bytes_unchecked(&buf, 3);
+	tt_assert(memcmp(data, "xyz", 3) == 0);
+	int_check(mbuf_avail_for_read(&buf), 0);
+end:
+	mbuf_free(&buf);
+}
+
+static void test_mbuf_varint(void *p)
+{
+	struct MBuf buf;
+	uint8_t tmp[16];
+	uint64_t u, arr[6] = { 0, 1, 127, 128, 300, UINT64_MAX }, arr2[6];
+	int64_t s;
+
+	mbuf_init_dynamic(&buf);
+	tt_assert(mbuf_write_varint(&buf, 300));
+	int_check(mbuf_written(&buf), 2);
+	int_check(buf.data[0], 0xAC);
+	int_check(buf.data[1], 0x02);
+	tt_assert(mbuf_get_varint(&buf, &u));
+	ull_check(u, 300);
+
+	mbuf_rewind_writer(&buf);
+	tt_assert(mbuf_write_varint_array(&buf, arr, 6));
+	int_check(mbuf_written(&buf), 1 + 1 + 1 + 2 + 2 + 10);
+	int_check(buf.data[16], 0x01);
+	tt_assert(mbuf_get_varint_array(&buf, arr2, 6));
+	tt_assert(memcmp(arr, arr2, sizeof(arr)) == 0);
+	mbuf_rewind_reader(&buf);
+	tt_assert(!mbuf_get_varint_array(&buf, arr2, 7));
+	int_check(mbuf_consumed(&buf), 0);
+
+	/* zigzag */
+	mbuf_rewind_writer(&buf);
+	tt_assert(mbuf_write_svarint(&buf, 0));
+	tt_assert(mbuf_write_svarint(&buf, -1));
+	tt_assert(mbuf_write_svarint(&buf, 1));
+	tt_assert(mbuf_write_svarint(&buf, INT64_MIN));
+	tt_assert(mbuf_write_svarint(&buf, INT64_MAX));
+	int_check(buf.data[1], 1);
+	int_check(buf.data[2], 2);
+	tt_assert(mbuf_get_svarint(&buf, &s));
+	ull_check(s, 0);
+	tt_assert(mbuf_get_svarint(&buf, &s));
+	ull_check(s, -1);
+	tt_assert(mbuf_get_svarint(&buf, &s));
+	ull_check(s, 1);
+	tt_assert(mbuf_get_svarint(&buf, &s));
+	tt_assert(s == INT64_MIN);
+	tt_assert(mbuf_get_svarint(&buf, &s));
+	tt_assert(s == INT64_MAX);
+	mbuf_free(&buf);
+
+	/* truncated, too long */
+	mbuf_init_fixed_reader(&buf, "\x80\x80", 2);
+	tt_assert(!mbuf_get_varint(&buf, &u));
+	int_check(mbuf_consumed(&buf), 0);
+	mbuf_init_fixed_reader(&buf, "\xff\xff\xff\xff\xff\xff\xff\xff\xff\x02", 10);
+	tt_assert(!mbuf_get_varint(&buf, &u));
+	mbuf_init_fixed_reader(&buf, "\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\x01", 11);
+	tt_assert(!mbuf_get_varint(&buf, &u));
+
+	/* fixed buffer with less than max room */
+	mbuf_init_fixed_writer(&buf, tmp, 3);
+	tt_assert(mbuf_write_varint(&buf, 5));
+	tt_assert(mbuf_write_varint(&buf, 300));
+	tt_assert(!mbuf_write_varint(&buf, 300));
+	int_check(mbuf_written(&buf), 3);
+end:
+	mbuf_free(&buf);
+}
+
+/*
+ * MBufChain
+ */
+
+static bool chain_eq(struct MBufChain *chain, const char *str)
+{
+	struct iovec iov[64];
+	const char *p = str;
+	int i, n;
+
+	n = mbuf_chain_iovec(chain, iov, 64);
+	for (i = 0; i < n; i++) {
+		if (memcmp(p, iov[i].iov_base, iov[i].iov_len) != 0)
+			return false;
+		p += iov[i].iov_len;
+	}
+	return (size_t)(p - str) == strlen(str) && chain->len == strlen(str);
+}
+
+static void test_chain_basic(void *p)
+{
+	struct MBufChain c, c2;
+	struct iovec iov[8];
+	uint8_t b;
+	uint16_t u16;
+	uint32_t u32;
+	uint64_t u64;
+	char buf[32];
+
+	mbuf_chain_init(&c, NULL, 4);
+	mbuf_chain_init(&c2, NULL, 0);
+
+	/* spans several segments */
+	tt_assert(mbuf_chain_write(&c, "0123456789", 10));
+	int_check(mbuf_chain_iovec(&c, iov, 8), 3);
+	int_check(iov[2].iov_len, 2);
+	tt_assert(mbuf_chain_write(&c, "ab", 2));
+	int_check(mbuf_chain_iovec(&c, iov, 8), 3);
+	int_check(mbuf_chain_iovec(&c, iov, 2), 2);
+	tt_assert(chain_eq(&c, "0123456789ab"));
+
+	tt_assert(mbuf_chain_prepend(&c, "hdr:", 4));
+	tt_assert(chain_eq(&c, "hdr:0123456789ab"));
+
+	/* reads cross segment boundaries */
+	tt_assert(mbuf_chain_get_bytes(&c, buf, 3));
+	tt_assert(memcmp(buf, "hdr", 3) == 0);
+	tt_assert(mbuf_chain_get_byte(&c, &b));
+	int_check(b, ':');
+	tt_assert(mbuf_chain_skip(&c, 2));
+	tt_assert(mbuf_chain_get_uint16be(&c, &u16));
+	int_check(u16, 0x3233);
+	tt_assert(chain_eq(&c, "456789ab"));
+	tt_assert(!mbuf_chain_skip(&c, 9));
+	tt_assert(mbuf_chain_skip(&c, 8));
+	int_check(mbuf_chain_avail_for_read(&c), 0);
+	tt_assert(!mbuf_chain_get_byte(&c, &b));
+
+	tt_assert(mbuf_chain_put_uint16be(&c, 0x0102));
+	tt_assert(mbuf_chain_put_uint32be(&c, 0x03040506));
+	tt_assert(mbuf_chain_put_uint64be(&c, 0x0708090A0B0C0D0EULL));
+	tt_assert(mbuf_chain_write_byte(&c, 0x0F));
+	int_check(c.len, 15);
+	tt_assert(mbuf_chain_get_uint32be(&c, &u32));
+	ull_check(u32, 0x01020304);
+	tt_assert(mbuf_chain_get_uint64be(&c, &u64));
+	ull_check(u64, 0x05060708090A0B0CULL);
+	tt_assert(!mbuf_chain_get_uint32be(&c, &u32));
+	int_check(c.len, 3);
+	tt_assert(mbuf_chain_get_uint16be(&c, &u16));
+	int_check(u16, 0x0D0E);
+	tt_assert(mbuf_chain_get_byte(&c, &b));
+	int_check(b, 0x0F);
+	int_check(c.len, 0);
+end:
+	mbuf_chain_free(&c);
+	mbuf_chain_free(&c2);
+}
+
+static void test_chain_share(void *p)
+{
+	struct MBufChain a, b, c;
+
+	mbuf_chain_init(&a, NULL, 8);
+	mbuf_chain_init(&b, NULL, 8);
+	mbuf_chain_init(&c, NULL, 8);
+
+	tt_assert(mbuf_chain_write(&a, "abcdefghij", 10));
+	tt_assert(mbuf_chain_append_chain(&b, &a));
+	tt_assert(chain_eq(&b, "abcdefghij"));
+
+	/* writes after shared data do not leak into other chain */
+	tt_assert(mbuf_chain_write(&a, "XY", 2));
+	tt_assert(mbuf_chain_write(&b, "zz", 2));
+	tt_assert(chain_eq(&a, "abcdefghijXY"));
+	tt_assert(chain_eq(&b, "abcdefghijzz"));
+
+	/* slice moves data by reference */
+	tt_assert(mbuf_chain_slice(&a, 9, &c));
+	tt_assert(chain_eq(&a, "jXY"));
+	tt_assert(chain_eq(&c, "abcdefghi"));
+	tt_assert(!mbuf_chain_slice(&a, 4, &c));
+
+	/* source may go away */
+	mbuf_chain_free(&a);
+	mbuf_chain_free(&b);
+	tt_assert(chain_eq(&c, "abcdefghi"));
+	tt_assert(mbuf_chain_write(&c, "123", 3));
+	tt_assert(chain_eq(&c, "abcdefghi123"));
+end:
+	mbuf_chain_free(&a);
+	mbuf_chain_free(&b);
+	mbuf_chain_free(&c);
+}
+
+static void test_chain_sendmsg(void *p)
+{
+	struct MBufChain c;
+	int spair[2] = { -1, -1 };
+	char buf[8192];
+	ssize_t res;
+	size_t i, got = 0;
+
+	mbuf_chain_init(&c, NULL, 100);
+	tt_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, spair) == 0);
+
+	for (i = 0; i < sizeof(buf); i++) {
+		uint8_t b = i % 251;
+		tt_assert(mbuf_chain_write_byte(&c, b));
+	}
+	while (mbuf_chain_avail_for_read(&c) > 0) {
+		res = mbuf_chain_sendmsg(&c, spair[0], 0);
+		tt_assert(res > 0);
+		res = safe_read(spair[1], buf + got, sizeof(buf) - got);
+		tt_assert(res > 0);
+		got += res;
+	}
+	while (got < sizeof(buf)) {
+		res = safe_read(spair[1], buf + got, sizeof(buf) - got);
+		tt_assert(res > 0);
+		got += res;
+	}
+	for (i = 0; i < sizeof(buf); i++) {
+		if ((uint8_t)buf[i] != i % 251)
+			tt_fail_msg("bad data");
+	}
+	int_check(mbuf_chain_sendmsg(&c, spair[0], 0), 0);
+end:
+	if (spair[0] >= 0)
+		close(spair[0]);
+	if (spair[1] >= 0)
+		close(spair[1]);
+	mbuf_chain_free(&c);
+}
+
+/*
+ * Describe
+ */
+
+struct testcase_t mbuf_tests[] = {
+	{ "cx", test_mbuf_cx },
+	{ "growth", test_mbuf_growth },
+	{ "ring", test_mbuf_ring },
+	{ "sockio", test_mbuf_sockio },
+	{ "bulk", test_mbuf_bulk },
+	{ "varint", test_mbuf_varint },
+	{ "chain_basic", test_chain_basic },
+	{ "chain_share", test_chain_share },
+	{ "chain_sendmsg", test_chain_sendmsg },
+	END_OF_TESTCASES
+};
@@ -0,0 +1,96 @@
+#include <usual/mempool.h>
+
+#include <string.h>
+
+#include "test_common.h"
+
+static void test_mempool_alloc(void *p)
+{
+	struct MemPool *pool = NULL;
+	char *a, *b;
+	int i;
+
+	a = mempool_alloc(&pool, 16);
+	for (i = 0; i < 16; i++)
+		int_check(a[i], 0);
+	memset(a, 'x', 16);
+
+	/* freed memory gets zeroed again */
+	mempool_free_to(&pool, a);
+	b = mempool_alloc(&pool, 16);
+	tt_assert(a == b);
+	for (i = 0; i < 16; i++)
+		int_check(b[i], 0);
+
+	/* spans blocks */
+	for (i = 0; i < 100; i++)
+		tt_assert(mempool_alloc_raw(&pool, 100));
+	mempool_free_to(&pool, a);
+	tt_assert(mempool_alloc_raw(&pool, 1) == a);
+	mempool_free_to(&pool, NULL);
+	tt_assert(pool == NULL);
+end:
+	mempool_destroy(&pool);
+}
+
+static void test_mempool_grow(void *p)
+{
+	struct MemPool *pool = NULL;
+	char *a, *b;
+	unsigned len;
+	int i;
+
+	a = mempool_finish(&pool, &len);
+	tt_assert(a);
+	int_check(len, 0);
+
+	tt_assert(mempool_grow(&pool, "ab", 2));
+	tt_assert(mempool_grow(&pool, "cd", 3));
+	a = mempool_finish(&pool, &len);
+	str_check(a, "abcd");
+	int_check(len, 5);
+
+	/* object moves to new block */
+	for (i = 0; i < 1000; i++)
+		tt_assert(mempool_grow(&pool, "0123456789", 10));
+	b = mempool_finish(&pool, &len);
+	int_check(len, 10000);
+	for (i = 0; i < 10000; i++) {
+		if (b[i] != '0' + i % 10)
+			tt_fail_msg("bad data");
+	}
+	str_check(a, "abcd");
+end:
+	mempool_destroy(&pool);
+}
+
+static void test_mempool_resize(void *p)
+{
+	struct MemPool *pool = NULL;
+	char *a, *b;
+
+	a = mempool_alloc(&pool, 8);
+	b = mempool_alloc(&pool, 8);
+	strcpy(b, "qwe");
+
+	tt_assert(mempool_resize_last(&pool, a, 16) == NULL);
+	tt_assert(mempool_resize_last(&pool, b, 100) == b);
+	tt_assert(mempool_resize_last(&pool, b, 4) == b);
+	a = mempool_alloc(&pool, 8);
+	tt_assert(a == b + 8);
+
+	b = mempool_resize_last(&pool, a, 10000);
+	tt_assert(b && b != a);
+	strcpy(b, "asd");
+	b = mempool_resize_last(&pool, b, 20000);
+	str_check(b, "asd");
+end:
+	mempool_destroy(&pool);
+}
+
+struct testcase_t mempool_tests[] = {
+	{ "alloc", test_mempool_alloc },
+	{ "grow", test_mempool_grow },
+	{ "resize", test_mempool_resize },
+	END_OF_TESTCASES
+};
@@ -116,6 +116,13 @@ static void log_reset(void)
 #define log_check_full(x) do { str_check(log_buf, x); int_check(delta, 0); log_reset(); } while (0)
 #define log_check_quick() do {  int_check(delta, 0); log_reset(); } while (0)
 
+/* compact headers allocate extra records from same cx */
+#ifdef TALLOC_COMPACT
+#define LOG_COMPACT(normal, compact) compact
+#else
+#define LOG_COMPACT(normal, compact) normal
+#endif
+
 static void *create_top(void)
 {
 	log_reset();
@@ -230,13 +237,13 @@ static void test_talloc_basic(void *zzz)
 	tt_assert(talloc_check_name(top, "xx") == NULL);
 	tt_assert(talloc_check_name(top, "foo: 10") == top);
 	talloc_free(top);
-	log_check_full("A:1, A:2, F:2, F:1");
+	log_check_full(LOG_COMPACT("A:1, A:2, F:2, F:1", "A:1, A:2, A:3, F:3, F:2, F:1"));
 
 	top = create_top();
 	p = talloc(top, struct CheckHeader);
 	str_check(dump_talloc(top), "[top[struct CheckHeader]]");
 	talloc_free(top);
-	log_check_full("A:1, A:2, F:2, F:1");
+	log_check_full(LOG_COMPACT("A:1, A:2, F:2, F:1", "A:1, A:2, A:3, F:3, F:2, F:1"));
 
 	/* init & NULL ctx */
 	top = talloc_init("test std init: %d", 1);
@@ -349,7 +356,8 @@ static void test_talloc_refs(void *zzz)
 	err = talloc_free(p2);			tt_assert(err == 0);
 	str_check(dump_talloc(top), "[top[p1]]");
 	err = talloc_free(top);			tt_assert(err == 0);
-	log_check_full("A:1, A:2, A:3, A:4, F:4, F:3, F:2, F:1");
+	log_check_full(LOG_COMPACT("A:1, A:2, A:3, A:4, F:4, F:3, F:2, F:1",
+				   "A:1, A:2, A:3, A:4, A:5, A:6, A:7, F:7, F:6, F:4, F:5, F:3, F:2, F:1"));
 
 	/* simple ref, free old parent */
 	top = talloc_from_cx(cx, 0, "top");	tt_assert(top != NULL);
@@ -361,7 +369,8 @@ static void test_talloc_refs(void *zzz)
 	err = talloc_unlink(top, p1);		tt_assert(err == 0);
 	str_check(dump_talloc(top), "[top[p2[p1]]]");
 	err = talloc_free(top);			tt_assert(err == 0);
-	log_check_full("A:1, A:2, A:3, A:4, F:4, F:2, F:3, F:1");
+	log_check_full(LOG_COMPACT("A:1, A:2, A:3, A:4, F:4, F:2, F:3, F:1",
+				   "A:1, A:2, A:3, A:4, A:5, A:6, A:7, F:7, F:5, F:3, F:6, F:4, F:2, F:1"));
 
 	/* ref loop */
 	top = talloc_from_cx(cx, 0, "top");	tt_assert(top != NULL);
@@ -449,11 +458,118 @@ static void test_talloc_reparent(void *zzz)
 end:;
 }
 
+static void test_talloc_pool(void *zzz)
+{
+	void *top, *pool, *p, *p1 = NULL, *ref;
+	int i, err;
+
+	top = create_top();
+	pool = talloc_pool(top, 4096);		tt_assert(pool);
+	log_check(LOG_COMPACT("A:1, A:2", "A:1, A:2, A:3"));
+
+	/* all children come from pool */
+	dcount = 0;
+	for (i = 0; i < 20; i++) {
+		p = talloc_asprintf(pool, "p%d", i);	tt_assert(p);
+		talloc_set_destructor(p, destructor1);
+		if (i == 0)
+			p1 = p;
+	}
+	p = talloc_realloc_size(NULL, p, 1000);		tt_assert(p);
+	log_check("");
+	str_check(dump_talloc(pool), "[.pool[p0,p1,p2,p3,p4,p5,p6,p7,p8,p9,p10,p11,p12,p13,p14,p15,p16,p17,p18,talloc_realloc_size]]");
+
+	/* free all children, memory is reused */
+	talloc_free_children(pool);
+	int_check(dcount, 20);
+	p = talloc_strdup(pool, "x");
+	tt_assert(p == p1);
+	talloc_free(p);
+	log_check("");
+
+	/* pool can move, children only inside */
+	p1 = talloc_strdup(top, "p1");
+	tt_assert(talloc_steal(p1, pool) == pool);
+	p = talloc_strdup(pool, "x");
+	tt_assert(talloc_steal(p1, p) == NULL);
+	str_check(dump_talloc(top), "[top[p1[.pool[x]]]]");
+
+	/* reference keeps pool memory alive */
+	ref = talloc_reference(top, p);		tt_assert(ref == p);
+	err = talloc_free(pool);		tt_assert(err == 0);
+	log_check(LOG_COMPACT("A:3, A:4, F:4", "A:4, A:5, A:6, F:6"));
+	str_check(dump_talloc(top), "[top[p1,x]]");
+	str_check(p, "x");
+	talloc_free(p);
+	log_check(LOG_COMPACT("F:2", "F:3"));
+
+	talloc_free(top);
+	log_check_quick();
+end:;
+}
+
+static void test_talloc_compact(void *zzz)
+{
+	void *top, *p, *list[8];
+	char name[32];
+	int i, d;
+
+	/* header overhead */
+	top = create_top();
+	d = delta;
+	p = talloc_size(top, 8);		tt_assert(p);
+	d = delta - d - 8;
+#ifdef TALLOC_COMPACT
+	tt_assert(d < 32);
+#endif
+
+	/* extra record is allocated from same cx */
+	d = delta;
+	talloc_set_destructor(p, destructor1);
+#ifdef TALLOC_COMPACT
+	tt_assert(delta > d);
+#endif
+	talloc_free(p);
+
+	/* unlink from middle and end, move siblings */
+	for (i = 0; i < 8; i++) {
+		snprintf(name, sizeof(name), "p%d", i);
+		list[i] = talloc_strdup(top, name);	tt_assert(list[i]);
+	}
+	talloc_free(list[7]);
+	talloc_free(list[3]);
+	talloc_free(list[0]);
+	list[5] = talloc_strdup_append(list[5], "-longer-string-that-moves");
+	tt_assert(list[5]);
+	list[6] = talloc_realloc_size(top, list[6], 2000);
+	tt_assert(list[6]);
+	talloc_set_name_const(list[6], "p6");
+	str_check(dump_talloc(top), "[top[p1,p2,p4,p5-longer-string-that-moves,p6]]");
+
+	/* children follow moved parent */
+	p = talloc_strdup(list[1], "c1");	tt_assert(p);
+	p = talloc_strdup(list[1], "c2");	tt_assert(p);
+	talloc_set_destructor(p, destructor1);
+	list[1] = talloc_realloc_size(top, list[1], 4000);
+	tt_assert(list[1]);
+	talloc_set_name(list[1], "p1: %d", 1);
+	tt_assert(talloc_parent(p) == list[1]);
+	str_check(dump_talloc(top), "[top[p1: 1[c1,c2,p1: 1]p2,p4,p5-longer-string-that-moves,p6]]");
+
+	dcount = 0;
+	talloc_free(top);
+	int_check(dcount, 1);
+	log_check_quick();
+end:;
+}
+
 struct testcase_t talloc_tests[] = {
 	{ "basic", test_talloc_basic },
 	{ "strings", test_talloc_strings },
 	{ "refs", test_talloc_refs },
 	{ "memlimit", test_talloc_memlimit },
 	{ "reparent", test_talloc_reparent },
+	{ "pool", test_talloc_pool },
+	{ "compact", test_talloc_compact },
 	END_OF_TESTCASES
 };
@@ -210,11 +210,35 @@ end:;
  * Describe
  */
 
+static void test_utf8_validate_string(void *p)
+{
+	char buf[128];
+	int pos;
+
+	memset(buf, 'a', sizeof(buf));
+	tt_assert(utf8_validate_string(buf, buf + sizeof(buf)));
+
+	/* bad byte at every offset of vector block */
+	for (pos = 0; pos < 80; pos++) {
+		memset(buf, 'a', sizeof(buf));
+		memcpy(buf + pos, "\xe2\x82\xac", 3);
+		tt_assert(utf8_validate_string(buf, buf + sizeof(buf)));
+		buf[pos + 2] = 'x';
+		tt_assert(!utf8_validate_string(buf, buf + sizeof(buf)));
+		buf[pos] = '\0';
+		tt_assert(!utf8_validate_string(buf, buf + sizeof(buf)));
+		/* bad byte outside of range */
+		tt_assert(utf8_validate_string(buf, buf + pos));
+	}
+end:;
+}
+
 struct testcase_t utf8_tests[] = {
 	{ "utf8_char_size", test_utf8_char_size },
 	{ "utf8_seq_size", test_utf8_seq_size },
 	{ "utf8_get_char", test_utf8_get_char },
 	{ "utf8_put_char", test_utf8_put_char },
 	{ "utf8_validate_seq", test_utf8_validate_seq },
+	{ "utf8_validate_string", test_utf8_validate_string },
 	END_OF_TESTCASES
 };
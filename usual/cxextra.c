@@ -76,20 +76,34 @@ struct CxPool {
 	struct CxMem this;
 	const struct CxMem *parent;
 	struct CxPoolSeg *last;
+	struct CxPoolSeg *spare;
 	unsigned char *last_ptr;
+	size_t reserved;
 	unsigned int align;
+	unsigned int hdr;
 	bool allow_free_first;
 
 	struct CxPoolSeg first_seg;
 };
 #define POOL_HDR  ALIGN(sizeof(struct CxPoolSeg))
 
-static struct CxPoolSeg *new_seg(struct CxPool *pool, size_t nsize)
+static struct CxPoolSeg *new_seg(struct CxPool *pool, size_t nsize, size_t need)
 {
 	struct CxPoolSeg *seg;
 	unsigned char *ptr;
 	size_t alloc = POOL_HDR + nsize;
 
+	/* reuse segment kept by reset/rewind if it is big enough */
+	seg = pool->spare;
+	if (seg && (size_t)(seg->seg_end - seg->seg_start) >= need) {
+		pool->spare = NULL;
+		seg->seg_pos = seg->seg_start;
+		seg->prev = pool->last;
+		pool->last = seg;
+		pool->last_ptr = NULL;
+		return seg;
+	}
+
 	seg = cx_alloc(pool->parent, alloc);
 	if (seg == NULL)
 		return NULL;
@@ -103,31 +117,42 @@ static struct CxPoolSeg *new_seg(struct CxPool *pool, size_t nsize)
 	return seg;
 }
 
+/* make sure last segment has room for size bytes */
+static struct CxPoolSeg *pool_get_seg(struct CxPool *pool, size_t size)
+{
+	struct CxPoolSeg *seg = pool->last;
+	size_t nsize;
+
+	if (seg && seg->seg_pos + size <= seg->seg_end)
+		return seg;
+	nsize = seg ? (2 * (seg->seg_end - seg->seg_start)) : 512;
+	while (nsize < size)
+		nsize *= 2;
+	return new_seg(pool, nsize, size);
+}
+
+/* take size bytes from seg, store length in header if requested */
+static void *pool_take(struct CxPool *pool, struct CxPoolSeg *seg, size_t size)
+{
+	unsigned char *ptr = seg->seg_pos + pool->hdr;
+
+	if (pool->hdr)
+		*(size_t *)seg->seg_pos = size;
+	seg->seg_pos = ptr + size;
+	pool->last_ptr = ptr;
+	return ptr;
+}
+
 static void *pool_alloc(void *ctx, size_t size)
 {
 	struct CxPool *pool = ctx;
-	struct CxPoolSeg *seg = pool->last;
-	void *ptr;
-	unsigned nsize;
+	struct CxPoolSeg *seg;
 
 	size = CUSTOM_ALIGN(size, pool->align);
-	if (seg && seg->seg_pos + size <= seg->seg_end) {
-		ptr = seg->seg_pos;
-		seg->seg_pos += size;
-		pool->last_ptr = ptr;
-		return ptr;
-	} else {
-		nsize = seg ? (2 * (seg->seg_end - seg->seg_start)) : 512;
-		while (nsize < size)
-			nsize *= 2;
-		seg = new_seg(pool, nsize);
-		if (!seg)
-			return NULL;
-		ptr = seg->seg_pos;
-		seg->seg_pos += size;
-		pool->last_ptr = ptr;
-		return ptr;
-	}
+	seg = pool_get_seg(pool, pool->hdr + size);
+	if (!seg)
+		return NULL;
+	return pool_take(pool, seg, size);
 }
 
 /* free only last item */
@@ -138,7 +163,7 @@ static void pool_free(void *ctx, void *ptr)
 
 	if (pool->last_ptr != ptr)
 		return;
-	cur->seg_pos = (void *)ptr;
+	cur->seg_pos = (unsigned char *)ptr - pool->hdr;
 	pool->last_ptr = NULL;
 }
 
@@ -147,6 +172,10 @@ static size_t pool_guess_old_len(struct CxPool *pool, unsigned char *ptr)
 	struct CxPoolSeg *seg = pool->last;
 	unsigned char *cstart;
 
+	/* exact length is known */
+	if (pool->hdr)
+		return *(size_t *)(ptr - pool->hdr);
+
 	while (seg) {
 		cstart = (void *)CUSTOM_ALIGN((seg + 1), pool->align);
 		if (ptr >= cstart && ptr < seg->seg_pos)
@@ -162,10 +191,14 @@ static void *pool_realloc(void *ctx, void *ptr, size_t len)
 	struct CxPool *pool = ctx;
 	struct CxPoolSeg *seg = pool->last;
 	unsigned char *p = ptr;
-	size_t olen;
+	size_t olen, alen;
 
+	alen = CUSTOM_ALIGN(len, pool->align);
 	if (pool->last_ptr != ptr) {
 		olen = pool_guess_old_len(pool, ptr);
+		/* with known length, shrink in place */
+		if (pool->hdr && alen <= olen)
+			return p;
 		p = pool_alloc(ctx, len);
 		if (!p)
 			return NULL;
@@ -176,8 +209,10 @@ static void *pool_realloc(void *ctx, void *ptr, size_t len)
 	}
 
 	olen = seg->seg_pos - p;
-	if (seg->seg_pos - olen + len <= seg->seg_end) {
-		seg->seg_pos = p + len;
+	if (p + alen <= seg->seg_end) {
+		seg->seg_pos = p + alen;
+		if (pool->hdr)
+			*(size_t *)(p - pool->hdr) = alen;
 		return p;
 	} else {
 		p = pool_alloc(ctx, len);
@@ -201,6 +236,8 @@ static void pool_destroy(void *ctx)
 		cx_free(pool->parent, cur);
 		cur = prev;
 	}
+	if (pool->spare)
+		cx_free(pool->parent, pool->spare);
 	if (pool->allow_free_first)
 		cx_free(pool->parent, pool);
 }
@@ -212,6 +249,31 @@ static const struct CxOps pool_ops = {
 	pool_destroy,
 };
 
+/* drop segments newer than 'upto', keep largest of them as spare */
+static void pool_release_segs(struct CxPool *pool, struct CxPoolSeg *upto)
+{
+	struct CxPoolSeg *cur, *prev, *drop;
+
+	for (cur = pool->last; cur && cur != upto; cur = prev) {
+		prev = cur->prev;
+		if (!prev)
+			break;
+		drop = cur;
+		if (!pool->spare) {
+			pool->spare = cur;
+			continue;
+		}
+		if (cur->seg_end - cur->seg_start > pool->spare->seg_end - pool->spare->seg_start) {
+			drop = pool->spare;
+			pool->spare = cur;
+		}
+		cx_free(pool->parent, drop);
+	}
+	pool->last = cur;
+	pool->last_ptr = NULL;
+	pool->reserved = 0;
+}
+
 /*
  * public functions
  */
@@ -261,6 +323,76 @@ CxMem *cx_new_pool(CxMem *parent, size_t initial_size, unsigned int align)
 	return cx_new_pool_from_area(parent, area, size, true, align);
 }
 
+CxMem *cx_new_pool_sized(CxMem *parent, size_t initial_size, unsigned int align)
+{
+	CxMem *cx;
+	struct CxPool *pool;
+
+	cx = cx_new_pool(parent, initial_size, align);
+	if (!cx)
+		return NULL;
+	pool = cx->ctx;
+	pool->hdr = CUSTOM_ALIGN(sizeof(size_t), pool->align);
+	return cx;
+}
+
+void cx_pool_reset(CxMem *cx)
+{
+	struct CxPool *pool = cx->ctx;
+
+	Assert(cx->ops == &pool_ops);
+	pool_release_segs(pool, &pool->first_seg);
+	pool->first_seg.seg_pos = pool->first_seg.seg_start;
+}
+
+void cx_pool_mark(CxMem *cx, struct CxPoolMark *mark)
+{
+	struct CxPool *pool = cx->ctx;
+
+	Assert(cx->ops == &pool_ops);
+	mark->seg = pool->last;
+	mark->pos = pool->last->seg_pos;
+}
+
+void *cx_pool_reserve(CxMem *cx, size_t len)
+{
+	struct CxPool *pool = cx->ctx;
+	struct CxPoolSeg *cur = pool->last, *seg;
+	size_t keep = pool->reserved;
+
+	Assert(cx->ops == &pool_ops);
+	seg = pool_get_seg(pool, pool->hdr + CUSTOM_ALIGN(len, pool->align));
+	if (!seg)
+		return NULL;
+
+	/* moved to new segment, carry over unfinished data */
+	if (seg != cur && keep > 0)
+		memcpy(seg->seg_pos + pool->hdr, cur->seg_pos + pool->hdr, keep < len ? keep : len);
+	pool->reserved = len;
+	return seg->seg_pos + pool->hdr;
+}
+
+void *cx_pool_commit(CxMem *cx, size_t len)
+{
+	struct CxPool *pool = cx->ctx;
+
+	Assert(cx->ops == &pool_ops);
+	Assert(len <= pool->reserved);
+	pool->reserved = 0;
+	return pool_take(pool, pool->last, CUSTOM_ALIGN(len, pool->align));
+}
+
+void cx_pool_rewind(CxMem *cx, const struct CxPoolMark *mark)
+{
+	struct CxPool *pool = cx->ctx;
+	struct CxPoolSeg *seg = mark->seg;
+
+	Assert(cx->ops == &pool_ops);
+	pool_release_segs(pool, seg);
+	Assert(pool->last == seg);
+	seg->seg_pos = mark->pos;
+}
+
 /*
  * tree alloc
  */
@@ -41,6 +41,64 @@ CxMem *cx_new_pool(CxMem *parent, size_t initial_size, unsigned int align);
 
 CxMem *cx_new_pool_from_area(CxMem *parent, void *buf, size_t size, bool allow_free, unsigned int align);
 
+/**
+ * Pool that stores length of each allocation in small header.
+ *
+ * Makes realloc() of any object O(1): shrinking is done in place,
+ * growing copies only the object itself.  Otherwise same as
+ * cx_new_pool().
+ */
+CxMem *cx_new_pool_sized(CxMem *parent, size_t initial_size, unsigned int align);
+
+/**
+ * Get room for unfinished object at the end of pool.
+ *
+ * Returns pointer to at least len bytes.  If the object needs
+ * to move to new segment, the data from previous reserve call
+ * is copied over, so the object can be grown step by step.
+ *
+ * No other allocations may happen from pool until cx_pool_commit().
+ */
+void *cx_pool_reserve(CxMem *pool, size_t len);
+
+/**
+ * Turn reserved area into regular allocation of len bytes.
+ *
+ * Returns the pointer given by last cx_pool_reserve().
+ */
+void *cx_pool_commit(CxMem *pool, size_t len);
+
+/**
+ * Savepoint in pool.
+ *
+ * Filled by cx_pool_mark(), contents are private.
+ */
+struct CxPoolMark {
+	void *seg;
+	void *pos;
+};
+
+/**
+ * Forget all allocations in pool, but keep memory for reuse.
+ *
+ * Initial area and largest extra segment stay allocated,
+ * others are returned to parent.  Invalidates all marks.
+ */
+void cx_pool_reset(CxMem *pool);
+
+/**
+ * Remember current end of pool.
+ */
+void cx_pool_mark(CxMem *pool, struct CxPoolMark *mark);
+
+/**
+ * Free all allocations done after mark was taken.
+ *
+ * Mark must not be older than last cx_pool_reset()
+ * or rewind to older mark.
+ */
+void cx_pool_rewind(CxMem *pool, const struct CxPoolMark *mark);
+
 /**
  * Creates allocator that remebers all allocations done
  * under it and allows all of it to be freed together.
@@ -0,0 +1,394 @@
+/*
+ * Allocation profiler.
+ */
+
+#include <usual/cxprof.h>
+#include <usual/json.h>
+#include <usual/list.h>
+#include <usual/bits.h>
+
+#include <string.h>
+
+#ifdef HAVE_EXECINFO_H
+#include <execinfo.h>
+#endif
+
+struct CxProfiler;
+
+/* counters for one tag, ->this is the view given to user */
+struct CxProfTag {
+	struct CxMem this;
+	struct List node;
+	struct CxProfiler *prof;
+	const char *name;
+	struct CxProfStats stats;
+};
+
+struct CxProfSample {
+	const struct CxProfTag *tag;
+	size_t size;
+	int nframes;
+	void *frames[CX_PROF_FRAMES];
+};
+
+struct CxProfiler {
+	/* "default" tag, also the profiler itself */
+	struct CxProfTag root;
+	CxMem *parent;
+	struct List tag_list;
+
+	size_t total_live;
+	size_t total_peak;
+
+	/* ring of CX_PROF_SAMPLES, allocated when sampling is enabled */
+	struct CxProfSample *samples;
+	unsigned int sample_every;
+	unsigned int sample_countdown;
+	uint64_t sample_count;
+};
+
+/* header for each allocation */
+struct CxProfItem {
+	struct CxProfTag *tag;
+	size_t len;
+};
+
+#define PROF_HDR (int)ALIGN(sizeof(struct CxProfItem))
+
+static inline void *p_move(const void *p, int ofs)
+{
+	return (char *)p + ofs;
+}
+
+/* bucket i is for sizes up to 16<<i */
+static inline int size_bucket(size_t len)
+{
+	int b;
+
+	if (len <= 16)
+		return 0;
+	b = flsll(len - 1) - 4;
+	return (b < CX_PROF_BUCKETS) ? b : CX_PROF_BUCKETS - 1;
+}
+
+static void add_bytes(struct CxProfTag *tag, size_t len)
+{
+	struct CxProfiler *prof = tag->prof;
+	struct CxProfStats *st = &tag->stats;
+
+	st->hist[size_bucket(len)]++;
+	st->live_bytes += len;
+	if (st->live_bytes > st->peak_bytes)
+		st->peak_bytes = st->live_bytes;
+	prof->total_live += len;
+	if (prof->total_live > prof->total_peak)
+		prof->total_peak = prof->total_live;
+}
+
+static void sub_bytes(struct CxProfTag *tag, size_t len)
+{
+	tag->stats.live_bytes -= len;
+	tag->prof->total_live -= len;
+}
+
+static void take_sample(struct CxProfTag *tag, size_t len)
+{
+	struct CxProfiler *prof = tag->prof;
+	struct CxProfSample *s;
+
+	if (!prof->sample_every || --prof->sample_countdown > 0)
+		return;
+	prof->sample_countdown = prof->sample_every;
+
+	s = &prof->samples[prof->sample_count++ % CX_PROF_SAMPLES];
+	s->tag = tag;
+	s->size = len;
+#ifdef HAVE_BACKTRACE
+	s->nframes = backtrace(s->frames, CX_PROF_FRAMES);
+#else
+	s->nframes = 0;
+#endif
+}
+
+/*
+ * CxOps, ctx is CxProfTag.
+ */
+
+static void *prof_alloc(void *ctx, size_t len)
+{
+	struct CxProfTag *tag = ctx;
+	struct CxProfItem *item;
+
+	item = cx_alloc(tag->prof->parent, PROF_HDR + len);
+	if (!item) {
+		tag->stats.failures++;
+		return NULL;
+	}
+	item->tag = tag;
+	item->len = len;
+
+	tag->stats.allocs++;
+	tag->stats.live_count++;
+	add_bytes(tag, len);
+	take_sample(tag, len);
+
+	return p_move(item, PROF_HDR);
+}
+
+/* credited to tag that allocated the object */
+static void *prof_realloc(void *ctx, void *ptr, size_t len)
+{
+	struct CxProfTag *tag = ctx;
+	struct CxProfItem *item, *item2;
+	struct CxProfTag *owner;
+	size_t olen;
+
+	item = p_move(ptr, -PROF_HDR);
+	owner = item->tag;
+	olen = item->len;
+
+	item2 = cx_realloc(tag->prof->parent, item, PROF_HDR + len);
+	if (!item2) {
+		owner->stats.failures++;
+		return NULL;
+	}
+	item2->len = len;
+
+	owner->stats.reallocs++;
+	sub_bytes(owner, olen);
+	add_bytes(owner, len);
+	take_sample(owner, len);
+
+	return p_move(item2, PROF_HDR);
+}
+
+static void prof_free(void *ctx, void *ptr)
+{
+	struct CxProfTag *tag = ctx;
+	struct CxProfItem *item;
+	struct CxProfTag *owner;
+
+	item = p_move(ptr, -PROF_HDR);
+	owner = item->tag;
+
+	owner->stats.frees++;
+	owner->stats.live_count--;
+	sub_bytes(owner, item->len);
+
+	cx_free(tag->prof->parent, item);
+}
+
+/* only profiler itself can be destroyed, not views */
+static void prof_destroy(void *ctx)
+{
+	struct CxProfTag *tag = ctx;
+	struct CxProfiler *prof = tag->prof;
+	struct List *el, *tmp;
+
+	if (tag != &prof->root)
+		return;
+
+	list_for_each_safe(el, &prof->tag_list, tmp) {
+		tag = container_of(el, struct CxProfTag, node);
+		list_del(el);
+		if (tag != &prof->root)
+			cx_free(prof->parent, tag);
+	}
+	if (prof->samples)
+		cx_free(prof->parent, prof->samples);
+	cx_free(prof->parent, prof);
+}
+
+static const struct CxOps prof_ops = {
+	prof_alloc,
+	prof_realloc,
+	prof_free,
+	prof_destroy,
+};
+
+static void init_tag(struct CxProfiler *prof, struct CxProfTag *tag, const char *name)
+{
+	memset(tag, 0, sizeof(*tag));
+	tag->this.ops = &prof_ops;
+	tag->this.ctx = tag;
+	tag->prof = prof;
+	tag->name = name;
+	list_append(&prof->tag_list, &tag->node);
+}
+
+static struct CxProfiler *get_profiler(CxMem *cx)
+{
+	struct CxProfTag *tag = cx->ctx;
+
+	Assert(cx->ops == &prof_ops);
+	return tag->prof;
+}
+
+/*
+ * JSON output.
+ */
+
+static bool dump_stats(struct JsonContext *ctx, struct JsonValue *dict, const struct CxProfStats *st)
+{
+	struct JsonValue *hist;
+	char key[32];
+	int i;
+
+	if (!json_dict_put_int(dict, "allocs", st->allocs))
+		return false;
+	if (!json_dict_put_int(dict, "reallocs", st->reallocs))
+		return false;
+	if (!json_dict_put_int(dict, "frees", st->frees))
+		return false;
+	if (!json_dict_put_int(dict, "failures", st->failures))
+		return false;
+	if (!json_dict_put_int(dict, "live_count", st->live_count))
+		return false;
+	if (!json_dict_put_int(dict, "live_bytes", st->live_bytes))
+		return false;
+	if (!json_dict_put_int(dict, "peak_bytes", st->peak_bytes))
+		return false;
+
+	/* non-empty buckets, keyed by upper bound */
+	hist = json_new_dict(ctx);
+	if (!hist || !json_dict_put(dict, "hist", hist))
+		return false;
+	for (i = 0; i < CX_PROF_BUCKETS; i++) {
+		if (!st->hist[i])
+			continue;
+		if (i < CX_PROF_BUCKETS - 1)
+			snprintf(key, sizeof(key), "%llu", (unsigned long long)16 << i);
+		else
+			snprintf(key, sizeof(key), "more");
+		if (!json_dict_put_int(hist, key, st->hist[i]))
+			return false;
+	}
+	return true;
+}
+
+static bool dump_sample(struct JsonContext *ctx, struct JsonValue *list, const struct CxProfSample *s)
+{
+	struct JsonValue *dict, *stack;
+	char buf[32];
+	int i;
+
+	dict = json_new_dict(ctx);
+	if (!dict || !json_list_append(list, dict))
+		return false;
+	if (!json_dict_put_string(dict, "tag", s->tag->name))
+		return false;
+	if (!json_dict_put_int(dict, "size", s->size))
+		return false;
+
+	stack = json_new_list(ctx);
+	if (!stack || !json_dict_put(dict, "stack", stack))
+		return false;
+	for (i = 0; i < s->nframes; i++) {
+		snprintf(buf, sizeof(buf), "0x%llx", (unsigned long long)(uintptr_t)s->frames[i]);
+		if (!json_list_append_string(stack, buf))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Public API.
+ */
+
+CxMem *cx_new_profiler(CxMem *parent)
+{
+	struct CxProfiler *prof;
+
+	prof = cx_alloc(parent, sizeof(*prof));
+	if (!prof)
+		return NULL;
+	memset(prof, 0, sizeof(*prof));
+	prof->parent = parent;
+	list_init(&prof->tag_list);
+	init_tag(prof, &prof->root, "default");
+	return &prof->root.this;
+}
+
+CxMem *cx_profiler_tag(CxMem *cx, const char *name)
+{
+	struct CxProfiler *prof = get_profiler(cx);
+	struct CxProfTag *tag;
+	struct List *el;
+
+	list_for_each(el, &prof->tag_list) {
+		tag = container_of(el, struct CxProfTag, node);
+		if (strcmp(tag->name, name) == 0)
+			return &tag->this;
+	}
+
+	tag = cx_alloc(prof->parent, sizeof(*tag));
+	if (!tag)
+		return NULL;
+	init_tag(prof, tag, name);
+	return &tag->this;
+}
+
+void cx_profiler_set_sampling(CxMem *cx, unsigned int every)
+{
+	struct CxProfiler *prof = get_profiler(cx);
+
+	if (every && !prof->samples) {
+		prof->samples = cx_alloc(prof->parent, CX_PROF_SAMPLES * sizeof(struct CxProfSample));
+		if (!prof->samples)
+			every = 0;
+	}
+	prof->sample_every = every;
+	prof->sample_countdown = every;
+}
+
+const struct CxProfStats *cx_profiler_stats(CxMem *cx)
+{
+	struct CxProfTag *tag = cx->ctx;
+
+	Assert(cx->ops == &prof_ops);
+	return &tag->stats;
+}
+
+struct JsonValue *cx_profiler_dump(CxMem *cx, struct JsonContext *ctx)
+{
+	struct CxProfiler *prof = get_profiler(cx);
+	struct JsonValue *res, *tags, *dict, *list;
+	struct CxProfTag *tag;
+	struct List *el;
+	uint64_t i, first = 0;
+
+	res = json_new_dict(ctx);
+	if (!res)
+		return NULL;
+	if (!json_dict_put_int(res, "live_bytes", prof->total_live))
+		return NULL;
+	if (!json_dict_put_int(res, "peak_bytes", prof->total_peak))
+		return NULL;
+
+	tags = json_new_dict(ctx);
+	if (!tags || !json_dict_put(res, "tags", tags))
+		return NULL;
+	list_for_each(el, &prof->tag_list) {
+		tag = container_of(el, struct CxProfTag, node);
+		dict = json_new_dict(ctx);
+		if (!dict || !json_dict_put(tags, tag->name, dict))
+			return NULL;
+		if (!dump_stats(ctx, dict, &tag->stats))
+			return NULL;
+	}
+
+	if (!json_dict_put_int(res, "sampling", prof->sample_every))
+		return NULL;
+	list = json_new_list(ctx);
+	if (!list || !json_dict_put(res, "samples", list))
+		return NULL;
+
+	/* oldest first */
+	if (prof->sample_count > CX_PROF_SAMPLES)
+		first = prof->sample_count - CX_PROF_SAMPLES;
+	for (i = first; i < prof->sample_count; i++) {
+		if (!dump_sample(ctx, list, &prof->samples[i % CX_PROF_SAMPLES]))
+			return NULL;
+	}
+	return res;
+}
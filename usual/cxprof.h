@@ -0,0 +1,92 @@
+
+/** @file
+ * Allocation profiler for cxalloc.
+ *
+ * Wraps another CxMem and counts allocations per tag.
+ * Each subsystem gets its own tagged view of same profiler,
+ * so memory growth can be pinned to its owner without
+ * restarting under valgrind.
+ *
+ * Each allocation gets small header that remembers size and tag,
+ * so free() and realloc() are credited to tag that allocated
+ * the object, whatever view is used to release it.
+ *
+ * Optionally every Nth allocation records a backtrace, last
+ * CX_PROF_SAMPLES of them are kept.
+ *
+ * Not thread-safe, same as other cxalloc allocators.
+ */
+
+#ifndef _USUAL_CXPROF_H_
+#define _USUAL_CXPROF_H_
+
+#include <usual/cxalloc.h>
+
+struct JsonContext;
+struct JsonValue;
+
+/** Number of size classes in histogram */
+#define CX_PROF_BUCKETS		16
+
+/** Number of backtrace samples kept */
+#define CX_PROF_SAMPLES		64
+
+/** Max frames in one sample */
+#define CX_PROF_FRAMES		16
+
+/**
+ * Counters for one tag.
+ */
+struct CxProfStats {
+	uint64_t allocs;		/**< successful allocations */
+	uint64_t reallocs;		/**< successful reallocations */
+	uint64_t frees;			/**< freed objects */
+	uint64_t failures;		/**< failed alloc/realloc calls */
+	size_t live_count;		/**< objects not freed yet */
+	size_t live_bytes;		/**< bytes in live objects */
+	size_t peak_bytes;		/**< max value of live_bytes */
+	/** allocation sizes, bucket i is for sizes up to 16<<i, last bucket for larger ones */
+	uint64_t hist[CX_PROF_BUCKETS];
+};
+
+/**
+ * Create profiler on top of parent.
+ *
+ * Returned allocator itself is tagged as "default".
+ * cx_destroy() on it releases profiler bookkeeping,
+ * objects that are not freed yet stay in parent.
+ */
+CxMem *cx_new_profiler(CxMem *parent);
+
+/**
+ * Get view of profiler that credits allocations to tag.
+ *
+ * Works on profiler or any of its views.  Views with same
+ * tag share counters.  Tag string is not copied, it must
+ * stay valid while profiler exists.  View is released
+ * together with profiler, cx_destroy() on it does nothing.
+ */
+CxMem *cx_profiler_tag(CxMem *prof, const char *tag);
+
+/**
+ * Record backtrace on every Nth allocation.
+ *
+ * 0 disables sampling, which is the default.  Without
+ * backtrace() support only size and tag are recorded.
+ */
+void cx_profiler_set_sampling(CxMem *prof, unsigned int every);
+
+/**
+ * Get counters of view's tag.
+ */
+const struct CxProfStats *cx_profiler_stats(CxMem *view);
+
+/**
+ * Return all counters and samples as JSON dict.
+ *
+ * Values are allocated from ctx, which should not use the profiler
+ * itself, otherwise counters change during the dump.
+ */
+struct JsonValue *cx_profiler_dump(CxMem *prof, struct JsonContext *ctx);
+
+#endif
@@ -29,7 +29,7 @@
 /** Info about mapped file */
 struct MappedFile {
 	int fd;
-	unsigned len;
+	size_t len;
 	void *ptr;
 };
 
@@ -18,13 +18,26 @@
 
 #include <usual/json.h>
 #include <usual/cxextra.h>
-#include <usual/cbtree.h>
+#include <usual/hashing/memhash.h>
 #include <usual/misc.h>
 #include <usual/utf8.h>
 #include <usual/ctype.h>
 #include <usual/bytemap.h>
 #include <usual/string.h>
+#include <usual/bits.h>
 #include <math.h>
+#include <float.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define JSON_SCAN_AVX2
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define JSON_SCAN_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define JSON_SCAN_NEON
+#endif
 
 #define TYPE_BITS	3
 #define TYPE_MASK	((1 << TYPE_BITS) - 1)
@@ -32,6 +45,9 @@
 
 #define JSON_MAX_KEY	(1024*1024)
 
+/* smaller dicts are scanned linearly */
+#define DICT_INDEX_MIN	8
+
 #define NUMBER_BUF	100
 
 #define JSON_MAXINT	((1LL << 53) - 1)
@@ -55,11 +71,61 @@ struct JsonValue {
 
 /*
  * List container.
+ *
+ * Elements are kept in array that grows by doubling.
  */
 struct ValueList {
-	struct JsonValue *first;
-	struct JsonValue *last;
-	struct JsonValue **array;
+	struct JsonValue **items;
+	uint32_t alloc;
+};
+
+/*
+ * Dict container.
+ *
+ * Keys are kept in insertion order, value is next of key.
+ * Index is open-addressing hash table of key positions + 1.
+ */
+struct ValueDict {
+	struct JsonValue **keys;
+	uint32_t *index;
+	uint32_t index_mask;
+	uint32_t alloc;
+};
+
+/*
+ * Tape from lazy parse.
+ *
+ * Item is followed by its children, ->end is index after them.
+ */
+struct TapeItem {
+	uint8_t type;
+	bool escaped;			/* string has escapes */
+	bool is_key;			/* string is dict key */
+	uint32_t end;
+	union {
+		struct {
+			uint32_t ofs;
+			uint32_t len;
+		} str;			/* raw string in source */
+		uint32_t count;		/* list/dict elements */
+		int64_t v_int;
+		double v_float;
+		bool v_bool;
+	} u;
+	struct JsonValue *node;		/* value, once created */
+};
+
+struct JsonTape {
+	const char *src;
+	uint32_t count;
+	struct TapeItem items[FLEX_ARRAY];
+};
+
+/* container that is not expanded yet */
+struct LazyRef {
+	struct JsonTape *tape;
+	uint32_t item;
+	uint32_t *pos;		/* list element positions, for indexed access */
 };
 
 /*
@@ -72,14 +138,18 @@ struct JsonContainer {
 	/* main context for child alloc */
 	struct JsonContext *c_ctx;
 
+	/* children are still in tape */
+	bool c_lazy;
+
 	/* child elements */
 	union {
-		struct CBTree *c_dict;
+		struct ValueDict c_dict;
 		struct ValueList c_list;
+		struct LazyRef c_tape;
 	} u;
 };
 
-#define DICT_EXTRA (offsetof(struct JsonContainer, u.c_dict) + sizeof(struct CBTree *))
+#define DICT_EXTRA (offsetof(struct JsonContainer, u.c_dict) + sizeof(struct ValueDict))
 #define LIST_EXTRA (sizeof(struct JsonContainer))
 
 /*
@@ -87,6 +157,7 @@ struct JsonContainer {
  */
 struct JsonContext {
 	CxMem *pool;
+	struct CxPoolMark pool_start;	/* pool end after context itself */
 	unsigned int options;
 
 	/* parse state */
@@ -96,11 +167,32 @@ struct JsonContext {
 	const char *lasterr;
 	char errbuf[128];
 	int64_t linenr;
+
+	/* token state */
+	const struct JsonEvents *events;
+	void *events_arg;
+	unsigned char state;
+	bool partial;		/* more input may follow */
+	bool need_more;		/* token was cut at end of input */
+	bool carry_esc;		/* carry ends with '\\' in string or '*' in comment */
+
+	/* lazy parse */
+	const char *tape_src;	/* source, when building tape */
+	uint32_t tape_open;	/* innermost open container */
+
+	/* buffers from parent allocator, not pool */
+	struct MBuf nest;	/* type of each open container */
+	struct MBuf carry;	/* unfinished token from previous chunk */
+	struct MBuf strbuf;	/* unescaped string */
+	struct MBuf tapebuf;	/* tape under construction */
 };
 
 struct RenderState {
 	struct MBuf *dst;
 	unsigned int options;
+	unsigned int depth;	/* container nesting, for indent */
+	size_t limit;		/* write_pos where output must stop */
+	struct MBuf sortbuf;	/* key arrays of dicts being rendered */
 };
 
 /*
@@ -151,6 +243,9 @@ typedef bool (*render_func_t)(struct RenderState *rs, struct JsonValue *jv);
 
 static bool render_any(struct RenderState *rs, struct JsonValue *jv);
 
+static const struct JsonEvents tree_events;
+static bool expand_lazy(struct JsonValue *jv);
+
 /*
  * Header manipulation
  */
@@ -220,12 +315,21 @@ static inline struct JsonContext *get_context(struct JsonValue *jv)
 	return c ? c->c_ctx : NULL;
 }
 
-static inline struct CBTree *get_dict_tree(struct JsonValue *jv)
+static inline bool is_lazy(struct JsonValue *jv)
+{
+	struct JsonContainer *c = get_container(jv);
+	return c && c->c_lazy;
+}
+
+/* lazy container is expanded first */
+static inline struct ValueDict *get_dict_vdict(struct JsonValue *jv)
 {
 	struct JsonContainer *c;
 	if (has_type(jv, JSON_DICT)) {
 		c = get_container(jv);
-		return c->u.c_dict;
+		if (c->c_lazy && !expand_lazy(jv))
+			return NULL;
+		return &c->u.c_dict;
 	}
 	return NULL;
 }
@@ -235,6 +339,8 @@ static inline struct ValueList *get_list_vlist(struct JsonValue *jv)
 	struct JsonContainer *c;
 	if (has_type(jv, JSON_LIST)) {
 		c = get_container(jv);
+		if (c->c_lazy && !expand_lazy(jv))
+			return NULL;
 		return &c->u.c_list;
 	}
 	return NULL;
@@ -288,47 +394,128 @@ static void *err_null(struct JsonContext *ctx, const char *errmsg, ...)
 	return NULL;
 }
 
-/* callback for cbtree, returns key bytes */
-static size_t get_key_data_cb(void *dictptr, void *keyptr, const void **dst_p)
-{
-	struct JsonValue *key = keyptr;
-	*dst_p = get_cstring(key);
-	return key->u.v_size;
-}
-
 /* add elemnt to list */
-static void real_list_append(struct JsonValue *list, struct JsonValue *elem)
+static bool real_list_append(struct JsonContext *ctx, struct JsonValue *list, struct JsonValue *elem)
 {
 	struct ValueList *vlist;
+	struct JsonValue **items;
+	uint32_t n, nalloc;
 
 	vlist = get_list_vlist(list);
-	if (vlist->last) {
-		set_next(vlist->last, elem);
-	} else {
-		vlist->first = elem;
+	if (!vlist)
+		return err_false(ctx, "Expect list");
+
+	n = list->u.v_size;
+	if (n == vlist->alloc) {
+		if (n >= UINT32_MAX / 4)
+			return err_false(ctx, "Too many elements");
+		nalloc = n ? n * 2 : 4;
+		items = cx_realloc(ctx->pool, vlist->items, nalloc * sizeof(*items));
+		if (!items)
+			return err_false(ctx, "No memory");
+		vlist->items = items;
+		vlist->alloc = nalloc;
 	}
-	vlist->last = elem;
-	vlist->array = NULL;
-
+	vlist->items[n] = elem;
 	list->u.v_size++;
+	return true;
+}
+
+static inline bool key_equals(struct JsonValue *key, const char *str, size_t len)
+{
+	return key->u.v_size == len && memcmp(get_cstring(key), str, len) == 0;
+}
+
+/* find key value in dict */
+static struct JsonValue *dict_lookup(struct JsonValue *dict, const char *str, size_t len)
+{
+	struct ValueDict *vdict = get_dict_vdict(dict);
+	uint32_t h, pos;
+	size_t i;
+
+	if (!vdict->index) {
+		for (i = 0; i < dict->u.v_size; i++) {
+			if (key_equals(vdict->keys[i], str, len))
+				return vdict->keys[i];
+		}
+		return NULL;
+	}
+
+	h = memhash(str, len) & vdict->index_mask;
+	while ((pos = vdict->index[h]) != 0) {
+		if (key_equals(vdict->keys[pos - 1], str, len))
+			return vdict->keys[pos - 1];
+		h = (h + 1) & vdict->index_mask;
+	}
+	return NULL;
+}
+
+/* put key position into index */
+static void index_insert(struct ValueDict *vdict, uint32_t pos)
+{
+	struct JsonValue *key = vdict->keys[pos];
+	uint32_t h;
+
+	h = memhash(get_cstring(key), key->u.v_size) & vdict->index_mask;
+	while (vdict->index[h] != 0)
+		h = (h + 1) & vdict->index_mask;
+	vdict->index[h] = pos + 1;
+}
+
+/* create index with room for count keys, fill rate is kept under 1/2 */
+static bool build_index(struct JsonContext *ctx, struct ValueDict *vdict, uint32_t count)
+{
+	uint32_t size = 16, i;
+
+	while (size < count * 2)
+		size *= 2;
+	if (vdict->index)
+		cx_free(ctx->pool, vdict->index);
+	vdict->index = cx_alloc0(ctx->pool, size * sizeof(uint32_t));
+	if (!vdict->index)
+		return false;
+	vdict->index_mask = size - 1;
+	for (i = 0; i < count; i++)
+		index_insert(vdict, i);
+	return true;
 }
 
-/* add key to tree */
+/* add key to dict */
 static bool real_dict_add_key(struct JsonContext *ctx, struct JsonValue *dict, struct JsonValue *key)
 {
-	struct CBTree *tree;
+	struct ValueDict *vdict;
+	struct JsonValue **keys;
+	uint32_t n, nalloc;
 
-	tree = get_dict_tree(dict);
-	if (!tree)
+	vdict = get_dict_vdict(dict);
+	if (!vdict)
 		return err_false(ctx, "Expect dict");
 
 	if (json_value_size(key) > JSON_MAX_KEY)
 		return err_false(ctx, "Too large key");
-
+	if (dict->u.v_size >= UINT32_MAX / 4)
+		return err_false(ctx, "Too many keys");
+	if (dict_lookup(dict, get_cstring(key), key->u.v_size))
+		return err_false(ctx, "Duplicate key");
+
+	n = dict->u.v_size;
+	if (n == vdict->alloc) {
+		nalloc = n ? n * 2 : 4;
+		keys = cx_realloc(ctx->pool, vdict->keys, nalloc * sizeof(*keys));
+		if (!keys)
+			return err_false(ctx, "No memory");
+		vdict->keys = keys;
+		vdict->alloc = nalloc;
+	}
+	vdict->keys[n] = key;
 	dict->u.v_size++;
-	if (!cbtree_insert(tree, key))
-		return err_false(ctx, "Key insertion failed");
 
+	if (vdict->index && (n + 1) * 2 <= vdict->index_mask) {
+		index_insert(vdict, n);
+	} else if (n + 1 >= DICT_INDEX_MIN) {
+		if (!build_index(ctx, vdict, n + 1))
+			return err_false(ctx, "No memory");
+	}
 	return true;
 }
 
@@ -355,10 +542,9 @@ static struct JsonValue *mk_value(struct JsonContext *ctx, enum JsonValueType ty
 		col = get_container(val);
 		col->c_ctx = ctx;
 		col->c_parent = NULL;
+		col->c_lazy = false;
 		if (type == JSON_DICT) {
-			col->u.c_dict = cbtree_create(get_key_data_cb, NULL, val, ctx->pool);
-			if (!col->u.c_dict)
-				return err_null(ctx, "No memory");
+			memset(&col->u.c_dict, 0, sizeof(col->u.c_dict));
 		} else {
 			memset(&col->u.c_list, 0, sizeof(col->u.c_list));
 		}
@@ -383,7 +569,8 @@ static struct JsonValue *mk_value(struct JsonContext *ctx, enum JsonValueType ty
 			ctx->cur_key = val;
 		}
 	} else if (has_type(ctx->parent, JSON_LIST)) {
-		real_list_append(ctx->parent, val);
+		if (!real_list_append(ctx, ctx->parent, val))
+			return NULL;
 	} else if (!ctx->top) {
 		ctx->top = val;
 	} else {
@@ -392,66 +579,92 @@ static struct JsonValue *mk_value(struct JsonContext *ctx, enum JsonValueType ty
 	return val;
 }
 
-static void prepare_array(struct JsonValue *list)
-{
-	struct JsonContainer *c;
-	struct JsonValue *val;
-	struct ValueList *vlist;
-	size_t i;
+/*
+ * Parsing code starts
+ */
 
-	vlist = get_list_vlist(list);
-	if (vlist->array)
-		return;
-	c = get_container(list);
-	vlist->array = cx_alloc(c->c_ctx->pool, list->u.v_size * sizeof(struct JsonValue *));
-	if (!vlist->array)
-		return;
-	val = vlist->first;
-	for (i = 0; i < list->u.v_size && val; i++) {
-		vlist->array[i] = val;
-		val = get_next(val);
-	}
+/* input ended inside token, caller must retry with more data */
+static bool need_more(struct JsonContext *ctx)
+{
+	ctx->need_more = true;
+	return false;
 }
 
 /*
- * Parsing code starts
+ * Event dispatch, missing callback means ok.
  */
 
-/* create and change context */
-static bool open_container(struct JsonContext *ctx, enum JsonValueType type, unsigned int extra)
+static bool event_result(struct JsonContext *ctx, bool ok)
 {
-	struct JsonValue *jv;
+	if (!ok)
+		return err_false(ctx, "Stopped by callback");
+	return true;
+}
 
-	jv = mk_value(ctx, type, extra, true);
-	if (!jv)
-		return false;
+static bool emit_open(struct JsonContext *ctx, enum JsonValueType type)
+{
+	const struct JsonEvents *ev = ctx->events;
+	bool (*cb)(void *arg) = (type == JSON_DICT) ? ev->start_dict : ev->start_list;
 
-	ctx->parent = jv;
-	ctx->cur_key = NULL;
-	return true;
+	return !cb || event_result(ctx, cb(ctx->events_arg));
 }
 
-/* close and change context */
-static enum ParseState close_container(struct JsonContext *ctx, enum ParseState state)
+static bool emit_close(struct JsonContext *ctx, enum JsonValueType type)
 {
-	struct JsonContainer *c;
+	const struct JsonEvents *ev = ctx->events;
+	bool (*cb)(void *arg) = (type == JSON_DICT) ? ev->end_dict : ev->end_list;
 
-	if (state != S_PARENT)
-		return (int)err_false(ctx, "close_container bug");
+	return !cb || event_result(ctx, cb(ctx->events_arg));
+}
 
-	c = get_container(ctx->parent);
-	if (!c)
-		return (int)err_false(ctx, "invalid parent");
+static bool emit_string(struct JsonContext *ctx, const char *str, size_t len, bool is_key)
+{
+	const struct JsonEvents *ev = ctx->events;
+	bool (*cb)(void *arg, const char *str, size_t len) = is_key ? ev->key : ev->string_value;
 
-	ctx->parent = c->c_parent;
-	ctx->cur_key = NULL;
+	return !cb || event_result(ctx, cb(ctx->events_arg, str, len));
+}
 
-	if (has_type(ctx->parent, JSON_DICT)) {
+static bool emit_literal(struct JsonContext *ctx, enum JsonValueType type, bool val)
+{
+	const struct JsonEvents *ev = ctx->events;
+
+	if (type == JSON_NULL)
+		return !ev->null_value || event_result(ctx, ev->null_value(ctx->events_arg));
+	return !ev->bool_value || event_result(ctx, ev->bool_value(ctx->events_arg, val));
+}
+
+static bool emit_number(struct JsonContext *ctx, enum JsonValueType type, int64_t v_int, double v_float)
+{
+	const struct JsonEvents *ev = ctx->events;
+
+	if (type == JSON_INT)
+		return !ev->int_value || event_result(ctx, ev->int_value(ctx->events_arg, v_int));
+	return !ev->float_value || event_result(ctx, ev->float_value(ctx->events_arg, v_float));
+}
+
+/* remember container type and report it */
+static bool open_container(struct JsonContext *ctx, enum JsonValueType type)
+{
+	if (!mbuf_write_byte(&ctx->nest, type))
+		return err_false(ctx, "No memory");
+	return emit_open(ctx, type);
+}
+
+/* report end of container, return state for parent */
+static enum ParseState close_container(struct JsonContext *ctx, enum JsonValueType type)
+{
+	struct MBuf *nest = &ctx->nest;
+
+	if (!emit_close(ctx, type))
+		return 0;
+
+	nest->write_pos--;
+	if (nest->write_pos == 0)
+		return S_DONE;
+	if (nest->data[nest->write_pos - 1] == JSON_DICT)
 		return S_DICT_COMMA_OR_CLOSE;
-	} else if (has_type(ctx->parent, JSON_LIST)) {
-		return S_LIST_COMMA_OR_CLOSE;
-	}
-	return S_DONE;
+	return S_LIST_COMMA_OR_CLOSE;
 }
 
 /* parse 4-char token */
@@ -460,25 +673,339 @@ static bool parse_char4(struct JsonContext *ctx, const char **src_p, const char
 {
 	const char *src;
 	uint32_t t_got;
-	struct JsonValue *jv;
 
 	src = *src_p;
-	if (src + 4 > end)
+	if (src + 4 > end) {
+		if (ctx->partial)
+			return need_more(ctx);
 		return err_false(ctx, "Unexpected end of token");
+	}
 
 	memcpy(&t_got, src, 4);
 	if (t_exp != t_got)
 		return err_false(ctx, "Invalid token");
 
-	jv = mk_value(ctx, type, 0, true);
-	if (!jv)
+	if (!emit_literal(ctx, type, val))
 		return false;
-	jv->u.v_bool = val;
 
 	*src_p += 4;
 	return true;
 }
 
+/*
+ * Number conversion fast paths.
+ */
+
+/* powers of 10 that are exact in double */
+static const double pow10_tab[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+#define EXACT_MANTISSA	(UINT64_C(1) << 53)
+
+static const char digit_pairs[] =
+	"0001020304050607080910111213141516171819"
+	"2021222324252627282930313233343536373839"
+	"4041424344454647484950515253545556575859"
+	"6061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+static inline bool is_digit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+/* write decimal digits, return length */
+static int fmt_uint64(char *buf, uint64_t val)
+{
+	char tmp[20], *p = tmp + sizeof(tmp);
+	int len;
+
+	while (val >= 100) {
+		p -= 2;
+		memcpy(p, digit_pairs + (val % 100) * 2, 2);
+		val /= 100;
+	}
+	if (val >= 10) {
+		p -= 2;
+		memcpy(p, digit_pairs + val * 2, 2);
+	} else {
+		*--p = '0' + val;
+	}
+	len = tmp + sizeof(tmp) - p;
+	memcpy(buf, p, len);
+	return len;
+}
+
+static int fmt_int64(char *buf, int64_t val)
+{
+	if (val < 0) {
+		buf[0] = '-';
+		return 1 + fmt_uint64(buf + 1, -(uint64_t)val);
+	}
+	return fmt_uint64(buf, val);
+}
+
+/*
+ * Parse plain decimal number without libc.
+ *
+ * Float uses Clinger's fast path: if mantissa and power of 10
+ * are both exact doubles, one multiplication or division gives
+ * correctly rounded result.  Returns false if number needs
+ * full parser, which also reports errors.
+ */
+static bool fast_number(const char *s, const char *end, enum JsonValueType type,
+			int64_t *int_p, double *float_p)
+{
+	bool neg = false, eneg = false;
+	uint64_t m = 0;
+	int digits = 0, exp10 = 0, e = 0, edigits = 0;
+	double v;
+
+	if (s < end && *s == '-') {
+		neg = true;
+		s++;
+	}
+	if (s == end || !is_digit(*s))
+		return false;
+	for (; s < end && is_digit(*s); s++, digits++)
+		m = m * 10 + (*s - '0');
+
+	if (type == JSON_INT) {
+		if (s != end || digits > 18 || m > JSON_MAXINT)
+			return false;
+		*int_p = neg ? -(int64_t)m : (int64_t)m;
+		return true;
+	}
+
+	if (s < end && *s == '.') {
+		s++;
+		if (s == end || !is_digit(*s))
+			return false;
+		for (; s < end && is_digit(*s); s++, digits++, exp10--)
+			m = m * 10 + (*s - '0');
+	}
+	if (s < end && (*s == 'e' || *s == 'E')) {
+		s++;
+		if (s < end && (*s == '+' || *s == '-'))
+			eneg = (*s++ == '-');
+		if (s == end || !is_digit(*s))
+			return false;
+		for (; s < end && is_digit(*s); s++, edigits++)
+			e = e * 10 + (*s - '0');
+		if (edigits > 4)
+			return false;
+		exp10 += eneg ? -e : e;
+	}
+	if (s != end || digits > 19 || m > EXACT_MANTISSA)
+		return false;
+	if (exp10 < -22 || exp10 > 22)
+		return false;
+
+	v = (double)m;
+	if (exp10 < 0)
+		v /= pow10_tab[-exp10];
+	else
+		v *= pow10_tab[exp10];
+	*float_p = neg ? -v : v;
+	return true;
+}
+
+/*
+ * Shortest float output, Schubfach algorithm by Raffaello Giulietti.
+ *
+ * Rounding interval of val is scaled by 10^-k so it is at least 1
+ * and less than 10 units wide.  Then it contains at most one multiple
+ * of 10 - that is the shorter candidate - otherwise closest integer
+ * inside is taken.  Products are done with 128-bit powers of 10
+ * rounded to odd, which keeps comparisons against interval ends exact.
+ */
+
+#include <usual/json_pow10.h>
+
+/* floor(x / 2^n) without relying on sign-extending shift */
+#define FLOOR_SHR(x, n)	((int)((((int64_t)(x)) + ((int64_t)1 << 40)) >> (n)) - (int)(((int64_t)1 << 40) >> (n)))
+
+/* floor(log10(2^e)) */
+static inline int floor_log10_pow2(int e)
+{
+	return FLOOR_SHR(e * 315653, 20);
+}
+
+/* floor(log10(3/4 * 2^e)) */
+static inline int floor_log10_3q_pow2(int e)
+{
+	return FLOOR_SHR(e * 315653 - 131237, 20);
+}
+
+/* floor(log2(10^e)) */
+static inline int floor_log2_pow10(int e)
+{
+	return FLOOR_SHR(e * 1741647, 19);
+}
+
+/* 64x64->128 multiply, returns high half */
+static inline uint64_t mul_128(uint64_t a, uint64_t b, uint64_t *lo_p)
+{
+#ifdef __SIZEOF_INT128__
+	unsigned __int128 r = (unsigned __int128)a * b;
+
+	*lo_p = (uint64_t)r;
+	return (uint64_t)(r >> 64);
+#else
+	uint64_t a0 = (uint32_t)a, a1 = a >> 32;
+	uint64_t b0 = (uint32_t)b, b1 = b >> 32;
+	uint64_t p00 = a0 * b0, p01 = a0 * b1, p10 = a1 * b0, p11 = a1 * b1;
+	uint64_t mid = (p00 >> 32) + (uint32_t)p01 + (uint32_t)p10;
+
+	*lo_p = (mid << 32) | (uint32_t)p00;
+	return p11 + (p01 >> 32) + (p10 >> 32) + (mid >> 32);
+#endif
+}
+
+/* high 64 bits of g * cp, with lost bits folded into lowest bit */
+static inline uint64_t round_to_odd(const uint64_t *g, uint64_t cp)
+{
+	uint64_t x_hi, x_lo, y_hi, y_lo;
+
+	x_hi = mul_128(g[1], cp, &x_lo);
+	y_hi = mul_128(g[0], cp, &y_lo);
+	y_lo += x_hi;
+	y_hi += y_lo < x_hi;
+	return y_hi | (y_lo > 1);
+}
+
+/* shortest s * 10^k that reads back as val, val must be finite and positive */
+static uint64_t float_to_decimal(double val, int *exp10_p)
+{
+	uint64_t bits, c, vbl, vb, vbr, lower, upper, s, sp;
+	const uint64_t *g;
+	int e, q, k, h;
+	bool even, closer, u_in, w_in;
+
+	memcpy(&bits, &val, sizeof(bits));
+	c = bits & ((UINT64_C(1) << 52) - 1);
+	e = (bits >> 52) & 0x7ff;
+
+	/* on power of 2 lower neighbour is closer than upper one */
+	closer = c == 0 && e > 1;
+	if (e > 0) {
+		c |= UINT64_C(1) << 52;
+		q = e - 1075;
+	} else {
+		q = -1074;
+	}
+	even = (c & 1) == 0;
+
+	k = closer ? floor_log10_3q_pow2(q) : floor_log10_pow2(q);
+	h = q + floor_log2_pow10(-k) + 1;
+	g = pow10_g_tab[-k - POW10_G_MIN];
+
+	/* interval ends and val itself, in quarter units */
+	vbl = round_to_odd(g, (4 * c - 2 + closer) << h);
+	vb = round_to_odd(g, (4 * c) << h);
+	vbr = round_to_odd(g, (4 * c + 2) << h);
+	lower = vbl + !even;
+	upper = vbr - !even;
+
+	s = vb / 4;
+	if (s >= 10) {
+		sp = s / 10;
+		u_in = lower <= 40 * sp;
+		w_in = 40 * sp + 40 <= upper;
+		if (u_in != w_in) {
+			*exp10_p = k + 1;
+			return sp + w_in;
+		}
+	}
+	*exp10_p = k;
+	u_in = lower <= 4 * s;
+	w_in = 4 * s + 4 <= upper;
+	if (u_in != w_in)
+		return s + w_in;
+
+	/* both inside, take closer one, ties to even */
+	if (vb > 4 * s + 2 || (vb == 4 * s + 2 && (s & 1)))
+		s++;
+	return s;
+}
+
+/*
+ * Shortest round-trip digits of finite nonzero val, sign ignored.
+ * Returns digit count, *exp10_p is exponent of first digit.
+ */
+static int float_digits(char *digits, double val, int *exp10_p)
+{
+	uint64_t s;
+	int k, n;
+
+	s = float_to_decimal(fabs(val), &k);
+	while (s % 10 == 0) {
+		s /= 10;
+		k++;
+	}
+	n = fmt_uint64(digits, s);
+	*exp10_p = k + n - 1;
+	return n;
+}
+
+/*
+ * Shortest output in same layout as printf %g would use
+ * with enough precision: exponent below -4 or above 16
+ * gives 'e' format.
+ */
+static int fmt_float(char *buf, double val)
+{
+	char digits[20];
+	int ndig, x, len = 0;
+
+	if (signbit(val))
+		buf[len++] = '-';
+	if (val == 0) {
+		buf[len++] = '0';
+		return len;
+	}
+	if (!isfinite(val))
+		return -1;
+
+	ndig = float_digits(digits, val, &x);
+	if (x < -4 || x > 16) {
+		buf[len++] = digits[0];
+		if (ndig > 1) {
+			buf[len++] = '.';
+			memcpy(buf + len, digits + 1, ndig - 1);
+			len += ndig - 1;
+		}
+		buf[len++] = 'e';
+		buf[len++] = x < 0 ? '-' : '+';
+		if (x < 0)
+			x = -x;
+		if (x < 10)
+			buf[len++] = '0';
+		len += fmt_uint64(buf + len, x);
+	} else if (x < 0) {
+		buf[len++] = '0';
+		buf[len++] = '.';
+		memset(buf + len, '0', -x - 1);
+		len += -x - 1;
+		memcpy(buf + len, digits, ndig);
+		len += ndig;
+	} else if (x + 1 >= ndig) {
+		memcpy(buf + len, digits, ndig);
+		len += ndig;
+		memset(buf + len, '0', x + 1 - ndig);
+		len += x + 1 - ndig;
+	} else {
+		memcpy(buf + len, digits, x + 1);
+		len += x + 1;
+		buf[len++] = '.';
+		memcpy(buf + len, digits + x + 1, ndig - x - 1);
+		len += ndig - x - 1;
+	}
+	return len;
+}
+
 /* parse int or float */
 static bool parse_number(struct JsonContext *ctx, const char **src_p, const char *end)
 {
@@ -487,7 +1014,6 @@ static bool parse_number(struct JsonContext *ctx, const char **src_p, const char
 	char *tokend = NULL;
 	char buf[NUMBER_BUF];
 	size_t len;
-	struct JsonValue *jv;
 	double v_float = 0;
 	int64_t v_int = 0;
 
@@ -502,9 +1028,13 @@ static bool parse_number(struct JsonContext *ctx, const char **src_p, const char
 			break;
 		}
 	}
+	if (src == end && ctx->partial)
+		return need_more(ctx);
 	len = src - start;
 	if (len >= NUMBER_BUF)
 		goto failed;
+	if (fast_number(start, src, type, &v_int, &v_float))
+		goto done;
 	memcpy(buf, start, len);
 	buf[len] = 0;
 
@@ -524,16 +1054,9 @@ static bool parse_number(struct JsonContext *ctx, const char **src_p, const char
 		if (*tokend != 0 || errno || v_int < JSON_MININT || v_int > JSON_MAXINT)
 			goto failed;
 	}
-
-	/* create value struct */
-	jv = mk_value(ctx, type, 0, true);
-	if (!jv)
+done:
+	if (!emit_number(ctx, type, v_int, v_float))
 		return false;
-	if (type == JSON_FLOAT) {
-		jv->u.v_float = v_float;
-	} else {
-		jv->u.v_int = v_int;
-	}
 
 	*src_p = src;
 	return true;
@@ -609,6 +1132,80 @@ static bool parse_uescape(struct JsonContext *ctx, char **dst_p, char *dstend,
 			 (c) == '\n' || ((c) & 0x80) != 0) ? 1 : 0)
 static const uint8_t string_examine_chars[] = INTMAP256_CONST(meta_string);
 
+/* SWAR helpers: nonzero if some byte in word is zero / equal to c */
+#define ONES64		UINT64_C(0x0101010101010101)
+#define HIGHS64		UINT64_C(0x8080808080808080)
+#define word_haszero(v)		(((v) - ONES64) & ~(v) & HIGHS64)
+#define word_hasbyte(v, c)	word_haszero((v) ^ (ONES64 * (c)))
+
+/*
+ * Skip bytes that are not in string_examine_chars,
+ * return pointer to first meta byte or end.
+ */
+static inline const char *skip_plain(const char *src, const char *end)
+{
+#if defined(JSON_SCAN_AVX2)
+	const __m256i q = _mm256_set1_epi8('"'), bs = _mm256_set1_epi8('\\');
+	const __m256i nl = _mm256_set1_epi8('\n'), zero = _mm256_setzero_si256();
+	__m256i v, m;
+	unsigned int bits;
+
+	while (end - src >= 32) {
+		v = _mm256_loadu_si256((const __m256i *)src);
+		m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, q), _mm256_cmpeq_epi8(v, bs)),
+				    _mm256_or_si256(_mm256_cmpeq_epi8(v, nl), _mm256_cmpeq_epi8(v, zero)));
+		/* movemask also picks up high bit of plain bytes */
+		bits = _mm256_movemask_epi8(_mm256_or_si256(m, v));
+		if (bits)
+			return src + ffs(bits) - 1;
+		src += 32;
+	}
+#elif defined(JSON_SCAN_SSE2)
+	const __m128i q = _mm_set1_epi8('"'), bs = _mm_set1_epi8('\\');
+	const __m128i nl = _mm_set1_epi8('\n'), zero = _mm_setzero_si128();
+	__m128i v, m;
+	unsigned int bits;
+
+	while (end - src >= 16) {
+		v = _mm_loadu_si128((const __m128i *)src);
+		m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, q), _mm_cmpeq_epi8(v, bs)),
+				 _mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, zero)));
+		bits = _mm_movemask_epi8(_mm_or_si128(m, v));
+		if (bits)
+			return src + ffs(bits) - 1;
+		src += 16;
+	}
+#elif defined(JSON_SCAN_NEON)
+	const uint8x16_t q = vdupq_n_u8('"'), bs = vdupq_n_u8('\\');
+	const uint8x16_t nl = vdupq_n_u8('\n'), high = vdupq_n_u8(0x80);
+	uint8x16_t v, m;
+
+	while (end - src >= 16) {
+		v = vld1q_u8((const uint8_t *)src);
+		m = vorrq_u8(vorrq_u8(vceqq_u8(v, q), vceqq_u8(v, bs)),
+			     vorrq_u8(vceqq_u8(v, nl), vceqzq_u8(v)));
+		m = vorrq_u8(m, vcgeq_u8(v, high));
+		if (vmaxvq_u8(m))
+			break;
+		src += 16;
+	}
+#else
+	uint64_t v;
+
+	while (end - src >= 8) {
+		memcpy(&v, src, 8);
+		if ((v & HIGHS64) || word_haszero(v) || word_hasbyte(v, '"')
+		    || word_hasbyte(v, '\\') || word_hasbyte(v, '\n'))
+			break;
+		src += 8;
+	}
+#endif
+	/* tail, or exact position inside last block */
+	while (src < end && !string_examine_chars[(uint8_t)*src])
+		src++;
+	return src;
+}
+
 /* look for string end, validate contents */
 static bool scan_string(struct JsonContext *ctx, const char *src, const char *end,
 			const char **str_end_p, bool *hasesc_p, int64_t *nlines_p)
@@ -621,9 +1218,10 @@ static bool scan_string(struct JsonContext *ctx, const char *src, const char *en
 	if (ctx->options & JSON_PARSE_IGNORE_ENCODING)
 		check_utf8 = false;
 
-	while (src < end) {
-		if (!string_examine_chars[(uint8_t)*src]) {
-			src++;
+	while (1) {
+		src = skip_plain(src, end);
+		if (src >= end) {
+			break;
 		} else if (*src == '"') {
 			/* string end */
 			*hasesc_p = hasesc;
@@ -639,6 +1237,9 @@ static bool scan_string(struct JsonContext *ctx, const char *src, const char *en
 			n = utf8_validate_seq(src, end);
 			if (n) {
 				src += n;
+			} else if (ctx->partial && end - src < 4) {
+				/* sequence may be cut */
+				break;
 			} else if (check_utf8) {
 				goto badutf;
 			} else {
@@ -651,6 +1252,8 @@ static bool scan_string(struct JsonContext *ctx, const char *src, const char *en
 			goto badutf;
 		}
 	}
+	if (ctx->partial)
+		return need_more(ctx);
 	return err_false(ctx, "Unexpected end of string");
 
 badutf:
@@ -693,40 +1296,56 @@ static char *process_escapes(struct JsonContext *ctx,
 	return dst;
 }
 
+static bool tape_string(struct JsonContext *ctx, const char *str, size_t len, bool escaped, bool is_key);
+
 /* 2-phase string processing */
-static bool parse_string(struct JsonContext *ctx, const char **src_p, const char *end)
+static bool parse_string(struct JsonContext *ctx, const char **src_p, const char *end, bool is_key)
 {
-	const char *start, *strend = NULL;
+	const char *start, *str, *strend = NULL;
 	bool hasesc = false;
-	char *dst, *dstend;
+	char *dst;
 	size_t len;
-	struct JsonValue *jv;
 	int64_t lines = 0;
 
 	/* find string boundaries, validate */
 	start = *src_p;
 	if (!scan_string(ctx, start, end, &strend, &hasesc, &lines))
 		return false;
-
-	/* create value struct */
 	len = strend - start;
-	jv = mk_value(ctx, JSON_STRING, len + 1, true);
-	if (!jv)
-		return false;
-	dst = get_cstring(jv);
-	dstend = dst + len;
 
-	/* copy & process escapes */
+	/* tape keeps raw string, escapes are only validated */
+	if (ctx->tape_src) {
+		if (hasesc) {
+			mbuf_rewind_writer(&ctx->strbuf);
+			if (!mbuf_make_room(&ctx->strbuf, len + 1))
+				return err_false(ctx, "No memory");
+			str = (char *)ctx->strbuf.data;
+			if (!process_escapes(ctx, start, strend, (char *)str, (char *)str + len))
+				return false;
+		}
+		if (!tape_string(ctx, start, len, hasesc, is_key))
+			return false;
+		ctx->linenr += lines;
+		*src_p = strend + 1;
+		return true;
+	}
+
+	/* unescape into temp buffer, plain string is given as-is */
 	if (hasesc) {
-		dst = process_escapes(ctx, start, strend, dst, dstend);
+		mbuf_rewind_writer(&ctx->strbuf);
+		if (!mbuf_make_room(&ctx->strbuf, len + 1))
+			return err_false(ctx, "No memory");
+		str = (char *)ctx->strbuf.data;
+		dst = process_escapes(ctx, start, strend, (char *)str, (char *)str + len);
 		if (!dst)
 			return false;
+		len = dst - str;
 	} else {
-		dst = plain_copy(dst, start, strend);
+		str = start;
 	}
 
-	*dst = '\0';
-	jv->u.v_size = dst - get_cstring(jv);
+	if (!emit_string(ctx, str, len, is_key))
+		return false;
 	ctx->linenr += lines;
 	*src_p = strend + 1;
 	return true;
@@ -744,13 +1363,15 @@ static bool skip_comment(struct JsonContext *ctx, const char **src_p, const char
 
 	s = *src_p;
 	if (s >= end)
-		return false;
+		return ctx->partial ? need_more(ctx) : false;
 	c = *s++;
 	if (c == '/') {
 		s = memchr(s, '\n', end - s);
 		if (s) {
 			ctx->linenr++;
 			*src_p = s + 1;
+		} else if (ctx->partial) {
+			return need_more(ctx);
 		} else {
 			*src_p = end;
 		}
@@ -765,6 +1386,8 @@ static bool skip_comment(struct JsonContext *ctx, const char **src_p, const char
 				lnr++;
 			}
 		}
+		if (ctx->partial)
+			return need_more(ctx);
 	}
 	return false;
 }
@@ -780,6 +1403,8 @@ static bool skip_extra_comma(struct JsonContext *ctx, const char **src_p, const
 		src++;
 	}
 
+	if (src == end && ctx->partial)
+		return need_more(ctx);
 	if (src < end) {
 		if (*src == '}') {
 			if (state == S_DICT_COMMA_OR_CLOSE || state == S_DICT_KEY_OR_CLOSE)
@@ -842,14 +1467,25 @@ static const unsigned char STATE_STEPS[MAX_STATES][MAX_TOKENS] = {
 	state = newstate; \
 } while (0)
 
-/* actual parser */
-static bool parse_tokens(struct JsonContext *ctx, const char *src, const char *end)
+/*
+ * Actual parser.
+ *
+ * Tokens are started only before limit, but may continue until end.
+ * If token is cut at end, *src_p is left at its start.
+ */
+static bool parse_tokens(struct JsonContext *ctx, const char **src_p, const char *limit, const char *end)
 {
 	char c;
-	enum ParseState state = S_INITIAL_VALUE;
+	const char *src = *src_p, *tok = src;
+	enum ParseState state = ctx->state, prev = state;
+	int64_t linenr = ctx->linenr;
 	bool relaxed = ctx->options & JSON_PARSE_RELAXED;
+	bool is_key;
 
-	while (src < end) {
+	while (src < limit) {
+		tok = src;
+		prev = state;
+		linenr = ctx->linenr;
 		c = *src++;
 		switch (c) {
 		case '\n':
@@ -859,8 +1495,9 @@ static bool parse_tokens(struct JsonContext *ctx, const char *src, const char *e
 			while (src < end && *src == ' ') src++;
 			break;
 		case '"':
+			is_key = (state == S_DICT_KEY || state == S_DICT_KEY_OR_CLOSE);
 			MAPSTATE(state, T_STRING);
-			if (!parse_string(ctx, &src, end))
+			if (!parse_string(ctx, &src, end, is_key))
 				goto failed;
 			break;
 		case 'n':
@@ -890,192 +1527,1268 @@ static bool parse_tokens(struct JsonContext *ctx, const char *src, const char *e
 			break;
 		case '[':
 			MAPSTATE(state, T_OPEN_LIST);
-			if (!open_container(ctx, JSON_LIST, LIST_EXTRA))
+			if (!open_container(ctx, JSON_LIST))
 				goto failed;
 			break;
 		case '{':
 			MAPSTATE(state, T_OPEN_DICT);
-			if (!open_container(ctx, JSON_DICT, DICT_EXTRA))
+			if (!open_container(ctx, JSON_DICT))
 				goto failed;
 			break;
 		case ']':
 			MAPSTATE(state, T_CLOSE_LIST);
-			state = close_container(ctx, state);
+			state = close_container(ctx, JSON_LIST);
 			if (!state)
 				goto failed;
 			break;
 		case '}':
 			MAPSTATE(state, T_CLOSE_DICT);
-			state = close_container(ctx, state);
+			state = close_container(ctx, JSON_DICT);
 			if (!state)
 				goto failed;
 			break;
 		case ':':
 			MAPSTATE(state, T_COLON);
-			if (!real_dict_add_key(ctx, ctx->parent, ctx->cur_key))
-				goto failed;
 			break;
 		case ',':
 			if (relaxed && skip_extra_comma(ctx, &src, end, state))
 				continue;
+			if (ctx->need_more)
+				goto failed;
 			MAPSTATE(state, T_COMMA);
 			break;
 		case '/':
 			if (relaxed && skip_comment(ctx, &src, end))
 				continue;
+			if (ctx->need_more)
+				goto failed;
 			/* fallthrough */
 		default:
 			return err_false(ctx, "Invalid symbol: '%c'", c);
 		}
 	}
-	if (state != S_DONE)
-		return err_false(ctx, "Container still open");
+	ctx->state = state;
+	*src_p = src;
 	return true;
 failed:
+	if (ctx->need_more) {
+		/* forget partial token */
+		ctx->state = prev;
+		ctx->linenr = linenr;
+		*src_p = tok;
+	}
 	return false;
 }
 
-/* parser public api */
-struct JsonValue *json_parse(struct JsonContext *ctx, const char *json, size_t len)
-{
-	const char *end = json + len;
+/*
+ * Find where unfinished token in carry ends in new data.
+ *
+ * Only new bytes are looked at, state between chunks is kept
+ * in ctx->carry_esc.  Sets *n_p to number of bytes that complete
+ * the token and returns true, or false if it continues past len.
+ */
+static bool carry_token_end(struct JsonContext *ctx, const char *src, size_t len, size_t *n_p)
+{
+	const char *tok = (const char *)ctx->carry.data;
+	size_t have = ctx->carry.write_pos;
+	bool esc = ctx->carry_esc;
+	size_t i = 0, need;
+
+	switch (tok[0]) {
+	case '"':
+		for (; i < len; i++) {
+			if (esc)
+				esc = false;
+			else if (src[i] == '\\')
+				esc = true;
+			else if (src[i] == '"')
+				goto found_incl;
+		}
+		break;
+	case 'n': case 't': case 'f':
+		need = (tok[0] == 'f') ? 5 : 4;
+		if (have + len >= need) {
+			*n_p = need - have;
+			return true;
+		}
+		break;
+	case ',':
+		/* relaxed mode looks at next symbol */
+		for (; i < len; i++) {
+			if (!isspace((unsigned char)src[i]))
+				goto found_incl;
+		}
+		break;
+	case '/':
+		if (have == 1) {
+			if (len == 0)
+				break;
+			if (src[i] != '/' && src[i] != '*')
+				goto found_incl;
+			i++;
+		}
+		if ((have > 1 ? tok[1] : src[0]) == '/') {
+			for (; i < len; i++) {
+				if (src[i] == '\n')
+					goto found_incl;
+			}
+		} else {
+			/* esc means previous byte was '*' */
+			for (; i < len; i++) {
+				if (esc && src[i] == '/')
+					goto found_incl;
+				esc = (src[i] == '*');
+			}
+		}
+		break;
+	default:
+		/* number */
+		for (; i < len; i++) {
+			if ((src[i] < '0' || src[i] > '9') && src[i] != '+' && src[i] != '-'
+			    && src[i] != '.' && src[i] != 'e' && src[i] != 'E')
+				goto found;
+		}
+		break;
+	}
+	ctx->carry_esc = esc;
+	return false;
+found_incl:
+	i++;
+found:
+	*n_p = i;
+	return true;
+}
+
+/*
+ * Add data to unfinished token in carry.  Only bytes up to end of
+ * token are copied, complete token is then parsed and *src_p moved
+ * past the bytes it used.
+ */
+static bool feed_carry(struct JsonContext *ctx, const char **src_p, const char *end, bool last)
+{
+	struct MBuf *carry = &ctx->carry;
+	const char *src = *src_p;
+	const char *p;
+	size_t n, old = carry->write_pos;
+	bool ok;
+
+	if (!last && !carry_token_end(ctx, src, end - src, &n)) {
+		if (!mbuf_write(carry, src, end - src))
+			return err_false(ctx, "No memory");
+		*src_p = end;
+		return true;
+	}
+	if (last)
+		n = end - src;
+	if (!mbuf_write(carry, src, n))
+		return err_false(ctx, "No memory");
+
+	/* token is complete, nothing follows it in carry */
+	p = (const char *)carry->data;
+	ctx->partial = false;
+	ok = parse_tokens(ctx, &p, p + old, p + carry->write_pos);
+	ctx->partial = !last;
+	if (!ok)
+		return false;
+	*src_p = src + (p - (const char *)carry->data) - old;
+	mbuf_rewind_writer(carry);
+	ctx->carry_esc = false;
+	return true;
+}
+
+/* parse chunk, keep unfinished token in ctx->carry */
+static bool parse_chunk(struct JsonContext *ctx, const char *src, size_t len, bool last)
+{
+	const char *end = src + len;
+
+	if (ctx->lasterr)
+		return false;
+	ctx->partial = !last;
+
+	for (;;) {
+		/* finish token from previous chunk */
+		if (ctx->carry.write_pos > 0) {
+			if (!feed_carry(ctx, &src, end, last))
+				return false;
+			if (ctx->carry.write_pos > 0)
+				return true;
+		}
+
+		if (parse_tokens(ctx, &src, end, end))
+			return true;
+		if (!ctx->need_more)
+			return false;
+		ctx->need_more = false;
+
+		/* start carry with first byte, rest is scanned as new data */
+		if (!mbuf_write_byte(&ctx->carry, *src))
+			return err_false(ctx, "No memory");
+		src++;
+	}
+}
 
-	/* reset parser */
+void json_parse_start(struct JsonContext *ctx, const struct JsonEvents *events, void *arg)
+{
 	ctx->linenr = 1;
 	ctx->parent = NULL;
 	ctx->cur_key = NULL;
 	ctx->lasterr = NULL;
 	ctx->top = NULL;
 
-	if (!parse_tokens(ctx, json, end))
-		return NULL;
+	ctx->events = events ? events : &tree_events;
+	ctx->events_arg = events ? arg : ctx;
+	ctx->state = S_INITIAL_VALUE;
+	ctx->need_more = false;
+	ctx->carry_esc = false;
+	mbuf_rewind_writer(&ctx->nest);
+	mbuf_rewind_writer(&ctx->carry);
+}
 
+bool json_parse_feed(struct JsonContext *ctx, const char *src, size_t len)
+{
+	return parse_chunk(ctx, src, len, false);
+}
+
+bool json_parse_finish(struct JsonContext *ctx, struct JsonValue **top_p)
+{
+	if (!parse_chunk(ctx, NULL, 0, true))
+		return false;
+	if (ctx->state != S_DONE)
+		return err_false(ctx, "Container still open");
+	if (top_p)
+		*top_p = ctx->top;
+	return true;
+}
+
+/* parser public api */
+struct JsonValue *json_parse(struct JsonContext *ctx, const char *json, size_t len)
+{
+	json_parse_start(ctx, NULL, NULL);
+	if (!parse_chunk(ctx, json, len, true))
+		return NULL;
+	if (ctx->state != S_DONE)
+		return err_null(ctx, "Container still open");
 	return ctx->top;
 }
 
 /*
- * Render value as JSON string.
+ * Tree builder, gets ctx as arg.
  */
 
-static bool render_null(struct RenderState *rs, struct JsonValue *jv)
+static bool build_open(struct JsonContext *ctx, enum JsonValueType type, unsigned int extra)
 {
-	return mbuf_write(rs->dst, "null", 4);
+	struct JsonValue *jv;
+
+	jv = mk_value(ctx, type, extra, true);
+	if (!jv)
+		return false;
+
+	ctx->parent = jv;
+	ctx->cur_key = NULL;
+	return true;
 }
 
-static bool render_bool(struct RenderState *rs, struct JsonValue *jv)
+static bool build_close(void *arg)
 {
-	if (jv->u.v_bool)
-		return mbuf_write(rs->dst, "true", 4);
-	return mbuf_write(rs->dst, "false", 5);
+	struct JsonContext *ctx = arg;
+	struct JsonContainer *c;
+
+	c = get_container(ctx->parent);
+	if (!c)
+		return err_false(ctx, "invalid parent");
+
+	ctx->parent = c->c_parent;
+	ctx->cur_key = NULL;
+	return true;
 }
 
-static bool render_int(struct RenderState *rs, struct JsonValue *jv)
+static bool build_start_dict(void *arg)
 {
-	char buf[NUMBER_BUF];
-	int len;
+	return build_open(arg, JSON_DICT, DICT_EXTRA);
+}
 
-	len = snprintf(buf, sizeof(buf), "%" PRIi64, jv->u.v_int);
-	if (len < 0 || len >= NUMBER_BUF)
+static bool build_start_list(void *arg)
+{
+	return build_open(arg, JSON_LIST, LIST_EXTRA);
+}
+
+static struct JsonValue *build_string(struct JsonContext *ctx, const char *str, size_t len)
+{
+	struct JsonValue *jv;
+	char *dst;
+
+	jv = mk_value(ctx, JSON_STRING, len + 1, true);
+	if (!jv)
+		return NULL;
+	dst = get_cstring(jv);
+	memcpy(dst, str, len);
+	dst[len] = '\0';
+	jv->u.v_size = len;
+	return jv;
+}
+
+static bool build_key(void *arg, const char *str, size_t len)
+{
+	struct JsonContext *ctx = arg;
+	struct JsonValue *key;
+
+	key = build_string(ctx, str, len);
+	if (!key)
 		return false;
-	return mbuf_write(rs->dst, buf, len);
+	return real_dict_add_key(ctx, ctx->parent, key);
 }
 
-static bool render_float(struct RenderState *rs, struct JsonValue *jv)
+static bool build_string_value(void *arg, const char *str, size_t len)
 {
-	char buf[NUMBER_BUF + 2];
-	int len;
+	return build_string(arg, str, len) != NULL;
+}
 
-	len = dtostr_dot(buf, NUMBER_BUF, jv->u.v_float);
-	if (len < 0 || len >= NUMBER_BUF)
+static bool build_null(void *arg)
+{
+	return mk_value(arg, JSON_NULL, 0, true) != NULL;
+}
+
+static bool build_bool(void *arg, bool val)
+{
+	struct JsonValue *jv = mk_value(arg, JSON_BOOL, 0, true);
+	if (!jv)
 		return false;
-	if (!memchr(buf, '.', len) && !memchr(buf, 'e', len)) {
-	    buf[len++] = '.';
-	    buf[len++] = '0';
-	}
-	return mbuf_write(rs->dst, buf, len);
+	jv->u.v_bool = val;
+	return true;
 }
 
-static bool escape_char(struct MBuf *dst, unsigned int c)
+static bool build_int(void *arg, int64_t val)
 {
-	char ec;
-	char buf[10];
+	struct JsonValue *jv = mk_value(arg, JSON_INT, 0, true);
+	if (!jv)
+		return false;
+	jv->u.v_int = val;
+	return true;
+}
 
-	/* start escape */
-	if (!mbuf_write_byte(dst, '\\'))
+static bool build_float(void *arg, double val)
+{
+	struct JsonValue *jv = mk_value(arg, JSON_FLOAT, 0, true);
+	if (!jv)
 		return false;
+	jv->u.v_float = val;
+	return true;
+}
 
-	/* escape same char */
-	if (c == '"' || c == '\\')
-		return mbuf_write_byte(dst, c);
+static const struct JsonEvents tree_events = {
+	.start_dict = build_start_dict,
+	.end_dict = build_close,
+	.start_list = build_start_list,
+	.end_list = build_close,
+	.key = build_key,
+	.null_value = build_null,
+	.bool_value = build_bool,
+	.int_value = build_int,
+	.float_value = build_float,
+	.string_value = build_string_value,
+};
 
-	/* low-ascii mess */
-	switch (c) {
-	case '\b': ec = 'b'; break;
-	case '\f': ec = 'f'; break;
-	case '\n': ec = 'n'; break;
-	case '\r': ec = 'r'; break;
-	case '\t': ec = 't'; break;
+/*
+ * Lazy parsing.
+ *
+ * Parser only validates and fills tape, values are created
+ * when they are accessed.  Containers are created lazy and
+ * expanded into normal dict/list when full access is needed.
+ */
+
+#define TAPE_NONE	UINT32_MAX
+
+static inline struct TapeItem *tape_item(struct JsonContext *ctx, uint32_t idx)
+{
+	return (struct TapeItem *)ctx->tapebuf.data + idx;
+}
+
+/* append item, count it in parent */
+static struct TapeItem *tape_add(struct JsonContext *ctx, enum JsonValueType type, bool is_key)
+{
+	struct MBuf *buf = &ctx->tapebuf;
+	struct TapeItem *item;
+	uint32_t idx;
+
+	if (buf->write_pos / sizeof(*item) >= TAPE_NONE - 1)
+		return err_null(ctx, "Too many elements");
+	if (!mbuf_make_room(buf, sizeof(*item)))
+		return err_null(ctx, "No memory");
+	idx = buf->write_pos / sizeof(*item);
+	buf->write_pos += sizeof(*item);
+
+	item = tape_item(ctx, idx);
+	memset(item, 0, sizeof(*item));
+	item->type = type;
+	item->is_key = is_key;
+	item->end = idx + 1;
+	if (!is_key && ctx->tape_open != TAPE_NONE)
+		tape_item(ctx, ctx->tape_open)->u.count++;
+	return item;
+}
+
+static bool tape_string(struct JsonContext *ctx, const char *str, size_t len, bool escaped, bool is_key)
+{
+	struct TapeItem *item;
+
+	item = tape_add(ctx, JSON_STRING, is_key);
+	if (!item)
+		return false;
+	item->escaped = escaped;
+	item->u.str.ofs = str - ctx->tape_src;
+	item->u.str.len = len;
+	return true;
+}
+
+/* open containers are linked via ->end until closed */
+static bool tape_open(struct JsonContext *ctx, enum JsonValueType type)
+{
+	struct TapeItem *item;
+
+	item = tape_add(ctx, type, false);
+	if (!item)
+		return false;
+	item->end = ctx->tape_open;
+	ctx->tape_open = item - tape_item(ctx, 0);
+	return true;
+}
+
+static bool tape_close(void *arg)
+{
+	struct JsonContext *ctx = arg;
+	struct TapeItem *item = tape_item(ctx, ctx->tape_open);
+
+	ctx->tape_open = item->end;
+	item->end = ctx->tapebuf.write_pos / sizeof(*item);
+	return true;
+}
+
+static bool tape_start_dict(void *arg)
+{
+	return tape_open(arg, JSON_DICT);
+}
+
+static bool tape_start_list(void *arg)
+{
+	return tape_open(arg, JSON_LIST);
+}
+
+static bool tape_null(void *arg)
+{
+	return tape_add(arg, JSON_NULL, false) != NULL;
+}
+
+static bool tape_bool(void *arg, bool val)
+{
+	struct TapeItem *item = tape_add(arg, JSON_BOOL, false);
+	if (!item)
+		return false;
+	item->u.v_bool = val;
+	return true;
+}
+
+static bool tape_int(void *arg, int64_t val)
+{
+	struct TapeItem *item = tape_add(arg, JSON_INT, false);
+	if (!item)
+		return false;
+	item->u.v_int = val;
+	return true;
+}
+
+static bool tape_float(void *arg, double val)
+{
+	struct TapeItem *item = tape_add(arg, JSON_FLOAT, false);
+	if (!item)
+		return false;
+	item->u.v_float = val;
+	return true;
+}
+
+/* strings are added by parse_string() */
+static const struct JsonEvents tape_events = {
+	.start_dict = tape_start_dict,
+	.end_dict = tape_close,
+	.start_list = tape_start_list,
+	.end_list = tape_close,
+	.null_value = tape_null,
+	.bool_value = tape_bool,
+	.int_value = tape_int,
+	.float_value = tape_float,
+};
+
+/* get unescaped string from tape, into ctx->strbuf if needed */
+static const char *tape_get_string(struct JsonContext *ctx, struct JsonTape *tape,
+				   struct TapeItem *item, size_t *len_p)
+{
+	const char *src = tape->src + item->u.str.ofs;
+	char *dst, *end;
+
+	*len_p = item->u.str.len;
+	if (!item->escaped)
+		return src;
+
+	mbuf_rewind_writer(&ctx->strbuf);
+	if (!mbuf_make_room(&ctx->strbuf, item->u.str.len + 1))
+		return err_null(ctx, "No memory");
+	dst = (char *)ctx->strbuf.data;
+	end = process_escapes(ctx, src, src + item->u.str.len, dst, dst + item->u.str.len);
+	if (!end)
+		return NULL;
+	*len_p = end - dst;
+	return dst;
+}
+
+/* create value for tape item, once */
+static struct JsonValue *tape_node(struct JsonContext *ctx, struct JsonTape *tape,
+				   uint32_t idx, struct JsonValue *parent)
+{
+	struct TapeItem *item = &tape->items[idx];
+	struct JsonContainer *c;
+	struct JsonValue *jv;
+	const char *str;
+	size_t len;
+
+	if (item->node)
+		return item->node;
+
+	switch (item->type) {
+	case JSON_STRING:
+		str = tape_get_string(ctx, tape, item, &len);
+		if (!str)
+			return NULL;
+		jv = mk_value(ctx, JSON_STRING, len + 1, false);
+		if (!jv)
+			return NULL;
+		memcpy(get_cstring(jv), str, len);
+		get_cstring(jv)[len] = '\0';
+		jv->u.v_size = len;
+		break;
+	case JSON_DICT:
+	case JSON_LIST:
+		jv = mk_value(ctx, item->type, (item->type == JSON_DICT) ? DICT_EXTRA : LIST_EXTRA, false);
+		if (!jv)
+			return NULL;
+		c = get_container(jv);
+		c->c_parent = parent;
+		c->c_lazy = true;
+		c->u.c_tape.tape = tape;
+		c->u.c_tape.item = idx;
+		c->u.c_tape.pos = NULL;
+		jv->u.v_size = item->u.count;
+		break;
 	default:
-		snprintf(buf, sizeof(buf), "u%04x", c);
-		return mbuf_write(dst, buf, 5);
+		jv = mk_value(ctx, item->type, 0, false);
+		if (!jv)
+			return NULL;
+		if (item->type == JSON_INT)
+			jv->u.v_int = item->u.v_int;
+		else if (item->type == JSON_FLOAT)
+			jv->u.v_float = item->u.v_float;
+		else
+			jv->u.v_bool = item->u.v_bool;
 	}
-	return mbuf_write_byte(dst, ec);
+
+	/* belongs to parent, cannot be added elsewhere */
+	set_next(jv, NULL);
+	item->node = jv;
+	return jv;
 }
 
-static bool render_string(struct RenderState *rs, struct JsonValue *jv)
+/* position of value for key in lazy dict, 0 if missing */
+static uint32_t tape_dict_find(struct JsonValue *dict, const char *key, size_t klen)
 {
-	const char *s, *last;
-	const char *val = get_cstring(jv);
-	size_t len = jv->u.v_size;
-	const char *end = val + len;
-	unsigned int c;
+	struct JsonContainer *c = get_container(dict);
+	struct JsonTape *tape = c->u.c_tape.tape;
+	struct TapeItem *kitem;
+	const char *str;
+	size_t len;
+	uint32_t i;
 
-	/* start quote */
-	if (!mbuf_write_byte(rs->dst, '"'))
-		return false;
-
-	for (s = last = val; s < end; s++) {
-		if (*s == '"' || *s == '\\' || (unsigned char)*s < 0x20 ||
-			/* Valid in JSON, but not in JS:
-			   \u2028 - Line separator
-			   \u2029 - Paragraph separator */
-			((unsigned char)s[0] == 0xE2 && (unsigned char)s[1] == 0x80 &&
-			 ((unsigned char)s[2] == 0xA8 || (unsigned char)s[2] == 0xA9)))
-		{
-			/* flush */
-			if (last < s) {
-				if (!mbuf_write(rs->dst, last, s - last))
-					return false;
-			}
+	for (i = c->u.c_tape.item + 1; i < tape->items[c->u.c_tape.item].end; i = tape->items[i + 1].end) {
+		kitem = &tape->items[i];
+		if (!kitem->escaped) {
+			if (kitem->u.str.len == klen && memcmp(tape->src + kitem->u.str.ofs, key, klen) == 0)
+				return i + 1;
+			continue;
+		}
+		str = tape_get_string(c->c_ctx, tape, kitem, &len);
+		if (str && len == klen && memcmp(str, key, klen) == 0)
+			return i + 1;
+	}
+	return 0;
+}
 
-			if ((unsigned char)s[0] == 0xE2) {
-				c = 0x2028 + ((unsigned char)s[2] - 0xA8);
-				last = s + 3;
-			} else {
-				c = (unsigned char)*s;
-				last = s + 1;
-			}
+/* position of list element, 0 if missing */
+static uint32_t tape_list_find(struct JsonValue *list, size_t index)
+{
+	struct JsonContainer *c = get_container(list);
+	struct LazyRef *ref = &c->u.c_tape;
+	struct TapeItem *items = ref->tape->items;
+	uint32_t i = ref->item + 1;
+	size_t n;
 
-			/* output escaped char */
-			if (!escape_char(rs->dst, c))
-				return false;
+	if (index >= list->u.v_size)
+		return 0;
+	if (index == 0)
+		return i;
+
+	/* walk siblings once, then index is O(1) */
+	if (!ref->pos) {
+		ref->pos = cx_alloc(c->c_ctx->pool, list->u.v_size * sizeof(uint32_t));
+		if (!ref->pos) {
+			while (index-- > 0)
+				i = items[i].end;
+			return i;
+		}
+		for (n = 0; n < list->u.v_size; n++) {
+			ref->pos[n] = i;
+			i = items[i].end;
 		}
 	}
+	return ref->pos[index];
+}
 
-	/* flush */
-	if (last < s) {
-		if (!mbuf_write(rs->dst, last, s - last))
-			return false;
+/* turn lazy container into normal one */
+static bool expand_lazy(struct JsonValue *jv)
+{
+	struct JsonContainer *c = get_container(jv);
+	struct JsonContext *ctx = c->c_ctx;
+	struct LazyRef ref = c->u.c_tape;
+	struct TapeItem *items = ref.tape->items;
+	struct JsonValue *key = NULL, *val;
+	uint32_t i, count = items[ref.item].u.count;
+
+	c->c_lazy = false;
+	jv->u.v_size = 0;
+	memset(&c->u, 0, sizeof(c->u));
+
+	/* element count is known, allocate exact array */
+	if (get_type(jv) == JSON_LIST && count > 0) {
+		c->u.c_list.items = cx_alloc(ctx->pool, count * sizeof(struct JsonValue *));
+		if (!c->u.c_list.items)
+			goto failed;
+		c->u.c_list.alloc = count;
 	}
 
-	/* final quote */
-	if (!mbuf_write_byte(rs->dst, '"'))
-		return false;
-
+	for (i = ref.item + 1; i < items[ref.item].end; i = items[i].end) {
+		if (items[i].is_key) {
+			key = tape_node(ctx, ref.tape, i, jv);
+			if (!key || !real_dict_add_key(ctx, jv, key))
+				goto failed;
+			i++;
+		}
+		val = tape_node(ctx, ref.tape, i, jv);
+		if (!val)
+			goto failed;
+		if (get_type(jv) == JSON_DICT)
+			set_next(key, val);
+		else if (!real_list_append(ctx, jv, val))
+			goto failed;
+	}
 	return true;
+
+failed:
+	/* stay lazy, lookups still work */
+	jv->u.v_size = count;
+	c->c_lazy = true;
+	c->u.c_tape = ref;
+	return false;
 }
 
-/*
+struct JsonValue *json_parse_lazy(struct JsonContext *ctx, const char *json, size_t len)
+{
+	struct JsonTape *tape;
+	size_t count;
+	bool ok;
+
+	json_parse_start(ctx, &tape_events, ctx);
+	if (len >= UINT32_MAX)
+		return err_null(ctx, "Too large document");
+
+	ctx->tape_src = json;
+	ctx->tape_open = TAPE_NONE;
+	mbuf_rewind_writer(&ctx->tapebuf);
+	ok = parse_chunk(ctx, json, len, true);
+	ctx->tape_src = NULL;
+	if (!ok)
+		return NULL;
+	if (ctx->state != S_DONE)
+		return err_null(ctx, "Container still open");
+
+	/* exact-size copy to pool */
+	count = ctx->tapebuf.write_pos / sizeof(struct TapeItem);
+	tape = cx_alloc(ctx->pool, offsetof(struct JsonTape, items) + count * sizeof(struct TapeItem));
+	if (!tape)
+		return err_null(ctx, "No memory");
+	tape->src = json;
+	tape->count = count;
+	memcpy(tape->items, ctx->tapebuf.data, count * sizeof(struct TapeItem));
+
+	ctx->top = tape_node(ctx, tape, 0, NULL);
+	return ctx->top;
+}
+
+/*
+ * Bind to C struct.
+ */
+
+struct BindFrame {
+	const struct JsonBind *binds;
+	char *base;
+	uint64_t seen;			/* bit for each key in binds */
+};
+
+struct BindState {
+	struct JsonContext *ctx;
+	unsigned int options;
+	const struct JsonBind *cur;	/* field for next value, NULL to ignore it */
+	unsigned int skip;		/* depth inside ignored container */
+	unsigned int depth;
+	struct BindFrame stack[JSON_BIND_DEPTH];
+};
+
+static bool bind_type_error(struct BindState *bs)
+{
+	return err_false(bs->ctx, "Wrong type for key: %s", bs->cur->key_name);
+}
+
+/* value for current field is consumed */
+static void *bind_field(struct BindState *bs, size_t size)
+{
+	const struct JsonBind *b = bs->cur;
+
+	bs->cur = NULL;
+	if (b->field_size != size) {
+		err_false(bs->ctx, "Bad field size for key: %s", b->key_name);
+		return NULL;
+	}
+	return bs->stack[bs->depth - 1].base + b->field_ofs;
+}
+
+/* true if value is not stored, with error set for scalar on top */
+static bool bind_ignore(struct BindState *bs)
+{
+	if (bs->skip > 0)
+		return true;
+	if (bs->depth == 0) {
+		err_false(bs->ctx, "Expected dict");
+		return true;
+	}
+	return bs->cur == NULL;
+}
+
+static bool bind_start_dict(void *arg)
+{
+	struct BindState *bs = arg;
+	struct BindFrame *f;
+	const struct JsonBind *b = bs->cur;
+
+	if (bs->skip > 0 || (bs->depth > 0 && !b)) {
+		bs->skip++;
+		return true;
+	}
+	if (bs->depth >= JSON_BIND_DEPTH)
+		return err_false(bs->ctx, "Too deep");
+	f = &bs->stack[bs->depth];
+	if (bs->depth > 0) {
+		if (b->type != JSON_BIND_DICT)
+			return bind_type_error(bs);
+		f->binds = b->extra;
+		f->base = bs->stack[bs->depth - 1].base + b->field_ofs;
+	}
+	f->seen = 0;
+	bs->depth++;
+	bs->cur = NULL;
+	return true;
+}
+
+static bool bind_end_dict(void *arg)
+{
+	struct BindState *bs = arg;
+	struct BindFrame *f;
+	unsigned int i;
+
+	if (bs->skip > 0) {
+		bs->skip--;
+		return true;
+	}
+	f = &bs->stack[--bs->depth];
+	for (i = 0; f->binds[i].key_name && i < JSON_BIND_MAX_KEYS; i++) {
+		if ((f->binds[i].flags & JSON_BIND_REQUIRED) && !(f->seen & (UINT64_C(1) << i)))
+			return err_false(bs->ctx, "Missing key: %s", f->binds[i].key_name);
+	}
+	return true;
+}
+
+static bool bind_start_list(void *arg)
+{
+	struct BindState *bs = arg;
+
+	if (!bind_ignore(bs))
+		return bind_type_error(bs);
+	if (bs->ctx->lasterr)
+		return false;
+	bs->skip++;
+	return true;
+}
+
+static bool bind_end_list(void *arg)
+{
+	struct BindState *bs = arg;
+
+	bs->skip--;
+	return true;
+}
+
+static bool bind_key(void *arg, const char *key, size_t len)
+{
+	struct BindState *bs = arg;
+	struct BindFrame *f;
+	const struct JsonBind *b;
+	unsigned int i;
+
+	if (bs->skip > 0)
+		return true;
+	f = &bs->stack[bs->depth - 1];
+	for (i = 0; f->binds[i].key_name; i++) {
+		b = &f->binds[i];
+		if (strlen(b->key_name) != len || memcmp(b->key_name, key, len) != 0)
+			continue;
+		if (i >= JSON_BIND_MAX_KEYS)
+			return err_false(bs->ctx, "Too many keys in binding");
+		if (f->seen & (UINT64_C(1) << i))
+			return err_false(bs->ctx, "Duplicate key: %s", b->key_name);
+		f->seen |= UINT64_C(1) << i;
+		bs->cur = b;
+		return true;
+	}
+	if (bs->options & JSON_BIND_STRICT)
+		return err_false(bs->ctx, "Unknown key: %.*s", (int)(len < 64 ? len : 64), key);
+	bs->cur = NULL;
+	return true;
+}
+
+static bool bind_null(void *arg)
+{
+	struct BindState *bs = arg;
+	char **dst;
+
+	if (bind_ignore(bs))
+		return !bs->ctx->lasterr;
+	if (bs->cur->type != JSON_BIND_STRING)
+		return bind_type_error(bs);
+	dst = bind_field(bs, sizeof(char *));
+	if (dst)
+		*dst = NULL;
+	return dst != NULL;
+}
+
+static bool bind_bool(void *arg, bool val)
+{
+	struct BindState *bs = arg;
+	bool *dst;
+
+	if (bind_ignore(bs))
+		return !bs->ctx->lasterr;
+	if (bs->cur->type != JSON_BIND_BOOL)
+		return bind_type_error(bs);
+	dst = bind_field(bs, sizeof(bool));
+	if (dst)
+		*dst = val;
+	return dst != NULL;
+}
+
+static bool bind_number(struct BindState *bs, double val, int64_t v_int, bool is_int)
+{
+	const struct JsonBind *b = bs->cur;
+	void *dst;
+
+	if ((b->flags & JSON_BIND_CHECK_RANGE) && (val < b->min || val > b->max))
+		return err_false(bs->ctx, "Value out of range for key: %s", b->key_name);
+
+	switch (b->type) {
+	case JSON_BIND_INT:
+		if (!is_int || v_int < INT_MIN || v_int > INT_MAX)
+			break;
+		if ((dst = bind_field(bs, sizeof(int))))
+			*(int *)dst = v_int;
+		return dst != NULL;
+	case JSON_BIND_UINT:
+		if (!is_int || v_int < 0 || (uint64_t)v_int > UINT_MAX)
+			break;
+		if ((dst = bind_field(bs, sizeof(unsigned int))))
+			*(unsigned int *)dst = v_int;
+		return dst != NULL;
+	case JSON_BIND_INT64:
+		if (!is_int)
+			break;
+		if ((dst = bind_field(bs, sizeof(int64_t))))
+			*(int64_t *)dst = v_int;
+		return dst != NULL;
+	case JSON_BIND_DOUBLE:
+		if ((dst = bind_field(bs, sizeof(double))))
+			*(double *)dst = val;
+		return dst != NULL;
+	default:
+		break;
+	}
+	return bind_type_error(bs);
+}
+
+static bool bind_int(void *arg, int64_t val)
+{
+	struct BindState *bs = arg;
+
+	if (bind_ignore(bs))
+		return !bs->ctx->lasterr;
+	return bind_number(bs, val, val, true);
+}
+
+static bool bind_float(void *arg, double val)
+{
+	struct BindState *bs = arg;
+
+	if (bind_ignore(bs))
+		return !bs->ctx->lasterr;
+	return bind_number(bs, val, 0, false);
+}
+
+static bool bind_string(void *arg, const char *str, size_t len)
+{
+	struct BindState *bs = arg;
+	const struct JsonBind *b;
+	char *dst, **dst_p;
+
+	if (bind_ignore(bs))
+		return !bs->ctx->lasterr;
+	b = bs->cur;
+	if (b->type == JSON_BIND_STRBUF) {
+		if (len >= b->field_size)
+			return err_false(bs->ctx, "Too long value for key: %s", b->key_name);
+		dst = bind_field(bs, b->field_size);
+	} else if (b->type == JSON_BIND_STRING) {
+		dst_p = bind_field(bs, sizeof(char *));
+		if (!dst_p)
+			return false;
+		dst = *dst_p = cx_alloc(bs->ctx->pool, len + 1);
+		if (!dst)
+			return err_false(bs->ctx, "No memory");
+	} else {
+		return bind_type_error(bs);
+	}
+	if (!dst)
+		return false;
+	memcpy(dst, str, len);
+	dst[len] = 0;
+	return true;
+}
+
+static const struct JsonEvents bind_events = {
+	.start_dict = bind_start_dict,
+	.end_dict = bind_end_dict,
+	.start_list = bind_start_list,
+	.end_list = bind_end_list,
+	.key = bind_key,
+	.null_value = bind_null,
+	.bool_value = bind_bool,
+	.int_value = bind_int,
+	.float_value = bind_float,
+	.string_value = bind_string,
+};
+
+bool json_bind_parse(struct JsonContext *ctx, const struct JsonBind *binds, void *base,
+		     unsigned int options, const char *src, size_t len)
+{
+	struct BindState bs;
+
+	memset(&bs, 0, sizeof(bs));
+	bs.ctx = ctx;
+	bs.options = options;
+	bs.stack[0].binds = binds;
+	bs.stack[0].base = base;
+
+	json_parse_start(ctx, &bind_events, &bs);
+	if (!parse_chunk(ctx, src, len, true))
+		return false;
+	if (ctx->state != S_DONE)
+		return err_false(ctx, "Container still open");
+	return true;
+}
+
+/*
+ * Render value as JSON string.
+ */
+
+static bool render_null(struct RenderState *rs, struct JsonValue *jv)
+{
+	return mbuf_write(rs->dst, "null", 4);
+}
+
+static bool render_bool(struct RenderState *rs, struct JsonValue *jv)
+{
+	if (jv->u.v_bool)
+		return mbuf_write(rs->dst, "true", 4);
+	return mbuf_write(rs->dst, "false", 5);
+}
+
+static bool write_int(struct MBuf *dst, int64_t val)
+{
+	char buf[NUMBER_BUF];
+	int len;
+
+	len = fmt_int64(buf, val);
+	return mbuf_write(dst, buf, len);
+}
+
+static bool write_float(struct MBuf *dst, double val)
+{
+	char buf[NUMBER_BUF + 2];
+	int len;
+
+	len = fmt_float(buf, val);
+	if (len < 0 || len >= NUMBER_BUF)
+		return false;
+	if (!memchr(buf, '.', len) && !memchr(buf, 'e', len)) {
+	    buf[len++] = '.';
+	    buf[len++] = '0';
+	}
+	return mbuf_write(dst, buf, len);
+}
+
+/*
+ * Float in ECMAScript Number.toString() format, as RFC 8785 wants:
+ * shortest digits that read back same, exponent only outside
+ * 1e-6 .. 1e21, no ".0" on integers.
+ */
+static bool write_float_es(struct MBuf *dst, double val)
+{
+	char digits[20], buf[48];
+	int ndig, n, len, i;
+
+	if (val == 0)
+		return mbuf_write_byte(dst, '0');
+
+	if (!isfinite(val))
+		return false;
+
+	len = 0;
+	if (val < 0)
+		buf[len++] = '-';
+	ndig = float_digits(digits, val, &n);
+	n++;
+
+	if (ndig <= n && n <= 21) {
+		memcpy(buf + len, digits, ndig);
+		len += ndig;
+		for (i = ndig; i < n; i++)
+			buf[len++] = '0';
+	} else if (0 < n && n <= 21) {
+		memcpy(buf + len, digits, n);
+		len += n;
+		buf[len++] = '.';
+		memcpy(buf + len, digits + n, ndig - n);
+		len += ndig - n;
+	} else if (-6 < n && n <= 0) {
+		buf[len++] = '0';
+		buf[len++] = '.';
+		for (i = n; i < 0; i++)
+			buf[len++] = '0';
+		memcpy(buf + len, digits, ndig);
+		len += ndig;
+	} else {
+		buf[len++] = digits[0];
+		if (ndig > 1) {
+			buf[len++] = '.';
+			memcpy(buf + len, digits + 1, ndig - 1);
+			len += ndig - 1;
+		}
+		len += snprintf(buf + len, sizeof(buf) - len, "e%c%d", n > 0 ? '+' : '-', n > 0 ? n - 1 : 1 - n);
+	}
+	return mbuf_write(dst, buf, len);
+}
+
+static bool render_int(struct RenderState *rs, struct JsonValue *jv)
+{
+	int64_t val = jv->u.v_int;
+
+	/* canonical form is for double value */
+	if ((rs->options & JSON_RENDER_CANONICAL) && (val > JSON_MAXINT || val < JSON_MININT))
+		return write_float_es(rs->dst, (double)val);
+	return write_int(rs->dst, val);
+}
+
+static bool render_float(struct RenderState *rs, struct JsonValue *jv)
+{
+	if (rs->options & JSON_RENDER_CANONICAL)
+		return write_float_es(rs->dst, jv->u.v_float);
+	return write_float(rs->dst, jv->u.v_float);
+}
+
+static bool escape_char(struct MBuf *dst, unsigned int c)
+{
+	char ec;
+	char buf[10];
+
+	/* start escape */
+	if (!mbuf_write_byte(dst, '\\'))
+		return false;
+
+	/* escape same char */
+	if (c == '"' || c == '\\')
+		return mbuf_write_byte(dst, c);
+
+	/* low-ascii mess */
+	switch (c) {
+	case '\b': ec = 'b'; break;
+	case '\f': ec = 'f'; break;
+	case '\n': ec = 'n'; break;
+	case '\r': ec = 'r'; break;
+	case '\t': ec = 't'; break;
+	default:
+		snprintf(buf, sizeof(buf), "u%04x", c);
+		return mbuf_write(dst, buf, 5);
+	}
+	return mbuf_write_byte(dst, ec);
+}
+
+/*
+ * Bytes that need escaping.  0xE2 starts U+2028/U+2029, which
+ * are valid in JSON but not in JS, so they are escaped too.
+ */
+#define meta_render(c) (((c) == '"' || (c) == '\\' || (c) < 0x20 || (c) == 0xE2) ? 1 : 0)
+static const uint8_t render_examine_chars[] = INTMAP256_CONST(meta_render);
+
+/* word has byte below 0x20 */
+#define word_hasctrl(v)		(((v) - ONES64 * 0x20) & ~(v) & HIGHS64)
+
+/*
+ * Skip bytes that are not in render_examine_chars,
+ * return pointer to first meta byte or end.
+ */
+static inline const char *skip_safe(const char *src, const char *end)
+{
+#if defined(JSON_SCAN_AVX2)
+	const __m256i q = _mm256_set1_epi8('"'), bs = _mm256_set1_epi8('\\');
+	const __m256i e2 = _mm256_set1_epi8((char)0xE2), ctl = _mm256_set1_epi8(0x1F);
+	__m256i v, m;
+	unsigned int bits;
+
+	while (end - src >= 32) {
+		v = _mm256_loadu_si256((const __m256i *)src);
+		m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, q), _mm256_cmpeq_epi8(v, bs)),
+				    _mm256_or_si256(_mm256_cmpeq_epi8(v, e2),
+						    /* unsigned v <= 0x1F */
+						    _mm256_cmpeq_epi8(_mm256_max_epu8(v, ctl), ctl)));
+		bits = _mm256_movemask_epi8(m);
+		if (bits)
+			return src + ffs(bits) - 1;
+		src += 32;
+	}
+#elif defined(JSON_SCAN_SSE2)
+	const __m128i q = _mm_set1_epi8('"'), bs = _mm_set1_epi8('\\');
+	const __m128i e2 = _mm_set1_epi8((char)0xE2), ctl = _mm_set1_epi8(0x1F);
+	__m128i v, m;
+	unsigned int bits;
+
+	while (end - src >= 16) {
+		v = _mm_loadu_si128((const __m128i *)src);
+		m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, q), _mm_cmpeq_epi8(v, bs)),
+				 _mm_or_si128(_mm_cmpeq_epi8(v, e2),
+					      _mm_cmpeq_epi8(_mm_max_epu8(v, ctl), ctl)));
+		bits = _mm_movemask_epi8(m);
+		if (bits)
+			return src + ffs(bits) - 1;
+		src += 16;
+	}
+#elif defined(JSON_SCAN_NEON)
+	const uint8x16_t q = vdupq_n_u8('"'), bs = vdupq_n_u8('\\');
+	const uint8x16_t e2 = vdupq_n_u8(0xE2), ctl = vdupq_n_u8(0x20);
+	uint8x16_t v, m;
+
+	while (end - src >= 16) {
+		v = vld1q_u8((const uint8_t *)src);
+		m = vorrq_u8(vorrq_u8(vceqq_u8(v, q), vceqq_u8(v, bs)),
+			     vorrq_u8(vceqq_u8(v, e2), vcltq_u8(v, ctl)));
+		if (vmaxvq_u8(m))
+			break;
+		src += 16;
+	}
+#else
+	uint64_t v;
+
+	while (end - src >= 8) {
+		memcpy(&v, src, 8);
+		if (word_hasctrl(v) || word_hasbyte(v, '"') || word_hasbyte(v, '\\')
+		    || word_hasbyte(v, 0xE2))
+			break;
+		src += 8;
+	}
+#endif
+	/* tail, or exact position inside last block */
+	while (src < end && !render_examine_chars[(uint8_t)*src])
+		src++;
+	return src;
+}
+
+/* canonical output does not escape U+2028/2029, so js_safe is optional */
+static bool write_string(struct MBuf *dst, const char *val, size_t len, bool js_safe)
+{
+	const char *s, *last, *next;
+	const char *end = val + len;
+	unsigned int c;
+
+	/* escaping only makes output longer, reserve minimum once */
+	if (len + 2 > dst->alloc_len - dst->write_pos
+	    && !mbuf_make_room(dst, len + 2))
+		return false;
+
+	/* start quote */
+	dst->data[dst->write_pos++] = '"';
+
+	for (s = last = val; ; s = next) {
+		s = skip_safe(s, end);
+		if (s >= end)
+			break;
+
+		if ((uint8_t)s[0] == 0xE2) {
+			/* other E2 sequences are copied as-is */
+			if (!js_safe || end - s < 3 || (uint8_t)s[1] != 0x80 ||
+			    ((uint8_t)s[2] != 0xA8 && (uint8_t)s[2] != 0xA9)) {
+				next = s + 1;
+				continue;
+			}
+			c = 0x2028 + ((uint8_t)s[2] - 0xA8);
+			next = s + 3;
+		} else {
+			c = (uint8_t)s[0];
+			next = s + 1;
+		}
+
+		/* flush clean run */
+		if (last < s && !mbuf_write(dst, last, s - last))
+			return false;
+		if (!escape_char(dst, c))
+			return false;
+		last = next;
+	}
+
+	/* flush and final quote */
+	if (last < end && !mbuf_write(dst, last, end - last))
+		return false;
+	return mbuf_write_byte(dst, '"');
+}
+
+static bool render_string(struct RenderState *rs, struct JsonValue *jv)
+{
+	/* no point escaping string that cannot fit */
+	if (jv->u.v_size > rs->limit - rs->dst->write_pos)
+		return false;
+	return write_string(rs->dst, get_cstring(jv), jv->u.v_size,
+			    !(rs->options & JSON_RENDER_CANONICAL));
+}
+
+/*
  * Render complex values
  */
 
@@ -1084,90 +2797,785 @@ struct ElemWriterState {
 	char sep;
 };
 
-static bool list_elem_writer(void *arg, struct JsonValue *elem)
+/* newline and indent for pretty output */
+static bool write_indent(struct RenderState *rs)
+{
+	if (!(rs->options & JSON_RENDER_PRETTY))
+		return true;
+	if (!mbuf_write_byte(rs->dst, '\n'))
+		return false;
+	return mbuf_fill(rs->dst, ' ', rs->depth * JSON_RENDER_INDENT);
+}
+
+static bool list_elem_writer(void *arg, struct JsonValue *elem)
+{
+	struct ElemWriterState *state = arg;
+
+	if (state->sep && !mbuf_write_byte(state->rs->dst, state->sep))
+		return false;
+	state->sep = ',';
+
+	if (!write_indent(state->rs))
+		return false;
+	return render_any(state->rs, elem);
+}
+
+static bool render_list(struct RenderState *rs, struct JsonValue *list)
+{
+	struct ElemWriterState state;
+
+	state.rs = rs;
+	state.sep = 0;
+
+	if (!mbuf_write_byte(rs->dst, '['))
+		return false;
+	rs->depth++;
+	if (!json_list_iter(list, list_elem_writer, &state))
+		return false;
+	rs->depth--;
+	if (state.sep && !write_indent(rs))
+		return false;
+	if (!mbuf_write_byte(rs->dst, ']'))
+		return false;
+	return true;
+}
+
+static bool dict_elem_writer(void *ctx, struct JsonValue *key, struct JsonValue *val)
+{
+	struct ElemWriterState *state = ctx;
+
+	if (state->sep && !mbuf_write_byte(state->rs->dst, state->sep))
+		return false;
+	state->sep = ',';
+
+	if (!write_indent(state->rs))
+		return false;
+	if (!render_any(state->rs, key))
+		return false;
+	if (!mbuf_write_byte(state->rs->dst, ':'))
+		return false;
+	if ((state->rs->options & JSON_RENDER_PRETTY) && !mbuf_write_byte(state->rs->dst, ' '))
+		return false;
+	return render_any(state->rs, val);
+}
+
+/*
+ * Key order for sorted output.  RFC 8785 compares UTF-16 code
+ * units, which differs from UTF-8 byte order only in that
+ * U+E000..U+FFFF (lead byte EE, EF) sorts after surrogate pairs.
+ */
+static inline unsigned int utf16_order(uint8_t c)
+{
+	return (c == 0xEE || c == 0xEF) ? c + 0x10 : c;
+}
+
+static int key_cmp(const void *a, const void *b)
+{
+	const struct JsonValue *k1 = *(const struct JsonValue **)a;
+	const struct JsonValue *k2 = *(const struct JsonValue **)b;
+	const uint8_t *s1 = (const uint8_t *)get_cstring((struct JsonValue *)k1);
+	const uint8_t *s2 = (const uint8_t *)get_cstring((struct JsonValue *)k2);
+	size_t len = k1->u.v_size < k2->u.v_size ? k1->u.v_size : k2->u.v_size;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (s1[i] != s2[i])
+			return (int)utf16_order(s1[i]) - (int)utf16_order(s2[i]);
+	}
+	if (k1->u.v_size != k2->u.v_size)
+		return k1->u.v_size < k2->u.v_size ? -1 : 1;
+	return 0;
+}
+
+/* keys are copied to sortbuf, which nested dicts use as stack */
+static bool iter_sorted(struct RenderState *rs, struct JsonValue *dict, struct ElemWriterState *state)
+{
+	struct ValueDict *vdict;
+	struct JsonValue *key;
+	size_t i, n = dict->u.v_size;
+	size_t start = rs->sortbuf.write_pos;
+	bool ok = true;
+
+	vdict = get_dict_vdict(dict);
+	if (!vdict)
+		return false;
+	if (!mbuf_write(&rs->sortbuf, vdict->keys, n * sizeof(key)))
+		return false;
+	if (n > 1)
+		qsort(rs->sortbuf.data + start, n, sizeof(key), key_cmp);
+
+	/* buffer may move while children are rendered */
+	for (i = 0; i < n && ok; i++) {
+		memcpy(&key, rs->sortbuf.data + start + i * sizeof(key), sizeof(key));
+		ok = dict_elem_writer(state, key, get_next(key));
+	}
+	rs->sortbuf.write_pos = start;
+	return ok;
+}
+
+static bool render_dict(struct RenderState *rs, struct JsonValue *dict)
+{
+	struct ElemWriterState state;
+	bool ok;
+
+	state.rs = rs;
+	state.sep = 0;
+
+	if (!mbuf_write_byte(rs->dst, '{'))
+		return false;
+	rs->depth++;
+	if (rs->options & JSON_RENDER_SORT_KEYS)
+		ok = iter_sorted(rs, dict, &state);
+	else
+		ok = json_dict_iter(dict, dict_elem_writer, &state);
+	if (!ok)
+		return false;
+	rs->depth--;
+	if (state.sep && !write_indent(rs))
+		return false;
+	if (!mbuf_write_byte(rs->dst, '}'))
+		return false;
+
+	return true;
+}
+
+static bool render_invalid(struct RenderState *rs, struct JsonValue *jv)
+{
+	return false;
+}
+
+/*
+ * Public api
+ */
+
+static bool render_any(struct RenderState *rs, struct JsonValue *jv)
+{
+	static const render_func_t rfunc_map[] = {
+		render_invalid, render_null, render_bool, render_int,
+		render_float, render_string, render_list, render_dict,
+	};
+	if (rs->dst->write_pos > rs->limit)
+		return false;
+	return rfunc_map[get_type(jv)](rs, jv);
+}
+
+static void render_init(struct RenderState *rs, struct MBuf *dst, unsigned int options, size_t max_bytes)
+{
+	if (options & JSON_RENDER_CANONICAL) {
+		options &= ~JSON_RENDER_PRETTY;
+		options |= JSON_RENDER_SORT_KEYS;
+	}
+	rs->dst = dst;
+	rs->options = options;
+	rs->depth = 0;
+	rs->limit = SIZE_MAX;
+	if (max_bytes && max_bytes < SIZE_MAX - dst->write_pos)
+		rs->limit = dst->write_pos + max_bytes;
+	mbuf_init_dynamic(&rs->sortbuf);
+}
+
+bool json_render(struct MBuf *dst, struct JsonValue *jv)
+{
+	return json_render_opts(dst, jv, 0, 0);
+}
+
+bool json_render_opts(struct MBuf *dst, struct JsonValue *jv, unsigned int options, size_t max_bytes)
+{
+	struct RenderState rs;
+	bool ok;
+
+	render_init(&rs, dst, options, max_bytes);
+	ok = render_any(&rs, jv);
+	mbuf_free(&rs.sortbuf);
+
+	/* last write may have gone over */
+	if (dst->write_pos > rs.limit) {
+		dst->write_pos = rs.limit;
+		ok = false;
+	}
+	return ok;
+}
+
+/*
+ * Streaming writer.
+ */
+
+/* per-level state in JsonWriter.stack */
+enum WriterLevel {
+	JW_LIST = 1,
+	JW_DICT_KEY,
+	JW_DICT_VALUE,
+};
+
+/* check that value is allowed here and write separator */
+static bool jw_before_value(struct JsonWriter *jw)
+{
+	if (jw->depth == 0)
+		return !jw->done;
+	switch (jw->stack[jw->depth - 1]) {
+	case JW_LIST:
+		return !jw->sep || mbuf_write_byte(jw->dst, ',');
+	case JW_DICT_VALUE:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void jw_after_value(struct JsonWriter *jw)
+{
+	jw->sep = true;
+	if (jw->depth == 0)
+		jw->done = true;
+	else if (jw->stack[jw->depth - 1] == JW_DICT_VALUE)
+		jw->stack[jw->depth - 1] = JW_DICT_KEY;
+}
+
+/* drop partial output, remember failure for jw_finish() */
+static bool jw_fail(struct JsonWriter *jw, size_t pos)
+{
+	jw->dst->write_pos = pos;
+	jw->failed = true;
+	return false;
+}
+
+static bool jw_begin(struct JsonWriter *jw, enum WriterLevel level, char c)
+{
+	size_t pos = jw->dst->write_pos;
+
+	if (jw->depth >= JSON_WRITER_DEPTH || !jw_before_value(jw))
+		return jw_fail(jw, pos);
+	if (!mbuf_write_byte(jw->dst, c))
+		return jw_fail(jw, pos);
+	jw->stack[jw->depth++] = level;
+	jw->sep = false;
+	return true;
+}
+
+static bool jw_end(struct JsonWriter *jw, enum WriterLevel level, char c)
+{
+	size_t pos = jw->dst->write_pos;
+
+	if (jw->depth == 0 || jw->stack[jw->depth - 1] != level)
+		return jw_fail(jw, pos);
+	if (!mbuf_write_byte(jw->dst, c))
+		return jw_fail(jw, pos);
+	jw->depth--;
+	jw_after_value(jw);
+	return true;
+}
+
+void jw_init(struct JsonWriter *jw, struct MBuf *dst)
+{
+	jw->dst = dst;
+	jw->depth = 0;
+	jw->sep = false;
+	jw->done = false;
+	jw->failed = false;
+}
+
+bool jw_begin_dict(struct JsonWriter *jw)
+{
+	return jw_begin(jw, JW_DICT_KEY, '{');
+}
+
+bool jw_end_dict(struct JsonWriter *jw)
+{
+	return jw_end(jw, JW_DICT_KEY, '}');
+}
+
+bool jw_begin_list(struct JsonWriter *jw)
+{
+	return jw_begin(jw, JW_LIST, '[');
+}
+
+bool jw_end_list(struct JsonWriter *jw)
+{
+	return jw_end(jw, JW_LIST, ']');
+}
+
+bool jw_key_len(struct JsonWriter *jw, const char *key, size_t len)
+{
+	size_t pos = jw->dst->write_pos;
+
+	if (jw->depth == 0 || jw->stack[jw->depth - 1] != JW_DICT_KEY)
+		return jw_fail(jw, pos);
+	if (!utf8_validate_string(key, key + len))
+		return jw_fail(jw, pos);
+	if (jw->sep && !mbuf_write_byte(jw->dst, ','))
+		return jw_fail(jw, pos);
+	if (!write_string(jw->dst, key, len, true) || !mbuf_write_byte(jw->dst, ':'))
+		return jw_fail(jw, pos);
+	jw->stack[jw->depth - 1] = JW_DICT_VALUE;
+	return true;
+}
+
+bool jw_key(struct JsonWriter *jw, const char *key)
+{
+	return jw_key_len(jw, key, strlen(key));
+}
+
+bool jw_null(struct JsonWriter *jw)
+{
+	size_t pos = jw->dst->write_pos;
+
+	if (!jw_before_value(jw) || !mbuf_write(jw->dst, "null", 4))
+		return jw_fail(jw, pos);
+	jw_after_value(jw);
+	return true;
+}
+
+bool jw_bool(struct JsonWriter *jw, bool val)
+{
+	size_t pos = jw->dst->write_pos;
+
+	if (!jw_before_value(jw))
+		return jw_fail(jw, pos);
+	if (!(val ? mbuf_write(jw->dst, "true", 4) : mbuf_write(jw->dst, "false", 5)))
+		return jw_fail(jw, pos);
+	jw_after_value(jw);
+	return true;
+}
+
+bool jw_int(struct JsonWriter *jw, int64_t val)
+{
+	size_t pos = jw->dst->write_pos;
+
+	if (!jw_before_value(jw) || !write_int(jw->dst, val))
+		return jw_fail(jw, pos);
+	jw_after_value(jw);
+	return true;
+}
+
+bool jw_float(struct JsonWriter *jw, double val)
+{
+	size_t pos = jw->dst->write_pos;
+
+	if (!isfinite(val))
+		return jw_fail(jw, pos);
+	if (!jw_before_value(jw) || !write_float(jw->dst, val))
+		return jw_fail(jw, pos);
+	jw_after_value(jw);
+	return true;
+}
+
+bool jw_string_len(struct JsonWriter *jw, const char *str, size_t len)
+{
+	size_t pos = jw->dst->write_pos;
+
+	if (!utf8_validate_string(str, str + len))
+		return jw_fail(jw, pos);
+	if (!jw_before_value(jw) || !write_string(jw->dst, str, len, true))
+		return jw_fail(jw, pos);
+	jw_after_value(jw);
+	return true;
+}
+
+bool jw_string(struct JsonWriter *jw, const char *str)
+{
+	return jw_string_len(jw, str, strlen(str));
+}
+
+bool jw_value(struct JsonWriter *jw, struct JsonValue *jv)
+{
+	struct RenderState rs;
+	size_t pos = jw->dst->write_pos;
+
+	if (!jw_before_value(jw))
+		return jw_fail(jw, pos);
+	render_init(&rs, jw->dst, 0, 0);
+	if (!render_any(&rs, jv))
+		return jw_fail(jw, pos);
+	jw_after_value(jw);
+	return true;
+}
+
+bool jw_finish(struct JsonWriter *jw)
+{
+	return jw->done && !jw->failed;
+}
+
+/*
+ * CBOR encoding, RFC 8949.
+ */
+
+enum CborMajor {
+	CBOR_UINT = 0,
+	CBOR_NEGINT,
+	CBOR_BYTES,
+	CBOR_TEXT,
+	CBOR_ARRAY,
+	CBOR_MAP,
+	CBOR_TAG,
+	CBOR_SIMPLE,
+};
+
+/* additional info values */
+#define CBOR_INFO_FALSE		20
+#define CBOR_INFO_TRUE		21
+#define CBOR_INFO_NULL		22
+#define CBOR_INFO_HALF		25
+#define CBOR_INFO_SINGLE	26
+#define CBOR_INFO_DOUBLE	27
+#define CBOR_INFO_INDEF		31
+
+#define CBOR_BREAK		0xFF
+
+/* nesting level in ctx->nest while decoding */
+struct CborLevel {
+	uint64_t left;		/* items left, for definite length */
+	uint8_t type;		/* JSON_LIST or JSON_DICT */
+	bool indef;
+	bool want_key;
+};
+
+/* initial byte with argument in shortest form */
+static bool cbor_write_head(struct MBuf *dst, enum CborMajor major, uint64_t val)
+{
+	uint8_t buf[9];
+	unsigned int info, n, i;
+
+	if (val < 24) {
+		info = val;
+		n = 0;
+	} else if (val <= UINT8_MAX) {
+		info = 24;
+		n = 1;
+	} else if (val <= UINT16_MAX) {
+		info = 25;
+		n = 2;
+	} else if (val <= UINT32_MAX) {
+		info = 26;
+		n = 4;
+	} else {
+		info = 27;
+		n = 8;
+	}
+	buf[0] = (major << 5) | info;
+	for (i = n; i > 0; i--) {
+		buf[i] = val;
+		val >>= 8;
+	}
+	return mbuf_write(dst, buf, n + 1);
+}
+
+/* half-precision bits, if f converts exactly */
+static bool float_to_half(float f, uint16_t *dst_p)
+{
+	uint32_t bits, mant;
+	uint16_t sign;
+	int exp, shift;
+
+	memcpy(&bits, &f, 4);
+	sign = (bits >> 16) & 0x8000;
+	exp = (int)((bits >> 23) & 0xFF) - 127;
+	mant = bits & 0x7FFFFF;
+
+	if ((bits & 0x7FFFFFFF) == 0) {
+		*dst_p = sign;
+		return true;
+	} else if (exp >= -14 && exp <= 15) {
+		if (mant & 0x1FFF)
+			return false;
+		*dst_p = sign | ((exp + 15) << 10) | (mant >> 13);
+		return true;
+	} else if (exp >= -24 && exp < -14) {
+		/* subnormal half */
+		mant |= 0x800000;
+		shift = -1 - exp;
+		if (mant & ((1U << shift) - 1))
+			return false;
+		*dst_p = sign | (mant >> shift);
+		return true;
+	}
+	return false;
+}
+
+static double half_to_double(uint16_t half)
+{
+	int exp = (half >> 10) & 0x1F;
+	int mant = half & 0x3FF;
+	double val;
+
+	if (exp == 0)
+		val = ldexp(mant, -24);
+	else if (exp != 31)
+		val = ldexp(mant + 1024, exp - 25);
+	else
+		val = mant ? NAN : INFINITY;
+	return (half & 0x8000) ? -val : val;
+}
+
+/* shortest of half, single or double that keeps value */
+static bool cbor_write_float(struct MBuf *dst, double val)
 {
-	struct ElemWriterState *state = arg;
+	uint8_t buf[9];
+	uint64_t bits;
+	uint32_t fbits;
+	uint16_t half;
+	float f;
+	int i;
+
+	if (fabs(val) <= FLT_MAX && (double)(f = val) == val) {
+		if (float_to_half(f, &half)) {
+			buf[0] = (CBOR_SIMPLE << 5) | CBOR_INFO_HALF;
+			buf[1] = half >> 8;
+			buf[2] = half;
+			return mbuf_write(dst, buf, 3);
+		}
+		memcpy(&fbits, &f, 4);
+		buf[0] = (CBOR_SIMPLE << 5) | CBOR_INFO_SINGLE;
+		for (i = 4; i > 0; i--, fbits >>= 8)
+			buf[i] = fbits;
+		return mbuf_write(dst, buf, 5);
+	}
+	memcpy(&bits, &val, 8);
+	buf[0] = (CBOR_SIMPLE << 5) | CBOR_INFO_DOUBLE;
+	for (i = 8; i > 0; i--, bits >>= 8)
+		buf[i] = bits;
+	return mbuf_write(dst, buf, 9);
+}
 
-	if (state->sep && !mbuf_write_byte(state->rs->dst, state->sep))
-		return false;
-	state->sep = ',';
+static bool cbor_render_any(struct MBuf *dst, struct JsonValue *jv);
 
-	return render_any(state->rs, elem);
+static bool cbor_list_elem(void *arg, struct JsonValue *elem)
+{
+	return cbor_render_any(arg, elem);
 }
 
-static bool render_list(struct RenderState *rs, struct JsonValue *list)
+static bool cbor_dict_elem(void *arg, struct JsonValue *key, struct JsonValue *val)
 {
-	struct ElemWriterState state;
+	return cbor_render_any(arg, key) && cbor_render_any(arg, val);
+}
 
-	state.rs = rs;
-	state.sep = 0;
+static bool cbor_render_any(struct MBuf *dst, struct JsonValue *jv)
+{
+	switch (get_type(jv)) {
+	case JSON_NULL:
+		return mbuf_write_byte(dst, (CBOR_SIMPLE << 5) | CBOR_INFO_NULL);
+	case JSON_BOOL:
+		return mbuf_write_byte(dst, (CBOR_SIMPLE << 5) | (jv->u.v_bool ? CBOR_INFO_TRUE : CBOR_INFO_FALSE));
+	case JSON_INT:
+		if (jv->u.v_int < 0)
+			return cbor_write_head(dst, CBOR_NEGINT, -1 - jv->u.v_int);
+		return cbor_write_head(dst, CBOR_UINT, jv->u.v_int);
+	case JSON_FLOAT:
+		return cbor_write_float(dst, jv->u.v_float);
+	case JSON_STRING:
+		if (!cbor_write_head(dst, CBOR_TEXT, jv->u.v_size))
+			return false;
+		return mbuf_write(dst, get_cstring(jv), jv->u.v_size);
+	case JSON_LIST:
+		if (!cbor_write_head(dst, CBOR_ARRAY, json_value_size(jv)))
+			return false;
+		return json_list_iter(jv, cbor_list_elem, dst);
+	case JSON_DICT:
+		if (!cbor_write_head(dst, CBOR_MAP, json_value_size(jv)))
+			return false;
+		return json_dict_iter(jv, cbor_dict_elem, dst);
+	}
+	return false;
+}
 
-	if (!mbuf_write_byte(rs->dst, '['))
-		return false;
-	if (!json_list_iter(list, list_elem_writer, &state))
-		return false;
-	if (!mbuf_write_byte(rs->dst, ']'))
-		return false;
+/* read initial byte and its argument */
+static bool cbor_read_head(struct JsonContext *ctx, const uint8_t **src_p, const uint8_t *end,
+			   unsigned int *major_p, unsigned int *info_p, uint64_t *val_p)
+{
+	const uint8_t *src = *src_p;
+	unsigned int info, n;
+	uint64_t val = 0;
+
+	if (src >= end)
+		return err_false(ctx, "Unexpected end of data");
+	*major_p = *src >> 5;
+	info = *src++ & 0x1F;
+	if (info < 24) {
+		val = info;
+	} else if (info <= 27) {
+		n = 1 << (info - 24);
+		if ((size_t)(end - src) < n)
+			return err_false(ctx, "Unexpected end of data");
+		while (n--)
+			val = (val << 8) | *src++;
+	} else if (info != CBOR_INFO_INDEF || *major_p < CBOR_BYTES || *major_p == CBOR_TAG) {
+		return err_false(ctx, "Invalid CBOR header");
+	}
+	*info_p = info;
+	*val_p = val;
+	*src_p = src;
 	return true;
 }
 
-static bool dict_elem_writer(void *ctx, struct JsonValue *key, struct JsonValue *val)
+/* text string, indefinite one is collected into ctx->strbuf */
+static bool cbor_string(struct JsonContext *ctx, const uint8_t **src_p, const uint8_t *end,
+			uint64_t len, bool indef, bool is_key)
 {
-	struct ElemWriterState *state = ctx;
-
-	if (state->sep && !mbuf_write_byte(state->rs->dst, state->sep))
-		return false;
-	state->sep = ',';
+	const uint8_t *src = *src_p;
+	const char *str;
+	unsigned int major, info;
+	uint64_t clen;
+
+	if (!indef) {
+		if (len > (uint64_t)(end - src))
+			return err_false(ctx, "Unexpected end of data");
+		str = (const char *)src;
+		src += len;
+	} else {
+		mbuf_rewind_writer(&ctx->strbuf);
+		while (src >= end || *src != CBOR_BREAK) {
+			if (!cbor_read_head(ctx, &src, end, &major, &info, &clen))
+				return false;
+			if (major != CBOR_TEXT || info == CBOR_INFO_INDEF)
+				return err_false(ctx, "Invalid string chunk");
+			if (clen > (uint64_t)(end - src))
+				return err_false(ctx, "Unexpected end of data");
+			if (!mbuf_write(&ctx->strbuf, src, clen))
+				return err_false(ctx, "No memory");
+			src += clen;
+		}
+		src++;
+		str = (const char *)ctx->strbuf.data;
+		len = ctx->strbuf.write_pos;
+	}
+	if (len == 0)
+		str = "";
 
-	if (!render_any(state->rs, key))
-		return false;
-	if (!mbuf_write_byte(state->rs->dst, ':'))
-		return false;
-	return render_any(state->rs, val);
+	if (!(ctx->options & JSON_PARSE_IGNORE_ENCODING) && !utf8_validate_string(str, str + len))
+		return err_false(ctx, "Invalid UTF8 sequence");
+	*src_p = src;
+	return emit_string(ctx, str, len, is_key);
 }
 
-static bool render_dict(struct RenderState *rs, struct JsonValue *dict)
+/* decode scalar or open container */
+static bool cbor_value(struct JsonContext *ctx, const uint8_t **src_p, const uint8_t *end, bool is_key)
 {
-	struct ElemWriterState state;
+	struct CborLevel lv;
+	unsigned int major, info;
+	uint64_t val;
+	uint32_t fbits;
+	double v_float;
+	float f;
+
+	do {
+		if (!cbor_read_head(ctx, src_p, end, &major, &info, &val))
+			return false;
+	} while (major == CBOR_TAG);
+
+	if (is_key && major != CBOR_TEXT)
+		return err_false(ctx, "Dict key must be string");
+
+	switch (major) {
+	case CBOR_UINT:
+		if (val > JSON_MAXINT)
+			return err_false(ctx, "Number out of range");
+		return emit_number(ctx, JSON_INT, val, 0);
+	case CBOR_NEGINT:
+		if (val > -(JSON_MININT + 1))
+			return err_false(ctx, "Number out of range");
+		return emit_number(ctx, JSON_INT, -1 - (int64_t)val, 0);
+	case CBOR_TEXT:
+		return cbor_string(ctx, src_p, end, val, info == CBOR_INFO_INDEF, is_key);
+	case CBOR_ARRAY:
+	case CBOR_MAP:
+		lv.type = (major == CBOR_MAP) ? JSON_DICT : JSON_LIST;
+		lv.indef = (info == CBOR_INFO_INDEF);
+		lv.want_key = (major == CBOR_MAP);
+		lv.left = val;
+		if (major == CBOR_MAP && !lv.indef) {
+			if (val > UINT64_MAX / 2)
+				return err_false(ctx, "Invalid CBOR header");
+			lv.left = val * 2;
+		}
+		if (!mbuf_write(&ctx->nest, &lv, sizeof(lv)))
+			return err_false(ctx, "No memory");
+		return emit_open(ctx, lv.type);
+	case CBOR_SIMPLE:
+		break;
+	default:
+		return err_false(ctx, "Byte strings not supported");
+	}
 
-	state.rs = rs;
-	state.sep = 0;
+	switch (info) {
+	case CBOR_INFO_FALSE:
+	case CBOR_INFO_TRUE:
+		return emit_literal(ctx, JSON_BOOL, info == CBOR_INFO_TRUE);
+	case CBOR_INFO_NULL:
+		return emit_literal(ctx, JSON_NULL, false);
+	case CBOR_INFO_HALF:
+		v_float = half_to_double(val);
+		break;
+	case CBOR_INFO_SINGLE:
+		fbits = val;
+		memcpy(&f, &fbits, 4);
+		v_float = f;
+		break;
+	case CBOR_INFO_DOUBLE:
+		memcpy(&v_float, &val, 8);
+		break;
+	case CBOR_INFO_INDEF:
+		return err_false(ctx, "Unexpected break");
+	default:
+		return err_false(ctx, "Unsupported simple value");
+	}
+	if (!isfinite(v_float))
+		return err_false(ctx, "Invalid float");
+	return emit_number(ctx, JSON_FLOAT, 0, v_float);
+}
 
-	if (!mbuf_write_byte(rs->dst, '{'))
-		return false;
-	if (!json_dict_iter(dict, dict_elem_writer, &state))
-		return false;
-	if (!mbuf_write_byte(rs->dst, '}'))
-		return false;
+/* decode one item, containers are tracked in ctx->nest */
+static bool cbor_parse(struct JsonContext *ctx, const uint8_t *src, const uint8_t *end)
+{
+	struct MBuf *nest = &ctx->nest;
+	struct CborLevel *lv;
+	bool is_key;
+
+	do {
+		is_key = false;
+		if (nest->write_pos > 0) {
+			lv = (struct CborLevel *)(nest->data + nest->write_pos - sizeof(*lv));
+			if (lv->indef ? (src < end && *src == CBOR_BREAK) : lv->left == 0) {
+				if (lv->type == JSON_DICT && !lv->want_key)
+					return err_false(ctx, "Missing value for key");
+				if (lv->indef)
+					src++;
+				if (!emit_close(ctx, lv->type))
+					return false;
+				nest->write_pos -= sizeof(*lv);
+				continue;
+			}
+			if (lv->type == JSON_DICT) {
+				is_key = lv->want_key;
+				lv->want_key = !is_key;
+			}
+			lv->left--;
+		}
+		if (!cbor_value(ctx, &src, end, is_key))
+			return false;
+	} while (nest->write_pos > 0);
 
+	if (src != end)
+		return err_false(ctx, "Extra data after value");
 	return true;
 }
 
-static bool render_invalid(struct RenderState *rs, struct JsonValue *jv)
+bool json_render_cbor(struct MBuf *dst, struct JsonValue *jv)
 {
-	return false;
+	return cbor_render_any(dst, jv);
 }
 
-/*
- * Public api
- */
-
-static bool render_any(struct RenderState *rs, struct JsonValue *jv)
+struct JsonValue *json_parse_cbor(struct JsonContext *ctx, const void *src, size_t len)
 {
-	static const render_func_t rfunc_map[] = {
-		render_invalid, render_null, render_bool, render_int,
-		render_float, render_string, render_list, render_dict,
-	};
-	return rfunc_map[get_type(jv)](rs, jv);
+	json_parse_start(ctx, NULL, NULL);
+	if (!cbor_parse(ctx, src, (const uint8_t *)src + len))
+		return NULL;
+	return ctx->top;
 }
 
-bool json_render(struct MBuf *dst, struct JsonValue *jv)
+bool json_parse_cbor_events(struct JsonContext *ctx, const struct JsonEvents *events, void *arg,
+			    const void *src, size_t len)
 {
-	struct RenderState rs;
-
-	rs.dst = dst;
-	rs.options = 0;
-	return render_any(&rs, jv);
+	json_parse_start(ctx, events, arg);
+	return cbor_parse(ctx, src, (const uint8_t *)src + len);
 }
 
 /*
@@ -1237,20 +3645,26 @@ static int dict_getter(struct JsonValue *dict,
 		       enum JsonValueType req_type, bool req_value)
 {
 	struct JsonValue *val, *kjv;
-	struct CBTree *tree;
+	struct JsonContainer *c;
+	uint32_t pos;
 
-	tree = get_dict_tree(dict);
-	if (!tree)
+	if (!has_type(dict, JSON_DICT))
 		return false;
 
-	kjv = cbtree_lookup(tree, key, klen);
-	if (!kjv) {
+	if (is_lazy(dict)) {
+		c = get_container(dict);
+		pos = tape_dict_find(dict, key, klen);
+		val = pos ? tape_node(c->c_ctx, c->u.c_tape.tape, pos, dict) : NULL;
+	} else {
+		kjv = dict_lookup(dict, key, klen);
+		val = kjv ? get_next(kjv) : NULL;
+	}
+	if (!val) {
 		if (req_value)
 			return false;
 		*val_p = NULL;
 		return true;
 	}
-	val = get_next(kjv);
 	if (!req_value && json_value_is_null(val)) {
 		*val_p = NULL;
 		return true;
@@ -1263,16 +3677,23 @@ static int dict_getter(struct JsonValue *dict,
 
 bool json_dict_get_value(struct JsonValue *dict, const char *key, struct JsonValue **val_p)
 {
-	struct CBTree *tree;
 	struct JsonValue *kjv;
-	size_t klen;
+	struct JsonContainer *c;
+	uint32_t pos;
 
-	tree = get_dict_tree(dict);
-	if (!tree)
+	if (!has_type(dict, JSON_DICT))
 		return false;
 
-	klen = strlen(key);
-	kjv = cbtree_lookup(tree, key, klen);
+	if (is_lazy(dict)) {
+		c = get_container(dict);
+		pos = tape_dict_find(dict, key, strlen(key));
+		if (!pos)
+			return false;
+		*val_p = tape_node(c->c_ctx, c->u.c_tape.tape, pos, dict);
+		return *val_p != NULL;
+	}
+
+	kjv = dict_lookup(dict, key, strlen(key));
 	if (!kjv)
 		return false;
 	*val_p = get_next(kjv);
@@ -1401,9 +3822,18 @@ bool json_dict_get_opt_dict(struct JsonValue *dict, const char *key, struct Json
 
 bool json_list_get_value(struct JsonValue *list, size_t index, struct JsonValue **val_p)
 {
-	struct JsonValue *val;
 	struct ValueList *vlist;
-	size_t i;
+	struct JsonContainer *c;
+	uint32_t pos;
+
+	if (has_type(list, JSON_LIST) && is_lazy(list)) {
+		c = get_container(list);
+		pos = tape_list_find(list, index);
+		if (!pos)
+			return false;
+		*val_p = tape_node(c->c_ctx, c->u.c_tape.tape, pos, list);
+		return *val_p != NULL;
+	}
 
 	vlist = get_list_vlist(list);
 	if (!vlist)
@@ -1412,25 +3842,8 @@ bool json_list_get_value(struct JsonValue *list, size_t index, struct JsonValue
 	if (index >= list->u.v_size)
 		return false;
 
-	if (!vlist->array && list->u.v_size > 10)
-		prepare_array(list);
-
-	/* direct fetch */
-	if (vlist->array) {
-		*val_p = vlist->array[index];
-		return true;
-	}
-
-	/* walk */
-	val = vlist->first;
-	for (i = 0; val; i++) {
-		if (i == index) {
-			*val_p = val;
-			return true;
-		}
-		val = get_next(val);
-	}
-	return false;
+	*val_p = vlist->items[index];
+	return true;
 }
 
 bool json_list_is_null(struct JsonValue *list, size_t n)
@@ -1499,50 +3912,388 @@ bool json_list_get_dict(struct JsonValue *list, size_t index, struct JsonValue *
  * Iterate over list and dict values.
  */
 
-struct DictIterState {
-	json_dict_iter_callback_f cb_func;
-	void *cb_arg;
-};
+bool json_dict_iter(struct JsonValue *dict, json_dict_iter_callback_f cb_func, void *cb_arg)
+{
+	struct ValueDict *vdict;
+	struct JsonValue *key;
+	size_t i;
 
-static bool dict_iter_helper(void *arg, void *jv)
+	vdict = get_dict_vdict(dict);
+	if (!vdict)
+		return false;
+
+	/* callback may add keys, so keys array is reloaded each time */
+	for (i = 0; i < dict->u.v_size; i++) {
+		key = vdict->keys[i];
+		if (!cb_func(cb_arg, key, get_next(key)))
+			return false;
+	}
+	return true;
+}
+
+bool json_list_iter(struct JsonValue *list, json_list_iter_callback_f cb_func, void *cb_arg)
 {
-	struct DictIterState *state = arg;
-	struct JsonValue *key = jv;
-	struct JsonValue *val = get_next(key);
+	struct ValueList *vlist;
+	size_t i;
+
+	vlist = get_list_vlist(list);
+	if (!vlist)
+		return false;
 
-	return state->cb_func(state->cb_arg, key, val);
+	/* callback may append, array can move */
+	for (i = 0; i < list->u.v_size; i++) {
+		if (!cb_func(cb_arg, vlist->items[i]))
+			return false;
+	}
+	return true;
 }
 
-bool json_dict_iter(struct JsonValue *dict, json_dict_iter_callback_f cb_func, void *cb_arg)
+/*
+ * Path queries.
+ */
+
+enum PathOpType {
+	P_MEMBER,	/* JSON Pointer token: dict key or list index */
+	P_KEY,
+	P_INDEX,
+	P_SLICE,
+	P_WILDCARD,
+};
+
+struct PathOp {
+	enum PathOpType type;
+	bool has_start;
+	bool has_end;
+	int64_t start;		/* index, or slice start; -1 for P_MEMBER non-index */
+	int64_t end;
+	const char *key;
+	size_t key_len;
+};
+
+struct JsonPath {
+	CxMem *cx;
+	unsigned int count;
+	struct PathOp ops[FLEX_ARRAY];
+};
+
+/* callback for first match */
+struct PathFirst {
+	struct JsonValue *val;
+};
+
+static bool path_first_cb(void *arg, struct JsonValue *val)
+{
+	struct PathFirst *first = arg;
+	first->val = val;
+	return false;
+}
+
+/* RFC 6901 array index: digits without leading zero */
+static int64_t pointer_index(const char *s, size_t len)
 {
-	struct DictIterState state;
-	struct CBTree *tree;
+	int64_t val = 0;
+	size_t i;
+
+	if (len == 0 || len > 15 || (s[0] == '0' && len > 1))
+		return -1;
+	for (i = 0; i < len; i++) {
+		if (!is_digit(s[i]))
+			return -1;
+		val = val * 10 + (s[i] - '0');
+	}
+	return val;
+}
 
-	tree = get_dict_tree(dict);
-	if (!tree)
+/* optionally signed int for index and slice */
+static bool path_int(const char **src_p, int64_t *val_p)
+{
+	const char *s = *src_p;
+	bool neg = false;
+	int64_t val = 0;
+	int n = 0;
+
+	if (*s == '-') {
+		neg = true;
+		s++;
+	}
+	while (is_digit(*s) && n++ < 15)
+		val = val * 10 + (*s++ - '0');
+	if (n == 0 || is_digit(*s))
 		return false;
+	*val_p = neg ? -val : val;
+	*src_p = s;
+	return true;
+}
+
+/* "/a/b~1c/0" */
+static bool compile_pointer(struct JsonPath *path, const char *src, char *kbuf)
+{
+	struct PathOp *op;
 
-	state.cb_func = cb_func;
-	state.cb_arg = cb_arg;
-	return cbtree_walk(tree, dict_iter_helper, &state);
+	while (*src) {
+		if (*src++ != '/')
+			return false;
+		op = &path->ops[path->count++];
+		op->type = P_MEMBER;
+		op->key = kbuf;
+		while (*src && *src != '/') {
+			if (*src == '~') {
+				if (src[1] == '0')
+					*kbuf++ = '~';
+				else if (src[1] == '1')
+					*kbuf++ = '/';
+				else
+					return false;
+				src += 2;
+			} else {
+				*kbuf++ = *src++;
+			}
+		}
+		op->key_len = kbuf - op->key;
+		op->start = pointer_index(op->key, op->key_len);
+		*kbuf++ = 0;
+	}
+	return true;
 }
 
-bool json_list_iter(struct JsonValue *list, json_list_iter_callback_f cb_func, void *cb_arg)
+/* "$.a[*].b['x y'][1:3]" */
+static bool compile_expr(struct JsonPath *path, const char *src, char *kbuf)
+{
+	struct PathOp *op;
+	char q;
+
+	if (*src++ != '$')
+		return false;
+	while (*src) {
+		op = &path->ops[path->count++];
+		if (*src == '.') {
+			src++;
+			if (*src == '*') {
+				op->type = P_WILDCARD;
+				src++;
+				continue;
+			}
+			op->type = P_KEY;
+			op->key = kbuf;
+			while (*src && *src != '.' && *src != '[')
+				*kbuf++ = *src++;
+			op->key_len = kbuf - op->key;
+			*kbuf++ = 0;
+			if (op->key_len == 0)
+				return false;
+			continue;
+		}
+		if (*src++ != '[')
+			return false;
+		if (*src == '*') {
+			op->type = P_WILDCARD;
+			src++;
+		} else if (*src == '\'' || *src == '"') {
+			op->type = P_KEY;
+			op->key = kbuf;
+			q = *src++;
+			while (*src != q) {
+				if (*src == '\\' && (src[1] == q || src[1] == '\\'))
+					src++;
+				if (!*src)
+					return false;
+				*kbuf++ = *src++;
+			}
+			src++;
+			op->key_len = kbuf - op->key;
+			*kbuf++ = 0;
+		} else {
+			op->has_start = path_int(&src, &op->start);
+			if (*src == ':') {
+				src++;
+				op->type = P_SLICE;
+				op->has_end = path_int(&src, &op->end);
+			} else if (op->has_start) {
+				op->type = P_INDEX;
+			} else {
+				return false;
+			}
+		}
+		if (*src++ != ']')
+			return false;
+	}
+	return true;
+}
+
+static bool path_walk(const struct JsonPath *path, unsigned int opi, struct JsonValue *jv,
+		      json_list_iter_callback_f cb_func, void *cb_arg);
+
+/* run rest of path on list elements start..end-1 */
+static bool walk_list(const struct JsonPath *path, unsigned int opi, struct JsonValue *list,
+		      int64_t start, int64_t end, json_list_iter_callback_f cb_func, void *cb_arg)
 {
-	struct JsonValue *elem;
 	struct ValueList *vlist;
+	int64_t i;
 
 	vlist = get_list_vlist(list);
 	if (!vlist)
-		return false;
+		return true;
+	for (i = start; i < end && i < (int64_t)list->u.v_size; i++) {
+		if (!path_walk(path, opi, vlist->items[i], cb_func, cb_arg))
+			return false;
+	}
+	return true;
+}
 
-	for (elem = vlist->first; elem; elem = get_next(elem)) {
-		if (!cb_func(cb_arg, elem))
+static bool walk_dict(const struct JsonPath *path, unsigned int opi, struct JsonValue *dict,
+		      json_list_iter_callback_f cb_func, void *cb_arg)
+{
+	struct ValueDict *vdict;
+	size_t i;
+
+	vdict = get_dict_vdict(dict);
+	if (!vdict)
+		return true;
+	for (i = 0; i < dict->u.v_size; i++) {
+		if (!path_walk(path, opi, get_next(vdict->keys[i]), cb_func, cb_arg))
 			return false;
 	}
 	return true;
 }
 
+/* child by key, does not expand lazy dict */
+static struct JsonValue *path_key(struct JsonValue *dict, const char *key, size_t len)
+{
+	struct JsonValue *kjv;
+	struct JsonContainer *c;
+	uint32_t pos;
+
+	if (is_lazy(dict)) {
+		c = get_container(dict);
+		pos = tape_dict_find(dict, key, len);
+		return pos ? tape_node(c->c_ctx, c->u.c_tape.tape, pos, dict) : NULL;
+	}
+	kjv = dict_lookup(dict, key, len);
+	return kjv ? get_next(kjv) : NULL;
+}
+
+/* returns false only when callback stopped the walk */
+static bool path_walk(const struct JsonPath *path, unsigned int opi, struct JsonValue *jv,
+		      json_list_iter_callback_f cb_func, void *cb_arg)
+{
+	const struct PathOp *op;
+	struct JsonValue *child = NULL;
+	int64_t size, start, end;
+
+	if (opi == path->count)
+		return cb_func(cb_arg, jv);
+
+	op = &path->ops[opi++];
+	size = json_value_size(jv);
+	switch (op->type) {
+	case P_MEMBER:
+		if (has_type(jv, JSON_DICT))
+			child = path_key(jv, op->key, op->key_len);
+		else if (has_type(jv, JSON_LIST) && op->start >= 0)
+			json_list_get_value(jv, op->start, &child);
+		break;
+	case P_KEY:
+		if (has_type(jv, JSON_DICT))
+			child = path_key(jv, op->key, op->key_len);
+		break;
+	case P_INDEX:
+		start = op->start < 0 ? op->start + size : op->start;
+		if (has_type(jv, JSON_LIST) && start >= 0)
+			json_list_get_value(jv, start, &child);
+		break;
+	case P_SLICE:
+		if (!has_type(jv, JSON_LIST))
+			break;
+		start = op->has_start ? op->start : 0;
+		end = op->has_end ? op->end : size;
+		if (start < 0)
+			start = (start + size < 0) ? 0 : start + size;
+		if (end < 0)
+			end += size;
+		if (end > size)
+			end = size;
+		return walk_list(path, opi, jv, start, end, cb_func, cb_arg);
+	case P_WILDCARD:
+		if (has_type(jv, JSON_LIST))
+			return walk_list(path, opi, jv, 0, size, cb_func, cb_arg);
+		if (has_type(jv, JSON_DICT))
+			return walk_dict(path, opi, jv, cb_func, cb_arg);
+		break;
+	}
+	if (!child)
+		return true;
+	return path_walk(path, opi, child, cb_func, cb_arg);
+}
+
+struct JsonPath *json_path_compile(const void *cx_mem, const char *src)
+{
+	CxMem *cx = (CxMem *)cx_mem;
+	struct JsonPath *path;
+	size_t len = strlen(src);
+	size_t nops, ops_size;
+	const char *s;
+	bool ok;
+
+	/* each op starts with one of these */
+	for (nops = 0, s = src; *s; s++)
+		nops += (*s == '/' || *s == '.' || *s == '[');
+
+	/* unescaped keys go after ops */
+	ops_size = offsetof(struct JsonPath, ops) + nops * sizeof(struct PathOp);
+	path = cx_alloc0(cx, ops_size + len + nops + 1);
+	if (!path)
+		return NULL;
+	path->cx = cx;
+
+	if (*src == '$')
+		ok = compile_expr(path, src, (char *)path + ops_size);
+	else
+		ok = compile_pointer(path, src, (char *)path + ops_size);
+	if (!ok) {
+		cx_free(cx, path);
+		return NULL;
+	}
+	return path;
+}
+
+void json_path_free(struct JsonPath *path)
+{
+	if (path)
+		cx_free(path->cx, path);
+}
+
+bool json_path_iter(const struct JsonPath *path, struct JsonValue *jv,
+		    json_list_iter_callback_f cb_func, void *cb_arg)
+{
+	return path_walk(path, 0, jv, cb_func, cb_arg);
+}
+
+bool json_path_get(const struct JsonPath *path, struct JsonValue *jv, struct JsonValue **val_p)
+{
+	struct PathFirst first = { NULL };
+
+	path_walk(path, 0, jv, path_first_cb, &first);
+	if (!first.val)
+		return false;
+	*val_p = first.val;
+	return true;
+}
+
+bool json_pointer_get(struct JsonValue *jv, const char *pointer, struct JsonValue **val_p)
+{
+	struct JsonPath *path;
+	bool res;
+
+	if (*pointer == '$')
+		return false;
+	path = json_path_compile(NULL, pointer);
+	if (!path)
+		return false;
+	res = json_path_get(path, jv, val_p);
+	json_path_free(path);
+	return res;
+}
+
 /*
  * Create new values.
  */
@@ -1626,13 +4377,14 @@ bool json_list_append(struct JsonValue *list, struct JsonValue *val)
 {
 	if (!val)
 		return false;
-	if (!has_type(list, JSON_LIST))
+	if (!get_list_vlist(list))
 		return false;
 	if (!is_unattached(val))
 		return false;
+	if (!real_list_append(get_context(list), list, val))
+		return false;
 	set_parent(val, list);
 	set_next(val, NULL);
-	real_list_append(list, val);
 	return true;
 }
 
@@ -1762,6 +4514,11 @@ struct JsonContext *json_new_context(const void *cx, size_t initial_mem)
 		return NULL;
 	}
 	ctx->pool = pool;
+	cx_pool_mark(pool, &ctx->pool_start);
+	mbuf_init_dynamic_cx(&ctx->nest, (CxMem *)cx);
+	mbuf_init_dynamic_cx(&ctx->carry, (CxMem *)cx);
+	mbuf_init_dynamic_cx(&ctx->strbuf, (CxMem *)cx);
+	mbuf_init_dynamic_cx(&ctx->tapebuf, (CxMem *)cx);
 	return ctx;
 }
 
@@ -1769,11 +4526,24 @@ void json_free_context(struct JsonContext *ctx)
 {
 	if (ctx) {
 		CxMem *pool = ctx->pool;
+		mbuf_free(&ctx->nest);
+		mbuf_free(&ctx->carry);
+		mbuf_free(&ctx->strbuf);
+		mbuf_free(&ctx->tapebuf);
 		memset(ctx, 0, sizeof(*ctx));
 		cx_destroy(pool);
 	}
 }
 
+void json_reset_context(struct JsonContext *ctx)
+{
+	cx_pool_rewind(ctx->pool, &ctx->pool_start);
+	json_parse_start(ctx, NULL, NULL);
+	mbuf_rewind_writer(&ctx->strbuf);
+	mbuf_rewind_writer(&ctx->tapebuf);
+	ctx->errbuf[0] = 0;
+}
+
 const char *json_strerror(struct JsonContext *ctx)
 {
 	return ctx->lasterr;
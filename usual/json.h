@@ -26,6 +26,13 @@
  * - Strict UTF8 validation.
  * - Full int64_t and double passthrough, except NaN and +-Infinity.
  * - Proper number I/O even in weird locales.
+ * - Incremental parsing over chunks, with callbacks instead of tree.
+ * - Dicts keep key order, lookups go through hash index.
+ * - Lazy parsing, values are created only when accessed.
+ * - Streaming writer that does not need value tree.
+ * - JSON Pointer and path queries.
+ * - Parsing straight into C structs.
+ * - CBOR encoding and decoding.
  *
  * Optional features for JSON config files, off by default:
  * - Allow C comments.
@@ -92,6 +99,15 @@ typedef bool (*json_list_iter_callback_f)(void *arg, struct JsonValue *elem);
 struct JsonContext *json_new_context(const void *cx_mem, size_t initial_mem);
 /** Create allocation context */
 void json_free_context(struct JsonContext *ctx);
+/**
+ * Forget all values, but keep memory for next document.
+ *
+ * Pool goes back to state after json_new_context(), keeping
+ * initial area and largest extra segment.  Parse state and
+ * error are cleared, options stay.  All values created
+ * in context become invalid.
+ */
+void json_reset_context(struct JsonContext *ctx);
 /** Create allocation context */
 const char *json_strerror(struct JsonContext *ctx);
 
@@ -109,6 +125,173 @@ struct JsonValue *json_parse(struct JsonContext *ctx, const char *src, size_t le
 /** Set parsing options */
 void json_set_options(struct JsonContext *ctx, unsigned int options);
 
+/**
+ * Parse JSON string lazily.
+ *
+ * Document is validated into flat tape of tokens, values are
+ * created only when getter functions reach them.  Strings are
+ * copied and unescaped on access.  Iterating, rendering or
+ * modifying a container creates all its direct children.
+ * First indexed access to a lazy list records positions of
+ * all its elements, after that it is O(1) like on normal list.
+ *
+ * Source is not copied, it must stay unchanged while values
+ * from it are used.  Duplicate keys are detected only when
+ * dict is fully created.
+ */
+struct JsonValue *json_parse_lazy(struct JsonContext *ctx, const char *src, size_t length);
+
+/**
+ * @}
+ *
+ * @name Incremental parsing
+ *
+ * Input can be given in chunks that are split at any byte.
+ * Token that is cut at end of chunk is kept in context
+ * until next chunk, so memory use depends only on largest
+ * token and chunk size, not on document size.
+ *
+ * @{
+ */
+
+/**
+ * Parser events.
+ *
+ * All callbacks are optional.  Strings are not zero-terminated
+ * and are valid only during callback.  Returning false stops
+ * parsing with error, unless callback has set its own.
+ */
+struct JsonEvents {
+	bool (*start_dict)(void *arg);		/**< '{' */
+	bool (*end_dict)(void *arg);		/**< '}' */
+	bool (*start_list)(void *arg);		/**< '[' */
+	bool (*end_list)(void *arg);		/**< ']' */
+	bool (*key)(void *arg, const char *key, size_t len);	/**< dict key */
+	bool (*null_value)(void *arg);				/**< null */
+	bool (*bool_value)(void *arg, bool val);		/**< true or false */
+	bool (*int_value)(void *arg, int64_t val);		/**< integer */
+	bool (*float_value)(void *arg, double val);		/**< float */
+	bool (*string_value)(void *arg, const char *str, size_t len);	/**< string value */
+};
+
+/**
+ * Start incremental parsing.
+ *
+ * With events NULL, values are built into tree like json_parse() does.
+ */
+void json_parse_start(struct JsonContext *ctx, const struct JsonEvents *events, void *arg);
+
+/** Parse next chunk */
+bool json_parse_feed(struct JsonContext *ctx, const char *src, size_t length);
+
+/**
+ * End of input, check that document is complete.
+ *
+ * If top_p is given, top value of tree is stored there,
+ * NULL when callbacks were used.
+ */
+bool json_parse_finish(struct JsonContext *ctx, struct JsonValue **top_p);
+
+/**
+ * @}
+ *
+ * @name Bind to C struct
+ *
+ * Table of JsonBind entries describes how dict keys map to
+ * struct fields.  json_bind_parse() runs parser with events
+ * that write values straight into struct, without value tree.
+ *
+ * Types are checked, ints must fit into field and may be
+ * range-checked.  Unknown keys are ignored, unless
+ * JSON_BIND_STRICT is given.  Fields for missing keys
+ * are not touched, so defaults can be set beforehand.
+ *
+ * Example:
+ * @code
+ * struct Foo { int port; char *host; };
+ * #define JSON_BIND_BASE struct Foo
+ * static const struct JsonBind foo_binds[] = {
+ *	JSON_BIND_RANGE("port", JSON_BIND_INT, port, JSON_BIND_REQUIRED, 1, 65535),
+ *	JSON_BIND("host", JSON_BIND_STRING, host, 0),
+ *	{ NULL }
+ * };
+ * #undef JSON_BIND_BASE
+ * @endcode
+ *
+ * @{
+ */
+
+/** Field types for JsonBind */
+enum JsonBindType {
+	JSON_BIND_BOOL = 1,	/**< bool */
+	JSON_BIND_INT,		/**< int */
+	JSON_BIND_UINT,		/**< unsigned int */
+	JSON_BIND_INT64,	/**< int64_t */
+	JSON_BIND_DOUBLE,	/**< double, accepts ints too */
+	JSON_BIND_STRING,	/**< char *, allocated from context, null gives NULL */
+	JSON_BIND_STRBUF,	/**< char array, too long string is error */
+	JSON_BIND_DICT,		/**< nested struct, extra is its JsonBind table */
+};
+
+/** Key must be present */
+#define JSON_BIND_REQUIRED	1
+/** Check numeric value against min and max */
+#define JSON_BIND_CHECK_RANGE	2
+
+/** Option for json_bind_parse(): error on unknown keys */
+#define JSON_BIND_STRICT	1
+
+/** Max nesting of JSON_BIND_DICT */
+#define JSON_BIND_DEPTH		16
+
+/** Max number of keys in one table */
+#define JSON_BIND_MAX_KEYS	64
+
+/**
+ * Binding for one key.  Table ends with NULL key_name.
+ */
+struct JsonBind {
+	/** Key name */
+	const char *key_name;
+	/** Field type */
+	enum JsonBindType type;
+	/** Flags: JSON_BIND_REQUIRED, JSON_BIND_CHECK_RANGE */
+	unsigned int flags;
+	/** Field offset in struct */
+	size_t field_ofs;
+	/** Field size */
+	size_t field_size;
+	/** Nested table for JSON_BIND_DICT */
+	const struct JsonBind *extra;
+	/** Range for JSON_BIND_CHECK_RANGE */
+	double min, max;
+};
+
+/**
+ * Binding for field in struct JSON_BIND_BASE.
+ */
+#define JSON_BIND(name, type, field, flags) \
+	{ name, type, flags, offsetof(JSON_BIND_BASE, field), \
+	  sizeof(((JSON_BIND_BASE *)0)->field), NULL, 0, 0 }
+
+/** Binding with range check */
+#define JSON_BIND_RANGE(name, type, field, flags, min, max) \
+	{ name, type, (flags) | JSON_BIND_CHECK_RANGE, offsetof(JSON_BIND_BASE, field), \
+	  sizeof(((JSON_BIND_BASE *)0)->field), NULL, min, max }
+
+/** Binding for nested struct, described by table sub */
+#define JSON_BIND_SUB(name, field, flags, sub) \
+	{ name, JSON_BIND_DICT, flags, offsetof(JSON_BIND_BASE, field), \
+	  sizeof(((JSON_BIND_BASE *)0)->field), sub, 0, 0 }
+
+/**
+ * Parse JSON dict into struct at base.
+ *
+ * On error, struct may be partially filled.
+ */
+bool json_bind_parse(struct JsonContext *ctx, const struct JsonBind *binds, void *base,
+		     unsigned int options, const char *src, size_t length);
+
 /**
  * @}
  *
@@ -227,12 +410,55 @@ bool json_list_get_dict(struct JsonValue *list, size_t index, struct JsonValue *
  * @{
  */
 
-/** Walk over dict elements */
+/** Walk over dict elements, in insertion order */
 bool json_dict_iter(struct JsonValue *dict, json_dict_iter_callback_f cb_func, void *cb_arg);
 
 /** Walk over list elements */
 bool json_list_iter(struct JsonValue *list, json_list_iter_callback_f cb_func, void *cb_arg);
 
+/**
+ * @}
+ *
+ * @name Path queries.
+ *
+ * Path is compiled once and can be run on any number of trees.
+ * Two syntaxes are accepted:
+ *
+ * - RFC 6901 JSON Pointer: "" or "/a/0/b~1c".
+ * - Path expression starting with "$": ".key", "['key']",
+ *   "[2]", "[-1]" (from end), "[1:3]", "[:-1]" (slices),
+ *   ".*" or "[*]" (all elements of list or dict).
+ *
+ * Key and index steps on lazily parsed containers look into
+ * tape without creating other children.  Wildcards and slices
+ * create all direct children of container they walk.
+ *
+ * @{
+ */
+
+/**
+ * @struct JsonPath
+ *
+ * Compiled path.
+ */
+struct JsonPath;
+
+/** Compile path, NULL on syntax error or if out of memory */
+struct JsonPath *json_path_compile(const void *cx_mem, const char *path);
+/** Free compiled path */
+void json_path_free(struct JsonPath *path);
+/** Get first value that matches path */
+bool json_path_get(const struct JsonPath *path, struct JsonValue *jv, struct JsonValue **val_p);
+/**
+ * Call cb_func for each match, in document order.
+ *
+ * Returns false if callback stopped iteration.
+ */
+bool json_path_iter(const struct JsonPath *path, struct JsonValue *jv,
+		    json_list_iter_callback_f cb_func, void *cb_arg);
+/** Get value by JSON Pointer, without keeping compiled path */
+bool json_pointer_get(struct JsonValue *jv, const char *pointer, struct JsonValue **val_p);
+
 /**
  * @}
  *
@@ -241,9 +467,132 @@ bool json_list_iter(struct JsonValue *list, json_list_iter_callback_f cb_func, v
  * @{
  */
 
+/** Options for json_render_opts(). */
+enum JsonRenderOptions {
+	/** Newlines and JSON_RENDER_INDENT spaces per level. */
+	JSON_RENDER_PRETTY = 1,
+	/** Dict keys in sorted order, instead of insertion order. */
+	JSON_RENDER_SORT_KEYS = 2,
+	/**
+	 * RFC 8785 canonical form: compact, sorted keys,
+	 * ECMAScript number format and minimal string escaping.
+	 * Same data gives same bytes, so output can be hashed
+	 * or signed.
+	 */
+	JSON_RENDER_CANONICAL = 4,
+};
+
+/** Indent step for JSON_RENDER_PRETTY */
+#define JSON_RENDER_INDENT	2
+
 /** Render JSON object as string */
 bool json_render(struct MBuf *dst, struct JsonValue *jv);
 
+/**
+ * Render JSON object with options.
+ *
+ * If max_bytes is not 0, rendering stops when output would
+ * be longer and false is returned.  dst then has at most
+ * max_bytes of partial output.
+ */
+bool json_render_opts(struct MBuf *dst, struct JsonValue *jv, unsigned int options, size_t max_bytes);
+
+/**
+ * @}
+ *
+ * @name Streaming writer.
+ *
+ * Writes JSON directly into MBuf without creating values.
+ * Output is escaped same way as json_render() does.
+ *
+ * Nesting is checked: value where key is expected, wrong
+ * closing call or second top-level value makes the call
+ * fail.  Strings and keys must be valid UTF-8.  Failed call
+ * leaves no partial output in MBuf, also when MBuf cannot grow,
+ * and makes jw_finish() return false.
+ *
+ * To send over chained buffer, write into MBuf and move it
+ * with mbuf_chain_write_mbuf() after each batch.
+ *
+ * @{
+ */
+
+/** Max container depth for JsonWriter */
+#define JSON_WRITER_DEPTH	64
+
+/** Writer state.  Allocated by user, can be in stack. */
+struct JsonWriter {
+	struct MBuf *dst;
+	unsigned int depth;
+	bool sep;
+	bool done;
+	bool failed;
+	uint8_t stack[JSON_WRITER_DEPTH];
+};
+
+/** Start writing one top-level value into dst */
+void jw_init(struct JsonWriter *jw, struct MBuf *dst);
+/** Start dict */
+bool jw_begin_dict(struct JsonWriter *jw);
+/** End dict */
+bool jw_end_dict(struct JsonWriter *jw);
+/** Start list */
+bool jw_begin_list(struct JsonWriter *jw);
+/** End list */
+bool jw_end_list(struct JsonWriter *jw);
+/** Write dict key, next call must write its value */
+bool jw_key(struct JsonWriter *jw, const char *key);
+/** Write dict key with length */
+bool jw_key_len(struct JsonWriter *jw, const char *key, size_t len);
+/** Write null */
+bool jw_null(struct JsonWriter *jw);
+/** Write bool */
+bool jw_bool(struct JsonWriter *jw, bool val);
+/** Write int */
+bool jw_int(struct JsonWriter *jw, int64_t val);
+/** Write float, NaN and Infinity are refused */
+bool jw_float(struct JsonWriter *jw, double val);
+/** Write string */
+bool jw_string(struct JsonWriter *jw, const char *str);
+/** Write string with length */
+bool jw_string_len(struct JsonWriter *jw, const char *str, size_t len);
+/** Write existing value tree */
+bool jw_value(struct JsonWriter *jw, struct JsonValue *jv);
+/** Return true if top-level value is complete and no call failed */
+bool jw_finish(struct JsonWriter *jw);
+
+/**
+ * @}
+ *
+ * @name CBOR encoding.
+ *
+ * Binary form of same values, as described in RFC 8949.
+ * Ints and floats keep their type, floats are written in
+ * shortest form that keeps the value.
+ *
+ * Decoder accepts definite and indefinite lengths and ignores
+ * tags.  Byte strings, undefined and other simple values are
+ * refused as they have no JSON type, ints must be in same range
+ * as for text parser.  Strings are UTF8-validated, unless
+ * JSON_PARSE_IGNORE_ENCODING is set.
+ *
+ * @{
+ */
+
+/** Encode value as CBOR into dst */
+bool json_render_cbor(struct MBuf *dst, struct JsonValue *jv);
+
+/** Decode single CBOR item into value tree */
+struct JsonValue *json_parse_cbor(struct JsonContext *ctx, const void *src, size_t length);
+
+/**
+ * Decode single CBOR item, calling events instead of creating tree.
+ *
+ * Callbacks work same way as with json_parse_start().
+ */
+bool json_parse_cbor_events(struct JsonContext *ctx, const struct JsonEvents *events, void *arg,
+			    const void *src, size_t length);
+
 /**
  * @}
  *
@@ -4,32 +4,471 @@
  */
 
 #include <usual/mbuf.h>
+#include <usual/safeio.h>
 
-bool mbuf_make_room(struct MBuf *buf, unsigned len)
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#include <fcntl.h>
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#ifndef WORDS_BIGENDIAN
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#define MBUF_SWAP_SSSE3
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define MBUF_SWAP_NEON
+#endif
+#endif
+
+size_t mbuf_grow_double(size_t cur_len, size_t need, size_t step)
+{
+	size_t new_alloc = cur_len ? cur_len : step;
+
+	while (new_alloc < need) {
+		if (new_alloc > SIZE_MAX / 2)
+			return need;
+		new_alloc *= 2;
+	}
+	return new_alloc;
+}
+
+size_t mbuf_grow_half(size_t cur_len, size_t need, size_t step)
+{
+	size_t new_alloc = cur_len ? cur_len : step;
+
+	while (new_alloc < need) {
+		if (new_alloc > SIZE_MAX / 3 * 2)
+			return need;
+		new_alloc += (new_alloc + 1) / 2;
+	}
+	return new_alloc;
+}
+
+size_t mbuf_grow_fixed(size_t cur_len, size_t need, size_t step)
+{
+	if (need > SIZE_MAX - step)
+		return need;
+	return (need + step - 1) / step * step;
+}
+
+/*
+ * Ring buffer.
+ *
+ * Data area is mapped twice, so data + read_pos is valid for
+ * ring_size bytes even when it crosses end of ring.  Positions
+ * only grow until writer needs room, then they are moved back
+ * to first mapping and alloc_len is set to end of free space.
+ */
+
+/* move positions back to first mapping, update room for writing */
+static void ring_sync(struct MBuf *buf)
+{
+	if (buf->read_pos == buf->write_pos) {
+		buf->read_pos = 0;
+		buf->write_pos = 0;
+	} else if (buf->read_pos >= buf->ring_size) {
+		buf->read_pos -= buf->ring_size;
+		buf->write_pos -= buf->ring_size;
+	}
+	buf->alloc_len = buf->read_pos + buf->ring_size;
+}
+
+#ifdef HAVE_MMAP
+
+/* anonymous shared memory object */
+static int ring_open(void)
+{
+	int fd;
+#ifdef HAVE_MEMFD_CREATE
+	fd = memfd_create("mbuf-ring", MFD_CLOEXEC);
+#else
+	char fn[] = "/tmp/mbuf-ring-XXXXXX";
+	fd = mkstemp(fn);
+	if (fd >= 0)
+		unlink(fn);
+#endif
+	return fd;
+}
+
+bool mbuf_init_ring(struct MBuf *buf, size_t size)
+{
+	size_t pgsize = sysconf(_SC_PAGESIZE);
+	uint8_t *area, *p1, *p2;
+	int fd;
+
+	memset(buf, 0, sizeof(*buf));
+	if (size == 0 || size > SIZE_MAX / 2 - pgsize)
+		return false;
+	size = CUSTOM_ALIGN(size, pgsize);
+
+	fd = ring_open();
+	if (fd < 0)
+		return false;
+	if (ftruncate(fd, size) < 0)
+		goto failed;
+
+	/* reserve address space, then map same pages to both halves */
+	area = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (area == MAP_FAILED)
+		goto failed;
+	p1 = mmap(area, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+	p2 = mmap(area + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+	if (p1 != area || p2 != area + size) {
+		munmap(area, 2 * size);
+		goto failed;
+	}
+	close(fd);
+
+	buf->data = area;
+	buf->alloc_len = size;
+	buf->ring_size = size;
+	return true;
+failed:
+	close(fd);
+	return false;
+}
+
+static void ring_free(struct MBuf *buf)
+{
+	munmap(buf->data, 2 * buf->ring_size);
+}
+
+#else
+
+bool mbuf_init_ring(struct MBuf *buf, size_t size)
 {
-	unsigned new_alloc = buf->alloc_len;
+	memset(buf, 0, sizeof(*buf));
+	errno = ENOSYS;
+	return false;
+}
+
+static void ring_free(struct MBuf *buf)
+{
+}
+
+#endif
+
+void mbuf_free(struct MBuf *buf)
+{
+	if (buf->data) {
+		if (buf->ring_size)
+			ring_free(buf);
+		else if (!buf->fixed)
+			cx_free(buf->cx, buf->data);
+		memset(buf, 0, sizeof(*buf));
+	}
+}
+
+bool mbuf_make_room(struct MBuf *buf, size_t len)
+{
+	mbuf_grow_f grow = buf->grow ? buf->grow : mbuf_grow_double;
+	size_t step = buf->grow_step ? buf->grow_step : MBUF_GROW_STEP;
+	size_t new_alloc;
 	void *ptr;
 
+	/* ring cannot grow, only reuse consumed space */
+	if (buf->ring_size) {
+		ring_sync(buf);
+		return len <= buf->alloc_len - buf->write_pos;
+	}
+
 	/* is it a dynamic buffer */
 	if (buf->reader || buf->fixed)
 		return false;
 
 	/* maybe there is enough room already */
-	if (buf->write_pos + len <= buf->alloc_len)
+	if (len <= buf->alloc_len - buf->write_pos)
 		return true;
 
-	if (new_alloc == 0)
-		new_alloc = 128;
-
 	/* calc new alloc size */
-	while (new_alloc < buf->write_pos + len)
-		new_alloc *= 2;
+	if (len > SIZE_MAX - buf->write_pos)
+		return false;
+	new_alloc = grow(buf->alloc_len, buf->write_pos + len, step);
+	if (new_alloc < buf->write_pos + len)
+		return false;
 
 	/* realloc */
-	ptr = realloc(buf->data, new_alloc);
+	ptr = cx_realloc(buf->cx, buf->data, new_alloc);
 	if (!ptr)
 		return false;
 	buf->data = ptr;
 	buf->alloc_len = new_alloc;
 	return true;
 }
+
+bool mbuf_shrink_to_fit(struct MBuf *buf)
+{
+	void *ptr;
+
+	if (buf->reader || buf->fixed || buf->ring_size)
+		return false;
+	if (buf->alloc_len == buf->write_pos)
+		return true;
+
+	if (buf->write_pos == 0) {
+		cx_free(buf->cx, buf->data);
+		ptr = NULL;
+	} else {
+		ptr = cx_realloc(buf->cx, buf->data, buf->write_pos);
+		if (!ptr)
+			return false;
+	}
+	buf->data = ptr;
+	buf->alloc_len = buf->write_pos;
+	return true;
+}
+
+/*
+ * Socket I/O.
+ */
+
+ssize_t mbuf_recv(struct MBuf *buf, int fd, int flags)
+{
+	size_t step = buf->grow_step ? buf->grow_step : MBUF_GROW_STEP;
+	ssize_t res;
+
+	if (buf->ring_size)
+		ring_sync(buf);
+	if (buf->write_pos >= buf->alloc_len && !mbuf_make_room(buf, step)) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	res = safe_recv(fd, buf->data + buf->write_pos, buf->alloc_len - buf->write_pos, flags);
+	if (res > 0)
+		buf->write_pos += res;
+	return res;
+}
+
+ssize_t mbuf_send(struct MBuf *buf, int fd, int flags)
+{
+	size_t avail = mbuf_avail_for_read(buf);
+	ssize_t res;
+
+	if (avail == 0)
+		return 0;
+	res = safe_send(fd, buf->data + buf->read_pos, avail, flags);
+	if (res > 0)
+		buf->read_pos += res;
+	return res;
+}
+
+/*
+ * Bulk encoding.
+ */
+
+/* copy count integers of width bytes, converting between host and big-endian */
+static void swap_copy(uint8_t *dst, const uint8_t *src, size_t count, unsigned width)
+{
+	size_t len = count * width;
+#ifdef MBUF_SWAP_SSSE3
+	__m128i mask, v;
+#endif
+
+#ifdef WORDS_BIGENDIAN
+	memcpy(dst, src, len);
+	return;
+#endif
+
+#if defined(MBUF_SWAP_SSSE3)
+	if (width == 2)
+		mask = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	else if (width == 4)
+		mask = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	else
+		mask = _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+	for (; len >= 16; len -= 16, src += 16, dst += 16) {
+		v = _mm_loadu_si128((const __m128i *)src);
+		_mm_storeu_si128((__m128i *)dst, _mm_shuffle_epi8(v, mask));
+	}
+#elif defined(MBUF_SWAP_NEON)
+	for (; len >= 16; len -= 16, src += 16, dst += 16) {
+		uint8x16_t v = vld1q_u8(src);
+		if (width == 2)
+			v = vrev16q_u8(v);
+		else if (width == 4)
+			v = vrev32q_u8(v);
+		else
+			v = vrev64q_u8(v);
+		vst1q_u8(dst, v);
+	}
+#endif
+
+	/* tail, or everything without SIMD */
+	switch (width) {
+	case 2:
+		for (; len > 0; len -= 2, src += 2, dst += 2)
+			h16enc(dst, be16dec(src));
+		break;
+	case 4:
+		for (; len > 0; len -= 4, src += 4, dst += 4)
+			h32enc(dst, be32dec(src));
+		break;
+	default:
+		for (; len > 0; len -= 8, src += 8, dst += 8)
+			h64enc(dst, be64dec(src));
+		break;
+	}
+}
+
+static bool get_array(struct MBuf *buf, void *dst, size_t count, unsigned width)
+{
+	if (count > mbuf_avail_for_read(buf) / width)
+		return false;
+	swap_copy(dst, buf->data + buf->read_pos, count, width);
+	buf->read_pos += count * width;
+	return true;
+}
+
+static bool write_array(struct MBuf *buf, const void *src, size_t count, unsigned width)
+{
+	size_t len;
+
+	if (count > SIZE_MAX / width)
+		return false;
+	len = count * width;
+	if (len > buf->alloc_len - buf->write_pos
+	    && !mbuf_make_room(buf, len))
+		return false;
+	swap_copy(buf->data + buf->write_pos, src, count, width);
+	buf->write_pos += len;
+	return true;
+}
+
+bool mbuf_get_uint16be_array(struct MBuf *buf, uint16_t *dst, size_t count)
+{
+	return get_array(buf, dst, count, 2);
+}
+
+bool mbuf_get_uint32be_array(struct MBuf *buf, uint32_t *dst, size_t count)
+{
+	return get_array(buf, dst, count, 4);
+}
+
+bool mbuf_get_uint64be_array(struct MBuf *buf, uint64_t *dst, size_t count)
+{
+	return get_array(buf, dst, count, 8);
+}
+
+bool mbuf_write_uint16be_array(struct MBuf *buf, const uint16_t *src, size_t count)
+{
+	return write_array(buf, src, count, 2);
+}
+
+bool mbuf_write_uint32be_array(struct MBuf *buf, const uint32_t *src, size_t count)
+{
+	return write_array(buf, src, count, 4);
+}
+
+bool mbuf_write_uint64be_array(struct MBuf *buf, const uint64_t *src, size_t count)
+{
+	return write_array(buf, src, count, 8);
+}
+
+/*
+ * LEB128 varints, 7 bits per byte, low bits first.
+ */
+
+#define VARINT_MAX 10
+
+/* returns bytes used, 0 if truncated or too long */
+static inline size_t varint_dec(const uint8_t *p, size_t avail, uint64_t *dst_p)
+{
+	uint64_t val = 0;
+	size_t i, max = avail < VARINT_MAX ? avail : VARINT_MAX;
+
+	for (i = 0; i < max; i++) {
+		val |= (uint64_t)(p[i] & 0x7F) << (7 * i);
+		if (p[i] < 0x80) {
+			/* last byte can carry only 1 bit */
+			if (i == VARINT_MAX - 1 && p[i] > 1)
+				return 0;
+			*dst_p = val;
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+static inline size_t varint_enc(uint8_t *p, uint64_t val)
+{
+	size_t n = 0;
+
+	while (val >= 0x80) {
+		p[n++] = (uint8_t)val | 0x80;
+		val >>= 7;
+	}
+	p[n++] = val;
+	return n;
+}
+
+bool mbuf_get_varint(struct MBuf *buf, uint64_t *dst_p)
+{
+	size_t n;
+
+	n = varint_dec(buf->data + buf->read_pos, mbuf_avail_for_read(buf), dst_p);
+	buf->read_pos += n;
+	return n > 0;
+}
+
+bool mbuf_get_svarint(struct MBuf *buf, int64_t *dst_p)
+{
+	uint64_t v;
+
+	if (!mbuf_get_varint(buf, &v))
+		return false;
+	*dst_p = (int64_t)((v >> 1) ^ (0 - (v & 1)));
+	return true;
+}
+
+bool mbuf_get_varint_array(struct MBuf *buf, uint64_t *dst, size_t count)
+{
+	size_t start = buf->read_pos;
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		if (!mbuf_get_varint(buf, &dst[i])) {
+			buf->read_pos = start;
+			return false;
+		}
+	}
+	return true;
+}
+
+bool mbuf_write_varint(struct MBuf *buf, uint64_t val)
+{
+	uint8_t tmp[VARINT_MAX];
+
+	/* encode in place if there is room for longest value */
+	if (buf->alloc_len - buf->write_pos >= VARINT_MAX && !buf->reader) {
+		buf->write_pos += varint_enc(buf->data + buf->write_pos, val);
+		return true;
+	}
+	return mbuf_write(buf, tmp, varint_enc(tmp, val));
+}
+
+bool mbuf_write_svarint(struct MBuf *buf, int64_t val)
+{
+	uint64_t v = (uint64_t)val;
+
+	return mbuf_write_varint(buf, (v << 1) ^ (0 - (v >> 63)));
+}
+
+bool mbuf_write_varint_array(struct MBuf *buf, const uint64_t *src, size_t count)
+{
+	size_t start = buf->write_pos;
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		if (!mbuf_write_varint(buf, src[i])) {
+			buf->write_pos = start;
+			return false;
+		}
+	}
+	return true;
+}
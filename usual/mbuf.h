@@ -6,16 +6,35 @@
 #ifndef _USUAL_MBUF_H_
 #define _USUAL_MBUF_H_
 
-#include <usual/base.h>
+#include <usual/cxalloc.h>
+#include <usual/endian.h>
 
 #include <string.h>
 
+struct MBuf;
+
+/**
+ * Growth policy for dynamic buffer.
+ *
+ * Returns new allocation size that is at least need bytes.
+ * cur_len is current allocation size, 0 if nothing is allocated yet.
+ * step is value given to mbuf_set_growth().
+ */
+typedef size_t (*mbuf_grow_f)(size_t cur_len, size_t need, size_t step);
+
+/** Default step for growth policy */
+#define MBUF_GROW_STEP	128
+
 /** MBuf structure.  Allocated by user, can be in stack. */
 struct MBuf {
 	uint8_t *data;
-	unsigned read_pos;
-	unsigned write_pos;
-	unsigned alloc_len;
+	size_t read_pos;
+	size_t write_pos;
+	size_t alloc_len;
+	CxMem *cx;		/* allocator for dynamic buffer, NULL for default */
+	mbuf_grow_f grow;	/* growth policy, NULL for doubling */
+	size_t grow_step;	/* argument for grow, 0 for default */
+	size_t ring_size;	/* size of ring, 0 if not ring */
 	bool reader;
 	bool fixed;
 };
@@ -23,55 +42,108 @@ struct MBuf {
 /** Format fragment for *printf() */
 #define MBUF_FMT	".*s"
 /** Argument layout for *printf() */
-#define MBUF_ARG(m)	((m) ? mbuf_written(m) : 6), ((m) ? (const char *)mbuf_data(m) : "(null)")
+#define MBUF_ARG(m)	((m) ? (int)mbuf_written(m) : 6), ((m) ? (const char *)mbuf_data(m) : "(null)")
+
+/**
+ * @name Growth policies.
+ *
+ * @{
+ */
+
+/** Double the size, start from step bytes.  Default. */
+size_t mbuf_grow_double(size_t cur_len, size_t need, size_t step);
+
+/** Grow by half, start from step bytes.  Wastes less memory on big buffers. */
+size_t mbuf_grow_half(size_t cur_len, size_t need, size_t step);
+
+/** Round up to multiple of step.  Memory use stays close to data size. */
+size_t mbuf_grow_fixed(size_t cur_len, size_t need, size_t step);
+
+/** @} */
 
 /*
  * Init functions
  */
 
 /** Initialize R/O buffer to fixed memory area. */
-static inline void mbuf_init_fixed_reader(struct MBuf *buf, const void *ptr, unsigned len)
+static inline void mbuf_init_fixed_reader(struct MBuf *buf, const void *ptr, size_t len)
 {
 	buf->data = (uint8_t *)ptr;
 	buf->read_pos = 0;
 	buf->write_pos = len;
 	buf->alloc_len = len;
+	buf->cx = NULL;
+	buf->grow = NULL;
+	buf->grow_step = 0;
+	buf->ring_size = 0;
 	buf->reader = true;
 	buf->fixed = true;
 }
 
 /** Initialize R/W buffer to fixed memory area. */
-static inline void mbuf_init_fixed_writer(struct MBuf *buf, void *ptr, unsigned len)
+static inline void mbuf_init_fixed_writer(struct MBuf *buf, void *ptr, size_t len)
 {
 	buf->data = (uint8_t *)ptr;
 	buf->read_pos = 0;
 	buf->write_pos = 0;
 	buf->alloc_len = len;
+	buf->cx = NULL;
+	buf->grow = NULL;
+	buf->grow_step = 0;
+	buf->ring_size = 0;
 	buf->reader = false;
 	buf->fixed = true;
 }
 
-/** Initialize R/W buffer to dynamically allocated memory area.  */
-static inline void mbuf_init_dynamic(struct MBuf *buf)
+/** Initialize R/W buffer to memory area allocated from cx. */
+static inline void mbuf_init_dynamic_cx(struct MBuf *buf, CxMem *cx)
 {
 	buf->data = NULL;
 	buf->read_pos = 0;
 	buf->write_pos = 0;
 	buf->alloc_len = 0;
+	buf->cx = cx;
+	buf->grow = NULL;
+	buf->grow_step = 0;
+	buf->ring_size = 0;
 	buf->reader = false;
 	buf->fixed = false;
 }
 
-/** Free dynamically allocated area, if exists. */
-static inline void mbuf_free(struct MBuf *buf)
+/** Initialize R/W buffer to dynamically allocated memory area.  */
+static inline void mbuf_init_dynamic(struct MBuf *buf)
 {
-	if (buf->data) {
-		if (!buf->fixed)
-			free(buf->data);
-		memset(buf, 0, sizeof(*buf));
-	}
+	mbuf_init_dynamic_cx(buf, NULL);
+}
+
+/**
+ * Set growth policy for dynamic buffer.
+ *
+ * NULL func means mbuf_grow_double(), 0 step means MBUF_GROW_STEP.
+ */
+static inline void mbuf_set_growth(struct MBuf *buf, mbuf_grow_f func, size_t step)
+{
+	buf->grow = func;
+	buf->grow_step = step;
 }
 
+/**
+ * Initialize R/W buffer as ring.
+ *
+ * Same memory is mapped twice back-to-back, so unread data
+ * and free space are always contiguous and consumed space
+ * is reused without memmove.  Size is rounded up to page size.
+ *
+ * Returns false if allocation failed or system does not support
+ * shared mappings.  mbuf_rewind_reader() and mbuf_cut() cannot
+ * be used on ring, mbuf_shrink_to_fit() fails on it.
+ */
+_MUSTCHECK
+bool mbuf_init_ring(struct MBuf *buf, size_t size);
+
+/** Free dynamically allocated area, if exists. */
+void mbuf_free(struct MBuf *buf);
+
 /*
  * Reset functions.
  */
@@ -88,6 +160,8 @@ static inline void mbuf_rewind_writer(struct MBuf *buf)
 	if (!buf->reader) {
 		buf->read_pos = 0;
 		buf->write_pos = 0;
+		if (buf->ring_size)
+			buf->alloc_len = buf->ring_size;
 	}
 }
 
@@ -96,27 +170,29 @@ static inline void mbuf_rewind_writer(struct MBuf *buf)
  */
 
 /** How many bytes can be read with read cursor. */
-static inline unsigned mbuf_avail_for_read(const struct MBuf *buf)
+static inline size_t mbuf_avail_for_read(const struct MBuf *buf)
 {
 	return buf->write_pos - buf->read_pos;
 }
 
 /** How many bytes can be written with write cursor, without realloc. */
-static inline unsigned mbuf_avail_for_write(const struct MBuf *buf)
+static inline size_t mbuf_avail_for_write(const struct MBuf *buf)
 {
+	if (buf->ring_size)
+		return buf->ring_size - (buf->write_pos - buf->read_pos);
 	if (!buf->reader && buf->alloc_len > buf->write_pos)
 		return buf->alloc_len - buf->write_pos;
 	return 0;
 }
 
 /** How many data bytes are in buffer. */
-static inline unsigned mbuf_written(const struct MBuf *buf)
+static inline size_t mbuf_written(const struct MBuf *buf)
 {
 	return buf->write_pos;
 }
 
 /** How many bytes have been read from buffer */
-static inline unsigned mbuf_consumed(const struct MBuf *buf)
+static inline size_t mbuf_consumed(const struct MBuf *buf)
 {
 	return buf->read_pos;
 }
@@ -152,7 +228,7 @@ static inline bool mbuf_eq_str(const struct MBuf *buf1, const char *s)
 _MUSTCHECK
 static inline bool mbuf_get_byte(struct MBuf *buf, uint8_t *dst_p)
 {
-	if (buf->read_pos + 1 > buf->write_pos)
+	if (buf->read_pos >= buf->write_pos)
 		return false;
 	*dst_p = buf->data[buf->read_pos++];
 	return true;
@@ -162,7 +238,7 @@ static inline bool mbuf_get_byte(struct MBuf *buf, uint8_t *dst_p)
 _MUSTCHECK
 static inline bool mbuf_get_char(struct MBuf *buf, char *dst_p)
 {
-	if (buf->read_pos + 1 > buf->write_pos)
+	if (buf->read_pos >= buf->write_pos)
 		return false;
 	*dst_p = buf->data[buf->read_pos++];
 	return true;
@@ -172,7 +248,7 @@ _MUSTCHECK
 static inline bool mbuf_get_uint16be(struct MBuf *buf, uint16_t *dst_p)
 {
 	unsigned a, b;
-	if (buf->read_pos + 2 > buf->write_pos)
+	if (mbuf_avail_for_read(buf) < 2)
 		return false;
 	a = buf->data[buf->read_pos++];
 	b = buf->data[buf->read_pos++];
@@ -185,7 +261,7 @@ _MUSTCHECK
 static inline bool mbuf_get_uint32be(struct MBuf *buf, uint32_t *dst_p)
 {
 	unsigned a, b, c, d;
-	if (buf->read_pos + 4 > buf->write_pos)
+	if (mbuf_avail_for_read(buf) < 4)
 		return false;
 	a = buf->data[buf->read_pos++];
 	b = buf->data[buf->read_pos++];
@@ -208,20 +284,113 @@ static inline bool mbuf_get_uint64be(struct MBuf *buf, uint64_t *dst_p)
 }
 
 _MUSTCHECK
-static inline bool mbuf_get_bytes(struct MBuf *buf, unsigned len, const uint8_t **dst_p)
+static inline bool mbuf_get_bytes(struct MBuf *buf, size_t len, const uint8_t **dst_p)
 {
-	if (buf->read_pos + len > buf->write_pos)
+	if (len > mbuf_avail_for_read(buf))
 		return false;
 	*dst_p = buf->data + buf->read_pos;
 	buf->read_pos += len;
 	return true;
 }
 
+/**
+ * @name Unchecked reads.
+ *
+ * For pre-validated frames: check length once with
+ * mbuf_avail_for_read(), then read fields without
+ * per-call bounds checks.
+ *
+ * @{
+ */
+
+/** Read a byte, caller has checked length. */
+static inline uint8_t mbuf_get_byte_unchecked(struct MBuf *buf)
+{
+	Assert(mbuf_avail_for_read(buf) >= 1);
+	return buf->data[buf->read_pos++];
+}
+
+/** Read big-endian uint16, caller has checked length. */
+static inline uint16_t mbuf_get_uint16be_unchecked(struct MBuf *buf)
+{
+	uint16_t val;
+	Assert(mbuf_avail_for_read(buf) >= 2);
+	val = be16dec(buf->data + buf->read_pos);
+	buf->read_pos += 2;
+	return val;
+}
+
+/** Read big-endian uint32, caller has checked length. */
+static inline uint32_t mbuf_get_uint32be_unchecked(struct MBuf *buf)
+{
+	uint32_t val;
+	Assert(mbuf_avail_for_read(buf) >= 4);
+	val = be32dec(buf->data + buf->read_pos);
+	buf->read_pos += 4;
+	return val;
+}
+
+/** Read big-endian uint64, caller has checked length. */
+static inline uint64_t mbuf_get_uint64be_unchecked(struct MBuf *buf)
+{
+	uint64_t val;
+	Assert(mbuf_avail_for_read(buf) >= 8);
+	val = be64dec(buf->data + buf->read_pos);
+	buf->read_pos += 8;
+	return val;
+}
+
+/** Get reference to len bytes, caller has checked length. */
+static inline const uint8_t *mbuf_get_bytes_unchecked(struct MBuf *buf, size_t len)
+{
+	const uint8_t *res = buf->data + buf->read_pos;
+	Assert(mbuf_avail_for_read(buf) >= len);
+	buf->read_pos += len;
+	return res;
+}
+
+/**
+ * @}
+ *
+ * @name Bulk reads.
+ *
+ * Decode count big-endian integers to host order.
+ * On failure nothing is consumed.
+ *
+ * @{
+ */
+
+/** Read array of big-endian uint16. */
+_MUSTCHECK
+bool mbuf_get_uint16be_array(struct MBuf *buf, uint16_t *dst, size_t count);
+
+/** Read array of big-endian uint32. */
+_MUSTCHECK
+bool mbuf_get_uint32be_array(struct MBuf *buf, uint32_t *dst, size_t count);
+
+/** Read array of big-endian uint64. */
+_MUSTCHECK
+bool mbuf_get_uint64be_array(struct MBuf *buf, uint64_t *dst, size_t count);
+
+/** Read unsigned LEB128 varint. */
+_MUSTCHECK
+bool mbuf_get_varint(struct MBuf *buf, uint64_t *dst_p);
+
+/** Read zigzag-encoded signed LEB128 varint. */
+_MUSTCHECK
+bool mbuf_get_svarint(struct MBuf *buf, int64_t *dst_p);
+
+/** Read array of unsigned LEB128 varints. */
+_MUSTCHECK
+bool mbuf_get_varint_array(struct MBuf *buf, uint64_t *dst, size_t count);
+
+/** @} */
+
 /** Get reference to asciiz string from read cursor. */
 _MUSTCHECK
-static inline bool mbuf_get_chars(struct MBuf *buf, unsigned len, const char **dst_p)
+static inline bool mbuf_get_chars(struct MBuf *buf, size_t len, const char **dst_p)
 {
-	if (buf->read_pos + len > buf->write_pos)
+	if (len > mbuf_avail_for_read(buf))
 		return false;
 	*dst_p = (char *)buf->data + buf->read_pos;
 	buf->read_pos += len;
@@ -246,13 +415,21 @@ static inline bool mbuf_get_string(struct MBuf *buf, const char **dst_p)
 
 /** Allocate more room if needed and the mbuf allows. */
 _MUSTCHECK
-bool mbuf_make_room(struct MBuf *buf, unsigned len);
+bool mbuf_make_room(struct MBuf *buf, size_t len);
+
+/**
+ * Reallocate dynamic buffer to size of written data.
+ *
+ * Returns false if buffer is not dynamic (including ring)
+ * or realloc failed.
+ */
+bool mbuf_shrink_to_fit(struct MBuf *buf);
 
 /** Write a byte to write cursor. */
 _MUSTCHECK
 static inline bool mbuf_write_byte(struct MBuf *buf, uint8_t val)
 {
-	if (buf->write_pos + 1 > buf->alloc_len
+	if (buf->write_pos >= buf->alloc_len
 	    && !mbuf_make_room(buf, 1))
 		return false;
 	buf->data[buf->write_pos++] = val;
@@ -261,9 +438,9 @@ static inline bool mbuf_write_byte(struct MBuf *buf, uint8_t val)
 
 /** Write len bytes to write cursor. */
 _MUSTCHECK
-static inline bool mbuf_write(struct MBuf *buf, const void *ptr, unsigned len)
+static inline bool mbuf_write(struct MBuf *buf, const void *ptr, size_t len)
 {
-	if (buf->write_pos + len > buf->alloc_len
+	if (len > buf->alloc_len - buf->write_pos
 	    && !mbuf_make_room(buf, len))
 		return false;
 	if (len > 0)
@@ -272,6 +449,76 @@ static inline bool mbuf_write(struct MBuf *buf, const void *ptr, unsigned len)
 	return true;
 }
 
+/** Write big-endian uint16 to write cursor. */
+_MUSTCHECK
+static inline bool mbuf_write_uint16be(struct MBuf *buf, uint16_t val)
+{
+	if (2 > buf->alloc_len - buf->write_pos
+	    && !mbuf_make_room(buf, 2))
+		return false;
+	be16enc(buf->data + buf->write_pos, val);
+	buf->write_pos += 2;
+	return true;
+}
+
+/** Write big-endian uint32 to write cursor. */
+_MUSTCHECK
+static inline bool mbuf_write_uint32be(struct MBuf *buf, uint32_t val)
+{
+	if (4 > buf->alloc_len - buf->write_pos
+	    && !mbuf_make_room(buf, 4))
+		return false;
+	be32enc(buf->data + buf->write_pos, val);
+	buf->write_pos += 4;
+	return true;
+}
+
+/** Write big-endian uint64 to write cursor. */
+_MUSTCHECK
+static inline bool mbuf_write_uint64be(struct MBuf *buf, uint64_t val)
+{
+	if (8 > buf->alloc_len - buf->write_pos
+	    && !mbuf_make_room(buf, 8))
+		return false;
+	be64enc(buf->data + buf->write_pos, val);
+	buf->write_pos += 8;
+	return true;
+}
+
+/**
+ * @name Bulk writes.
+ *
+ * Encode count host-order integers as big-endian.
+ *
+ * @{
+ */
+
+/** Write array of uint16 as big-endian. */
+_MUSTCHECK
+bool mbuf_write_uint16be_array(struct MBuf *buf, const uint16_t *src, size_t count);
+
+/** Write array of uint32 as big-endian. */
+_MUSTCHECK
+bool mbuf_write_uint32be_array(struct MBuf *buf, const uint32_t *src, size_t count);
+
+/** Write array of uint64 as big-endian. */
+_MUSTCHECK
+bool mbuf_write_uint64be_array(struct MBuf *buf, const uint64_t *src, size_t count);
+
+/** Write unsigned LEB128 varint, 1..10 bytes. */
+_MUSTCHECK
+bool mbuf_write_varint(struct MBuf *buf, uint64_t val);
+
+/** Write signed value as zigzag-encoded LEB128 varint. */
+_MUSTCHECK
+bool mbuf_write_svarint(struct MBuf *buf, int64_t val);
+
+/** Write array of unsigned LEB128 varints. */
+_MUSTCHECK
+bool mbuf_write_varint_array(struct MBuf *buf, const uint64_t *src, size_t count);
+
+/** @} */
+
 /** writes full contents of another mbuf, without touching it */
 _MUSTCHECK
 static inline bool mbuf_write_raw_mbuf(struct MBuf *dst, struct MBuf *src)
@@ -281,7 +528,7 @@ static inline bool mbuf_write_raw_mbuf(struct MBuf *dst, struct MBuf *src)
 
 /** writes partial contents of another mbuf, with touching it */
 _MUSTCHECK
-static inline bool mbuf_write_mbuf(struct MBuf *dst, struct MBuf *src, unsigned len)
+static inline bool mbuf_write_mbuf(struct MBuf *dst, struct MBuf *src, size_t len)
 {
 	const uint8_t *data;
 	if (!mbuf_get_bytes(src, len, &data))
@@ -295,9 +542,9 @@ static inline bool mbuf_write_mbuf(struct MBuf *dst, struct MBuf *src, unsigned
 
 /** Fiil mbuf with byte value */
 _MUSTCHECK
-static inline bool mbuf_fill(struct MBuf *buf, uint8_t byte, unsigned len)
+static inline bool mbuf_fill(struct MBuf *buf, uint8_t byte, size_t len)
 {
-	if (buf->write_pos + len > buf->alloc_len
+	if (len > buf->alloc_len - buf->write_pos
 	    && !mbuf_make_room(buf, len))
 		return false;
 	memset(buf->data + buf->write_pos, byte, len);
@@ -307,12 +554,12 @@ static inline bool mbuf_fill(struct MBuf *buf, uint8_t byte, unsigned len)
 
 /** remove some data from mbuf */
 _MUSTCHECK
-static inline bool mbuf_cut(struct MBuf *buf, unsigned ofs, unsigned len)
+static inline bool mbuf_cut(struct MBuf *buf, size_t ofs, size_t len)
 {
 	if (buf->reader)
 		return false;
-	if (ofs + len < buf->write_pos) {
-		unsigned endofs = ofs + len;
+	if (ofs < buf->write_pos && len < buf->write_pos - ofs) {
+		size_t endofs = ofs + len;
 		memmove(buf->data + ofs, buf->data + endofs, buf->write_pos - endofs);
 		buf->write_pos -= len;
 	} else if (ofs < buf->write_pos) {
@@ -327,7 +574,7 @@ static inline void mbuf_copy(const struct MBuf *src, struct MBuf *dst)
 }
 
 _MUSTCHECK
-static inline bool mbuf_slice(struct MBuf *src, unsigned len, struct MBuf *dst)
+static inline bool mbuf_slice(struct MBuf *src, size_t len, struct MBuf *dst)
 {
 	if (len > mbuf_avail_for_read(src))
 		return false;
@@ -336,4 +583,23 @@ static inline bool mbuf_slice(struct MBuf *src, unsigned len, struct MBuf *dst)
 	return true;
 }
 
+/*
+ * Socket I/O.
+ */
+
+/**
+ * Receive into free space with safe_recv().
+ *
+ * Dynamic buffer is grown if full, ring or fixed buffer
+ * fails with ENOBUFS.  Returns result of safe_recv().
+ */
+ssize_t mbuf_recv(struct MBuf *buf, int fd, int flags) _MUSTCHECK;
+
+/**
+ * Send unread data with safe_send() and consume bytes that were sent.
+ *
+ * Returns result of safe_send(), 0 if there is nothing to send.
+ */
+ssize_t mbuf_send(struct MBuf *buf, int fd, int flags) _MUSTCHECK;
+
 #endif
@@ -0,0 +1,342 @@
+/*
+ * Chained buffer.
+ */
+
+#include <usual/mbufchain.h>
+#include <usual/safeio.h>
+
+#include <string.h>
+
+/* refcounted data area, shared between parts */
+struct MBufSeg {
+	int refcnt;
+	unsigned size;
+	unsigned used;
+	CxMem *cx;
+	uint8_t data[FLEX_ARRAY];
+};
+
+/* chain element, points to part of segment */
+struct MBufPart {
+	struct MBufPart *next;
+	struct MBufSeg *seg;
+	uint8_t *data;
+	unsigned len;
+};
+
+/* temporary list, to be spliced into chain when complete */
+struct PartList {
+	struct MBufPart *head;
+	struct MBufPart *tail;
+};
+
+static struct MBufSeg *seg_new(CxMem *cx, unsigned size)
+{
+	struct MBufSeg *seg;
+
+	seg = cx_alloc(cx, offsetof(struct MBufSeg, data) + size);
+	if (!seg)
+		return NULL;
+	seg->refcnt = 0;
+	seg->size = size;
+	seg->used = 0;
+	seg->cx = cx;
+	return seg;
+}
+
+static void seg_unref(struct MBufSeg *seg)
+{
+	if (--seg->refcnt == 0)
+		cx_free(seg->cx, seg);
+}
+
+/* takes reference to seg */
+static struct MBufPart *part_new(CxMem *cx, struct MBufSeg *seg, uint8_t *data, unsigned len)
+{
+	struct MBufPart *part;
+
+	part = cx_alloc(cx, sizeof(*part));
+	if (!part)
+		return NULL;
+	part->next = NULL;
+	part->seg = seg;
+	part->data = data;
+	part->len = len;
+	seg->refcnt++;
+	return part;
+}
+
+/* new part with empty segment */
+static struct MBufPart *part_new_seg(CxMem *cx, unsigned size)
+{
+	struct MBufSeg *seg;
+	struct MBufPart *part;
+
+	seg = seg_new(cx, size);
+	if (!seg)
+		return NULL;
+	part = part_new(cx, seg, seg->data, 0);
+	if (!part)
+		cx_free(cx, seg);
+	return part;
+}
+
+static void part_free(CxMem *cx, struct MBufPart *part)
+{
+	seg_unref(part->seg);
+	cx_free(cx, part);
+}
+
+/* how many bytes can be appended to part in place */
+static inline unsigned part_room(const struct MBufPart *part)
+{
+	const struct MBufSeg *seg = part->seg;
+
+	/* someone else has written after us */
+	if (part->data + part->len != seg->data + seg->used)
+		return 0;
+	return seg->size - seg->used;
+}
+
+static void plist_add(struct PartList *list, struct MBufPart *part)
+{
+	if (list->tail)
+		list->tail->next = part;
+	else
+		list->head = part;
+	list->tail = part;
+}
+
+static void plist_free(CxMem *cx, struct PartList *list)
+{
+	struct MBufPart *part, *next;
+
+	for (part = list->head; part; part = next) {
+		next = part->next;
+		part_free(cx, part);
+	}
+	list->head = list->tail = NULL;
+}
+
+static void chain_append_list(struct MBufChain *chain, struct PartList *list)
+{
+	if (!list->head)
+		return;
+	if (chain->tail)
+		chain->tail->next = list->head;
+	else
+		chain->head = list->head;
+	chain->tail = list->tail;
+}
+
+/* consume len bytes from start, copy them to dst if given */
+static void chain_consume(struct MBufChain *chain, uint8_t *dst, size_t len)
+{
+	struct MBufPart *part;
+	unsigned n;
+
+	while (len > 0) {
+		part = chain->head;
+		n = (part->len < len) ? part->len : len;
+		if (dst) {
+			memcpy(dst, part->data, n);
+			dst += n;
+		}
+		part->data += n;
+		part->len -= n;
+		chain->len -= n;
+		len -= n;
+
+		/* keep empty tail, it may still have room */
+		if (part->len == 0 && part != chain->tail) {
+			chain->head = part->next;
+			part_free(chain->cx, part);
+		}
+	}
+}
+
+/*
+ * Public API.
+ */
+
+void mbuf_chain_init(struct MBufChain *chain, CxMem *cx, unsigned seg_size)
+{
+	chain->head = NULL;
+	chain->tail = NULL;
+	chain->len = 0;
+	chain->seg_size = seg_size ? seg_size : MBUF_CHAIN_SEG_SIZE;
+	chain->cx = cx;
+}
+
+void mbuf_chain_free(struct MBufChain *chain)
+{
+	struct PartList list;
+
+	list.head = chain->head;
+	list.tail = chain->tail;
+	plist_free(chain->cx, &list);
+	chain->head = NULL;
+	chain->tail = NULL;
+	chain->len = 0;
+}
+
+bool mbuf_chain_write(struct MBufChain *chain, const void *ptr, size_t len)
+{
+	struct PartList list = { NULL, NULL };
+	struct MBufPart *part;
+	const uint8_t *src = ptr;
+	size_t room;
+	unsigned n;
+
+	/* allocate all new segments first, so failure leaves chain untouched */
+	room = chain->tail ? part_room(chain->tail) : 0;
+	while (room < len) {
+		part = part_new_seg(chain->cx, chain->seg_size);
+		if (!part) {
+			plist_free(chain->cx, &list);
+			return false;
+		}
+		plist_add(&list, part);
+		room += chain->seg_size;
+	}
+
+	part = chain->tail;
+	if (!part || !part_room(part))
+		part = list.head;
+	chain_append_list(chain, &list);
+
+	for (; len > 0; part = part->next) {
+		n = part_room(part);
+		if (n > len)
+			n = len;
+		memcpy(part->data + part->len, src, n);
+		part->len += n;
+		part->seg->used += n;
+		chain->len += n;
+		src += n;
+		len -= n;
+	}
+	return true;
+}
+
+bool mbuf_chain_prepend(struct MBufChain *chain, const void *ptr, size_t len)
+{
+	struct MBufPart *part;
+
+	if (len == 0)
+		return true;
+	if (len > UINT_MAX)
+		return false;
+	part = part_new_seg(chain->cx, len);
+	if (!part)
+		return false;
+	memcpy(part->data, ptr, len);
+	part->len = len;
+	part->seg->used = len;
+
+	part->next = chain->head;
+	chain->head = part;
+	if (!chain->tail)
+		chain->tail = part;
+	chain->len += len;
+	return true;
+}
+
+bool mbuf_chain_append_chain(struct MBufChain *dst, const struct MBufChain *src)
+{
+	struct PartList list = { NULL, NULL };
+	struct MBufPart *part, *p;
+
+	Assert(dst != src);
+	for (p = src->head; p; p = p->next) {
+		if (p->len == 0)
+			continue;
+		part = part_new(dst->cx, p->seg, p->data, p->len);
+		if (!part) {
+			plist_free(dst->cx, &list);
+			return false;
+		}
+		plist_add(&list, part);
+	}
+	chain_append_list(dst, &list);
+	dst->len += src->len;
+	return true;
+}
+
+bool mbuf_chain_get_bytes(struct MBufChain *chain, void *dst, size_t len)
+{
+	if (len > chain->len)
+		return false;
+	chain_consume(chain, dst, len);
+	return true;
+}
+
+bool mbuf_chain_skip(struct MBufChain *chain, size_t len)
+{
+	if (len > chain->len)
+		return false;
+	chain_consume(chain, NULL, len);
+	return true;
+}
+
+bool mbuf_chain_slice(struct MBufChain *src, size_t len, struct MBufChain *dst)
+{
+	struct PartList list = { NULL, NULL };
+	struct MBufPart *part, *p;
+	size_t left = len;
+	unsigned n;
+
+	if (len > src->len)
+		return false;
+	Assert(dst != src);
+
+	for (p = src->head; left > 0; p = p->next) {
+		if (p->len == 0)
+			continue;
+		n = (p->len < left) ? p->len : left;
+		part = part_new(dst->cx, p->seg, p->data, n);
+		if (!part) {
+			plist_free(dst->cx, &list);
+			return false;
+		}
+		plist_add(&list, part);
+		left -= n;
+	}
+	chain_append_list(dst, &list);
+	dst->len += len;
+	chain_consume(src, NULL, len);
+	return true;
+}
+
+int mbuf_chain_iovec(const struct MBufChain *chain, struct iovec *iov, int max_iov)
+{
+	const struct MBufPart *part;
+	int n = 0;
+
+	for (part = chain->head; part && n < max_iov; part = part->next) {
+		if (part->len == 0)
+			continue;
+		iov[n].iov_base = part->data;
+		iov[n].iov_len = part->len;
+		n++;
+	}
+	return n;
+}
+
+ssize_t mbuf_chain_sendmsg(struct MBufChain *chain, int fd, int flags)
+{
+	struct iovec iov[MBUF_CHAIN_IOV_MAX];
+	struct msghdr msg;
+	ssize_t res;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = mbuf_chain_iovec(chain, iov, MBUF_CHAIN_IOV_MAX);
+	if (msg.msg_iovlen == 0)
+		return 0;
+
+	res = safe_sendmsg(fd, &msg, flags);
+	if (res > 0)
+		chain_consume(chain, NULL, res);
+	return res;
+}
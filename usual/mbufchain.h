@@ -0,0 +1,187 @@
+
+/** @file
+ * Chained buffer.
+ *
+ * Data is kept in list of fixed-size refcounted segments,
+ * so appending never reallocates or copies data that is
+ * already in buffer.  Slicing and appending one chain to
+ * another share segments instead of copying.  Contents can
+ * be given to writev()/sendmsg() as struct iovec array.
+ *
+ * Works as queue: writes go to end, reads consume from start.
+ */
+
+#ifndef _USUAL_MBUFCHAIN_H_
+#define _USUAL_MBUFCHAIN_H_
+
+#include <usual/cxalloc.h>
+#include <usual/mbuf.h>
+#include <usual/socket.h>
+
+/** Default segment size */
+#define MBUF_CHAIN_SEG_SIZE	4000
+
+/** Max number of iovecs mbuf_chain_sendmsg() uses in one call */
+#define MBUF_CHAIN_IOV_MAX	64
+
+struct MBufPart;
+
+/** Chained buffer.  Allocated by user, can be in stack. */
+struct MBufChain {
+	struct MBufPart *head;
+	struct MBufPart *tail;
+	size_t len;
+	unsigned seg_size;
+	CxMem *cx;
+};
+
+/** Initialize empty chain.  seg_size 0 means default. */
+void mbuf_chain_init(struct MBufChain *chain, CxMem *cx, unsigned seg_size);
+
+/** Drop all data.  Chain stays usable. */
+void mbuf_chain_free(struct MBufChain *chain);
+
+/** How many bytes can be read. */
+static inline size_t mbuf_chain_avail_for_read(const struct MBufChain *chain)
+{
+	return chain->len;
+}
+
+/*
+ * Write functions.
+ */
+
+/** Copy len bytes to end of chain. */
+_MUSTCHECK
+bool mbuf_chain_write(struct MBufChain *chain, const void *ptr, size_t len);
+
+/** Copy len bytes to start of chain. */
+_MUSTCHECK
+bool mbuf_chain_prepend(struct MBufChain *chain, const void *ptr, size_t len);
+
+/** Write a byte to end of chain. */
+_MUSTCHECK
+static inline bool mbuf_chain_write_byte(struct MBufChain *chain, uint8_t val)
+{
+	return mbuf_chain_write(chain, &val, 1);
+}
+
+/** Write big-endian uint16 to end of chain. */
+_MUSTCHECK
+static inline bool mbuf_chain_put_uint16be(struct MBufChain *chain, uint16_t val)
+{
+	uint8_t buf[2] = { val >> 8, val };
+	return mbuf_chain_write(chain, buf, 2);
+}
+
+/** Write big-endian uint32 to end of chain. */
+_MUSTCHECK
+static inline bool mbuf_chain_put_uint32be(struct MBufChain *chain, uint32_t val)
+{
+	uint8_t buf[4] = { val >> 24, val >> 16, val >> 8, val };
+	return mbuf_chain_write(chain, buf, 4);
+}
+
+/** Write big-endian uint64 to end of chain. */
+_MUSTCHECK
+static inline bool mbuf_chain_put_uint64be(struct MBufChain *chain, uint64_t val)
+{
+	return mbuf_chain_put_uint32be(chain, val >> 32)
+		&& mbuf_chain_put_uint32be(chain, val);
+}
+
+/** Copy unread data of MBuf to end of chain, without touching it. */
+_MUSTCHECK
+static inline bool mbuf_chain_write_mbuf(struct MBufChain *chain, const struct MBuf *src)
+{
+	return mbuf_chain_write(chain, src->data + src->read_pos, mbuf_avail_for_read(src));
+}
+
+/** Share all data of src at end of dst, without copying or touching src. */
+_MUSTCHECK
+bool mbuf_chain_append_chain(struct MBufChain *dst, const struct MBufChain *src);
+
+/*
+ * Read functions.
+ */
+
+/** Copy len bytes from start of chain and consume them. */
+_MUSTCHECK
+bool mbuf_chain_get_bytes(struct MBufChain *chain, void *dst, size_t len);
+
+/** Consume len bytes. */
+_MUSTCHECK
+bool mbuf_chain_skip(struct MBufChain *chain, size_t len);
+
+/** Read a byte. */
+_MUSTCHECK
+static inline bool mbuf_chain_get_byte(struct MBufChain *chain, uint8_t *dst_p)
+{
+	return mbuf_chain_get_bytes(chain, dst_p, 1);
+}
+
+/** Read big-endian uint16. */
+_MUSTCHECK
+static inline bool mbuf_chain_get_uint16be(struct MBufChain *chain, uint16_t *dst_p)
+{
+	uint8_t b[2];
+	if (!mbuf_chain_get_bytes(chain, b, 2))
+		return false;
+	*dst_p = (b[0] << 8) | b[1];
+	return true;
+}
+
+/** Read big-endian uint32. */
+_MUSTCHECK
+static inline bool mbuf_chain_get_uint32be(struct MBufChain *chain, uint32_t *dst_p)
+{
+	uint8_t b[4];
+	if (!mbuf_chain_get_bytes(chain, b, 4))
+		return false;
+	*dst_p = ((uint32_t)b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+	return true;
+}
+
+/** Read big-endian uint64. */
+_MUSTCHECK
+static inline bool mbuf_chain_get_uint64be(struct MBufChain *chain, uint64_t *dst_p)
+{
+	uint32_t a, b;
+	if (chain->len < 8)
+		return false;
+	if (!mbuf_chain_get_uint32be(chain, &a)
+	    || !mbuf_chain_get_uint32be(chain, &b))
+		return false;
+	*dst_p = ((uint64_t)a << 32) | b;
+	return true;
+}
+
+/**
+ * Move len bytes from start of src to end of dst.
+ *
+ * Segments are shared, not copied.
+ */
+_MUSTCHECK
+bool mbuf_chain_slice(struct MBufChain *src, size_t len, struct MBufChain *dst);
+
+/*
+ * Output.
+ */
+
+/**
+ * Fill iov with pointers to unread data.
+ *
+ * Returns number of entries used, at most max_iov.
+ * Data is not consumed, use mbuf_chain_skip() for
+ * bytes that were actually written.
+ */
+int mbuf_chain_iovec(const struct MBufChain *chain, struct iovec *iov, int max_iov);
+
+/**
+ * Send data with safe_sendmsg() and consume bytes that were sent.
+ *
+ * Returns result of safe_sendmsg().
+ */
+ssize_t mbuf_chain_sendmsg(struct MBufChain *chain, int fd, int flags);
+
+#endif
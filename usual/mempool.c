@@ -18,45 +18,154 @@
 
 #include <usual/mempool.h>
 
+#include <string.h>
+
 /*
  * Allows allocation of several variable-sized objects,
  * freeing them all together.
  *
- * ToDo: make it more 'obstack'-like (???)
- * - free_last
- * - resize_last
- * - append
+ * In addition it supports obstack-like operations on
+ * the newest block: growing unfinished object, freeing
+ * back to earlier object and resizing last object.
  */
 
 struct MemPool {
 	struct MemPool *prev;
 	unsigned size;
 	unsigned used;
+	unsigned last;		/* offset of last finished object */
+	unsigned grow;		/* length of unfinished object at 'used' */
 };
 
-void *mempool_alloc(struct MemPool **pool, unsigned size)
+#define POOL_DATA(p) ((char *)(p) + ALIGN(sizeof(struct MemPool)))
+
+static struct MemPool *new_block(struct MemPool **pool, unsigned need)
 {
 	struct MemPool *cur = *pool;
-	void *ptr;
 	unsigned nsize;
 
+	nsize = cur ? (2 * cur->size) : 512;
+	while (nsize < need)
+		nsize *= 2;
+	cur = malloc(ALIGN(sizeof(*cur)) + nsize);
+	if (cur == NULL)
+		return NULL;
+	cur->size = nsize;
+	cur->used = 0;
+	cur->last = 0;
+	cur->grow = 0;
+	cur->prev = *pool;
+	*pool = cur;
+	return cur;
+}
+
+void *mempool_alloc_raw(struct MemPool **pool, unsigned size)
+{
+	struct MemPool *cur = *pool;
+	void *ptr;
+
 	size = ALIGN(size);
-	if (cur && cur->used + size <= cur->size) {
-		ptr = (char *)(cur + 1) + cur->used;
-		cur->used += size;
-		return ptr;
-	} else {
-		nsize = cur ? (2 * cur->size) : 512;
-		while (nsize < size)
-			nsize *= 2;
-		cur = calloc(1, sizeof(*cur) + nsize);
+	if (!cur || cur->used + size > cur->size) {
+		cur = new_block(pool, size);
 		if (cur == NULL)
 			return NULL;
-		cur->used = size;
-		cur->size = nsize;
-		cur->prev = *pool;
-		*pool = cur;
-		return (char *)(cur + 1);
+	}
+	ptr = POOL_DATA(cur) + cur->used;
+	cur->last = cur->used;
+	cur->used += size;
+	return ptr;
+}
+
+void *mempool_alloc(struct MemPool **pool, unsigned size)
+{
+	void *ptr = mempool_alloc_raw(pool, size);
+	if (ptr)
+		memset(ptr, 0, size);
+	return ptr;
+}
+
+bool mempool_grow(struct MemPool **pool, const void *data, unsigned len)
+{
+	struct MemPool *cur = *pool, *old;
+	unsigned need;
+
+	need = cur ? cur->grow + len : len;
+	if (!cur || cur->used + ALIGN(need) > cur->size) {
+		old = cur;
+		cur = new_block(pool, ALIGN(need));
+		if (cur == NULL)
+			return false;
+		if (old && old->grow) {
+			memcpy(POOL_DATA(cur), POOL_DATA(old) + old->used, old->grow);
+			cur->grow = old->grow;
+			old->grow = 0;
+		}
+	}
+	memcpy(POOL_DATA(cur) + cur->used + cur->grow, data, len);
+	cur->grow += len;
+	return true;
+}
+
+void *mempool_finish(struct MemPool **pool, unsigned *len_p)
+{
+	struct MemPool *cur = *pool;
+	void *ptr;
+
+	if (!cur) {
+		cur = new_block(pool, 0);
+		if (cur == NULL)
+			return NULL;
+	}
+	ptr = POOL_DATA(cur) + cur->used;
+	if (len_p)
+		*len_p = cur->grow;
+	cur->last = cur->used;
+	cur->used += ALIGN(cur->grow);
+	cur->grow = 0;
+	return ptr;
+}
+
+void *mempool_resize_last(struct MemPool **pool, void *ptr, unsigned size)
+{
+	struct MemPool *cur = *pool;
+	unsigned olen;
+	void *nptr;
+
+	if (!cur || ptr != POOL_DATA(cur) + cur->last || cur->last == cur->used)
+		return NULL;
+
+	/* drop it, the data stays in place */
+	olen = cur->used - cur->last;
+	cur->used = cur->last;
+
+	if (cur->used + ALIGN(size) <= cur->size) {
+		cur->used += ALIGN(size);
+		return ptr;
+	}
+
+	nptr = mempool_alloc_raw(pool, size);
+	if (nptr == NULL) {
+		cur->used += olen;
+		return NULL;
+	}
+	memcpy(nptr, ptr, olen < size ? olen : size);
+	return nptr;
+}
+
+void mempool_free_to(struct MemPool **pool, void *ptr)
+{
+	struct MemPool *cur;
+	char *p = ptr;
+
+	while ((cur = *pool) != NULL) {
+		if (p >= POOL_DATA(cur) && p <= POOL_DATA(cur) + cur->used) {
+			cur->used = p - POOL_DATA(cur);
+			cur->last = cur->used;
+			cur->grow = 0;
+			return;
+		}
+		*pool = cur->prev;
+		free(cur);
 	}
 }
 
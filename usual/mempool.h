@@ -26,9 +26,44 @@
 /** Pool Reference */
 struct MemPool;
 
-/** Allocate from pool */
+/** Allocate zero-filled memory from pool */
 void *mempool_alloc(struct MemPool **pool, unsigned size) _MALLOC;
 
+/** Allocate from pool, without zeroing */
+void *mempool_alloc_raw(struct MemPool **pool, unsigned size) _MALLOC;
+
+/**
+ * Append data to unfinished object.
+ *
+ * The object may move while it grows, so its address
+ * is known only after mempool_finish().  No other allocations
+ * should be done from pool until then.
+ */
+bool mempool_grow(struct MemPool **pool, const void *data, unsigned len);
+
+/**
+ * Finish object built with mempool_grow().
+ *
+ * Returns pointer to object and stores its length in len_p
+ * if not NULL.  Empty object is valid.
+ */
+void *mempool_finish(struct MemPool **pool, unsigned *len_p);
+
+/**
+ * Resize last allocated or finished object.
+ *
+ * Returns new pointer to object, or NULL if ptr is not last object
+ * or on allocation failure.
+ */
+void *mempool_resize_last(struct MemPool **pool, void *ptr, unsigned size);
+
+/**
+ * Free object and all objects allocated after it.
+ *
+ * If ptr is NULL, all memory is freed.
+ */
+void mempool_free_to(struct MemPool **pool, void *ptr);
+
 /** Release all memory in pool */
 void mempool_destroy(struct MemPool **pool);
 
@@ -0,0 +1,400 @@
+/*
+ * Parallel NDJSON parsing.
+ */
+
+#include <usual/ndjson.h>
+#include <usual/cxalloc.h>
+#include <usual/fileutil.h>
+#include <usual/mbuf.h>
+
+#include <string.h>
+
+#ifdef HAVE_PTHREAD
+#include <usual/pthread.h>
+#define NDJSON_THREADS
+#endif
+
+struct NdState;
+
+/* parsed record, kept until delivery in ordered mode */
+struct NdRecord {
+	size_t ofs;
+	size_t len;
+	struct JsonValue *val;
+};
+
+/* contiguous range of records */
+struct NdBatch {
+	struct NdState *st;
+	const char *start;
+	const char *end;
+	struct JsonContext *ctx;
+	struct MBuf records;
+	bool failed;			/* out of memory */
+#ifdef NDJSON_THREADS
+	pthread_t thread;
+	bool started;
+#endif
+};
+
+struct NdState {
+	const struct NdjsonConfig *cf;
+	CxMem *cx;			/* cf->cx_mem, or locked_cx wrapping it */
+	const char *src;
+	const char *pos;		/* start of next batch */
+	const char *end;
+	size_t batch_size;
+	bool stop;			/* callback said stop, or no memory */
+#ifdef NDJSON_THREADS
+	pthread_mutex_t lock;
+	struct CxMem locked_cx;
+#endif
+};
+
+static inline void nd_lock(struct NdState *st)
+{
+#ifdef NDJSON_THREADS
+	pthread_mutex_lock(&st->lock);
+#endif
+}
+
+static inline void nd_unlock(struct NdState *st)
+{
+#ifdef NDJSON_THREADS
+	pthread_mutex_unlock(&st->lock);
+#endif
+}
+
+/* cut next batch from input at line end, false if no more */
+static bool split_batch(struct NdState *st, const char **start_p, const char **end_p)
+{
+	const char *start = st->pos;
+	const char *cut;
+
+	if (start >= st->end || st->stop)
+		return false;
+	if ((size_t)(st->end - start) <= st->batch_size) {
+		cut = st->end;
+	} else {
+		cut = memchr(start + st->batch_size, '\n', st->end - start - st->batch_size);
+		cut = cut ? cut + 1 : st->end;
+	}
+	*start_p = start;
+	*end_p = cut;
+	st->pos = cut;
+	return true;
+}
+
+/* next record in batch, whitespace-only lines are skipped */
+static bool next_record(const char **pos_p, const char *end, const char **rec_p, size_t *len_p)
+{
+	const char *p = *pos_p;
+	const char *nl, *s;
+
+	while (p < end) {
+		nl = memchr(p, '\n', end - p);
+		if (!nl)
+			nl = end;
+		for (s = p; s < nl && (*s == ' ' || *s == '\t' || *s == '\r'); s++)
+			;
+		p = (nl < end) ? nl + 1 : end;
+		if (s < nl) {
+			*pos_p = p;
+			*rec_p = s;
+			*len_p = nl - s;
+			return true;
+		}
+	}
+	*pos_p = end;
+	return false;
+}
+
+static struct JsonContext *batch_context(struct NdState *st, const char *start, const char *end)
+{
+	struct JsonContext *ctx;
+
+	ctx = json_new_context(st->cx, end - start);
+	if (ctx)
+		json_set_options(ctx, st->cf->parse_options);
+	return ctx;
+}
+
+/*
+ * Unordered mode: each thread parses and delivers
+ * whole batches, until input ends.
+ */
+
+static bool run_batch(struct NdState *st, const char *start, const char *end)
+{
+	struct JsonContext *ctx;
+	struct JsonValue *val;
+	const char *pos = start;
+	const char *rec;
+	size_t len;
+	bool ok = true;
+
+	ctx = batch_context(st, start, end);
+	if (!ctx)
+		return false;
+	while (ok && next_record(&pos, end, &rec, &len)) {
+		val = json_parse(ctx, rec, len);
+		ok = st->cf->cb_func(st->cf->cb_arg, rec - st->src, val, val ? NULL : json_strerror(ctx));
+	}
+	json_free_context(ctx);
+	return ok;
+}
+
+static void *unordered_worker(void *arg)
+{
+	struct NdState *st = arg;
+	const char *start, *end;
+	bool more;
+
+	for (;;) {
+		nd_lock(st);
+		more = split_batch(st, &start, &end);
+		nd_unlock(st);
+		if (!more)
+			break;
+		if (!run_batch(st, start, end)) {
+			nd_lock(st);
+			st->stop = true;
+			nd_unlock(st);
+		}
+	}
+	return NULL;
+}
+
+#ifdef NDJSON_THREADS
+
+/*
+ * cxalloc allocators are not thread-safe, so shared
+ * cf->cx_mem is used under st->lock.
+ */
+
+static void *locked_alloc(void *ctx, size_t len)
+{
+	struct NdState *st = ctx;
+	void *p;
+
+	nd_lock(st);
+	p = cx_alloc(st->cf->cx_mem, len);
+	nd_unlock(st);
+	return p;
+}
+
+static void *locked_realloc(void *ctx, void *ptr, size_t len)
+{
+	struct NdState *st = ctx;
+	void *p;
+
+	nd_lock(st);
+	p = cx_realloc(st->cf->cx_mem, ptr, len);
+	nd_unlock(st);
+	return p;
+}
+
+static void locked_free(void *ctx, void *ptr)
+{
+	struct NdState *st = ctx;
+
+	nd_lock(st);
+	cx_free(st->cf->cx_mem, ptr);
+	nd_unlock(st);
+}
+
+static const struct CxOps locked_ops = {
+	locked_alloc,
+	locked_realloc,
+	locked_free,
+	NULL,
+};
+
+static bool run_unordered(struct NdState *st, int nthreads)
+{
+	pthread_t *threads;
+	int i, started = 0;
+
+	threads = cx_alloc(st->cx, nthreads * sizeof(pthread_t));
+	if (!threads)
+		return false;
+
+	/* calling thread is one of workers */
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&threads[started], NULL, unordered_worker, st) != 0)
+			break;
+		started++;
+	}
+	unordered_worker(st);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	cx_free(st->cx, threads);
+	return !st->stop;
+}
+
+/*
+ * Ordered mode: batches are parsed in rounds of nthreads,
+ * calling thread delivers previous round while next one
+ * is parsed.
+ */
+
+static void parse_batch(struct NdBatch *b)
+{
+	struct NdRecord r;
+	const char *pos = b->start;
+	const char *rec;
+
+	b->ctx = batch_context(b->st, b->start, b->end);
+	if (!b->ctx) {
+		b->failed = true;
+		return;
+	}
+	while (next_record(&pos, b->end, &rec, &r.len)) {
+		/* failed record is parsed again on delivery, for error message */
+		r.ofs = rec - b->st->src;
+		r.val = json_parse(b->ctx, rec, r.len);
+		if (!mbuf_write(&b->records, &r, sizeof(r))) {
+			b->failed = true;
+			return;
+		}
+	}
+}
+
+static void *parse_batch_thread(void *arg)
+{
+	parse_batch(arg);
+	return NULL;
+}
+
+static void deliver_batch(struct NdState *st, struct NdBatch *b)
+{
+	const struct NdRecord *r = (const struct NdRecord *)b->records.data;
+	size_t i, count = b->records.write_pos / sizeof(*r);
+	const char *err;
+
+	if (b->failed)
+		st->stop = true;
+	for (i = 0; i < count && !st->stop; i++) {
+		err = NULL;
+		if (!r[i].val) {
+			json_parse(b->ctx, st->src + r[i].ofs, r[i].len);
+			err = json_strerror(b->ctx);
+		}
+		if (!st->cf->cb_func(st->cf->cb_arg, r[i].ofs, r[i].val, err))
+			st->stop = true;
+	}
+}
+
+static void free_batch(struct NdBatch *b)
+{
+	json_free_context(b->ctx);
+	mbuf_free(&b->records);
+}
+
+static bool run_ordered(struct NdState *st, int nthreads)
+{
+	struct NdBatch *batches, *cur, *prev, *tmp;
+	int i, ncur, nprev = 0;
+
+	batches = cx_alloc0(st->cx, 2 * nthreads * sizeof(struct NdBatch));
+	if (!batches)
+		return false;
+	cur = batches;
+	prev = batches + nthreads;
+
+	do {
+		/* start next round */
+		for (ncur = 0; ncur < nthreads; ncur++) {
+			memset(&cur[ncur], 0, sizeof(cur[ncur]));
+			if (!split_batch(st, &cur[ncur].start, &cur[ncur].end))
+				break;
+			cur[ncur].st = st;
+			mbuf_init_dynamic_cx(&cur[ncur].records, st->cx);
+			cur[ncur].started = pthread_create(&cur[ncur].thread, NULL, parse_batch_thread, &cur[ncur]) == 0;
+		}
+
+		/* previous round */
+		for (i = 0; i < nprev; i++) {
+			deliver_batch(st, &prev[i]);
+			free_batch(&prev[i]);
+		}
+
+		/* wait, or parse here if thread was not started */
+		for (i = 0; i < ncur; i++) {
+			if (cur[i].started)
+				pthread_join(cur[i].thread, NULL);
+			else
+				parse_batch(&cur[i]);
+		}
+
+		tmp = prev;
+		prev = cur;
+		cur = tmp;
+		nprev = ncur;
+	} while (ncur > 0);
+
+	cx_free(st->cx, batches);
+	return !st->stop;
+}
+
+/* wrap shared allocator, then run requested mode */
+static bool run_threads(struct NdState *st, int nthreads)
+{
+	bool res;
+
+	pthread_mutex_init(&st->lock, NULL);
+	if (st->cx) {
+		st->locked_cx.ops = &locked_ops;
+		st->locked_cx.ctx = st;
+		st->cx = &st->locked_cx;
+	}
+	if (st->cf->ordered)
+		res = run_ordered(st, nthreads);
+	else
+		res = run_unordered(st, nthreads);
+	pthread_mutex_destroy(&st->lock);
+	return res;
+}
+
+#endif
+
+/*
+ * Public API.
+ */
+
+bool ndjson_parse(const struct NdjsonConfig *cf, const char *src, size_t len)
+{
+	struct NdState st;
+
+	memset(&st, 0, sizeof(st));
+	st.cf = cf;
+	st.cx = (CxMem *)cf->cx_mem;
+	st.src = st.pos = src;
+	st.end = src + len;
+	st.batch_size = cf->batch_size ? cf->batch_size : NDJSON_BATCH_SIZE;
+
+#ifdef NDJSON_THREADS
+	if (cf->threads > 1)
+		return run_threads(&st, cf->threads);
+#endif
+
+	/* single thread delivers in order anyway */
+	unordered_worker(&st);
+	return !st.stop;
+}
+
+bool ndjson_parse_file(const struct NdjsonConfig *cf, const char *fname)
+{
+	struct MappedFile m;
+	bool res;
+
+	/* empty file cannot be mapped */
+	if (file_size(fname) == 0)
+		return true;
+	if (map_file(&m, fname, 0) < 0)
+		return false;
+	res = ndjson_parse(cf, m.ptr, m.len);
+	unmap_file(&m);
+	return res;
+}
@@ -0,0 +1,71 @@
+
+/** @file
+ * Parallel parsing of newline-delimited JSON.
+ *
+ * Input buffer is split into batches at record boundaries and
+ * batches are parsed by worker threads, each batch in its own
+ * JsonContext.  Empty lines are skipped.
+ *
+ * Without thread support everything is parsed in calling thread.
+ */
+
+#ifndef _USUAL_NDJSON_H_
+#define _USUAL_NDJSON_H_
+
+#include <usual/json.h>
+
+/** Default batch size */
+#define NDJSON_BATCH_SIZE	(1024*1024)
+
+/**
+ * Record callback.
+ *
+ * ofs is byte offset of record in input.  If record failed
+ * to parse, val is NULL and err has error message.
+ * Value is valid only during callback.
+ *
+ * Returning false stops parsing.  Without ordered mode, other
+ * threads may still deliver rest of their current batch.
+ */
+typedef bool (*ndjson_callback_f)(void *arg, size_t ofs, struct JsonValue *val, const char *err);
+
+/**
+ * Parser setup.  Zeroed fields mean defaults.
+ */
+struct NdjsonConfig {
+	ndjson_callback_f cb_func;	/**< called for each record */
+	void *cb_arg;			/**< first arg for cb_func */
+	/**
+	 * Allocator for contexts, NULL for libc.
+	 *
+	 * With threads, calls to it are serialized with internal lock,
+	 * as cxalloc allocators are not thread-safe.
+	 */
+	const void *cx_mem;
+	unsigned int parse_options;	/**< JsonParseOptions */
+	int threads;			/**< parsing threads, 0 or 1 for calling thread only */
+	size_t batch_size;		/**< bytes per batch */
+	/**
+	 * Call cb_func in input order, from calling thread.
+	 *
+	 * Otherwise it is called from all threads in parallel,
+	 * in any order, so it must be thread-safe.
+	 */
+	bool ordered;
+};
+
+/**
+ * Parse all records in buffer.
+ *
+ * Returns false if callback stopped parsing or out of memory.
+ */
+bool ndjson_parse(const struct NdjsonConfig *cf, const char *src, size_t len);
+
+/**
+ * Parse file, using map_file().
+ *
+ * Returns false also if file cannot be mapped, errno is then set.
+ */
+bool ndjson_parse_file(const struct NdjsonConfig *cf, const char *fname);
+
+#endif
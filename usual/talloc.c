@@ -27,6 +27,34 @@
 
 #include <string.h>
 
+#ifdef TALLOC_COMPACT
+
+#ifdef HAVE_PTHREAD
+#include <usual/pthread.h>
+#endif
+
+/*
+ * th_flags is shared between magic, flags and index in name_tab.
+ */
+#define MAGIC_USED		0x5F7		/* allocated block */
+#define MAGIC_FREE		0x2CB		/* freed block */
+#define MAGIC_MASK		0x7FF		/* keep only magic */
+
+#define FLAG_PENDING		(1 << 11)	/* partially freed */
+#define FLAG_USE_MEMLIMIT	(1 << 12)	/* some parent has memlimit */
+#define FLAG_HAS_MEMLIMIT	(1 << 13)	/* current node has TLimit child */
+#define FLAG_POOL		(1 << 14)	/* node owns TPool in TExt->cx */
+#define FLAG_EXT		(1 << 15)	/* ->link points to TExt */
+#define FLAG_NAME_SELF		(1 << 16)	/* object itself is the name */
+#define FLAG_REF		(1 << 17)	/* object is TRef */
+#define FLAG_LAST		(1 << 18)	/* last in parent's child ring */
+
+#define NAME_SHIFT		19
+#define NAME_MASK		0xFFF80000	/* index in name_tab */
+#define NAME_COUNT		(1 << 13)
+
+#else
+
 #define MAGIC_USED		0xF100F7	/* allocated block */
 #define MAGIC_FREE		0x8600CB	/* freed block */
 #define MAGIC_MASK		0xFFFFFF	/* keep only magic */
@@ -34,6 +62,9 @@
 #define FLAG_PENDING		(1 << 24)	/* partially freed */
 #define FLAG_USE_MEMLIMIT	(1 << 25)	/* some parent has memlimit */
 #define FLAG_HAS_MEMLIMIT	(1 << 26)	/* current node has TLimit child */
+#define FLAG_POOL		(1 << 27)	/* node owns TPool in ->cx */
+
+#endif
 
 /* flags parent passes to children */
 #define INHERIT_FLAGS		(FLAG_USE_MEMLIMIT)
@@ -55,6 +86,44 @@
  * 		from start.  this makes sure refs are freed
  * 		before other objects.
  */
+#ifdef TALLOC_COMPACT
+
+/*
+ * With TALLOC_COMPACT, header keeps only fields that each node needs.
+ *
+ * Children are in ring linked via next pointers, parent's TExt
+ * points to last one.  Name is index in name_tab, if it does not
+ * fit there or other rarely used fields are needed, node gets TExt,
+ * which then takes over ->link and keeps next pointer.  TExt is
+ * allocated from node's cx.  Node without TExt uses cx of parent,
+ * which always has TExt as it has children.
+ *
+ * Unlinking node that is not first child needs walk over siblings.
+ */
+struct THeader {
+	uint32_t th_flags;		/* flags, magic & name index */
+	uint32_t size;			/* requested size */
+	struct THeader *parent;		/* parent node, may be NULL */
+	union {
+		struct THeader *next;	/* next sibling, NULL if not linked */
+		struct TExt *ext;	/* if FLAG_EXT */
+	} link;
+};
+
+/*
+ * Rarely used fields of node with FLAG_EXT.
+ */
+struct TExt {
+	struct THeader *next;		/* next sibling, NULL if not linked */
+	struct THeader *last_child;	/* last->next is first child */
+	struct List ref_list;		/* contains TRef->ref_node */
+	const char *name;		/* name that is not in name_tab */
+	talloc_destructor_f destructor;	/* function to be called on free */
+	CxMem *cx;			/* node's allocation context */
+};
+
+#else
+
 struct THeader {
 	uint32_t th_flags;		/* flags & magic */
 	uint32_t size;			/* requested size */
@@ -67,12 +136,15 @@ struct THeader {
 	talloc_destructor_f destructor;	/* function to be called on free */
 };
 
+#endif
+
 /*
  * Per-reference struct, attached as child to non-primary parent.
  */
 struct TRef {
 	struct List ref_node;		/* node in ->ref_list */
 	struct TRef *paired_ref;	/* track paired helper ref */
+	void *target;			/* referenced object */
 };
 
 /*
@@ -85,6 +157,22 @@ struct TLimit {
 	ssize_t cur_size;
 };
 
+/*
+ * Pool for children of talloc_pool() context.
+ *
+ * Allocations are bump-allocated from CxPool.  Each object,
+ * including pool node itself, is counted, memory is given back
+ * to parent in one go when last of them is freed.
+ */
+struct TPool {
+	struct CxMem this;
+	CxMem *pool;			/* actual memory */
+	struct THeader *owner;		/* pool node, NULL if freed */
+	struct CxPoolMark mark;		/* position after owner */
+	size_t count;			/* live objects */
+	size_t base;			/* objects of owner itself */
+};
+
 /*
  * Internal helper functions.
  */
@@ -117,6 +205,7 @@ static const char MEMLIMIT_NAME[] = ".memlimit";
 static const char REF_NAME[] = ".ref";
 static const char NULL_NAME[] = ".null-context";
 static const char AUTOFREE_NAME[] = ".autofree";
+static const char POOL_NAME[] = ".pool";
 static const char UNNAMED_NAME[] = "UNNAMED";
 
 /* flags to atexit callback */
@@ -144,13 +233,6 @@ static inline void clear_flags(struct THeader *t, uint32_t flags)
 	t->th_flags &= ~flags;
 }
 
-static inline bool hdr_is_ref(const struct THeader *t)
-{
-	if (t->destructor == ref_destructor)
-		return true;
-	return false;
-}
-
 static inline void check_magic(const struct THeader *t, const char *pos)
 {
 	uint32_t magic = t->th_flags & MAGIC_MASK;
@@ -186,63 +268,532 @@ static inline size_t total_size(size_t alloc)
 	return ALIGN(alloc) + THSIZE;
 }
 
-/* if FLAG_CXOWNER is set, this->cx is for children */
-static CxMem *get_owner_cx(struct THeader *t)
+#ifdef TALLOC_COMPACT
+
+/*
+ * Interned names.
+ *
+ * Table is process-wide and append-only, so index in th_flags
+ * stays valid.  Lookup is lock-free where compiler has atomics,
+ * inserts are serialized with name_lock.
+ */
+
+static const char *name_tab[NAME_COUNT];
+static uint16_t name_hash[NAME_COUNT * 2];
+static unsigned name_count;
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t name_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* slot is set after name_tab entry and never changes after that */
+#ifdef __ATOMIC_ACQUIRE
+#define NAME_LOCKFREE
+#define name_slot_get(pos)	__atomic_load_n(&name_hash[pos], __ATOMIC_ACQUIRE)
+#define name_slot_set(pos, idx)	__atomic_store_n(&name_hash[pos], idx, __ATOMIC_RELEASE)
+#else
+#define name_slot_get(pos)	(name_hash[pos])
+#define name_slot_set(pos, idx)	(name_hash[pos] = (idx))
+#endif
+
+static inline uint32_t ptr_hash(const void *ptr)
 {
-	return t->cx;
+	uintptr_t h = (uintptr_t)ptr * 0x9E3779B1;
+	return h ^ (h >> 16);
 }
 
-/* add refs to start, others to end */
-static void add_child(struct THeader *parent, struct THeader *child)
+/* returns 0 if not found, *pos_p is then free slot */
+static unsigned name_lookup(const char *name, unsigned *pos_p)
 {
-	if (parent) {
-		if (hdr_is_ref(child))
-			list_prepend(&parent->child_list, &child->node);
-		else
-			list_append(&parent->child_list, &child->node);
+	unsigned pos, idx;
+	unsigned mask = ARRAY_NELEM(name_hash) - 1;
+
+	for (pos = ptr_hash(name) & mask; (idx = name_slot_get(pos)) != 0; pos = (pos + 1) & mask) {
+		if (name_tab[idx] == name)
+			return idx;
+	}
+	*pos_p = pos;
+	return 0;
+}
+
+/* returns 0 if name_tab is full */
+static unsigned name_intern(const char *name)
+{
+	unsigned pos, idx;
+
+#if defined(NAME_LOCKFREE) || !defined(HAVE_PTHREAD)
+	idx = name_lookup(name, &pos);
+	if (idx)
+		return idx;
+#endif
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&name_lock);
+#endif
+	/* may have been added meanwhile */
+	idx = name_lookup(name, &pos);
+	if (!idx && name_count + 1 < NAME_COUNT) {
+		idx = ++name_count;
+		name_tab[idx] = name;
+		name_slot_set(pos, idx);
 	}
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&name_lock);
+#endif
+	return idx;
 }
 
 /*
- * actual alloc
+ * Header access.
  */
 
-static struct THeader *hdr_alloc_cx(CxMem *cx, struct THeader *parent, size_t len, bool prepend)
+static inline void hdr_init(struct THeader *t, struct THeader *parent, size_t len)
 {
-	struct THeader *t;
+	t->th_flags = MAGIC_USED;
+	t->size = len;
+	t->parent = parent;
+	t->link.next = NULL;
+}
 
-	if (len > TALLOC_MAXLEN)
+static inline bool hdr_is_ref(const struct THeader *t)
+{
+	return has_flags(t, FLAG_REF);
+}
+
+/* node must have FLAG_EXT */
+static inline struct TExt *ext_find(const struct THeader *t)
+{
+	return t->link.ext;
+}
+
+/* parent of linked node always has TExt, so this stops in one step */
+static CxMem *hdr_cx(const struct THeader *t)
+{
+	while (t && !has_flags(t, FLAG_EXT))
+		t = t->parent;
+	return t ? ext_find(t)->cx : NULL;
+}
+
+/* cx must be the one node itself was allocated from */
+static struct TExt *ext_new(struct THeader *t, CxMem *cx)
+{
+	struct TExt *ext;
+
+	ext = cx_alloc0(cx, sizeof(*ext));
+	if (!ext)
 		return NULL;
-	if (!parent)
-		parent = ptr2hdr(null_context);
+	ext->next = t->link.next;
+	ext->cx = cx;
+	list_init(&ext->ref_list);
+	t->link.ext = ext;
+	set_flags(t, FLAG_EXT);
+	return ext;
+}
 
-	if (!apply_memlimit(parent, total_size(len), false))
+/* find or create */
+static struct TExt *ext_get(struct THeader *t)
+{
+	if (has_flags(t, FLAG_EXT))
+		return ext_find(t);
+	return ext_new(t, hdr_cx(t));
+}
+
+static void ext_free(struct THeader *t)
+{
+	struct TExt *ext;
+
+	if (!has_flags(t, FLAG_EXT))
+		return;
+	ext = ext_find(t);
+	t->link.next = ext->next;
+	clear_flags(t, FLAG_EXT);
+	cx_free(ext->cx, ext);
+}
+
+static inline struct THeader *hdr_next(const struct THeader *t)
+{
+	return has_flags(t, FLAG_EXT) ? ext_find(t)->next : t->link.next;
+}
+
+static inline void hdr_set_next(struct THeader *t, struct THeader *next)
+{
+	if (has_flags(t, FLAG_EXT))
+		ext_find(t)->next = next;
+	else
+		t->link.next = next;
+}
+
+/* TExt is needed only if cx differs from parent one */
+static inline bool hdr_init_cx(struct THeader *t, CxMem *cx)
+{
+	if (cx == hdr_cx(t->parent))
+		return true;
+	return ext_new(t, cx) != NULL;
+}
+
+/* remember current cx before moving under new parent */
+static bool hdr_keep_cx(struct THeader *t, const struct THeader *newparent)
+{
+	CxMem *cx;
+
+	if (has_flags(t, FLAG_EXT))
+		return true;
+	cx = hdr_cx(t);
+	if (cx == hdr_cx(newparent))
+		return true;
+	return ext_new(t, cx) != NULL;
+}
+
+static const char *hdr_name(const struct THeader *t)
+{
+	unsigned idx = (t->th_flags & NAME_MASK) >> NAME_SHIFT;
+
+	if (has_flags(t, FLAG_NAME_SELF))
+		return (const char *)(t + 1);
+	if (idx)
+		return name_tab[idx];
+	if (has_flags(t, FLAG_EXT))
+		return ext_find(t)->name;
+	return NULL;
+}
+
+/* only const names go to name_tab */
+static bool hdr_set_name(struct THeader *t, const char *name, bool is_const)
+{
+	struct TExt *ext;
+	unsigned idx = 0;
+
+	clear_flags(t, FLAG_NAME_SELF | NAME_MASK);
+	if (has_flags(t, FLAG_EXT))
+		ext_find(t)->name = NULL;
+	if (!name)
+		return true;
+
+	if (name == (const char *)(t + 1)) {
+		set_flags(t, FLAG_NAME_SELF);
+		return true;
+	}
+	if (is_const)
+		idx = name_intern(name);
+	if (idx) {
+		set_flags(t, idx << NAME_SHIFT);
+		return true;
+	}
+
+	ext = ext_get(t);
+	if (!ext)
+		return false;
+	ext->name = name;
+	return true;
+}
+
+static talloc_destructor_f hdr_destructor(const struct THeader *t)
+{
+	if (has_flags(t, FLAG_REF))
+		return ref_destructor;
+	if (has_flags(t, FLAG_EXT))
+		return ext_find(t)->destructor;
+	return NULL;
+}
+
+/* ref_destructor is kept as flag */
+static bool hdr_set_destructor(struct THeader *t, talloc_destructor_f destructor)
+{
+	struct TExt *ext;
+
+	if (destructor == ref_destructor) {
+		set_flags(t, FLAG_REF);
+		destructor = NULL;
+	} else {
+		clear_flags(t, FLAG_REF);
+	}
+	if (!destructor && !has_flags(t, FLAG_EXT))
+		return true;
+
+	ext = ext_get(t);
+	if (!ext)
+		return false;
+	ext->destructor = destructor;
+	return true;
+}
+
+/* returns NULL if there are no refs and create is not set */
+static struct List *hdr_ref_list(struct THeader *t, bool create)
+{
+	struct TExt *ext;
+
+	if (!create && !has_flags(t, FLAG_EXT))
 		return NULL;
+	ext = ext_get(t);
+	return ext ? &ext->ref_list : NULL;
+}
 
-	t = cx_alloc(cx, total_size(len));
-	if (!t) {
-		apply_memlimit(parent, -total_size(len), false);
+static struct THeader *first_child(const struct THeader *t)
+{
+	struct THeader *last;
+
+	if (!has_flags(t, FLAG_EXT))
 		return NULL;
+	last = ext_find(t)->last_child;
+	return last ? hdr_next(last) : NULL;
+}
+
+static inline struct THeader *next_child(const struct THeader *t, const struct THeader *child)
+{
+	return has_flags(child, FLAG_LAST) ? NULL : hdr_next(child);
+}
+
+/* prepare parent for link_child() */
+static inline bool hdr_can_adopt(struct THeader *parent)
+{
+	return !parent || ext_get(parent) != NULL;
+}
+
+static void link_child(struct THeader *parent, struct THeader *child, bool prepend)
+{
+	struct TExt *ext = ext_find(parent);
+	struct THeader *last = ext->last_child;
+
+	if (!last) {
+		hdr_set_next(child, child);
+	} else {
+		hdr_set_next(child, hdr_next(last));
+		hdr_set_next(last, child);
+		if (prepend)
+			return;
+		clear_flags(last, FLAG_LAST);
 	}
+	set_flags(child, FLAG_LAST);
+	ext->last_child = child;
+}
+
+/* walks over siblings that are before node */
+static void unlink_child(struct THeader *t)
+{
+	struct THeader *prev, *next;
+	struct TExt *ext;
 
+	next = hdr_next(t);
+	if (!next)
+		return;
+
+	ext = ext_find(t->parent);
+	if (next == t) {
+		ext->last_child = NULL;
+	} else {
+		prev = ext->last_child;
+		while (hdr_next(prev) != t)
+			prev = hdr_next(prev);
+		hdr_set_next(prev, next);
+		if (ext->last_child == t) {
+			set_flags(prev, FLAG_LAST);
+			ext->last_child = prev;
+		}
+	}
+	clear_flags(t, FLAG_LAST);
+	hdr_set_next(t, NULL);
+}
+
+/* header was moved from old location, old one must not be accessed */
+static void hdr_moved(struct THeader *t, const struct THeader *old)
+{
+	struct THeader *tmp, *next;
+	struct TExt *ext;
+
+	/* fix sibling ring, TExt itself does not move */
+	next = hdr_next(t);
+	if (next) {
+		ext = ext_find(t->parent);
+		if (ext->last_child == old)
+			ext->last_child = t;
+		if (next == old) {
+			hdr_set_next(t, t);
+		} else {
+			for (tmp = next; hdr_next(tmp) != old; tmp = hdr_next(tmp)) {}
+			hdr_set_next(tmp, t);
+		}
+	}
+
+	for (tmp = first_child(t); tmp; tmp = next_child(t, tmp))
+		tmp->parent = t;
+}
+
+#else /* !TALLOC_COMPACT */
+
+static inline void hdr_init(struct THeader *t, struct THeader *parent, size_t len)
+{
 	t->th_flags = MAGIC_USED;
 	t->size = len;
-	t->cx = cx;
+	t->cx = NULL;
 	t->parent = parent;
 	list_init(&t->node);
 	list_init(&t->child_list);
 	list_init(&t->ref_list);
 	t->name = NULL;
 	t->destructor = NULL;
+}
+
+static inline bool hdr_is_ref(const struct THeader *t)
+{
+	if (t->destructor == ref_destructor)
+		return true;
+	return false;
+}
+
+static inline CxMem *hdr_cx(const struct THeader *t)
+{
+	return t ? t->cx : NULL;
+}
+
+static inline bool hdr_init_cx(struct THeader *t, CxMem *cx)
+{
+	t->cx = cx;
+	return true;
+}
+
+static inline bool hdr_keep_cx(struct THeader *t, const struct THeader *newparent)
+{
+	return true;
+}
+
+static inline const char *hdr_name(const struct THeader *t)
+{
+	return t->name;
+}
+
+static inline bool hdr_set_name(struct THeader *t, const char *name, bool is_const)
+{
+	t->name = name;
+	return true;
+}
+
+static inline talloc_destructor_f hdr_destructor(const struct THeader *t)
+{
+	return t->destructor;
+}
+
+static inline bool hdr_set_destructor(struct THeader *t, talloc_destructor_f destructor)
+{
+	t->destructor = destructor;
+	return true;
+}
+
+static inline struct List *hdr_ref_list(struct THeader *t, bool create)
+{
+	return &t->ref_list;
+}
+
+static inline struct THeader *first_child(const struct THeader *t)
+{
+	if (list_empty(&t->child_list))
+		return NULL;
+	return container_of(t->child_list.next, struct THeader, node);
+}
+
+static inline struct THeader *next_child(const struct THeader *t, const struct THeader *child)
+{
+	if (child->node.next == &t->child_list)
+		return NULL;
+	return container_of(child->node.next, struct THeader, node);
+}
+
+static inline bool hdr_can_adopt(struct THeader *parent)
+{
+	return true;
+}
+
+static inline void link_child(struct THeader *parent, struct THeader *child, bool prepend)
+{
+	if (prepend)
+		list_prepend(&parent->child_list, &child->node);
+	else
+		list_append(&parent->child_list, &child->node);
+}
+
+static inline void unlink_child(struct THeader *t)
+{
+	list_del(&t->node);
+}
+
+/* node address has moved */
+static void fix_list(struct List *node, struct List *oldnode)
+{
+	if (node->next == oldnode) {
+		list_init(node);
+	} else {
+		node->next->prev = node;
+		node->prev->next = node;
+	}
+}
+
+static void hdr_moved(struct THeader *t, struct THeader *old)
+{
+	struct THeader *tchild;
+
+	fix_list(&t->node, &old->node);
+	fix_list(&t->child_list, &old->child_list);
+	fix_list(&t->ref_list, &old->ref_list);
+	for (tchild = first_child(t); tchild; tchild = next_child(t, tchild))
+		tchild->parent = t;
+}
+
+static inline void ext_free(struct THeader *t)
+{
+}
+
+#endif /* !TALLOC_COMPACT */
+
+static inline bool has_refs(struct THeader *t)
+{
+	struct List *refs = hdr_ref_list(t, false);
+	return refs && !list_empty(refs);
+}
+
+/* add refs to start, others to end */
+static void add_child(struct THeader *parent, struct THeader *child)
+{
+	if (parent)
+		link_child(parent, child, hdr_is_ref(child));
+}
+
+/*
+ * actual alloc
+ */
+
+static struct THeader *hdr_alloc_cx(CxMem *cx, struct THeader *parent, size_t len, bool prepend, const char *name)
+{
+	struct THeader *t;
+
+	if (len > TALLOC_MAXLEN)
+		return NULL;
+	if (!parent)
+		parent = ptr2hdr(null_context);
+
+	if (!apply_memlimit(parent, total_size(len), false))
+		return NULL;
+
+	if (!hdr_can_adopt(parent))
+		goto failed;
+	t = cx_alloc(cx, total_size(len));
+	if (!t)
+		goto failed;
+
+	hdr_init(t, parent, len);
+	if (!hdr_init_cx(t, cx) || !hdr_set_name(t, name, true)) {
+		ext_free(t);
+		cx_free(cx, t);
+		goto failed;
+	}
 
 	if (parent) {
 		set_flags(t, parent->th_flags & INHERIT_FLAGS);
-		if (prepend)
-			list_prepend(&parent->child_list, &t->node);
-		else
-			list_append(&parent->child_list, &t->node);
+		link_child(parent, t, prepend);
 	}
 	return t;
+
+failed:
+	apply_memlimit(parent, -total_size(len), false);
+	return NULL;
 }
 
 /*
@@ -253,13 +804,91 @@ void *talloc_from_cx(CxMem *cx, size_t len, const char *name)
 {
 	struct THeader *t;
 
-	t = hdr_alloc_cx(cx, NULL, len, false);
+	t = hdr_alloc_cx(cx, NULL, len, false, name);
 	if (!t)
 		return NULL;
-	t->name = name;
 	return hdr2ptr(t);
 }
 
+/*
+ * Pooled allocation.
+ */
+
+static void *tpool_alloc(void *ctx, size_t len)
+{
+	struct TPool *tp = ctx;
+	void *p;
+
+	p = cx_alloc(tp->pool, len);
+	if (p)
+		tp->count++;
+	return p;
+}
+
+static void *tpool_realloc(void *ctx, void *ptr, size_t len)
+{
+	struct TPool *tp = ctx;
+	return cx_realloc(tp->pool, ptr, len);
+}
+
+static void tpool_free(void *ctx, void *ptr)
+{
+	struct TPool *tp = ctx;
+
+	if (ptr == tp->owner)
+		tp->owner = NULL;
+
+	if (--tp->count == 0) {
+		/* TPool itself lives in pool */
+		cx_destroy(tp->pool);
+	} else if (tp->owner && tp->count == tp->base) {
+		/* only pool node left, reuse memory */
+		cx_pool_rewind(tp->pool, &tp->mark);
+	} else {
+		cx_free(tp->pool, ptr);
+	}
+}
+
+static const struct CxOps tpool_ops = {
+	tpool_alloc,
+	tpool_realloc,
+	tpool_free,
+};
+
+void *talloc_pool(const void *parent, size_t size)
+{
+	struct THeader *tparent, *t;
+	struct TPool *tp;
+	CxMem *pool;
+
+	tparent = ptr2hdr(parent);
+	pool = cx_new_pool_sized(hdr_cx(tparent), size, 0);
+	if (!pool)
+		return NULL;
+	tp = cx_alloc(pool, sizeof(*tp));
+	if (!tp)
+		goto failed;
+	tp->this.ops = &tpool_ops;
+	tp->this.ctx = tp;
+	tp->pool = pool;
+	tp->owner = NULL;
+	tp->count = 1;		/* keep pool alive if setup fails */
+
+	t = hdr_alloc_cx(&tp->this, tparent, 0, false, POOL_NAME);
+	if (!t)
+		goto failed;
+	tp->count--;
+	set_flags(t, FLAG_POOL);
+	tp->owner = t;
+	tp->base = tp->count;
+	cx_pool_mark(pool, &tp->mark);
+	return hdr2ptr(t);
+
+failed:
+	cx_destroy(pool);
+	return NULL;
+}
+
 void *_talloc_const_name(const void *parent, size_t elem_size, size_t count, bool zerofill, const char *name)
 {
 	struct THeader *t;
@@ -272,8 +901,8 @@ void *_talloc_const_name(const void *parent, size_t elem_size, size_t count, boo
 		return NULL;
 
 	tparent = ptr2hdr(parent);
-	cx = tparent ? tparent->cx : NULL;
-	t = hdr_alloc_cx(cx, tparent, size, false);
+	cx = hdr_cx(tparent);
+	t = hdr_alloc_cx(cx, tparent, size, false, name);
 	if (!t)
 		return NULL;
 
@@ -281,7 +910,6 @@ void *_talloc_const_name(const void *parent, size_t elem_size, size_t count, boo
 	if (zerofill)
 		memset(res, 0, size);
 
-	t->name = name;
 	return res;
 }
 
@@ -296,11 +924,10 @@ void *_talloc_format_name(const void *parent, size_t elem_size, size_t count, bo
 		va_start(ap, fmt);
 		name = talloc_vasprintf(res, fmt, ap);
 		va_end(ap);
-		if (!name) {
+		if (!name || !hdr_set_name(ptr2hdr(res), name, false)) {
 			talloc_free(res);
 			return NULL;
 		}
-		talloc_set_name_const(res, name);
 	}
 	return res;
 }
@@ -314,12 +941,11 @@ static void *internal_alloc_prepend(const void *parent, size_t size, const char
 	CxMem *cx;
 
 	tparent = ptr2hdr(parent);
-	cx = tparent ? tparent->cx : NULL;
-	t = hdr_alloc_cx(cx, tparent, size, true);
+	cx = hdr_cx(tparent);
+	t = hdr_alloc_cx(cx, tparent, size, true, name);
 	if (!t)
 		return NULL;
 	res = hdr2ptr(t);
-	t->name = name;
 	return res;
 }
 
@@ -333,8 +959,8 @@ void talloc_set_destructor(const void *ptr, talloc_destructor_f destructor)
 	struct THeader *t;
 
 	t = ptr2hdr(ptr);
-	if (t)
-		t->destructor = destructor;
+	if (t && !hdr_set_destructor(t, destructor))
+		do_log("talloc_set_destructor: out of memory");
 }
 
 /* attach undying child to live parent */
@@ -349,8 +975,7 @@ static void throw_child(struct THeader *t)
 
 static void free_children(const void *ptr, bool free_name, const char *source_pos)
 {
-	struct List *el, *tmp;
-	struct THeader *tchild;
+	struct THeader *tchild, *tmp;
 	struct THeader *t;
 	void *child;
 
@@ -358,15 +983,15 @@ static void free_children(const void *ptr, bool free_name, const char *source_po
 	if (!t)
 		return;
 
-	list_for_each_safe(el, &t->child_list, tmp) {
-		tchild = container_of(el, struct THeader, node);
+	for (tchild = first_child(t); tchild; tchild = tmp) {
+		tmp = next_child(t, tchild);
 		child = hdr2ptr(tchild);
 		if (free_name) {
-			if (child == t->name)
-				t->name = NULL;
-		} else if (child == t->name) {
+			if (child == hdr_name(t))
+				hdr_set_name(t, NULL, false);
+		} else if (child == hdr_name(t)) {
 			continue;
-		} else if (tchild->name == MEMLIMIT_NAME) {
+		} else if (hdr_name(tchild) == MEMLIMIT_NAME) {
 			continue;
 		}
 		if (talloc_unlink(ptr, child) != 0) {
@@ -393,7 +1018,7 @@ static int free_with_refs(struct THeader *t, const char *source_pos)
 	}
 
 	/* check if refs have same parent */
-	list_for_each(el, &t->ref_list) {
+	list_for_each(el, hdr_ref_list(t, false)) {
 		ref = container_of(el, struct TRef, ref_node);
 		tref = ptr2hdr(ref);
 		if (tref->parent != t->parent) {
@@ -408,6 +1033,7 @@ static int free_with_refs(struct THeader *t, const char *source_pos)
 
 int _talloc_free(const void *ptr, const char *source_pos)
 {
+	talloc_destructor_f destructor;
 	CxMem *cx;
 	struct THeader *t;
 	struct THeader *tparent;
@@ -420,7 +1046,7 @@ int _talloc_free(const void *ptr, const char *source_pos)
 	t = ptr2hdr(ptr);
 
 	/* handle multi-parent free */
-	if (!list_empty(&t->ref_list))
+	if (has_refs(t))
 		return free_with_refs(t, source_pos);
 
 	/* set pending flag */
@@ -429,24 +1055,28 @@ int _talloc_free(const void *ptr, const char *source_pos)
 	set_flags(t, FLAG_PENDING);
 
 	/* run destructor */
-	if (t->destructor && t->destructor((void *)ptr) < 0) {
+	destructor = hdr_destructor(t);
+	if (destructor && destructor((void *)ptr) < 0) {
 		do_dbg("DBG: talloc_free(%s) - destructor failed", talloc_get_name(ptr));
 		clear_flags(t, FLAG_PENDING);
 		return -1;
 	}
 
-	list_del(&t->node);
+	unlink_child(t);
 	free_children(ptr, true, source_pos);
 
 	tparent = t->parent;
 	orig_size = t->size;
-	cx = t->cx;
+	cx = hdr_cx(t);
+	ext_free(t);
 
 	/* clear & free */
 	memset(t, 0, THSIZE);
 	t->size = orig_size;
 	t->th_flags = MAGIC_FREE;
+#ifndef TALLOC_COMPACT
 	t->name = source_pos;
+#endif
 	cx_free(cx, t);
 
 	apply_memlimit(tparent, -total_size(orig_size), false);
@@ -460,11 +1090,14 @@ int _talloc_free(const void *ptr, const char *source_pos)
 
 static struct THeader *find_ref_by_parent(struct THeader *t, struct THeader *tparent)
 {
-	struct List *el;
+	struct List *el, *refs;
 	struct THeader *tref;
 	struct TRef *ref;
 
-	list_for_each(el, &t->ref_list) {
+	refs = hdr_ref_list(t, false);
+	if (!refs)
+		return NULL;
+	list_for_each(el, refs) {
 		ref = container_of(el, struct TRef, ref_node);
 		tref = ptr2hdr(ref);
 		if (tref->parent == tparent)
@@ -500,6 +1133,7 @@ static struct TRef *new_ref(const void *parent, const char *name)
 
 void *_talloc_reference_named(const void *new_parent, const void *ptr, const char *name)
 {
+	struct List *refs;
 	struct TRef *ref;
 	struct THeader *t;
 
@@ -507,11 +1141,16 @@ void *_talloc_reference_named(const void *new_parent, const void *ptr, const cha
 	if (!t)
 		return NULL;
 
+	refs = hdr_ref_list(t, true);
+	if (!refs)
+		return NULL;
+
 	ref = new_ref(new_parent, name);
 	if (!ref)
 		return NULL;
 
-	list_append(&t->ref_list, &ref->ref_node);
+	ref->target = (void *)ptr;
+	list_append(refs, &ref->ref_node);
 	return (void *)ptr;
 }
 
@@ -539,15 +1178,18 @@ int _talloc_unlink(const void *parent, const void *ptr, const char *source_pos)
 			do_dbg("_talloc_unlink err: find_ref_by_parent failed");
 			err = -1;
 		}
-	} else if (list_empty(&t->ref_list)) {
+	} else if (!has_refs(t)) {
 		/* ref is primary and there are no other refs */
 		err = _talloc_free(ptr, source_pos);
 	} else {
 		/* main parent but refs, move to new parent */
 		/* use first ref to get new parent */
-		ref = list_pop_type(&t->ref_list, struct TRef, ref_node);
+		ref = container_of(list_first(hdr_ref_list(t, false)), struct TRef, ref_node);
 		tref = ptr2hdr(ref);
-		list_del(&t->node);
+		if (!hdr_can_adopt(tref->parent) || !hdr_keep_cx(t, tref->parent))
+			return -1;
+		list_del(&ref->ref_node);
+		unlink_child(t);
 
 		/* move */
 		t->parent = tref->parent;
@@ -579,7 +1221,7 @@ void *talloc_reparent(const void *old_parent, const void *new_parent, const void
 	told = ptr2hdr(old_parent ? old_parent : null_context);
 	if (tnew == t || tnew == told)
 		return (void *)ptr;
-	cxnew = tnew ? tnew->cx : NULL;
+	cxnew = hdr_cx(tnew);
 
 	/* find ref to change parent of */
 	if (told != t->parent) {
@@ -590,13 +1232,15 @@ void *talloc_reparent(const void *old_parent, const void *new_parent, const void
 		}
 	}
 
-	/* check cx change */
-	if (t->cx != cxnew) {
+	/* check cx change, pool node carries its memory with it */
+	if (hdr_cx(t) != cxnew && !has_flags(t, FLAG_POOL)) {
 		return NULL;
 	}
+	if (!hdr_can_adopt(tnew) || !hdr_keep_cx(t, tnew))
+		return NULL;
 
 	/* change parent */
-	list_del(&t->node);
+	unlink_child(t);
 	add_child(tnew, t);
 	t->parent = tnew;
 
@@ -614,7 +1258,7 @@ void *talloc_steal(const void *new_parent, const void *ptr)
 		return NULL;
 
 	/* disallow steal when refs are present */
-	if (!list_empty(&t->ref_list))
+	if (has_refs(t))
 		return NULL;
 
 	return talloc_reparent(hdr2ptr(t->parent), new_parent, ptr);
@@ -634,21 +1278,9 @@ void *_talloc_move(const void *new_parent, void **ptr_p)
  * Realloc
  */
 
-/* node address has moved */
-static void fix_list(struct List *node, struct List *oldnode)
-{
-	if (node->next == oldnode) {
-		list_init(node);
-	} else {
-		node->next->prev = node;
-		node->prev->next = node;
-	}
-}
-
 void *_talloc_realloc(const void *parent, void *ptr, size_t elem_size, size_t count, const char *name)
 {
 	struct THeader *t1, *t2;
-	struct List *el;
 	CxMem *this_cx;
 	uint32_t old_flags;
 	ssize_t delta;
@@ -674,7 +1306,7 @@ void *_talloc_realloc(const void *parent, void *ptr, size_t elem_size, size_t co
 	t1 = ptr2hdr(ptr);
 
 	/* disallow realloc when refs are present */
-	if (!list_empty(&t1->ref_list))
+	if (has_refs(t1))
 		return NULL;
 
 	/* size difference */
@@ -687,7 +1319,7 @@ void *_talloc_realloc(const void *parent, void *ptr, size_t elem_size, size_t co
 		return NULL;
 
 	/* actual realloc of memory */
-	this_cx = get_owner_cx(t1);
+	this_cx = hdr_cx(t1);
 	old_flags = t1->th_flags;
 	t1->th_flags = MAGIC_FREE;
 	t2 = cx_realloc(this_cx, t1, total_size(size));
@@ -700,22 +1332,12 @@ void *_talloc_realloc(const void *parent, void *ptr, size_t elem_size, size_t co
 	/* fix header after realloc */
 	t2->th_flags = old_flags;
 	t2->size = size;
-	t2->name = name;
 
-	/* was memory moved? */
-	if (t1 == t2)
-		return ptr;
-
-	/* fix lists after move */
-	fix_list(&t2->node, &t1->node);
-	fix_list(&t2->child_list, &t1->child_list);
-	fix_list(&t2->ref_list, &t1->ref_list);
-	list_for_each(el, &t2->child_list) {
-		struct THeader *tchild;
-		tchild = container_of(el, struct THeader, node);
-		tchild->parent = t2;
-	}
+	/* fix links if memory was moved */
+	if (t1 != t2)
+		hdr_moved(t2, t1);
 
+	hdr_set_name(t2, name, true);
 	return hdr2ptr(t2);
 }
 
@@ -731,14 +1353,12 @@ void *talloc_realloc_fn(const void *parent, void *ptr, size_t size)
 /* apply delta to single context */
 static bool apply_memlimit_marked(struct THeader *t, ssize_t delta, bool force)
 {
-	struct List *el;
 	struct THeader *tlim;
 	struct TLimit *lim = NULL;
 
 	/* find memlimit struct */
-	list_for_each(el, &t->child_list) {
-		tlim = container_of(el, struct THeader, node);
-		if (tlim->name == MEMLIMIT_NAME) {
+	for (tlim = first_child(t); tlim; tlim = next_child(t, tlim)) {
+		if (hdr_name(tlim) == MEMLIMIT_NAME) {
 			lim = hdr2ptr(tlim);
 			goto apply;
 		}
@@ -786,7 +1406,6 @@ enum {
 /* count allocated memory and sync flags */
 static size_t memlimit_walk(struct THeader *t, int depth, int op)
 {
-	struct List *el;
 	struct THeader *tchild;
 	size_t size = 0;
 
@@ -809,10 +1428,8 @@ static size_t memlimit_walk(struct THeader *t, int depth, int op)
 
 	/* recurse info child_list */
 	set_flags(t, FLAG_PENDING);
-	list_for_each(el, &t->child_list) {
-		tchild = container_of(el, struct THeader, node);
+	for (tchild = first_child(t); tchild; tchild = next_child(t, tchild))
 		size += memlimit_walk(tchild, depth + 1, op);
-	}
 	clear_flags(t, FLAG_PENDING);
 
 	return size + t->size;
@@ -857,7 +1474,6 @@ int talloc_set_memlimit(const void *ptr, size_t max_size)
 {
 	struct TLimit *lim = NULL;
 	struct THeader *t, *tmp;
-	struct List *el;
 
 	if (!ptr)
 		return -1;
@@ -865,9 +1481,8 @@ int talloc_set_memlimit(const void *ptr, size_t max_size)
 
 	/* find TLimit struct */
 	if (has_flags(t, FLAG_HAS_MEMLIMIT)) {
-		list_for_each(el, &t->child_list) {
-			tmp = container_of(el, struct THeader, node);
-			if (tmp->name == MEMLIMIT_NAME) {
+		for (tmp = first_child(t); tmp; tmp = next_child(t, tmp)) {
+			if (hdr_name(tmp) == MEMLIMIT_NAME) {
 				lim = hdr2ptr(tmp);
 				break;
 			}
@@ -904,20 +1519,24 @@ int talloc_set_memlimit(const void *ptr, size_t max_size)
 const char *talloc_get_name(const void *ptr)
 {
 	struct THeader *t = ptr2hdr(ptr);
-	return (t && t->name) ? t->name : UNNAMED_NAME;
+	const char *name = t ? hdr_name(t) : NULL;
+	return name ? name : UNNAMED_NAME;
 }
 
 const char *talloc_set_name(const void *ptr, const char *fmt, ...)
 {
 	va_list ap;
 	struct THeader *t;
+	const char *name;
 
 	t = ptr2hdr(ptr);
 	if (t) {
 		va_start(ap, fmt);
-		t->name = talloc_vasprintf(ptr, fmt, ap);
+		name = talloc_vasprintf(ptr, fmt, ap);
 		va_end(ap);
-		return t->name;
+		if (!hdr_set_name(t, name, false))
+			return NULL;
+		return name;
 	}
 	return NULL;
 }
@@ -927,8 +1546,8 @@ void talloc_set_name_const(const void *ptr, const char *name)
 	struct THeader *t;
 
 	t = ptr2hdr(ptr);
-	if (t)
-		t->name = name;
+	if (t && !hdr_set_name(t, name, true))
+		do_log("talloc_set_name_const: out of memory");
 }
 
 void *talloc_check_name(const void *ptr, const char *name)
@@ -991,13 +1610,14 @@ bool talloc_is_parent(const void *parent, const void *ptr)
 
 size_t talloc_reference_count(const void *ptr)
 {
-	struct List *el;
+	struct List *el, *refs;
 	size_t cnt = 0;
 	struct THeader *t;
 
 	t = ptr2hdr(ptr);
-	if (t) {
-		list_for_each(el, &t->ref_list)
+	refs = t ? hdr_ref_list(t, false) : NULL;
+	if (refs) {
+		list_for_each(el, refs)
 			cnt++;
 	}
 	return cnt;
@@ -1053,7 +1673,7 @@ const char *talloc_parent_name(const void *ptr)
 
 void *talloc_find_parent_byname(const void *ptr, const char *name)
 {
-	struct List *el;
+	struct List *el, *refs;
 	struct THeader *tref;
 	struct TRef *ref;
 	struct THeader *t;
@@ -1062,13 +1682,16 @@ void *talloc_find_parent_byname(const void *ptr, const char *name)
 	if (!t || !name)
 		return NULL;
 
-	if (t->parent && !strcmp(name, t->parent->name))
+	if (t->parent && !strcmp(name, hdr_name(t->parent)))
 		return hdr2ptr(t->parent);
 
-	list_for_each(el, &t->ref_list) {
+	refs = hdr_ref_list(t, false);
+	if (!refs)
+		return NULL;
+	list_for_each(el, refs) {
 		ref = container_of(el, struct TRef, ref_node);
 		tref = ptr2hdr(ref);
-		if (tref->parent && !strcmp(name, tref->parent->name))
+		if (tref->parent && !strcmp(name, hdr_name(tref->parent)))
 			return hdr2ptr(tref->parent);
 	}
 	return NULL;
@@ -1407,16 +2030,15 @@ void talloc_enable_null_tracking_no_autofree(void)
 /* move childs away from null context */
 void talloc_disable_null_tracking(void)
 {
-	struct THeader *t, *tchild;
-	struct List *el, *tmp;
+	struct THeader *t, *tchild, *tmp;
 
 	if (!null_context)
 		return;
 
 	t = ptr2hdr(null_context);
-	list_for_each_safe(el, &t->child_list, tmp) {
-		tchild = container_of(el, struct THeader, node);
-		list_del(&tchild->node);
+	for (tchild = first_child(t); tchild; tchild = tmp) {
+		tmp = next_child(t, tchild);
+		unlink_child(tchild);
 		tchild->parent = NULL;
 	}
 	TALLOC_FREE(null_context);
@@ -1442,36 +2064,13 @@ void talloc_enable_leak_report_full(void)
 
 static void *find_ptr_from_ref(const struct TRef *ref)
 {
-	struct List *el;
-	struct TRef *ref2;
-	struct THeader *tref2;
-	struct THeader *t;
-
-	list_for_each(el, &ref->ref_node) {
-		/*
-		 * Actual struct is not known here - THeader
-		 * must have both ->destructor & ->ref_list
-		 * accessible locations.
-		 */
-		ref2 = container_of(el, struct TRef, ref_node);
-
-		/* this check must work it out */
-		tref2 = ((struct THeader *)ref2) - 1;
-		if (hdr_is_ref(tref2))
-			continue;
-
-		/* it is not TRef, so it must be parent's THeader */
-		t = container_of(el, struct THeader, ref_list);
-		return hdr2ptr(t);
-	}
-	return NULL;
+	return ref->target;
 }
 
 void talloc_report_depth_cb(const void *ptr, int depth, int max_depth,
 			    void (*cb_func)(const void *ptr, int depth, int max_depth, int is_ref, void *cb_arg),
 			    void *cb_arg)
 {
-	struct List *el;
 	struct THeader *tchild;
 	struct THeader *t;
 
@@ -1499,10 +2098,8 @@ void talloc_report_depth_cb(const void *ptr, int depth, int max_depth,
 
 	/* loop over childs */
 	set_flags(t, FLAG_PENDING);
-	list_for_each(el, &t->child_list) {
-		tchild = container_of(el, struct THeader, node);
+	for (tchild = first_child(t); tchild; tchild = next_child(t, tchild))
 		talloc_report_depth_cb(hdr2ptr(tchild), depth, max_depth, cb_func, cb_arg);
-	}
 	clear_flags(t, FLAG_PENDING);
 }
 
@@ -1565,7 +2162,7 @@ void talloc_show_parents(const void *ptr, FILE *file)
 {
 	struct THeader *t, *tref;
 	struct TRef *ref;
-	struct List *el;
+	struct List *el, *refs;
 	if (!ptr) {
 		fprintf(file, "No parents for NULL\n");
 		return;
@@ -1577,7 +2174,10 @@ void talloc_show_parents(const void *ptr, FILE *file)
 	} else {
 		fprintf(file, "\tNULL context\n");
 	}
-	list_for_each(el, &t->ref_list) {
+	refs = hdr_ref_list(t, false);
+	if (!refs)
+		return;
+	list_for_each(el, refs) {
 		ref = container_of(el, struct TRef, ref_node);
 		tref = ptr2hdr(ref);
 		fprintf(file, "\t%s\n", talloc_get_name(hdr2ptr(tref->parent)));
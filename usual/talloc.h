@@ -29,9 +29,17 @@
  * - References.
  * - Change parent.
  * - Built on top of <usual/cxalloc.h> API.
- *
- * Missing features:
- * - Pools.  Use <usual/cxextra.h> pools instead.
+ * - Pools, built on <usual/cxextra.h> pools.
+ * - Compact headers with TALLOC_COMPACT (configure --enable-talloc-compact):
+ *   24 bytes per object instead of 88 on 64-bit.  Destructors, references,
+ *   the children of a parent object and names that are not constant go
+ *   into extra record, allocated from same CxMem as the object.  Constant
+ *   names are interned into process-wide table, guarded by lock, so
+ *   separate trees can still be used from separate threads.
+ *   Children are kept in singly-linked list: freeing an object
+ *   that is not the first child of its parent walks over its older
+ *   siblings, so freeing N children in reverse order is O(N^2).
+ *   Freeing parent, or children in allocation order, is O(N).
  *
  * It mostly compatible with original so that Samba's documentation is usable,
  * but it does not try to be bug-for-bug compatible.
@@ -383,6 +391,24 @@ void *talloc_autofree_context(void);
  */
 void *talloc_from_cx(const struct CxMem *cx, size_t size, const char *name);
 
+/**
+ * Create pool context.
+ *
+ * All children of pool are bump-allocated from big memory
+ * blocks, freeing single child is cheap no-op.  Memory is
+ * released in one go when pool and all objects allocated
+ * from it are freed.  When pool has no children left, its
+ * memory is reused for new children.
+ *
+ * Objects from pool can be moved only inside the pool,
+ * the pool itself can be moved anywhere.
+ *
+ * @param parent	Parent context or NULL.
+ * @param size		Initial size of memory area.
+ * @returns		New context or NULL on error.
+ */
+void *talloc_pool(const void *parent, size_t size);
+
 /**
  * Create CxMem context that uses talloc.
  *
@@ -19,6 +19,13 @@
 #include <usual/utf8.h>
 #include <usual/err.h>
 
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define UTF8_SCAN_SSE2
+#endif
+
 #define u8head(c, mask)	(((c) & (mask | (mask >> 1))) == mask)
 #define u8tail(c)	u8head(c, 0x80)
 
@@ -200,11 +207,42 @@ invalid:
 	return 0;
 }
 
+/* skip ASCII run, stop at high-bit or zero byte */
+static inline const char *skip_ascii(const char *src, const char *end)
+{
+#ifdef UTF8_SCAN_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	__m128i v;
+
+	while (end - src >= 16) {
+		v = _mm_loadu_si128((const __m128i *)src);
+		if (_mm_movemask_epi8(_mm_or_si128(v, _mm_cmpeq_epi8(v, zero))))
+			break;
+		src += 16;
+	}
+#else
+	const uint64_t ones = UINT64_C(0x0101010101010101);
+	const uint64_t highs = UINT64_C(0x8080808080808080);
+	uint64_t v;
+
+	while (end - src >= 8) {
+		memcpy(&v, src, 8);
+		if ((v & highs) || ((v - ones) & ~v & highs))
+			break;
+		src += 8;
+	}
+#endif
+	return src;
+}
+
 bool utf8_validate_string(const char *src, const char *end)
 {
 	unsigned int n;
 	while (src < end) {
-		if (*src & 0x80) {
+		src = skip_ascii(src, end);
+		if (src >= end) {
+			break;
+		} else if (*src & 0x80) {
 			n = utf8_validate_seq(src, end);
 			if (n == 0)
 				return false;